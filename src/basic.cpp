@@ -1,6 +1,9 @@
+#include <algorithm>
 #include <cmath>
+#include <limits>
 #include <stdexcept>
 #include <string>
+#include <utility>
 
 #include "basic.hpp"
 
@@ -25,16 +28,173 @@ ErrorCode LocationNetworkError::code() const
 
 
 
+NodeIdTable& NodeIdTable::Instance()
+{
+    static NodeIdTable instance;
+    return instance;
+}
+
+
+NodeHandle NodeIdTable::Intern(const NodeId &id)
+{
+    NodeHandle handle;
+    Intern(id, handle);
+    return handle;
+}
+
+const NodeId& NodeIdTable::Intern(const NodeId &id, NodeHandle &handle)
+{
+    lock_guard<mutex> lock(_mutex);
+    auto it = _handles.find(id);
+    if ( it != _handles.end() )
+    {
+        handle = it->second;
+        ++_slots[handle].refCount;
+        return it->first;
+    }
+    
+    if ( ! _freeHandles.empty() )
+    {
+        handle = _freeHandles.back();
+        _freeHandles.pop_back();
+    }
+    else
+    {
+        if ( _slots.size() >= numeric_limits<NodeHandle>::max() )
+            { throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Node id table is full"); }
+        handle = static_cast<NodeHandle>( _slots.size() );
+        _slots.push_back( Slot{ nullptr, 0 } );
+    }
+    
+    it = _handles.emplace(id, handle).first;
+    _slots[handle] = Slot{ &it->first, 1 };
+    return it->first;
+}
+
+const NodeId& NodeIdTable::Acquire(NodeHandle handle)
+{
+    lock_guard<mutex> lock(_mutex);
+    if ( handle >= _slots.size() || _slots[handle].id == nullptr )
+        { throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Unknown node handle: " + to_string(handle) ); }
+    ++_slots[handle].refCount;
+    return *_slots[handle].id;
+}
+
+void NodeIdTable::Release(NodeHandle handle)
+{
+    lock_guard<mutex> lock(_mutex);
+    if ( handle >= _slots.size() || _slots[handle].id == nullptr )
+        { throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Unknown node handle: " + to_string(handle) ); }
+    
+    Slot &slot = _slots[handle];
+    if ( --slot.refCount > 0 )
+        { return; }
+    
+    _handles.erase(*slot.id);
+    slot.id = nullptr;
+    _freeHandles.push_back(handle);
+}
+
+bool NodeIdTable::Find(const NodeId &id, NodeHandle &handle) const
+{
+    lock_guard<mutex> lock(_mutex);
+    auto it = _handles.find(id);
+    if ( it == _handles.end() )
+        { return false; }
+    handle = it->second;
+    return true;
+}
+
+bool NodeIdTable::FindId(NodeHandle handle, NodeId &id) const
+{
+    lock_guard<mutex> lock(_mutex);
+    if ( handle >= _slots.size() || _slots[handle].id == nullptr )
+        { return false; }
+    id = *_slots[handle].id;
+    return true;
+}
+
+const NodeId& NodeIdTable::Id(NodeHandle handle) const
+{
+    lock_guard<mutex> lock(_mutex);
+    if ( handle >= _slots.size() || _slots[handle].id == nullptr )
+        { throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Unknown node handle: " + to_string(handle) ); }
+    return *_slots[handle].id;
+}
+
+size_t NodeIdTable::size() const
+{
+    lock_guard<mutex> lock(_mutex);
+    return _handles.size();
+}
+
+
+
+NodeIdRef::NodeIdRef(const NodeId &id) :
+    _handle(), _id( &NodeIdTable::Instance().Intern(id, _handle) ) {}
+
+NodeIdRef::NodeIdRef(NodeHandle handle) :
+    _handle(handle), _id( &NodeIdTable::Instance().Acquire(handle) ) {}
+
+NodeIdRef::NodeIdRef(const NodeIdRef &other) :
+    _handle(other._handle), _id(other._id)
+{
+    if (_id != nullptr)
+        { NodeIdTable::Instance().Acquire(_handle); }
+}
+
+NodeIdRef::NodeIdRef(NodeIdRef &&other) noexcept :
+    _handle(other._handle), _id(other._id)
+    { other._id = nullptr; }
+
+NodeIdRef& NodeIdRef::operator=(const NodeIdRef &other)
+{
+    if (other._id != nullptr)
+        { NodeIdTable::Instance().Acquire(other._handle); }
+    if (_id != nullptr)
+        { NodeIdTable::Instance().Release(_handle); }
+    _handle = other._handle;
+    _id = other._id;
+    return *this;
+}
+
+NodeIdRef& NodeIdRef::operator=(NodeIdRef &&other)
+{
+    if (this == &other)
+        { return *this; }
+    if (_id != nullptr)
+        { NodeIdTable::Instance().Release(_handle); }
+    _handle = other._handle;
+    _id = other._id;
+    other._id = nullptr;
+    return *this;
+}
+
+NodeIdRef::~NodeIdRef()
+{
+    if (_id != nullptr)
+        { NodeIdTable::Instance().Release(_handle); }
+}
+
+NodeHandle NodeIdRef::handle() const
+    { return _handle; }
+
+const NodeId& NodeIdRef::id() const
+{
+    static const NodeId EmptyId;
+    return _id != nullptr ? *_id : EmptyId;
+}
+
+
+
+
 // NetworkEndpoint::NetworkEndpoint() :
 //     _address(), _port() {}
 
-NetworkEndpoint::NetworkEndpoint(const NetworkEndpoint& other) :
-    _address(other._address), _port(other._port) {}
+NetworkEndpoint::NetworkEndpoint(Address address, TcpPort port) :
+    _address( move(address) ), _port(port) {}
 
-NetworkEndpoint::NetworkEndpoint(const Address& address, TcpPort port) :
-    _address(address), _port(port) {}
-
-Address NetworkEndpoint::address() const { return _address; }
+const Address& NetworkEndpoint::address() const { return _address; }
 TcpPort NetworkEndpoint::port() const { return _port; }
 
 bool NetworkEndpoint::operator==(const NetworkEndpoint& other) const
@@ -55,32 +215,52 @@ ostream& operator<<(ostream &out, const NetworkEndpoint &value)
 
 // NodeContact::NodeContact() {}
     
-NodeContact::NodeContact(const NodeContact& other) :
-    _address(other._address), _nodePort(other._nodePort), _clientPort(other._clientPort) {}
+NodeContact::NodeContact(const Address &address, TcpPort nodePort, TcpPort clientPort) :
+    _addressBytes(), _addressSize(0), _nodePort(nodePort), _clientPort(clientPort)
+    { this->address(address); }
 
-NodeContact::NodeContact(const Address& address, TcpPort nodePort, TcpPort clientPort) :
-    _address(address), _nodePort(nodePort), _clientPort(clientPort) {}
+NodeContact NodeContact::FromAddressBytes(const string &addressBytes, TcpPort nodePort, TcpPort clientPort)
+{
+    NodeContact result( Address(), nodePort, clientPort );
+    result.SetAddressBytes(addressBytes);
+    return result;
+}
 
 
-const Address& NodeContact::address() const { return _address; }
+Address NodeContact::address() const { return AddressFromBytes( AddressBytes() ); }
 TcpPort NodeContact::nodePort() const { return _nodePort; }
 TcpPort NodeContact::clientPort() const { return _clientPort; }
 
 NetworkEndpoint NodeContact::nodeEndpoint() const
-    { return NetworkEndpoint(_address, _nodePort); }
+    { return NetworkEndpoint(address(), _nodePort); }
 
 NetworkEndpoint NodeContact::clientEndpoint() const
-    { return NetworkEndpoint(_address, _clientPort); }
+    { return NetworkEndpoint(address(), _clientPort); }
 
 
-void NodeContact::address(const Address& address)
-    { _address = address; }
+void NodeContact::address(const Address &address)
+    { SetAddressBytes( AddressToBytes(address) ); }
+
+void NodeContact::SetAddressBytes(const string &bytes)
+{
+    // Only IPv4 and IPv6 addresses are expected here
+    if ( ! bytes.empty() && bytes.size() != 4 && bytes.size() != _addressBytes.size() )
+        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Invalid bytearray length of IP address: " + to_string( bytes.size() ) ); }
+    
+    _addressBytes.fill(0);
+    copy( bytes.begin(), bytes.end(), _addressBytes.begin() );
+    _addressSize = static_cast<uint8_t>( bytes.size() );
+}
+
+string NodeContact::AddressBytes() const
+    { return string( _addressBytes.begin(), _addressBytes.begin() + _addressSize ); }
 
 bool NodeContact::operator==(const NodeContact& other) const
 {
-    return  _address    == other._address &&
-            _nodePort   == other._nodePort &&
-            _clientPort == other._clientPort;
+    return  _addressSize  == other._addressSize &&
+            _addressBytes == other._addressBytes &&
+            _nodePort     == other._nodePort &&
+            _clientPort   == other._clientPort;
 }
 
 bool NodeContact::operator!=(const NodeContact& other) const
@@ -93,9 +273,6 @@ ostream& operator<<(ostream &out, const NodeContact &value)
 
 
 
-GpsLocation::GpsLocation(const GpsLocation &other) :
-    _latitude( other.latitude() ), _longitude( other.longitude() ) {}
-    
 GpsLocation::GpsLocation(GpsCoordinate latitude, GpsCoordinate longitude) :
     _latitude(latitude), _longitude(longitude)
     { Validate(); }
@@ -130,11 +307,8 @@ std::ostream& operator<<(std::ostream& out, const GpsLocation &value)
 
 ServiceInfo::ServiceInfo() : _type(), _port(0), _customData() {}
 
-ServiceInfo::ServiceInfo(const ServiceInfo& other) :
-    _type(other._type), _port(other._port), _customData(other._customData) {}
-
-ServiceInfo::ServiceInfo(std::string type, TcpPort port, const string& customData) :
-    _type(type), _port(port), _customData(customData) {}
+ServiceInfo::ServiceInfo(string type, TcpPort port, string customData) :
+    _type( move(type) ), _port(port), _customData( move(customData) ) {}
 
 const std::string& ServiceInfo::type() const { return _type; }
 TcpPort ServiceInfo::port() const { return _port; }
@@ -155,16 +329,72 @@ std::ostream& operator<<(std::ostream& out, const ServiceInfo &value)
 
 
 
-NodeInfo::NodeInfo(const NodeInfo& other) :
-    _id(other._id), _location(other._location), _contact(other._contact),
-    _services(other._services) {}
+ServiceMap::ServiceMap() : _services() {}
+
+ServiceMap::ServiceMap(initializer_list<ServiceInfo> services) : _services()
+{
+    for (const auto &service : services)
+        { Set(service); }
+}
+
+ServiceMap::const_iterator ServiceMap::begin() const { return _services.begin(); }
+ServiceMap::const_iterator ServiceMap::end()   const { return _services.end(); }
+size_t ServiceMap::size()  const { return _services.size(); }
+bool   ServiceMap::empty() const { return _services.empty(); }
+
+
+static vector<ServiceInfo>::const_iterator LowerBound(
+    const vector<ServiceInfo> &services, const string &type)
+{
+    return lower_bound( services.begin(), services.end(), type,
+        [](const ServiceInfo &service, const string &type) { return service.type() < type; } );
+}
+
+ServiceMap::const_iterator ServiceMap::find(const string &type) const
+{
+    auto it = LowerBound(_services, type);
+    return it != _services.end() && it->type() == type ? it : _services.end();
+}
+
+const ServiceInfo& ServiceMap::at(const string &type) const
+{
+    auto it = find(type);
+    if ( it == _services.end() )
+        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Service is not found: " + type); }
+    return *it;
+}
+
+
+void ServiceMap::Set(ServiceInfo service)
+{
+    auto it = _services.begin() + ( LowerBound(_services, service.type()) - _services.begin() );
+    if ( it != _services.end() && it->type() == service.type() )
+        { *it = move(service); }
+    else { _services.insert( it, move(service) ); }
+}
+
+void ServiceMap::Remove(const string &type)
+{
+    auto it = find(type);
+    if ( it != _services.end() )
+        { _services.erase(it); }
+}
+
+
+bool ServiceMap::operator==(const ServiceMap& other) const
+    { return _services == other._services; }
+
+bool ServiceMap::operator!=(const ServiceMap& other) const
+    { return ! operator==(other); }
+
+
 
-NodeInfo::NodeInfo( const NodeId &id, const GpsLocation &location,
-                    const NodeContact &contact, const Services &services ) :
-    _id(id), _location(location), _contact(contact), _services(services) {}
+NodeInfo::NodeInfo(NodeId id, GpsLocation location, NodeContact contact, Services services) :
+    _id(id), _location(location), _contact( move(contact) ), _services( move(services) ) {}
 
 
-const NodeId&       NodeInfo::id()       const { return _id; }
+const NodeId&       NodeInfo::id()       const { return _id.id(); }
+NodeHandle          NodeInfo::handle()   const { return _id.handle(); }
 const GpsLocation&  NodeInfo::location() const { return _location; }
 const NodeContact&  NodeInfo::contact()  const { return _contact; }
 const NodeInfo::Services& NodeInfo::services() const { return _services; }
@@ -174,7 +404,7 @@ NodeInfo::Services& NodeInfo::services() { return _services; }
 
 bool NodeInfo::operator==(const NodeInfo& other) const
 {
-    return _id       == other._id &&
+    return _id.handle() == other._id.handle() &&
            _location == other._location &&
            _contact  == other._contact &&
            _services == other._services;
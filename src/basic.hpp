@@ -1,10 +1,14 @@
 #ifndef __LOCNET_BASIC_TYPES_H__
 #define __LOCNET_BASIC_TYPES_H__
 
+#include <array>
 #include <exception>
 #include <functional>
+#include <initializer_list>
 #include <iostream>
+#include <mutex>
 #include <unordered_map>
+#include <vector>
 
 
 
@@ -17,6 +21,7 @@ typedef float       GpsCoordinate;
 typedef float       Distance;
 
 typedef std::string NodeId;
+typedef uint32_t    NodeHandle;
 typedef std::string Address;
 typedef uint16_t    TcpPort;
 
@@ -57,6 +62,74 @@ public:
 
 
 
+// Interning table assigning a dense numeric handle to each node id, so internal indexes can hash and
+// store small handles instead of long id strings. Ids are materialized again only where needed, e.g. for messages.
+// Ids are reference counted by their holders, i.e. each NodeInfo keeps a reference instead of its own copy of the id.
+// Once the last reference is released the id is removed and its handle is reused for another id,
+// so ids decided by remote peers do not pile up after their nodes are gone. Protected by a lock to be threadsafe.
+class NodeIdTable
+{
+    struct Slot
+    {
+        const NodeId   *id;         // Key of _handles, nullptr if the handle is free
+        size_t          refCount;
+    };
+    
+    mutable std::mutex _mutex;
+    
+    std::unordered_map<NodeId, NodeHandle> _handles;
+    std::vector<Slot>                       _slots;
+    std::vector<NodeHandle>                 _freeHandles;
+    
+public:
+    
+    static NodeIdTable& Instance();
+    
+    // Handle of the given id taking a reference on it, a free or new handle is assigned if the id is not present
+    NodeHandle Intern(const NodeId &id);
+    // Same as above, also returning the interned id which stays valid while the reference is held
+    const NodeId& Intern(const NodeId &id, NodeHandle &handle);
+    // Take another reference on an interned id and return it, throws for unknown handles
+    const NodeId& Acquire(NodeHandle handle);
+    // Drop a reference, the id is removed and its handle freed for reuse if no references are left
+    void Release(NodeHandle handle);
+    
+    // Look up the handle of an id without interning or referencing it, returns false if the id is not present
+    bool Find(const NodeId &id, NodeHandle &handle) const;
+    // Copy of the id of a handle, returns false if the handle is free. Use this without holding a reference.
+    bool FindId(NodeHandle handle, NodeId &id) const;
+    // Id of an interned node, throws for unknown handles
+    // NOTE the result is valid only while the caller holds a reference on the handle
+    const NodeId& Id(NodeHandle handle) const;
+    
+    // Number of ids present
+    size_t size() const;
+};
+
+
+// Reference on an interned node id, keeping the id and its handle in the table while alive.
+// Has a fixed size independent of the id length, so node records hold one instead of their own copy of the id.
+class NodeIdRef
+{
+    NodeHandle    _handle;
+    const NodeId *_id;      // Interned id, nullptr if moved from
+    
+public:
+    
+    explicit NodeIdRef(const NodeId &id);
+    explicit NodeIdRef(NodeHandle handle);
+    NodeIdRef(const NodeIdRef &other);
+    NodeIdRef(NodeIdRef &&other) noexcept;
+    NodeIdRef& operator=(const NodeIdRef &other);
+    NodeIdRef& operator=(NodeIdRef &&other);
+    ~NodeIdRef();
+    
+    NodeHandle handle() const;
+    const NodeId& id() const;
+};
+
+
+
 // Data holder class for a network endpoint to connect to.
 class NetworkEndpoint
 {
@@ -65,10 +138,9 @@ class NetworkEndpoint
     
 public:
     
-    NetworkEndpoint(const NetworkEndpoint &other);
-    NetworkEndpoint(const Address &address, TcpPort port);
+    NetworkEndpoint(Address address, TcpPort port);
     
-    Address address() const;
+    const Address& address() const;
     TcpPort port() const;
     
     bool operator==(const NetworkEndpoint &other) const;
@@ -83,18 +155,22 @@ std::ostream& operator<<(std::ostream& out, const NetworkEndpoint &value);
 
 
 // Data holder class for contact data of a single (remote) node of the network to be advertised.
+// NOTE the IP address is kept in binary form as sent in messages, text is formatted only on demand
 class NodeContact
 {
-    Address     _address;
+    std::array<uint8_t, 16> _addressBytes;  // Large enough for IPv6, IPv4 uses only the first 4 bytes
+    uint8_t     _addressSize;               // 0 if address is not known (yet)
     TcpPort     _nodePort;
     TcpPort     _clientPort;
+    
+    void SetAddressBytes(const std::string &bytes);
 
 public:
     
-    NodeContact(const NodeContact &other);
     NodeContact(const Address &address, TcpPort nodePort, TcpPort clientPort);
+    static NodeContact FromAddressBytes(const std::string &addressBytes, TcpPort nodePort, TcpPort clientPort);
     
-    const Address& address() const;
+    Address address() const;
     TcpPort nodePort() const;
     TcpPort clientPort() const;
     
@@ -128,7 +204,6 @@ class GpsLocation
     
 public:
     
-    GpsLocation(const GpsLocation &other);
     GpsLocation(GpsCoordinate latitude, GpsCoordinate longitude);
     
     GpsCoordinate latitude() const;
@@ -179,8 +254,7 @@ class ServiceInfo
 public:
     
     ServiceInfo(); // Required to be a value in a map
-    ServiceInfo(const ServiceInfo &other);
-    ServiceInfo( std::string type, TcpPort port, const std::string &customData = std::string() );
+    ServiceInfo( std::string type, TcpPort port, std::string customData = std::string() );
     
     const std::string& type() const;
     TcpPort port() const;
@@ -194,6 +268,37 @@ std::ostream& operator<<(std::ostream& out, const ServiceInfo &value);
 
 
 
+// Services of a node kept sorted by type in a vector. Nodes have only a few services,
+// so this is both smaller and faster to copy or compare than a hash map.
+class ServiceMap
+{
+    std::vector<ServiceInfo> _services;
+    
+public:
+    
+    typedef std::vector<ServiceInfo>::const_iterator const_iterator;
+    
+    ServiceMap();
+    ServiceMap(std::initializer_list<ServiceInfo> services);
+    
+    const_iterator begin() const;
+    const_iterator end() const;
+    size_t size() const;
+    bool empty() const;
+    
+    const_iterator find(const std::string &type) const;
+    const ServiceInfo& at(const std::string &type) const;
+    
+    // Add a new service or replace an existing one with the same type
+    void Set(ServiceInfo service);
+    void Remove(const std::string &type);
+    
+    bool operator==(const ServiceMap &other) const;
+    bool operator!=(const ServiceMap &other) const;
+};
+
+
+
 // Data holder class for complete node information exposed to the network,
 // including node identity, network contact and position.
 // TODO will we also need a public key here later as part of the identity?
@@ -201,22 +306,22 @@ class NodeInfo
 {
 public:
 
-    typedef std::unordered_map<std::string, ServiceInfo> Services;
+    typedef ServiceMap Services;
 
 private:
     
-    NodeId      _id;
+    // NOTE the id is interned, copies of a node share a single instance of it
+    NodeIdRef   _id;
     GpsLocation _location;
     NodeContact _contact;
     Services    _services;
     
 public:
     
-    NodeInfo(const NodeInfo &other);
-    NodeInfo( const NodeId &id, const GpsLocation &location, const NodeContact &contact,
-              const Services &services );
+    NodeInfo( NodeId id, GpsLocation location, NodeContact contact, Services services );
     
     const NodeId& id() const;
+    NodeHandle handle() const;
     const GpsLocation& location() const;
     const NodeContact& contact() const;
     const Services& services() const;
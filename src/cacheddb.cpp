@@ -0,0 +1,637 @@
+#include <limits>
+
+#include <easylogging++.h>
+
+#include "cacheddb.hpp"
+
+using namespace std;
+
+
+
+namespace LocNet
+{
+
+
+// Changes are collected for this period before writing them in a single transaction
+static const chrono::milliseconds PERSIST_INTERVAL = chrono::milliseconds(500);
+
+// A change failing this many times is dropped, otherwise a permanent error would block flushing forever
+static const size_t MAX_PERSIST_ATTEMPTS = 3;
+
+
+
+CachedSpatialDatabase::CachedSpatialDatabase( const NodeInfo &myNodeInfo, const string &dbPath,
+                                              chrono::duration<uint32_t> expirationPeriod,
+                                              DbDurability durability ) :
+    _persistentDb( new SpatiaLiteDatabase(myNodeInfo, dbPath, expirationPeriod, durability) ),
+    _entryExpirationPeriod(expirationPeriod),
+    _myNode( make_shared<const NodeDbEntry>( NodeDbEntry::FromSelfInfo(myNodeInfo) ) ),
+    _expirations( chrono::system_clock::to_time_t( chrono::system_clock::now() ) ), _nodeCounts(),
+    _persistInProgress(false), _flushRequested(false), _shutdownRequested(false)
+{
+    // NOTE the persistent database has already stored or updated the self entry
+    for ( auto &stored : _persistentDb->LoadAllEntries() )
+    {
+        NodeHandle handle = stored.first.handle();
+        ApplyEntry( handle, make_shared<const CachedEntry>( CachedEntry{ stored.first, stored.second } ) );
+        _persistedNodes.insert(handle);
+    }
+    
+    _persistThread = thread( [this] { PersistLoop(); } );
+    LOG(DEBUG) << "In-memory database ready with node count: " << GetNodeCount();
+}
+
+
+CachedSpatialDatabase::~CachedSpatialDatabase()
+{
+    {
+        lock_guard<mutex> lock(_persistMutex);
+        _shutdownRequested = true;
+    }
+    _persistCondition.notify_one();
+    _persistThread.join();
+}
+
+
+
+void CachedSpatialDatabase::PersistLoop()
+{
+    unique_lock<mutex> lock(_persistMutex);
+    while (true)
+    {
+        _persistCondition.wait_for( lock, PERSIST_INTERVAL,
+            [this] { return _flushRequested || _shutdownRequested; } );
+        
+        if ( ! _persistQueue.empty() )
+        {
+            PersistQueue changes;
+            changes.swap(_persistQueue);
+            _persistInProgress = true;
+            
+            lock.unlock();
+            Persist(changes);
+            lock.lock();
+            
+            // Requeue failed changes for retry unless a newer state of the node was queued meanwhile
+            for (auto &failed : changes)
+            {
+                if ( ++failed.second.failedAttempts < MAX_PERSIST_ATTEMPTS )
+                    { _persistQueue.emplace( failed.first, move(failed.second) ); }
+                else { LOG(ERROR) << "Giving up persisting change of node "
+                                  << NodeIdTable::Instance().Id(failed.first); }
+            }
+            _persistInProgress = false;
+        }
+        
+        // NOTE changes may have been queued while persisting, then we go around again without waiting
+        if ( _persistQueue.empty() )
+        {
+            _flushRequested = false;
+            _persistedCondition.notify_all();
+            if (_shutdownRequested)
+                { return; }
+        }
+    }
+}
+
+
+void CachedSpatialDatabase::Persist(PersistQueue &changes)
+{
+    // NOTE the persistent database calculates expiration from the time of writing,
+    //      which may be later than the in-memory expiration by the persist interval
+    vector<NodeHandle> written;
+    try
+    {
+        _persistentDb->BeginBatch();
+        scope_error rollback( [this] { _persistentDb->RollbackBatch(); } );
+        
+        for (const auto &change : changes)
+        {
+            // A failed write rolls back only its own nested batch, other changes are still persisted
+            const NodeId &nodeId = NodeIdTable::Instance().Id(change.first);
+            const shared_ptr<const CachedEntry> &entry = change.second.entry;
+            bool stored = _persistedNodes.find(change.first) != _persistedNodes.end();
+            try
+            {
+                if (entry == nullptr)
+                {
+                    if (stored)
+                        { _persistentDb->Remove(nodeId); }
+                }
+                else
+                {
+                    bool expires = entry->expiresAt != numeric_limits<time_t>::max();
+                    if (stored)     { _persistentDb->Update(entry->node, expires); }
+                    else            { _persistentDb->Store (entry->node, expires); }
+                }
+                written.push_back(change.first);
+            }
+            catch (exception &e)
+                { LOG(WARNING) << "Failed to persist change of node " << nodeId << ": " << e.what(); }
+        }
+        
+        _persistentDb->CommitBatch();
+    }
+    catch (exception &e)
+    {
+        LOG(ERROR) << "Failed to persist " << changes.size() << " node changes: " << e.what();
+        return;
+    }
+    
+    for (NodeHandle handle : written)
+    {
+        if (changes.at(handle).entry != nullptr)    { _persistedNodes.insert(handle); }
+        else                                        { _persistedNodes.erase(handle); }
+        changes.erase(handle);
+    }
+}
+
+
+void CachedSpatialDatabase::Flush()
+{
+    unique_lock<mutex> lock(_persistMutex);
+    _flushRequested = true;
+    _persistCondition.notify_one();
+    _persistedCondition.wait( lock, [this] { return _persistQueue.empty() && ! _persistInProgress; } );
+}
+
+
+
+void CachedSpatialDatabase::ApplyEntry(NodeHandle handle, shared_ptr<const CachedEntry> entry)
+{
+    lock_guard<mutex> lock(_mutex);
+    
+    auto nodeIt = _nodes.find(handle);
+    if ( nodeIt != _nodes.end() )
+    {
+        --_nodeCounts.at( static_cast<size_t>( nodeIt->second->node.relationType() ) );
+        if (entry == nullptr)
+        {
+            // NOTE the removed entry keeps the id until indexes are cleaned up
+            shared_ptr<const CachedEntry> removed = move(nodeIt->second);
+            _nodes.erase(nodeIt);
+            _locationIndex.Remove(handle);
+            _nodeIds.Remove(handle);
+            _neighbourhood.Remove(handle);
+            _expirations.Remove(handle);
+            return;
+        }
+    }
+    else if (entry == nullptr)
+        { return; }
+    
+    const NodeDbEntry &node = entry->node;
+    ++_nodeCounts.at( static_cast<size_t>( node.relationType() ) );
+    _locationIndex.Set( handle, node.location(), static_cast<uint8_t>( node.relationType() ) );
+    _nodeIds.Set( handle, node.relationType() );
+    if ( entry->expiresAt != numeric_limits<time_t>::max() )
+        { _expirations.Set(handle, entry->expiresAt); }
+    else { _expirations.Remove(handle); }
+    
+    if ( node.relationType() == NodeRelationType::Self )
+    {
+        // Our location changes very rarely, distances of all neighbours are recalculated only then
+        bool locationChanged = _myNode->location() != node.location();
+        atomic_store( &_myNode, make_shared<const NodeDbEntry>( NodeDbEntry::FromSelfInfo(node) ) );
+        if (locationChanged)
+        {
+            _neighbourhood.Clear();
+            for (const auto &stored : _nodes)
+            {
+                const NodeDbEntry &storedNode = stored.second->node;
+                if ( storedNode.relationType() == NodeRelationType::Neighbour )
+                    { _neighbourhood.Set( stored.first, SelfDistanceKm( storedNode.location() ) ); }
+            }
+        }
+    }
+    else if ( node.relationType() == NodeRelationType::Neighbour )
+        { _neighbourhood.Set( handle, SelfDistanceKm( node.location() ) ); }
+    else { _neighbourhood.Remove(handle); }
+    
+    _nodes[handle] = move(entry);
+}
+
+
+Distance CachedSpatialDatabase::SelfDistanceKm(const GpsLocation &location) const
+    { return GeodesicDistanceKm( _myNode->location(), location, NODE_DISTANCE_MODEL ); }
+
+
+void CachedSpatialDatabase::SetEntry(NodeHandle handle, shared_ptr<const CachedEntry> entry)
+{
+    shared_ptr<const CachedEntry> previous;
+    {
+        lock_guard<mutex> lock(_mutex);
+        auto nodeIt = _nodes.find(handle);
+        if ( nodeIt != _nodes.end() )
+            { previous = nodeIt->second; }
+    }
+    
+    _undoLog.emplace_back( handle, previous );
+    _changedNodes.push_back(handle);
+    ApplyEntry( handle, move(entry) );
+}
+
+
+shared_ptr<const CachedSpatialDatabase::CachedEntry> CachedSpatialDatabase::FindEntry(const NodeId &nodeId) const
+{
+    // NOTE unknown ids are not interned, they are surely not present
+    NodeHandle handle;
+    if ( ! NodeIdTable::Instance().Find(nodeId, handle) )
+        { return shared_ptr<const CachedEntry>(); }
+    
+    lock_guard<mutex> lock(_mutex);
+    auto nodeIt = _nodes.find(handle);
+    return nodeIt == _nodes.end() ? shared_ptr<const CachedEntry>() : nodeIt->second;
+}
+
+
+time_t CachedSpatialDatabase::ExpirationFromNow(bool expires) const
+{
+    return expires ?
+        chrono::system_clock::to_time_t( chrono::system_clock::now() + _entryExpirationPeriod ) :
+        numeric_limits<time_t>::max();
+}
+
+
+void CachedSpatialDatabase::WriteEntry(const NodeDbEntry &node, time_t expiresAt, bool existing)
+{
+    BeginBatch();
+    scope_error rollback( [this] { RollbackBatch(); } );
+    
+    bool present = FindEntry( node.id() ) != nullptr;
+    if (present && ! existing)
+        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Node to be stored is already present: " + node.id()); }
+    if (existing && ! present)
+        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Node to be updated is not present: " + node.id()); }
+    
+    SetEntry( node.handle(), make_shared<const CachedEntry>( CachedEntry{node, expiresAt} ) );
+    
+    _afterCommitActions.push_back( [this, node, existing]
+    {
+        for ( auto listenerEntry : _listenerRegistry.listeners() )
+        {
+            if (existing)   { listenerEntry->UpdatedNode(node); }
+            else            { listenerEntry->AddedNode(node); }
+        }
+    } );
+    CommitBatch();
+}
+
+
+
+void CachedSpatialDatabase::Store(const NodeDbEntry &node, bool expires)
+    { WriteEntry( node, ExpirationFromNow(expires), false ); }
+
+
+void CachedSpatialDatabase::Update(const NodeDbEntry &node, bool expires)
+    { WriteEntry( node, ExpirationFromNow(expires), true ); }
+
+
+void CachedSpatialDatabase::StoreExpiringAt(const NodeDbEntry &node, time_t expiresAt)
+    { WriteEntry(node, expiresAt, false); }
+
+
+void CachedSpatialDatabase::Remove(const NodeId &nodeId)
+{
+    BeginBatch();
+    scope_error rollback( [this] { RollbackBatch(); } );
+    
+    shared_ptr<const CachedEntry> storedEntry = FindEntry(nodeId);
+    if (storedEntry == nullptr)
+        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Node to be removed is not present: " + nodeId); }
+    if ( storedEntry->node.relationType() == NodeRelationType::Self )
+        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Attempt to delete self entry"); }
+    
+    SetEntry( storedEntry->node.handle(), shared_ptr<const CachedEntry>() );
+    
+    _afterCommitActions.push_back( [this, storedEntry]
+    {
+        for ( auto listenerEntry : _listenerRegistry.listeners() )
+            { listenerEntry->RemovedNode(storedEntry->node); }
+    } );
+    CommitBatch();
+}
+
+
+void CachedSpatialDatabase::ExpireOldNodes()
+{
+    time_t now = chrono::system_clock::to_time_t( chrono::system_clock::now() );
+    
+    BeginBatch();
+    scope_error rollback( [this] { RollbackBatch(); } );
+    
+    // Only nodes found due by the expiration wheel are checked instead of scanning all nodes
+    vector<NodeHandle> expiredHandles;
+    auto expiredEntries = make_shared< vector< shared_ptr<const CachedEntry> > >();
+    {
+        lock_guard<mutex> lock(_mutex);
+        for ( NodeHandle handle : _expirations.PopDue(now) )
+        {
+            auto nodeIt = _nodes.find(handle);
+            if ( nodeIt != _nodes.end() && nodeIt->second->expiresAt <= now &&
+                 nodeIt->second->node.relationType() != NodeRelationType::Self )
+            {
+                expiredHandles.push_back(handle);
+                expiredEntries->push_back(nodeIt->second);
+            }
+        }
+    }
+    
+    for (NodeHandle handle : expiredHandles)
+        { SetEntry( handle, shared_ptr<const CachedEntry>() ); }
+    
+    if ( ! expiredEntries->empty() )
+    {
+        _afterCommitActions.push_back( [this, expiredEntries]
+        {
+            for (const auto &entry : *expiredEntries)
+            {
+                for ( auto listenerEntry : _listenerRegistry.listeners() )
+                    { listenerEntry->RemovedNode(entry->node); }
+            }
+        } );
+    }
+    CommitBatch();
+    
+    LOG(DEBUG) << "Expired " << expiredEntries->size() << " nodes";
+}
+
+
+
+void CachedSpatialDatabase::BeginBatch()
+{
+    _writeMutex.lock();
+    _batchStarts.push_back( BatchStart{ _undoLog.size(), _changedNodes.size(), _afterCommitActions.size() } );
+}
+
+
+void CachedSpatialDatabase::CommitBatch()
+{
+    if ( _batchStarts.empty() )
+        { throw LocationNetworkError(ErrorCode::ERROR_BAD_STATE, "No batch was started to be committed"); }
+    _batchStarts.pop_back();
+    
+    vector<function<void()>> actions;
+    if ( _batchStarts.empty() )
+    {
+        actions.swap(_afterCommitActions);
+        
+        // Queue the latest state of changed nodes for the persister thread
+        // NOTE ids of removed nodes are still referenced by the undo log here, so it is cleared only afterwards
+        if ( ! _changedNodes.empty() )
+        {
+            {
+                lock_guard<mutex> nodesLock(_mutex);
+                lock_guard<mutex> persistLock(_persistMutex);
+                for (NodeHandle handle : _changedNodes)
+                {
+                    auto nodeIt = _nodes.find(handle);
+                    PendingChange change{ nodeIt == _nodes.end() ?
+                        shared_ptr<const CachedEntry>() : nodeIt->second, 0, NodeIdRef(handle) };
+                    auto queued = _persistQueue.emplace(handle, change);
+                    if (! queued.second)
+                        { queued.first->second = change; }
+                }
+            }
+            _changedNodes.clear();
+        }
+        _undoLog.clear();
+    }
+    _writeMutex.unlock();
+    
+    for (const auto &action : actions)
+        { action(); }
+}
+
+
+// NOTE this is typically called from scope guards thus must not throw
+void CachedSpatialDatabase::RollbackBatch()
+{
+    if ( _batchStarts.empty() )
+    {
+        LOG(ERROR) << "No batch was started to be rolled back";
+        return;
+    }
+    
+    const BatchStart &batchStart = _batchStarts.back();
+    for (size_t idx = _undoLog.size(); idx > batchStart.undoLogSize; --idx)
+    {
+        const EntryState &previous = _undoLog[idx - 1];
+        ApplyEntry(previous.first, previous.second);
+    }
+    
+    _undoLog.resize(batchStart.undoLogSize);
+    _changedNodes.resize(batchStart.changedNodesSize);
+    _afterCommitActions.resize(batchStart.afterCommitSize);
+    _batchStarts.pop_back();
+    _writeMutex.unlock();
+}
+
+
+IChangeListenerRegistry& CachedSpatialDatabase::changeListenerRegistry()
+    { return _listenerRegistry; }
+
+
+
+Distance CachedSpatialDatabase::GetDistanceKm(const GpsLocation &one, const GpsLocation &other) const
+    { return GeodesicDistanceKm(one, other, NODE_DISTANCE_MODEL); }
+
+
+shared_ptr<const NodeDbEntry> CachedSpatialDatabase::ThisNode() const
+    { return atomic_load(&_myNode); }
+
+
+shared_ptr<NodeDbEntry> CachedSpatialDatabase::Load(const NodeId &nodeId) const
+{
+    shared_ptr<const CachedEntry> entry = FindEntry(nodeId);
+    return entry == nullptr ? shared_ptr<NodeDbEntry>() : make_shared<NodeDbEntry>(entry->node);
+}
+
+
+vector<NodeDbEntry> CachedSpatialDatabase::GetNodes(NodeContactRoleType roleType)
+{
+    lock_guard<mutex> lock(_mutex);
+    vector<NodeDbEntry> result;
+    for (const auto &entry : _nodes)
+    {
+        if ( entry.second->node.roleType() == roleType )
+            { result.push_back(entry.second->node); }
+    }
+    return result;
+}
+
+
+vector< pair<NodeDbEntry, time_t> > CachedSpatialDatabase::LoadAllEntries() const
+{
+    lock_guard<mutex> lock(_mutex);
+    vector< pair<NodeDbEntry, time_t> > result;
+    result.reserve( _nodes.size() );
+    for (const auto &entry : _nodes)
+        { result.emplace_back( entry.second->node, entry.second->expiresAt ); }
+    return result;
+}
+
+
+
+size_t CachedSpatialDatabase::GetNodeCount() const
+{
+    lock_guard<mutex> lock(_mutex);
+    return _nodes.size();
+}
+
+
+size_t CachedSpatialDatabase::GetNodeCount(NodeRelationType filter) const
+{
+    lock_guard<mutex> lock(_mutex);
+    return _nodeCounts.at( static_cast<size_t>(filter) );
+}
+
+
+
+vector<NodeDbEntry> CachedSpatialDatabase::GetEntries(
+    const vector<LocationIndex::Result> &closest, ServiceDetails details) const
+{
+    vector<NodeDbEntry> result;
+    result.reserve( closest.size() );
+    for (const auto &item : closest)
+    {
+        const NodeDbEntry &node = _nodes.at(item.first)->node;
+        if (details == ServiceDetails::Included)
+            { result.push_back(node); }
+        else
+        {
+            result.emplace_back( NodeInfo( node.id(), node.location(), node.contact(), NodeInfo::Services() ),
+                                 node.relationType(), node.roleType() );
+        }
+    }
+    return result;
+}
+
+
+vector<NodeDbEntry> CachedSpatialDatabase::GetNeighbourNodesByDistance() const
+{
+    lock_guard<mutex> lock(_mutex);
+    vector<NodeDbEntry> result;
+    for ( NodeHandle handle : _neighbourhood.Ids() )
+        { result.push_back( _nodes.at(handle)->node ); }
+    return result;
+}
+
+
+size_t CachedSpatialDatabase::GetNeighbourRank(const NodeId &nodeId) const
+{
+    NodeHandle handle;
+    if ( ! NodeIdTable::Instance().Find(nodeId, handle) )
+        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Node is not a neighbour: " + nodeId); }
+    return _neighbourhood.Rank(handle);
+}
+
+
+Distance CachedSpatialDatabase::GetNeighbourDistanceKm(size_t rank) const
+    { return _neighbourhood.DistanceAt(rank); }
+
+
+vector<NodeDbEntry> CachedSpatialDatabase::GetClosestNodesByDistance(
+    const GpsLocation &location, Distance radiusKm, size_t maxNodeCount, Neighbours filter,
+    ServiceDetails details) const
+{
+    // NOTE same as with SpatiaLite, excluding neighbours leaves colleagues only
+    uint32_t tagMask = filter == Neighbours::Included ? ~0u :
+        1u << static_cast<uint8_t>(NodeRelationType::Colleague);
+    
+    lock_guard<mutex> lock(_mutex);
+    return GetEntries( _locationIndex.GetClosest(location, radiusKm, maxNodeCount, tagMask), details );
+}
+
+
+vector<NodeDbEntry> CachedSpatialDatabase::GetRandomNodes(
+    size_t maxNodeCount, Neighbours filter, ServiceDetails details) const
+{
+    vector<NodeRelationType> relationTypes = filter == Neighbours::Included ?
+        vector<NodeRelationType>{ NodeRelationType::Colleague, NodeRelationType::Neighbour, NodeRelationType::Self } :
+        vector<NodeRelationType>{ NodeRelationType::Colleague };
+    
+    lock_guard<mutex> lock(_mutex);
+    vector<LocationIndex::Result> candidates;
+    for ( NodeHandle handle : _nodeIds.Sample(maxNodeCount, relationTypes) )
+        { candidates.emplace_back(handle, 0); }
+    return GetEntries(candidates, details);
+}
+
+
+// Visitors are called only after unlocking, holding the entries alive instead of copying them.
+// NOTE as copies are not made, services are passed even if ServiceDetails::Excluded is requested
+void CachedSpatialDatabase::VisitEntries(const vector< shared_ptr<const CachedEntry> > &entries,
+                                         const NodeVisitor &visitor)
+{
+    for (const auto &entry : entries)
+    {
+        if ( ! visitor(entry->node) )
+            { break; }
+    }
+}
+
+
+void CachedSpatialDatabase::VisitNodes(NodeContactRoleType roleType, const NodeVisitor &visitor)
+{
+    vector< shared_ptr<const CachedEntry> > entries;
+    {
+        lock_guard<mutex> lock(_mutex);
+        for (const auto &entry : _nodes)
+        {
+            if ( entry.second->node.roleType() == roleType )
+                { entries.push_back(entry.second); }
+        }
+    }
+    VisitEntries(entries, visitor);
+}
+
+
+void CachedSpatialDatabase::VisitNeighbourNodesByDistance(const NodeVisitor &visitor) const
+{
+    vector< shared_ptr<const CachedEntry> > entries;
+    {
+        lock_guard<mutex> lock(_mutex);
+        for ( NodeHandle handle : _neighbourhood.Ids() )
+            { entries.push_back( _nodes.at(handle) ); }
+    }
+    VisitEntries(entries, visitor);
+}
+
+
+void CachedSpatialDatabase::VisitClosestNodesByDistance(
+    const GpsLocation &location, Distance radiusKm, size_t maxNodeCount, Neighbours filter,
+    const NodeVisitor &visitor, ServiceDetails) const
+{
+    uint32_t tagMask = filter == Neighbours::Included ? ~0u :
+        1u << static_cast<uint8_t>(NodeRelationType::Colleague);
+    
+    vector< shared_ptr<const CachedEntry> > entries;
+    {
+        lock_guard<mutex> lock(_mutex);
+        for ( const auto &item : _locationIndex.GetClosest(location, radiusKm, maxNodeCount, tagMask) )
+            { entries.push_back( _nodes.at(item.first) ); }
+    }
+    VisitEntries(entries, visitor);
+}
+
+
+void CachedSpatialDatabase::VisitRandomNodes(size_t maxNodeCount, Neighbours filter,
+    const NodeVisitor &visitor, ServiceDetails) const
+{
+    vector<NodeRelationType> relationTypes = filter == Neighbours::Included ?
+        vector<NodeRelationType>{ NodeRelationType::Colleague, NodeRelationType::Neighbour, NodeRelationType::Self } :
+        vector<NodeRelationType>{ NodeRelationType::Colleague };
+    
+    vector< shared_ptr<const CachedEntry> > entries;
+    {
+        lock_guard<mutex> lock(_mutex);
+        for ( NodeHandle handle : _nodeIds.Sample(maxNodeCount, relationTypes) )
+            { entries.push_back( _nodes.at(handle) ); }
+    }
+    VisitEntries(entries, visitor);
+}
+
+
+
+} // namespace LocNet
@@ -0,0 +1,167 @@
+#ifndef __LOCNET_CACHED_DATABASE_H__
+#define __LOCNET_CACHED_DATABASE_H__
+
+#include <condition_variable>
+#include <deque>
+#include <thread>
+#include <unordered_set>
+
+#include "geodesic.hpp"
+#include "spatialdb.hpp"
+
+
+
+namespace LocNet
+{
+
+
+
+// A spatial database serving all queries from memory. Changes are persisted into a SpatiaLite database
+// asynchronously by a background thread, applying all pending writes in a single transaction.
+// The node map is rebuilt from the SpatiaLite database on startup.
+// NOTE writes not persisted yet are lost on a crash, the window is usually a single transaction.
+class CachedSpatialDatabase : public ISpatialDatabase
+{
+    // NOTE each state of a node references its id through the node info, so the handle is kept while any of them is alive, e.g. in the undo log
+    struct CachedEntry
+    {
+        NodeDbEntry node;
+        time_t      expiresAt;
+    };
+    
+    // Node state to be persisted or restored on rollback, nullptr if the node does not exist
+    typedef std::pair< NodeHandle, std::shared_ptr<const CachedEntry> > EntryState;
+    
+    // Latest committed state of a node waiting to be persisted, retried a few times if writing it fails.
+    // NOTE references the id also for removed nodes until their removal is persisted.
+    struct PendingChange
+    {
+        std::shared_ptr<const CachedEntry> entry;
+        size_t failedAttempts;
+        NodeIdRef id;
+    };
+    typedef std::unordered_map<NodeHandle, PendingChange> PersistQueue;
+    
+    // Positions of a batch start in the logs below to be cut back on rollback
+    struct BatchStart
+    {
+        size_t undoLogSize;
+        size_t changedNodesSize;
+        size_t afterCommitSize;
+    };
+    
+    
+    std::unique_ptr<SpatiaLiteDatabase> _persistentDb;
+    std::chrono::duration<uint32_t>     _entryExpirationPeriod;
+    
+    mutable std::mutex  _mutex;
+    // NOTE replaced under _mutex with atomic_store(), so ThisNode() can use atomic_load() without locking
+    std::shared_ptr<const NodeDbEntry> _myNode;
+    std::unordered_map< NodeHandle, std::shared_ptr<const CachedEntry> > _nodes;
+    LocationIndex       _locationIndex;
+    NodeIdSampler       _nodeIds;
+    
+    // Neighbours ordered by their distance from self, rebuilt only when our location changes
+    NeighbourhoodIndex  _neighbourhood;
+    TimingWheel         _expirations;
+    std::array<size_t, 4> _nodeCounts;
+    
+    // Held by write operations and open batches, changes are published and persisted only after commit
+    std::recursive_mutex                _writeMutex;
+    std::vector<BatchStart>             _batchStarts;
+    std::vector<EntryState>             _undoLog;
+    std::vector<NodeHandle>             _changedNodes;
+    std::vector<std::function<void()>>  _afterCommitActions;
+    
+    ThreadSafeChangeListenerRegistry _listenerRegistry;
+    
+    // Latest committed state of nodes not persisted yet, consumed by the persister thread
+    std::mutex                  _persistMutex;
+    std::condition_variable     _persistCondition;
+    std::condition_variable     _persistedCondition;
+    PersistQueue                _persistQueue;
+    bool                        _persistInProgress;
+    bool                        _flushRequested;
+    bool                        _shutdownRequested;
+    std::thread                 _persistThread;
+    // Nodes present in the persistent database, used only by the persister thread after construction.
+    // NOTE handles are referenced by the persistent database itself while the nodes are stored there.
+    std::unordered_set<NodeHandle> _persistedNodes;
+    
+    void PersistLoop();
+    // Writes changes in a single transaction, failed changes are left in the queue
+    void Persist(PersistQueue &changes);
+    
+    std::shared_ptr<const CachedEntry> FindEntry(const NodeId &nodeId) const;
+    void ApplyEntry(NodeHandle handle, std::shared_ptr<const CachedEntry> entry);
+    static void VisitEntries(const std::vector< std::shared_ptr<const CachedEntry> > &entries,
+                             const NodeVisitor &visitor);
+    
+    time_t ExpirationFromNow(bool expires) const;
+    
+    // NOTE these expect _writeMutex to be locked
+    void SetEntry(NodeHandle handle, std::shared_ptr<const CachedEntry> entry);
+    void WriteEntry(const NodeDbEntry &node, time_t expiresAt, bool existing);
+    
+    // NOTE these expect _mutex to be locked
+    Distance SelfDistanceKm(const GpsLocation &location) const;
+    std::vector<NodeDbEntry> GetEntries(const std::vector<LocationIndex::Result> &closest,
+                                        ServiceDetails details) const;
+
+public:
+
+    CachedSpatialDatabase(const NodeInfo &myNodeInfo, const std::string &dbPath,
+                          std::chrono::duration<uint32_t> expirationPeriod,
+                          DbDurability durability = DbDurability::Normal);
+    virtual ~CachedSpatialDatabase();
+    
+    // Block until all changes committed so far are written into the persistent database
+    void Flush();
+    
+    Distance GetDistanceKm(const GpsLocation &one, const GpsLocation &other) const override;
+    
+    std::shared_ptr<NodeDbEntry> Load(const NodeId &nodeId) const override;
+    void Store (const NodeDbEntry &node, bool expires = true) override;
+    void Update(const NodeDbEntry &node, bool expires = true) override;
+    void StoreExpiringAt(const NodeDbEntry &node, time_t expiresAt) override;
+    void Remove(const NodeId &nodeId) override;
+    void ExpireOldNodes() override;
+    
+    void BeginBatch() override;
+    void CommitBatch() override;
+    void RollbackBatch() override;
+    
+    IChangeListenerRegistry& changeListenerRegistry() override;
+    
+    std::shared_ptr<const NodeDbEntry> ThisNode() const override;
+    std::vector<NodeDbEntry> GetNodes(NodeContactRoleType roleType) override;
+    std::vector< std::pair<NodeDbEntry, time_t> > LoadAllEntries() const override;
+    
+    size_t GetNodeCount() const override;
+    size_t GetNodeCount(NodeRelationType filter) const override;
+    std::vector<NodeDbEntry> GetNeighbourNodesByDistance() const override;
+    size_t GetNeighbourRank(const NodeId &nodeId) const override;
+    Distance GetNeighbourDistanceKm(size_t rank) const override;
+    std::vector<NodeDbEntry> GetRandomNodes(
+        size_t maxNodeCount, Neighbours filter,
+        ServiceDetails details = ServiceDetails::Included) const override;
+    
+    std::vector<NodeDbEntry> GetClosestNodesByDistance(const GpsLocation &location,
+        Distance radiusKm, size_t maxNodeCount, Neighbours filter,
+        ServiceDetails details = ServiceDetails::Included) const override;
+    
+    void VisitNodes(NodeContactRoleType roleType, const NodeVisitor &visitor) override;
+    void VisitNeighbourNodesByDistance(const NodeVisitor &visitor) const override;
+    void VisitClosestNodesByDistance(const GpsLocation &location,
+        Distance radiusKm, size_t maxNodeCount, Neighbours filter,
+        const NodeVisitor &visitor, ServiceDetails details = ServiceDetails::Included) const override;
+    void VisitRandomNodes(size_t maxNodeCount, Neighbours filter,
+        const NodeVisitor &visitor, ServiceDetails details = ServiceDetails::Included) const override;
+};
+
+
+
+} // namespace LocNet
+
+
+#endif // __LOCNET_CACHED_DATABASE_H__
@@ -1,4 +1,5 @@
 #include <cstdlib>
+#include <thread>
 
 #ifdef _WIN32
   #include <windows.h>
@@ -33,9 +34,11 @@ static const string LOCNET_VERSION = to_string(VERSION_MAJOR) + "." +
 static const size_t NEIGHBOURHOOD_TARGET_SIZE = 50;
 
 const chrono::duration<uint32_t> EzParserConfig::_requestExpirationPeriod = chrono::seconds(10);
+const chrono::duration<uint32_t> EzParserConfig::_connectTimeout      = chrono::seconds(5);
 const chrono::duration<uint32_t> EzParserConfig::_dbExpirationPeriod  = chrono::hours(24);
 const chrono::duration<uint32_t> EzParserConfig::_dbMaintenancePeriod = chrono::hours(7);
 const chrono::duration<uint32_t> EzParserConfig::_discoveryPeriod     = chrono::minutes(5);
+const chrono::duration<uint32_t> EzParserConfig::_snapshotPeriod      = chrono::minutes(10);
 
 
 
@@ -110,6 +113,13 @@ static const string DESC_OPTIONAL_DEFAULT = "Optional, default value: ";
 static const string DEFAULT_CONFIG_FILE = GetApplicationDataDirectory() + "iop-locnet.cfg";
 static const string DEFAULT_DBPATH      = GetApplicationDataDirectory() + "locnet.sqlite";
 static const string DEFAULT_LOGPATH     = GetApplicationDataDirectory() + "debug.log";
+static const string DEFAULT_DBDURABILITY= "normal";
+static const string DEFAULT_DBBACKEND   = "spatialite";
+static const string DEFAULT_SNAPSHOTPATH= GetApplicationDataDirectory() + "locnet.snapshot";
+static const string DEFAULT_THREADS     = to_string( max( thread::hardware_concurrency(), 1u ) );
+static const string DEFAULT_NODE_WORKERS   = "16";
+static const string DEFAULT_CLIENT_WORKERS = "16";
+static const string DEFAULT_LOCAL_WORKERS  = "4";
 //const string DBFILE_PATH = ":memory:"; // NOTE in-memory storage without a db file
 //const string DBFILE_PATH = "file:locnet.sqlite"; // NOTE this may be any file URL
 
@@ -128,6 +138,13 @@ static const char *OPTNAME_LONGITUDE    = "--longitude";
 static const char *OPTNAME_SEEDNODE     = "--seednode";
 
 static const char *OPTNAME_DBPATH       = "--dbpath";
+static const char *OPTNAME_DBDURABILITY = "--dbdurability";
+static const char *OPTNAME_DBBACKEND    = "--dbbackend";
+static const char *OPTNAME_SNAPSHOTPATH = "--snapshotpath";
+static const char *OPTNAME_THREADS      = "--threads";
+static const char *OPTNAME_NODE_WORKERS     = "--nodeworkers";
+static const char *OPTNAME_CLIENT_WORKERS   = "--clientworkers";
+static const char *OPTNAME_LOCAL_WORKERS    = "--localworkers";
 static const char *OPTNAME_LOGPATH      = "--logpath";
 static const char *OPTNAME_TESTMODE     = "--test";
 
@@ -186,6 +203,23 @@ bool EzParserConfig::Initialize(int argc, const char *argv[])
         DESC_OPTIONAL_DEFAULT + DEFAULT_LOGPATH ).c_str(), OPTNAME_LOGPATH);
     _optParser.add(DEFAULT_DBPATH.c_str(), false, 1, 0, ( "Path to db file. " +
         DESC_OPTIONAL_DEFAULT + DEFAULT_DBPATH ).c_str(), OPTNAME_DBPATH);
+    _optParser.add(DEFAULT_DBDURABILITY.c_str(), false, 1, 0, ( "Durability of db writes: full, normal or off. "
+        "Lower durability is faster, but recent changes may be lost on power failure. " +
+        DESC_OPTIONAL_DEFAULT + DEFAULT_DBDURABILITY ).c_str(), OPTNAME_DBDURABILITY);
+    _optParser.add(DEFAULT_DBBACKEND.c_str(), false, 1, 0, ( "Node database implementation: spatialite or memory. "
+        "Memory serves queries faster, but needs memory for all nodes and persists changes asynchronously. " +
+        DESC_OPTIONAL_DEFAULT + DEFAULT_DBBACKEND ).c_str(), OPTNAME_DBBACKEND);
+    _optParser.add(DEFAULT_SNAPSHOTPATH.c_str(), false, 1, 0, ( "Path to node map snapshot file "
+        "used to serve queries right after a restart. Empty value disables snapshots. " +
+        DESC_OPTIONAL_DEFAULT + DEFAULT_SNAPSHOTPATH ).c_str(), OPTNAME_SNAPSHOTPATH);
+    _optParser.add(DEFAULT_THREADS.c_str(), false, 1, 0, ( "Number of threads serving network requests. " +
+        DESC_OPTIONAL_DEFAULT + "number of CPU cores" ).c_str(), OPTNAME_THREADS);
+    _optParser.add(DEFAULT_NODE_WORKERS.c_str(), false, 1, 0, ( "Number of threads serving requests of other nodes. " +
+        DESC_OPTIONAL_DEFAULT + DEFAULT_NODE_WORKERS ).c_str(), OPTNAME_NODE_WORKERS);
+    _optParser.add(DEFAULT_CLIENT_WORKERS.c_str(), false, 1, 0, ( "Number of threads serving requests of clients. " +
+        DESC_OPTIONAL_DEFAULT + DEFAULT_CLIENT_WORKERS ).c_str(), OPTNAME_CLIENT_WORKERS);
+    _optParser.add(DEFAULT_LOCAL_WORKERS.c_str(), false, 1, 0, ( "Number of threads serving requests of local services. " +
+        DESC_OPTIONAL_DEFAULT + DEFAULT_LOCAL_WORKERS ).c_str(), OPTNAME_LOCAL_WORKERS);
     
     // Perform parsing, first from command line ...
     _optParser.parse(argc, argv);
@@ -235,6 +269,44 @@ bool EzParserConfig::Initialize(int argc, const char *argv[])
     _optParser.get(OPTNAME_LONGITUDE)->getFloat(_longitude);
     _optParser.get(OPTNAME_LOGPATH)->getString(_logPath);
     _optParser.get(OPTNAME_DBPATH)->getString(_dbPath);
+    _optParser.get(OPTNAME_SNAPSHOTPATH)->getString(_snapshotPath);
+    
+    string dbDurability;
+    _optParser.get(OPTNAME_DBDURABILITY)->getString(dbDurability);
+    if      (dbDurability == "full")    { _dbDurability = DbDurability::Full; }
+    else if (dbDurability == "normal")  { _dbDurability = DbDurability::Normal; }
+    else if (dbDurability == "off")     { _dbDurability = DbDurability::Off; }
+    else
+    {
+        cerr << "Invalid value for option " << OPTNAME_DBDURABILITY << ": " << dbDurability << endl;
+        return false;
+    }
+    
+    string dbBackend;
+    _optParser.get(OPTNAME_DBBACKEND)->getString(dbBackend);
+    if      (dbBackend == "spatialite") { _dbBackend = DbBackend::SpatiaLite; }
+    else if (dbBackend == "memory")     { _dbBackend = DbBackend::InMemory; }
+    else
+    {
+        cerr << "Invalid value for option " << OPTNAME_DBBACKEND << ": " << dbBackend << endl;
+        return false;
+    }
+    
+    for ( auto const &threadOption : vector< pair<const char*, size_t*> > {
+            { OPTNAME_THREADS,          &_reactorThreadCount },
+            { OPTNAME_NODE_WORKERS,     &_nodeWorkerCount },
+            { OPTNAME_CLIENT_WORKERS,   &_clientWorkerCount },
+            { OPTNAME_LOCAL_WORKERS,    &_localWorkerCount } } )
+    {
+        unsigned long threadCount;
+        _optParser.get(threadOption.first)->getULong(threadCount);
+        if (threadCount == 0)
+        {
+            cerr << "Invalid value for option " << threadOption.first << ": " << threadCount << endl;
+            return false;
+        }
+        *threadOption.second = threadCount;
+    }
     
     unsigned long nodePort;
     _optParser.get(OPTNAME_NODE_PORT)->getULong(nodePort);
@@ -280,6 +352,27 @@ const string& EzParserConfig::logPath() const
 const string& EzParserConfig::dbPath() const
     { return _dbPath; }
 
+DbDurability EzParserConfig::dbDurability() const
+    { return _dbDurability; }
+
+DbBackend EzParserConfig::dbBackend() const
+    { return _dbBackend; }
+
+const string& EzParserConfig::snapshotPath() const
+    { return _snapshotPath; }
+
+size_t EzParserConfig::reactorThreadCount() const
+    { return _reactorThreadCount; }
+
+size_t EzParserConfig::nodeWorkerCount() const
+    { return _nodeWorkerCount; }
+
+size_t EzParserConfig::clientWorkerCount() const
+    { return _clientWorkerCount; }
+
+size_t EzParserConfig::localWorkerCount() const
+    { return _localWorkerCount; }
+
 const NodeInfo& EzParserConfig::myNodeInfo() const
     { return *_myNodeInfo; }
 
@@ -295,6 +388,9 @@ const NetworkEndpoint& EzParserConfig::localServiceEndpoint() const
 chrono::duration<uint32_t> EzParserConfig::requestExpirationPeriod() const
      { return isTestMode() ? chrono::duration<uint32_t>(chrono::seconds(60)) : _requestExpirationPeriod; }
 
+chrono::duration<uint32_t> EzParserConfig::connectTimeout() const
+    { return _connectTimeout; }
+
 chrono::duration<uint32_t> EzParserConfig::dbMaintenancePeriod() const
     { return isTestMode() ? chrono::duration<uint32_t>(chrono::seconds(35)) : _dbMaintenancePeriod; }
 
@@ -304,6 +400,9 @@ chrono::duration<uint32_t> EzParserConfig::dbExpirationPeriod() const
 chrono::duration<uint32_t> EzParserConfig::discoveryPeriod() const
     { return isTestMode() ? chrono::duration<uint32_t>(chrono::seconds(15)) : _discoveryPeriod; }
 
+chrono::duration<uint32_t> EzParserConfig::snapshotPeriod() const
+    { return isTestMode() ? chrono::duration<uint32_t>(chrono::seconds(30)) : _snapshotPeriod; }
+
 
 }
 
@@ -13,6 +13,25 @@ namespace LocNet
 
 
 
+// Tradeoff between durability and write performance of the node database,
+// values are the same as the SQLite synchronous pragma
+enum class DbDurability : uint8_t
+{
+    Off     = 0,    // No syncing at all, data may be lost or corrupted on power failure
+    Normal  = 1,    // Last transactions may be lost on power failure, but database stays consistent
+    Full    = 2,    // All committed transactions are kept
+};
+
+
+// Implementation serving node database queries
+enum class DbBackend : uint8_t
+{
+    SpatiaLite  = 1,    // All queries run on the SQLite database
+    InMemory    = 2,    // Queries are served from memory, changes are written into the SQLite database asynchronously
+};
+
+
+
 // Abstract base class for project configuration.
 // Built with the singleton pattern.
 class Config
@@ -34,15 +53,28 @@ public:
     
     virtual const std::string& logPath() const = 0;
     virtual const std::string& dbPath() const = 0;
+    virtual DbDurability dbDurability() const = 0;
+    virtual DbBackend dbBackend() const = 0;
+    // Node map snapshot file for fast restarts, empty if snapshots are disabled
+    virtual const std::string& snapshotPath() const = 0;
+    // Number of threads running the network reactor, requests of different sessions are served in parallel
+    virtual size_t reactorThreadCount() const = 0;
+    // Number of threads serving requests on each interface, so reactor threads never wait for them
+    virtual size_t nodeWorkerCount() const = 0;
+    virtual size_t clientWorkerCount() const = 0;
+    virtual size_t localWorkerCount() const = 0;
     
     virtual bool isTestMode() const = 0;
     virtual const std::vector<NetworkEndpoint>& seedNodes() const = 0;
     virtual size_t neighbourhoodTargetSize() const = 0;
     
     virtual std::chrono::duration<uint32_t> requestExpirationPeriod() const = 0;
+    // Limit for resolving and connecting to a remote node, unreachable nodes are given up after this
+    virtual std::chrono::duration<uint32_t> connectTimeout() const = 0;
     virtual std::chrono::duration<uint32_t> dbMaintenancePeriod() const = 0;
     virtual std::chrono::duration<uint32_t> dbExpirationPeriod() const = 0;
     virtual std::chrono::duration<uint32_t> discoveryPeriod() const = 0;
+    virtual std::chrono::duration<uint32_t> snapshotPeriod() const = 0;
 };
 
 
@@ -52,9 +84,11 @@ public:
 class EzParserConfig : public Config
 {
     static const std::chrono::duration<uint32_t> _requestExpirationPeriod;
+    static const std::chrono::duration<uint32_t> _connectTimeout;
     static const std::chrono::duration<uint32_t> _dbMaintenancePeriod;
     static const std::chrono::duration<uint32_t> _dbExpirationPeriod;
     static const std::chrono::duration<uint32_t> _discoveryPeriod;
+    static const std::chrono::duration<uint32_t> _snapshotPeriod;
     
     bool            _testMode = false;
     bool            _versionRequested = false;
@@ -67,6 +101,13 @@ class EzParserConfig : public Config
     GpsCoordinate   _longitude = 0;
     std::string     _logPath;
     std::string     _dbPath;
+    DbDurability    _dbDurability = DbDurability::Normal;
+    DbBackend       _dbBackend = DbBackend::SpatiaLite;
+    std::string     _snapshotPath;
+    size_t          _reactorThreadCount = 1;
+    size_t          _nodeWorkerCount = 1;
+    size_t          _clientWorkerCount = 1;
+    size_t          _localWorkerCount = 1;
     std::vector<NetworkEndpoint> _seedNodes;
     
     std::unique_ptr<NodeInfo> _myNodeInfo;
@@ -81,15 +122,24 @@ public:
     
     const std::string& logPath() const override;
     const std::string& dbPath() const override;
+    DbDurability dbDurability() const override;
+    DbBackend dbBackend() const override;
+    const std::string& snapshotPath() const override;
+    size_t reactorThreadCount() const override;
+    size_t nodeWorkerCount() const override;
+    size_t clientWorkerCount() const override;
+    size_t localWorkerCount() const override;
     
     bool isTestMode() const override;
     const std::vector<NetworkEndpoint>& seedNodes() const override;
     size_t neighbourhoodTargetSize() const override;
     
     std::chrono::duration<uint32_t> requestExpirationPeriod() const override;
+    std::chrono::duration<uint32_t> connectTimeout() const override;
     std::chrono::duration<uint32_t> dbMaintenancePeriod() const override;
     std::chrono::duration<uint32_t> dbExpirationPeriod() const override;
     std::chrono::duration<uint32_t> discoveryPeriod() const override;
+    std::chrono::duration<uint32_t> snapshotPeriod() const override;
 };
 
 
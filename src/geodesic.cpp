@@ -0,0 +1,358 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+#include <immintrin.h>
+#define LOCNET_X86_KERNELS
+#endif
+
+#include "geodesic.hpp"
+
+using namespace std;
+
+
+
+namespace LocNet
+{
+
+
+
+const DistanceModel NODE_DISTANCE_MODEL = DistanceModel::Vincenty;
+
+// Mean radius of the Earth used for spherical calculations
+static const double EARTH_MEAN_RADIUS_KM = 6371.;
+
+// Parameters of the WGS84 reference ellipsoid
+static const double WGS84_MAJOR_AXIS_KM = 6378.137;
+static const double WGS84_FLATTENING    = 1. / 298.257223563;
+static const double WGS84_MINOR_AXIS_KM = WGS84_MAJOR_AXIS_KM * (1. - WGS84_FLATTENING);
+
+static const size_t VINCENTY_MAX_ITERATIONS = 200;
+static const double VINCENTY_PRECISION      = 1e-12;
+
+
+static inline double DegreesToRadian(double degrees)
+    { return degrees * M_PI / 180.; }
+
+
+
+// Implementation based on Haversine formula, see e.g. http://www.movable-type.co.uk/scripts/latlong.html
+double HaversineDistanceKm(double latitude1, double longitude1, double latitude2, double longitude2)
+{
+    double fi1 = DegreesToRadian(latitude1);
+    double fi2 = DegreesToRadian(latitude2);
+    double sinHalfDeltaFi     = sin( (fi2 - fi1) / 2 );
+    double sinHalfDeltaLambda = sin( DegreesToRadian(longitude2 - longitude1) / 2 );
+    
+    double a = sinHalfDeltaFi * sinHalfDeltaFi +
+        cos(fi1) * cos(fi2) * sinHalfDeltaLambda * sinHalfDeltaLambda;
+    double c = 2 * atan2( sqrt(a), sqrt(1 - a) );
+    return EARTH_MEAN_RADIUS_KM * c;
+}
+
+
+
+// Implementation of Vincenty's inverse formula on the WGS84 ellipsoid,
+// see e.g. http://www.movable-type.co.uk/scripts/latlong-vincenty.html
+double VincentyDistanceKm(double latitude1, double longitude1, double latitude2, double longitude2)
+{
+    const double f = WGS84_FLATTENING;
+    const double a = WGS84_MAJOR_AXIS_KM;
+    const double b = WGS84_MINOR_AXIS_KM;
+    
+    double L = DegreesToRadian(longitude2 - longitude1);
+    double U1 = atan( (1 - f) * tan( DegreesToRadian(latitude1) ) );
+    double U2 = atan( (1 - f) * tan( DegreesToRadian(latitude2) ) );
+    double sinU1 = sin(U1), cosU1 = cos(U1);
+    double sinU2 = sin(U2), cosU2 = cos(U2);
+    
+    double lambda = L;
+    double sinSigma = 0, cosSigma = 0, sigma = 0, cosSqAlpha = 0, cos2SigmaM = 0;
+    bool converged = false;
+    for (size_t iteration = 0; iteration < VINCENTY_MAX_ITERATIONS && ! converged; ++iteration)
+    {
+        double sinLambda = sin(lambda), cosLambda = cos(lambda);
+        double sinSqSigma = (cosU2 * sinLambda) * (cosU2 * sinLambda) +
+            (cosU1 * sinU2 - sinU1 * cosU2 * cosLambda) * (cosU1 * sinU2 - sinU1 * cosU2 * cosLambda);
+        sinSigma = sqrt(sinSqSigma);
+        if (sinSigma == 0)
+            { return 0; } // coincident points
+        
+        cosSigma = sinU1 * sinU2 + cosU1 * cosU2 * cosLambda;
+        sigma = atan2(sinSigma, cosSigma);
+        double sinAlpha = cosU1 * cosU2 * sinLambda / sinSigma;
+        cosSqAlpha = 1 - sinAlpha * sinAlpha;
+        // NOTE on the equator cosSqAlpha is zero and cos2SigmaM is not used
+        cos2SigmaM = cosSqAlpha != 0 ? cosSigma - 2 * sinU1 * sinU2 / cosSqAlpha : 0;
+        
+        double C = f / 16 * cosSqAlpha * ( 4 + f * (4 - 3 * cosSqAlpha) );
+        double lambdaPrev = lambda;
+        lambda = L + (1 - C) * f * sinAlpha *
+            ( sigma + C * sinSigma * ( cos2SigmaM + C * cosSigma * (-1 + 2 * cos2SigmaM * cos2SigmaM) ) );
+        converged = fabs(lambda - lambdaPrev) <= VINCENTY_PRECISION;
+    }
+    
+    // The iteration may fail to converge for nearly antipodal points, fall back to spherical distance there
+    if (! converged)
+        { return HaversineDistanceKm(latitude1, longitude1, latitude2, longitude2); }
+    
+    double uSq = cosSqAlpha * (a * a - b * b) / (b * b);
+    double A = 1 + uSq / 16384 * ( 4096 + uSq * ( -768 + uSq * (320 - 175 * uSq) ) );
+    double B = uSq / 1024 * ( 256 + uSq * ( -128 + uSq * (74 - 47 * uSq) ) );
+    double deltaSigma = B * sinSigma * ( cos2SigmaM + B / 4 * (
+        cosSigma * (-1 + 2 * cos2SigmaM * cos2SigmaM) -
+        B / 6 * cos2SigmaM * (-3 + 4 * sinSigma * sinSigma) * (-3 + 4 * cos2SigmaM * cos2SigmaM) ) );
+    
+    return b * A * (sigma - deltaSigma);
+}
+
+
+
+double GeodesicDistanceKm(double latitude1, double longitude1, double latitude2, double longitude2,
+                          DistanceModel model)
+{
+    switch (model)
+    {
+        case DistanceModel::Haversine:
+            return HaversineDistanceKm(latitude1, longitude1, latitude2, longitude2);
+        case DistanceModel::Vincenty:
+            return VincentyDistanceKm(latitude1, longitude1, latitude2, longitude2);
+        default:
+            throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Unknown distance model");
+    }
+}
+
+
+Distance GeodesicDistanceKm(const GpsLocation &one, const GpsLocation &other, DistanceModel model)
+{
+    return GeodesicDistanceKm( one.latitude(), one.longitude(),
+                               other.latitude(), other.longitude(), model );
+}
+
+
+
+
+// Batch kernels calculating squared chord lengths between a point and unit vectors given in SoA layout
+typedef void (*SquaredChordKernel)(const double *x, const double *y, const double *z, size_t count,
+                                   double fromX, double fromY, double fromZ, double *result);
+
+static void SquaredChordsScalar(const double *x, const double *y, const double *z, size_t count,
+                                double fromX, double fromY, double fromZ, double *result)
+{
+    for (size_t idx = 0; idx < count; ++idx)
+    {
+        double dx = x[idx] - fromX;
+        double dy = y[idx] - fromY;
+        double dz = z[idx] - fromZ;
+        result[idx] = dx * dx + dy * dy + dz * dz;
+    }
+}
+
+
+#ifdef LOCNET_X86_KERNELS
+
+__attribute__((target("sse2")))
+static void SquaredChordsSse2(const double *x, const double *y, const double *z, size_t count,
+                              double fromX, double fromY, double fromZ, double *result)
+{
+    const __m128d vFromX = _mm_set1_pd(fromX);
+    const __m128d vFromY = _mm_set1_pd(fromY);
+    const __m128d vFromZ = _mm_set1_pd(fromZ);
+    
+    size_t idx = 0;
+    for (; idx + 2 <= count; idx += 2)
+    {
+        __m128d dx = _mm_sub_pd( _mm_loadu_pd(x + idx), vFromX );
+        __m128d dy = _mm_sub_pd( _mm_loadu_pd(y + idx), vFromY );
+        __m128d dz = _mm_sub_pd( _mm_loadu_pd(z + idx), vFromZ );
+        __m128d sum = _mm_add_pd( _mm_add_pd( _mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy) ), _mm_mul_pd(dz, dz) );
+        _mm_storeu_pd(result + idx, sum);
+    }
+    SquaredChordsScalar(x + idx, y + idx, z + idx, count - idx, fromX, fromY, fromZ, result + idx);
+}
+
+
+__attribute__((target("avx2,fma")))
+static void SquaredChordsAvx2(const double *x, const double *y, const double *z, size_t count,
+                              double fromX, double fromY, double fromZ, double *result)
+{
+    const __m256d vFromX = _mm256_set1_pd(fromX);
+    const __m256d vFromY = _mm256_set1_pd(fromY);
+    const __m256d vFromZ = _mm256_set1_pd(fromZ);
+    
+    size_t idx = 0;
+    for (; idx + 4 <= count; idx += 4)
+    {
+        __m256d dx = _mm256_sub_pd( _mm256_loadu_pd(x + idx), vFromX );
+        __m256d dy = _mm256_sub_pd( _mm256_loadu_pd(y + idx), vFromY );
+        __m256d dz = _mm256_sub_pd( _mm256_loadu_pd(z + idx), vFromZ );
+        __m256d sum = _mm256_mul_pd(dx, dx);
+        sum = _mm256_fmadd_pd(dy, dy, sum);
+        sum = _mm256_fmadd_pd(dz, dz, sum);
+        _mm256_storeu_pd(result + idx, sum);
+    }
+    SquaredChordsScalar(x + idx, y + idx, z + idx, count - idx, fromX, fromY, fromZ, result + idx);
+}
+
+#endif
+
+
+struct KernelSelection
+{
+    SquaredChordKernel  kernel;
+    const char         *name;
+};
+
+static const KernelSelection& SelectKernel()
+{
+    static const KernelSelection selected = [] () -> KernelSelection {
+#ifdef LOCNET_X86_KERNELS
+        __builtin_cpu_init();
+        if ( __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") )
+            { return { SquaredChordsAvx2, "avx2" }; }
+        if ( __builtin_cpu_supports("sse2") )
+            { return { SquaredChordsSse2, "sse2" }; }
+#endif
+        return { SquaredChordsScalar, "scalar" };
+    }();
+    return selected;
+}
+
+
+
+// Squared chord length of points on the unit sphere for a given surface distance
+static double DistanceKmToSquaredChord(Distance distanceKm)
+{
+    double angle = distanceKm / EARTH_MEAN_RADIUS_KM;
+    if (angle >= M_PI)
+        { return numeric_limits<double>::infinity(); }
+    double chord = 2 * sin(angle / 2);
+    return chord * chord;
+}
+
+// Inverse of the above, gives the same result as haversine formula
+static Distance SquaredChordToDistanceKm(double squaredChord)
+{
+    double halfChord = min( 1., sqrt(squaredChord) / 2 );
+    return 2 * EARTH_MEAN_RADIUS_KM * asin(halfChord);
+}
+
+
+
+const char* LocationIndex::KernelName()
+    { return SelectKernel().name; }
+
+size_t LocationIndex::size() const
+    { return _ids.size(); }
+
+
+void LocationIndex::Clear()
+{
+    _ids.clear();
+    _tags.clear();
+    _x.clear();
+    _y.clear();
+    _z.clear();
+    _positions.clear();
+}
+
+
+void LocationIndex::Set(NodeHandle id, const GpsLocation &location, uint8_t tag)
+{
+    if (tag >= 32)
+        { throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Location index tag out of range"); }
+    
+    double latitude  = DegreesToRadian( location.latitude() );
+    double longitude = DegreesToRadian( location.longitude() );
+    double x = cos(latitude) * cos(longitude);
+    double y = cos(latitude) * sin(longitude);
+    double z = sin(latitude);
+    
+    auto positionIt = _positions.find(id);
+    if ( positionIt == _positions.end() )
+    {
+        _positions.emplace( id, _ids.size() );
+        _ids.push_back(id);
+        _tags.push_back(tag);
+        _x.push_back(x);
+        _y.push_back(y);
+        _z.push_back(z);
+    }
+    else
+    {
+        size_t position = positionIt->second;
+        _tags[position] = tag;
+        _x[position] = x;
+        _y[position] = y;
+        _z[position] = z;
+    }
+}
+
+
+void LocationIndex::Remove(NodeHandle id)
+{
+    auto positionIt = _positions.find(id);
+    if ( positionIt == _positions.end() )
+        { return; }
+    
+    // Move last entry into the place of the removed one to keep arrays contiguous
+    size_t position = positionIt->second;
+    size_t last = _ids.size() - 1;
+    if (position != last)
+    {
+        _ids[position]  = _ids[last];
+        _tags[position] = _tags[last];
+        _x[position]    = _x[last];
+        _y[position]    = _y[last];
+        _z[position]    = _z[last];
+        _positions[ _ids[position] ] = position;
+    }
+    _positions.erase(positionIt);
+    _ids.pop_back();
+    _tags.pop_back();
+    _x.pop_back();
+    _y.pop_back();
+    _z.pop_back();
+}
+
+
+vector<LocationIndex::Result> LocationIndex::GetClosest(const GpsLocation &location,
+    Distance maxRadiusKm, size_t maxCount, uint32_t tagMask) const
+{
+    double latitude  = DegreesToRadian( location.latitude() );
+    double longitude = DegreesToRadian( location.longitude() );
+    
+    vector<double> squaredChords( _ids.size() );
+    SelectKernel().kernel( _x.data(), _y.data(), _z.data(), _ids.size(),
+        cos(latitude) * cos(longitude), cos(latitude) * sin(longitude), sin(latitude),
+        squaredChords.data() );
+    
+    double maxSquaredChord = DistanceKmToSquaredChord(maxRadiusKm);
+    vector<size_t> candidates;
+    for (size_t idx = 0; idx < squaredChords.size(); ++idx)
+    {
+        if ( squaredChords[idx] <= maxSquaredChord && ( tagMask & (1u << _tags[idx]) ) )
+            { candidates.push_back(idx); }
+    }
+    
+    // Select top k candidates in linear time, then sort only those
+    auto closerThan = [&squaredChords] (size_t one, size_t other)
+        { return squaredChords[one] < squaredChords[other]; };
+    if ( candidates.size() > maxCount )
+    {
+        nth_element( candidates.begin(), candidates.begin() + maxCount, candidates.end(), closerThan );
+        candidates.resize(maxCount);
+    }
+    sort( candidates.begin(), candidates.end(), closerThan );
+    
+    vector<Result> result;
+    result.reserve( candidates.size() );
+    for (size_t idx : candidates)
+        { result.emplace_back( _ids[idx], SquaredChordToDistanceKm( squaredChords[idx] ) ); }
+    return result;
+}
+
+
+
+} // namespace LocNet
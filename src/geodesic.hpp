@@ -0,0 +1,77 @@
+#ifndef __LOCNET_GEODESIC_H__
+#define __LOCNET_GEODESIC_H__
+
+#include <vector>
+
+#include "basic.hpp"
+
+
+
+namespace LocNet
+{
+
+
+
+// Method of calculating the surface distance of two points.
+enum class DistanceModel : uint8_t
+{
+    Haversine   = 1,    // Great circle distance on a sphere, faster but has up to 0.5% error
+    Vincenty    = 2,    // Distance on the WGS84 ellipsoid, same as used by SpatiaLite for GPS coordinates
+};
+
+
+// Model used for node distances by all database implementations, so they agree on distance ranks and limits.
+// SpatiaLite measures GPS distances on the ellipsoid, the same model is used natively.
+extern const DistanceModel NODE_DISTANCE_MODEL;
+
+
+// Native distance functions to avoid expensive SQL roundtrips for simple distance calculations.
+// Coordinates are given in degrees, results are in kilometers.
+double HaversineDistanceKm(double latitude1, double longitude1, double latitude2, double longitude2);
+double VincentyDistanceKm (double latitude1, double longitude1, double latitude2, double longitude2);
+
+double GeodesicDistanceKm(double latitude1, double longitude1, double latitude2, double longitude2,
+                          DistanceModel model);
+Distance GeodesicDistanceKm(const GpsLocation &one, const GpsLocation &other, DistanceModel model);
+
+
+
+// Spatial index for ranking many locations by their distance from a single point.
+// Locations are stored as unit vectors in a structure-of-arrays layout, so a batch kernel (AVX2 or SSE2
+// if supported by the CPU) can calculate squared chord lengths for all entries without trigonometry.
+// Chord length is monotonic in surface distance, only selected results are converted to haversine km.
+class LocationIndex
+{
+    std::vector<NodeHandle> _ids;
+    std::vector<uint8_t>    _tags;
+    std::vector<double>     _x;
+    std::vector<double>     _y;
+    std::vector<double>     _z;
+    std::unordered_map<NodeHandle, size_t> _positions;
+    
+public:
+    
+    typedef std::pair<NodeHandle, Distance> Result;
+    
+    // Name of the batch distance kernel selected for this CPU
+    static const char* KernelName();
+    
+    size_t size() const;
+    void Clear();
+    
+    // Add or overwrite a location. Tag is an arbitrary value below 32 that can be used to filter results.
+    void Set(NodeHandle id, const GpsLocation &location, uint8_t tag = 0);
+    void Remove(NodeHandle id);
+    
+    // Handles and distances of closest locations ordered by distance.
+    // Only entries are returned whose tag bit is set in tagMask.
+    std::vector<Result> GetClosest(const GpsLocation &location, Distance maxRadiusKm,
+        size_t maxCount, uint32_t tagMask = ~0u) const;
+};
+
+
+
+} // namespace LocNet
+
+
+#endif // __LOCNET_GEODESIC_H__
@@ -2,6 +2,7 @@
 #include <cmath>
 #include <chrono>
 #include <deque>
+#include <iterator>
 #include <limits>
 #include <thread>
 #include <unordered_set>
@@ -28,6 +29,14 @@ const size_t   MERGE_RANDOM_NODE_COuNT          = 10;
 random_device Node::_randomDevice;
 
 
+// Strip database details from entries, node data is moved instead of copied
+static vector<NodeInfo> ToNodeInfos(vector<NodeDbEntry> &&entries)
+{
+    return vector<NodeInfo>( make_move_iterator( entries.begin() ),
+                             make_move_iterator( entries.end() ) );
+}
+
+
 shared_ptr<Node> Node::Create( shared_ptr<Config> config,
                                shared_ptr<ISpatialDatabase> spatialDb,
                                shared_ptr<INodeProxyFactory> proxyFactory )
@@ -37,7 +46,9 @@ shared_ptr<Node> Node::Create( shared_ptr<Config> config,
 Node::Node( shared_ptr<Config> config,
             shared_ptr<ISpatialDatabase> spatialDb,
             shared_ptr<INodeProxyFactory> proxyFactory ) :
-    _config(config), _spatialDb(spatialDb), _proxyFactory(proxyFactory)
+    _config(config), _spatialDb(spatialDb), _proxyFactory(proxyFactory),
+    _renewals( chrono::system_clock::to_time_t( chrono::system_clock::now() ) ),
+    _lastMapFillAttempt( chrono::steady_clock::now() )
 {
     if (_config == nullptr) {
         throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "No config instantiated");
@@ -48,6 +59,37 @@ Node::Node( shared_ptr<Config> config,
     if (_proxyFactory == nullptr) {
         throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "No proxy factory instantiated");
     }
+    
+    // Spread renewals of relations already stored evenly over a renewal period instead of renewing all at once
+    vector<NodeId> relations;
+    _spatialDb->VisitNodes( NodeContactRoleType::Initiator, [&relations] (const NodeDbEntry &node)
+        { relations.push_back( node.id() ); return true; } );
+    auto now = chrono::system_clock::now();
+    for (size_t idx = 0; idx < relations.size(); ++idx)
+    {
+        auto delay = _config->dbMaintenancePeriod() * (idx + 1) / (relations.size() + 1);
+        ScheduleRenewal( relations[idx], now + delay );
+    }
+}
+
+
+Node::~Node()
+{
+    for ( NodeHandle handle : _renewals.Ids() )
+        { NodeIdTable::Instance().Release(handle); }
+}
+
+
+void Node::ScheduleRenewal(const NodeId &nodeId)
+    { ScheduleRenewal( nodeId, chrono::system_clock::now() + _config->dbMaintenancePeriod() ); }
+
+
+void Node::ScheduleRenewal(const NodeId &nodeId, chrono::system_clock::time_point renewAt)
+{
+    // Only a single reference is kept for a node, rescheduling it just moves its deadline
+    NodeHandle handle = NodeIdTable::Instance().Intern(nodeId);
+    if ( ! _renewals.Set( handle, chrono::system_clock::to_time_t(renewAt) ) )
+        { NodeIdTable::Instance().Release(handle); }
 }
 
 
@@ -57,10 +99,10 @@ void Node::EnsureMapFilled()
     if ( seedNodes.empty() )
         { throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "No seed nodes configured, can't bootstrap exploration"); }
     
-    NodeInfo myInfo = _spatialDb->ThisNode();
+    shared_ptr<const NodeDbEntry> myInfo = _spatialDb->ThisNode();
     auto seedIt = find_if( seedNodes.begin(), seedNodes.end(),
         [&myInfo] (const NetworkEndpoint &contact)
-            { return myInfo.contact().nodeEndpoint() == contact; } );
+            { return myInfo->contact().nodeEndpoint() == contact; } );
     bool IAmSeed = seedIt != seedNodes.end();
     
     // Initialize random generator and shuffle seeds for balancing their load during client exploration
@@ -96,7 +138,7 @@ void Node::EnsureMapFilled()
 
 
 
-NodeInfo Node::GetNodeInfo() const
+shared_ptr<const NodeInfo> Node::GetNodeInfo() const
     { return _spatialDb->ThisNode(); }
     
 GpsLocation Node::RegisterService(const ServiceInfo& serviceInfo)
@@ -107,8 +149,8 @@ GpsLocation Node::RegisterService(const ServiceInfo& serviceInfo)
 //         throw LocationNetworkError(ErrorCode::ERROR_INVALID_STATE, "Service type is already registered");
 //     }
     
-    NodeDbEntry entry = _spatialDb->ThisNode();
-    entry.services()[ serviceInfo.type() ] = serviceInfo;
+    NodeDbEntry entry( *_spatialDb->ThisNode() );
+    entry.services().Set(serviceInfo);
     _spatialDb->Update(entry);
     
     // NOTE running RenewNeighbours could block the reactor while connect(endpoint) has blocking implementation
@@ -116,7 +158,7 @@ GpsLocation Node::RegisterService(const ServiceInfo& serviceInfo)
     thread updateNodeInfoAtNeighboursThread( [self] { self->RenewNeighbours(); } );
     updateNodeInfoAtNeighboursThread.detach();
     
-    return GetNodeInfo().location();
+    return GetNodeInfo()->location();
 }
 
 void Node::DeregisterService(std::string serviceType)
@@ -127,8 +169,8 @@ void Node::DeregisterService(std::string serviceType)
 //         throw LocationNetworkError(ErrorCode::ERROR_INVALID_STATE, "Service type was not registered");
 //     }
     
-    NodeDbEntry entry = _spatialDb->ThisNode();
-    entry.services().erase(serviceType);
+    NodeDbEntry entry( *_spatialDb->ThisNode() );
+    entry.services().Remove(serviceType);
     _spatialDb->Update(entry);
     
     // NOTE running RenewNeighbours could block the reactor while connect(endpoint) has blocking implementation
@@ -148,7 +190,7 @@ void Node::RemoveListener(const SessionId &sessionId)
 
 void Node::DetectedExternalAddress(const Address& address)
 {
-    NodeDbEntry myEntry = _spatialDb->ThisNode();
+    NodeDbEntry myEntry( *_spatialDb->ThisNode() );
     if ( myEntry.contact().address() != address && ! address.empty() )
     {
         LOG(INFO) << "Detected external IP address " << address;
@@ -162,7 +204,7 @@ void Node::DetectedExternalAddress(const Address& address)
 }
 
 
-shared_ptr<NodeInfo> Node::AcceptColleague(const NodeInfo &node)
+shared_ptr<const NodeInfo> Node::AcceptColleague(const NodeInfo &node)
 {
 // TODO Sanity checks are performed in SafeStoreNode, should we reject the request
 //      if the other node "forgot" about the existing relation or call the wrong method (accept vs renew)?
@@ -173,12 +215,12 @@ shared_ptr<NodeInfo> Node::AcceptColleague(const NodeInfo &node)
     
     bool success = SafeStoreNode( NodeDbEntry(
         node, NodeRelationType::Colleague, NodeContactRoleType::Acceptor) );
-    return success ? shared_ptr<NodeInfo>( new NodeInfo( _spatialDb->ThisNode() ) ) :
-                     shared_ptr<NodeInfo>();
+    return success ? shared_ptr<const NodeInfo>( _spatialDb->ThisNode() ) :
+                     shared_ptr<const NodeInfo>();
 }
 
 
-shared_ptr<NodeInfo> Node::RenewColleague(const NodeInfo& node)
+shared_ptr<const NodeInfo> Node::RenewColleague(const NodeInfo& node)
 {
 // TODO Store conditions are checked in SafeStoreNode, should we reject the request?
 //     shared_ptr<NodeInfo> storedInfo = _spatialDb->Load( node.id() );
@@ -187,13 +229,13 @@ shared_ptr<NodeInfo> Node::RenewColleague(const NodeInfo& node)
 
     bool success = SafeStoreNode( NodeDbEntry(
         node, NodeRelationType::Colleague, NodeContactRoleType::Acceptor) );
-    return success ? shared_ptr<NodeInfo>( new NodeInfo( _spatialDb->ThisNode() ) ) :
-                     shared_ptr<NodeInfo>();
+    return success ? shared_ptr<const NodeInfo>( _spatialDb->ThisNode() ) :
+                     shared_ptr<const NodeInfo>();
 }
 
 
 
-shared_ptr<NodeInfo> Node::AcceptNeighbour(const NodeInfo &node)
+shared_ptr<const NodeInfo> Node::AcceptNeighbour(const NodeInfo &node)
 {
 // TODO Store conditions are checked in SafeStoreNode, should we reject the request?
 //     shared_ptr<NodeInfo> storedInfo = _spatialDb->Load( node.id() );
@@ -202,12 +244,12 @@ shared_ptr<NodeInfo> Node::AcceptNeighbour(const NodeInfo &node)
     
     bool success = SafeStoreNode( NodeDbEntry(
         node, NodeRelationType::Neighbour, NodeContactRoleType::Acceptor) );
-    return success ? shared_ptr<NodeInfo>( new NodeInfo( _spatialDb->ThisNode() ) ) :
-                     shared_ptr<NodeInfo>();
+    return success ? shared_ptr<const NodeInfo>( _spatialDb->ThisNode() ) :
+                     shared_ptr<const NodeInfo>();
 }
 
 
-shared_ptr<NodeInfo> Node::RenewNeighbour(const NodeInfo& node)
+shared_ptr<const NodeInfo> Node::RenewNeighbour(const NodeInfo& node)
 {
 // TODO Store conditions are checked in SafeStoreNode, should we reject the request?
 //     shared_ptr<NodeInfo> storedInfo = _spatialDb->Load( node.id() );
@@ -216,8 +258,8 @@ shared_ptr<NodeInfo> Node::RenewNeighbour(const NodeInfo& node)
         
     bool success = SafeStoreNode( NodeDbEntry(
         node, NodeRelationType::Neighbour, NodeContactRoleType::Acceptor) );
-    return success ? shared_ptr<NodeInfo>( new NodeInfo( _spatialDb->ThisNode() ) ) :
-                     shared_ptr<NodeInfo>();
+    return success ? shared_ptr<const NodeInfo>( _spatialDb->ThisNode() ) :
+                     shared_ptr<const NodeInfo>();
 }
 
 
@@ -227,25 +269,16 @@ size_t Node::GetNodeCount() const
 
 
 vector<NodeInfo> Node::GetRandomNodes(size_t maxNodeCount, Neighbours filter) const
-{
-    vector<NodeDbEntry> entries( _spatialDb->GetRandomNodes(maxNodeCount, filter) );
-    return vector<NodeInfo>( entries.begin(), entries.end() );
-}
+    { return ToNodeInfos( _spatialDb->GetRandomNodes(maxNodeCount, filter) ); }
     
 vector<NodeInfo> Node::GetNeighbourNodesByDistance() const
-{
-    vector<NodeDbEntry> entries( _spatialDb->GetNeighbourNodesByDistance() );
-    return vector<NodeInfo>( entries.begin(), entries.end() );
-}
+    { return ToNodeInfos( _spatialDb->GetNeighbourNodesByDistance() ); }
 
 
 
 vector<NodeInfo> Node::GetClosestNodesByDistance(const GpsLocation& location,
     Distance radiusKm, size_t maxNodeCount, Neighbours filter) const
-{
-    vector<NodeDbEntry> entries( _spatialDb->GetClosestNodesByDistance(location, radiusKm, maxNodeCount, filter) );
-    return vector<NodeInfo>( entries.begin(), entries.end() );
-}
+    { return ToNodeInfos( _spatialDb->GetClosestNodesByDistance(location, radiusKm, maxNodeCount, filter) ); }
 
 
 vector<NodeInfo> Node::ExploreNetworkNodesByDistance(const GpsLocation &location,
@@ -263,7 +296,7 @@ vector<NodeInfo> Node::ExploreNetworkNodesByDistance(const GpsLocation &location
         { throw LocationNetworkError(ErrorCode::ERROR_CONCEPTUAL, "The node always must know at least itself"); }
     NodeInfo newClosestNode = closestNodesByDistance.front();
     
-    NodeInfo oldClosestNode = GetNodeInfo();
+    NodeInfo oldClosestNode = *GetNodeInfo();
     for (size_t hops = 0; hops < maxNodeHops; ++hops)
     {
         if (newClosestNode == oldClosestNode)
@@ -303,27 +336,30 @@ Distance Node::GetBubbleSize(const GpsLocation& location) const
 
 bool Node::BubbleOverlaps(const NodeInfo &newNode) const
 {
-    // Get our closest node to location, no matter the radius
-    vector<NodeDbEntry> closestNodes = _spatialDb->GetClosestNodesByDistance(
-        newNode.location(), numeric_limits<Distance>::max(), 2, Neighbours::Excluded);
-
+    // Get our closest node to location, no matter the radius.
     // A node cannot overlap with itself, ignore same node for this check
-    if ( ! closestNodes.empty() && closestNodes.front().id() == newNode.id() )
+    bool found = false;
+    GpsLocation closestLocation(0, 0);
+    _spatialDb->VisitClosestNodesByDistance( newNode.location(), numeric_limits<Distance>::max(), 2, Neighbours::Excluded,
+        [&found, &closestLocation, &newNode] (const NodeDbEntry &node)
     {
-        closestNodes.front() = closestNodes.back();
-        closestNodes.pop_back();
-    }
+        if ( node.id() == newNode.id() )
+            { return true; }
+        found = true;
+        closestLocation = node.location();
+        return false;
+    }, ServiceDetails::Excluded );
     
     // If there are no points yet (i.e. map is still empty), it cannot overlap
-    if ( closestNodes.empty() )
+    if ( ! found )
         { return false; }
             
     // Get bubble sizes of both locations
-    Distance myClosestNodeBubbleSize = GetBubbleSize( closestNodes.front().location() );
+    Distance myClosestNodeBubbleSize = GetBubbleSize(closestLocation);
     Distance newNodeBubbleSize       = GetBubbleSize( newNode.location() );
     
     // If sum of bubble sizes greater than distance of points, the bubbles overlap
-    Distance newNodeDistanceFromClosestNode = _spatialDb->GetDistanceKm( newNode.location(), closestNodes.front().location() );
+    Distance newNodeDistanceFromClosestNode = _spatialDb->GetDistanceKm( newNode.location(), closestLocation );
     return myClosestNodeBubbleSize + newNodeBubbleSize > newNodeDistanceFromClosestNode;
 }
 
@@ -332,7 +368,7 @@ bool Node::BubbleOverlaps(const NodeInfo &newNode) const
 shared_ptr<INodeMethods> Node::SafeConnectTo(const NetworkEndpoint& endpoint) const
 {
     // There is no point in connecting to ourselves
-    if ( endpoint == _spatialDb->ThisNode().contact().nodeEndpoint() ||
+    if ( endpoint == _spatialDb->ThisNode()->contact().nodeEndpoint() ||
          ( ! _config->isTestMode() && endpoint.isLoopback() ) )
     {
         LOG(TRACE) << "Address " << endpoint << " is self or local, refusing";
@@ -414,12 +450,10 @@ bool Node::SafeStoreNode(const NodeDbEntry& plannedEntry, shared_ptr<INodeMethod
                         // Neighbour limit is exceeded by adding a new neighbour, but if it is closer
                         // than an old neighbour then we can temporarily break the neighbourhood count limit
                         // and will later refuse renewal of exceeding old neighbours and let them expire
-                        vector<NodeInfo> neighboursByDistance( GetNeighbourNodesByDistance() );
-                        const NodeInfo &limitNeighbour = neighboursByDistance[neighbourhoodTargetSize - 1];
+                        Distance limitDistanceKm = _spatialDb->GetNeighbourDistanceKm(neighbourhoodTargetSize - 1);
                         LOG(TRACE) << "We have reached the neighbour limit " << neighbourhoodTargetSize
-                                   << ", farthest neighbour within limit is " << limitNeighbour;
-                        if ( _spatialDb->GetDistanceKm( myNode.location(), limitNeighbour.location() ) <=
-                             _spatialDb->GetDistanceKm( myNode.location(), plannedEntry.location() ) )
+                                   << ", farthest neighbour within limit is " << limitDistanceKm << " km away";
+                        if ( limitDistanceKm <= _spatialDb->GetDistanceKm( myNode.location(), plannedEntry.location() ) )
                         {
                             LOG(TRACE) << neighbourhoodTargetSize << " closer neighbours found, refusing to add new";
                             return false;
@@ -431,17 +465,15 @@ bool Node::SafeStoreNode(const NodeDbEntry& plannedEntry, shared_ptr<INodeMethod
                     // Renewal of an old neighbour
                     if (neighbourhoodSize > neighbourhoodTargetSize)
                     {
-                        vector<NodeInfo> neighboursByDistance( GetNeighbourNodesByDistance() );
-                        auto neighbourIter = find_if( neighboursByDistance.begin(), neighboursByDistance.end(),
-                            [plannedEntry] (const NodeInfo &neighbour) { return neighbour.id() == plannedEntry.id(); } );
-                        if ( neighbourIter == neighboursByDistance.end() )
+                        // Don't care about location change here. If moved too far away we expire it
+                        // at the next renewal request when it's at its new place in the neighbour list.
+                        size_t neighbourIndex;
+                        try { neighbourIndex = _spatialDb->GetNeighbourRank( plannedEntry.id() ); }
+                        catch (exception &e)
                         {
-                            LOG(ERROR) << "Implementation problem: stored neighbour is not found in neighbour list";
+                            LOG(ERROR) << "Implementation problem: stored neighbour is not found in neighbour list: " << e.what();
                             throw LocationNetworkError(ErrorCode::ERROR_CONCEPTUAL, "Please report this to the developers");
                         }
-                        // Don't care about location change here. If moved too far away we expire it
-                        // at the next renewal request when it's at its new place in the neighbour list.
-                        size_t neighbourIndex = distance( neighboursByDistance.begin(), neighbourIter );
                         if (neighbourIndex >= neighbourhoodTargetSize)
                         {
                             LOG(TRACE) << neighbourhoodTargetSize << " neighbours limit reached, refusing to renew neighbour nr. " << neighbourIndex;
@@ -472,7 +504,7 @@ bool Node::SafeStoreNode(const NodeDbEntry& plannedEntry, shared_ptr<INodeMethod
             }
             
             // Ask for its permission for mutual acceptance
-            shared_ptr<NodeInfo> freshInfo;
+            shared_ptr<const NodeInfo> freshInfo;
             switch ( plannedEntry.relationType() )
             {
                 case NodeRelationType::Colleague:
@@ -522,6 +554,10 @@ bool Node::SafeStoreNode(const NodeDbEntry& plannedEntry, shared_ptr<INodeMethod
             LOG(DEBUG) << "Updating node info " << entryToWrite;
             _spatialDb->Update(entryToWrite);
         }
+        
+        // Relations initiated by us have to be renewed before they expire
+        if ( entryToWrite.roleType() == NodeContactRoleType::Initiator )
+            { ScheduleRenewal( entryToWrite.id() ); }
         return true;
     }
     catch (exception &e)
@@ -555,8 +591,8 @@ bool Node::InitializeWorld(const vector<NetworkEndpoint> &seedNodes)
                 { continue; }
             
             // Try to add seed node to our network (no matter if fails)
-            NodeInfo seedInfo = seedNodeProxy->GetNodeInfo();
-            SafeStoreNode( NodeDbEntry(seedInfo, NodeRelationType::Colleague, NodeContactRoleType::Initiator),
+            shared_ptr<const NodeInfo> seedInfo = seedNodeProxy->GetNodeInfo();
+            SafeStoreNode( NodeDbEntry(*seedInfo, NodeRelationType::Colleague, NodeContactRoleType::Initiator),
                            seedNodeProxy );
             
             // Query both total node count and an initial list of random nodes to start with
@@ -637,24 +673,24 @@ bool Node::InitializeNeighbourhood(const vector<NetworkEndpoint> &seedNodes)
 {
     LOG(DEBUG) << "Discovering neighbourhood";
     
-    NodeDbEntry myNode = _spatialDb->ThisNode();
+    shared_ptr<const NodeDbEntry> myNode = _spatialDb->ThisNode();
     vector<NodeInfo> closestNodesByDistance = GetClosestNodesByDistance(
-        myNode.location(), numeric_limits<Distance>::max(), 2, Neighbours::Included);
+        myNode->location(), numeric_limits<Distance>::max(), 2, Neighbours::Included);
     
-    if ( closestNodesByDistance.size() >= 1 && closestNodesByDistance[0].location() != GetNodeInfo().location() )
+    if ( closestNodesByDistance.size() >= 1 && closestNodesByDistance[0].location() != myNode->location() )
     {
         LOG(ERROR) << "Assert: there cannot be a node that is closer to you than yourself";
         throw LocationNetworkError(ErrorCode::ERROR_CONCEPTUAL, "Please report this to the developers");
     }
     
-    NodeInfo newClosestNode = GetNodeInfo();
+    NodeInfo newClosestNode = *myNode;
     if ( closestNodesByDistance.size() >= 2 )
     {
         LOG(DEBUG) << "Already know other nodes, start from the closest one";
         for (const NodeInfo &node : closestNodesByDistance)
         {
             // make sure that we don't choose ourselves
-            if ( node.id() != GetNodeInfo().id() )
+            if ( node.id() != myNode->id() )
             {
                 newClosestNode = node;
                 break;
@@ -671,7 +707,7 @@ bool Node::InitializeNeighbourhood(const vector<NetworkEndpoint> &seedNodes)
                 shared_ptr<INodeMethods> seedNodeProxy = SafeConnectTo(seedContact);
                 if (seedNodeProxy == nullptr)
                     { continue; }
-                newClosestNode = seedNodeProxy->GetNodeInfo();
+                newClosestNode = *seedNodeProxy->GetNodeInfo();
             }
             catch (exception &e)
             {
@@ -680,7 +716,7 @@ bool Node::InitializeNeighbourhood(const vector<NetworkEndpoint> &seedNodes)
             }
         }
     }
-    if ( newClosestNode == GetNodeInfo() )
+    if ( newClosestNode == *myNode )
     {
         LOG(DEBUG) << "Could not contact any other node, failed to discover neighbourhood";
         return false;
@@ -700,11 +736,11 @@ bool Node::InitializeNeighbourhood(const vector<NetworkEndpoint> &seedNodes)
             }
             
             closestNodesByDistance = closestNodeProxy->GetClosestNodesByDistance(
-                myNode.location(), numeric_limits<Distance>::max(), 2, Neighbours::Included);
+                myNode->location(), numeric_limits<Distance>::max(), 2, Neighbours::Included);
             if ( closestNodesByDistance.empty() )
                 { throw LocationNetworkError(ErrorCode::ERROR_BAD_RESPONSE, "Node returned empty node list result"); }
                 
-            if ( closestNodesByDistance.front().id() != myNode.id() )
+            if ( closestNodesByDistance.front().id() != myNode->id() )
                 { newClosestNode = closestNodesByDistance[0]; }
             else if ( closestNodesByDistance.size() > 1 )
                 { newClosestNode = closestNodesByDistance[1]; }
@@ -718,7 +754,8 @@ bool Node::InitializeNeighbourhood(const vector<NetworkEndpoint> &seedNodes)
             _spatialDb->GetDistanceKm( _config->myNodeInfo().location(), oldClosestNode.location() ) );
     
     // Try to fill neighbourhood map until limit reached or no new nodes left to ask
-    unordered_set<string> askedNodeIds;
+    // NOTE candidates are mostly foreign nodes, interning their ids would keep them forever
+    unordered_set<NodeId> askedNodes;
     deque<NodeInfo> nodesToAskQueue{oldClosestNode};
     while ( _spatialDb->GetNodeCount(NodeRelationType::Neighbour) < _config->neighbourhoodTargetSize() &&
             ! nodesToAskQueue.empty() )
@@ -728,8 +765,7 @@ bool Node::InitializeNeighbourhood(const vector<NetworkEndpoint> &seedNodes)
         nodesToAskQueue.pop_front();
         
         // Skip it if has been processed already
-        auto askedIt = askedNodeIds.find( neighbourCandidate.id() );
-        if ( askedIt != askedNodeIds.end() )
+        if ( askedNodes.find( neighbourCandidate.id() ) != askedNodes.end() )
             { continue; }
         
         try
@@ -745,11 +781,11 @@ bool Node::InitializeNeighbourhood(const vector<NetworkEndpoint> &seedNodes)
             
             // Get its neighbours closest to us
             vector<NodeInfo> newNeighbourCandidates = candidateProxy->GetClosestNodesByDistance(
-                myNode.location(), numeric_limits<Distance>::max(),
+                myNode->location(), numeric_limits<Distance>::max(),
                 _config->neighbourhoodTargetSize(), Neighbours::Included );
             
             // Mark current node as processed and append new neighbour candidates to our todo list
-            askedNodeIds.insert( neighbourCandidate.id() );
+            askedNodes.insert( neighbourCandidate.id() );
             nodesToAskQueue.insert( nodesToAskQueue.end(),
                 newNeighbourCandidates.begin(), newNeighbourCandidates.end() );
         }
@@ -768,12 +804,18 @@ bool Node::InitializeNeighbourhood(const vector<NetworkEndpoint> &seedNodes)
 
 void Node::ExpireOldNodes()
 {
-//     size_t sizeBefore = _spatialDb->GetNodeCount();
-    LOG(DEBUG) << "Deleting expired node connections";
+    size_t sizeBefore = _spatialDb->GetNodeCount();
+    LOG(TRACE) << "Deleting expired node connections";
     _spatialDb->ExpireOldNodes();
     if ( _spatialDb->GetNodeCount() <= 1 && ! _config->isTestMode() )
     {
-        EnsureMapFilled();
+        // NOTE expiration runs frequently, an isolated node retries exploration only once per maintenance period
+        auto now = chrono::steady_clock::now();
+        if ( sizeBefore > 1 || now - _lastMapFillAttempt >= _config->dbMaintenancePeriod() )
+        {
+            _lastMapFillAttempt = now;
+            EnsureMapFilled();
+        }
 //         cout << "  *** " << _config->myNodeInfo() << " had " << sizeBefore << " nodes"
 //              << " but all expired, reexplored node count is " << _spatialDb->GetNodeCount() << endl;
     }
@@ -801,6 +843,42 @@ void Node::RenewNodeRelations()
 }
 
 
+void Node::RenewDueNodeRelations()
+{
+    time_t now = chrono::system_clock::to_time_t( chrono::system_clock::now() );
+    vector<NodeHandle> dueHandles = _renewals.PopDue(now);
+    if ( dueHandles.empty() )
+        { return; }
+    
+    LOG(DEBUG) << "We have " << dueHandles.size() << " relations due to renew";
+    for (NodeHandle handle : dueHandles)
+    {
+        // Popped nodes are not scheduled anymore, so their reference is dropped, rescheduling takes a new one
+        NodeId nodeId = NodeIdTable::Instance().Id(handle);
+        NodeIdTable::Instance().Release(handle);
+        try
+        {
+            // Relation might have been expired or removed since it was scheduled
+            shared_ptr<NodeDbEntry> node = _spatialDb->Load(nodeId);
+            if ( node == nullptr || node->roleType() != NodeContactRoleType::Initiator )
+                { continue; }
+            
+            bool renewed = SafeStoreNode(*node);
+            LOG(DEBUG) << "Attempted renewing relation with node " << nodeId << ", result: " << renewed;
+            
+            // Retry failed renewals in the next period, the relation simply expires if all of them fail
+            if (! renewed)
+                { ScheduleRenewal(nodeId); }
+        }
+        catch (exception &e)
+        {
+            LOG(WARNING) << "Unexpected error renewing relation with node " << nodeId << " : " << e.what();
+            ScheduleRenewal(nodeId);
+        }
+    }
+}
+
+
 void Node::RenewNeighbours()
 {
     vector<NodeDbEntry> neighbours( _spatialDb->GetNeighbourNodesByDistance() );
@@ -874,15 +952,15 @@ void Node::DiscoverUnknownAreas()
             
         try
         {
-            NodeInfo myNodeInfo = _spatialDb->ThisNode();
+            shared_ptr<const NodeInfo> myNodeInfo = GetNodeInfo();
             
             // Get node closest to this position that is already present in our database
             vector<NodeInfo> myClosestNodes = GetClosestNodesByDistance(
                 randomLocation, numeric_limits<Distance>::max(), 2, Neighbours::Excluded );
             if ( myClosestNodes.empty() ||
-                 ( myClosestNodes.size() == 1 && myNodeInfo == myClosestNodes[0] ) )
+                 ( myClosestNodes.size() == 1 && *myNodeInfo == myClosestNodes[0] ) )
                 { continue; }
-            const auto &myClosestNode = myClosestNodes[0] != myNodeInfo ?
+            const auto &myClosestNode = myClosestNodes[0] != *myNodeInfo ?
                 myClosestNodes[0] : myClosestNodes[1];
             
             // Connect to closest node
@@ -896,7 +974,7 @@ void Node::DiscoverUnknownAreas()
             // Ask closest node about its nodes closest to the random position
             vector<NodeInfo> newClosestNodes = knownNodeProxy->GetClosestNodesByDistance(
                 randomLocation, numeric_limits<Distance>::max(), 1, Neighbours::Included );
-            if ( newClosestNodes.empty() || newClosestNodes[0].id() == myNodeInfo.id() )
+            if ( newClosestNodes.empty() || newClosestNodes[0].id() == myNodeInfo->id() )
                 { continue; }
             const auto &newClosestNode = newClosestNodes[0];
             LOG(DEBUG) << "Closest node to random position is " << newClosestNode;
@@ -1,6 +1,7 @@
 #ifndef __LOCNET_BUSINESS_LOGIC_H__
 #define __LOCNET_BUSINESS_LOGIC_H__
 
+#include <chrono>
 #include <random>
 #include <unordered_map>
 
@@ -24,7 +25,7 @@ public:
     virtual GpsLocation RegisterService(const ServiceInfo &serviceInfo) = 0;
     virtual void DeregisterService(std::string serviceType) = 0;
     virtual std::vector<NodeInfo> GetNeighbourNodesByDistance() const = 0;
-    virtual NodeInfo GetNodeInfo() const = 0;
+    virtual std::shared_ptr<const NodeInfo> GetNodeInfo() const = 0;
     
     // NOTE methods used through this interface, but not exported to remote nodes
     virtual void AddListener(std::shared_ptr<IChangeListener> listener) = 0;
@@ -40,7 +41,7 @@ public:
     
     virtual ~INodeMethods() {}
     
-    virtual NodeInfo GetNodeInfo() const = 0;
+    virtual std::shared_ptr<const NodeInfo> GetNodeInfo() const = 0;
     virtual size_t GetNodeCount() const = 0;
     virtual std::vector<NodeInfo> GetRandomNodes(
         size_t maxNodeCount, Neighbours filter) const = 0;
@@ -48,10 +49,10 @@ public:
     virtual std::vector<NodeInfo> GetClosestNodesByDistance(const GpsLocation &location,
         Distance radiusKm, size_t maxNodeCount, Neighbours filter) const = 0;
     
-    virtual std::shared_ptr<NodeInfo> AcceptColleague(const NodeInfo &node) = 0;
-    virtual std::shared_ptr<NodeInfo> RenewColleague (const NodeInfo &node) = 0;
-    virtual std::shared_ptr<NodeInfo> AcceptNeighbour(const NodeInfo &node) = 0;
-    virtual std::shared_ptr<NodeInfo> RenewNeighbour (const NodeInfo &node) = 0;
+    virtual std::shared_ptr<const NodeInfo> AcceptColleague(const NodeInfo &node) = 0;
+    virtual std::shared_ptr<const NodeInfo> RenewColleague (const NodeInfo &node) = 0;
+    virtual std::shared_ptr<const NodeInfo> AcceptNeighbour(const NodeInfo &node) = 0;
+    virtual std::shared_ptr<const NodeInfo> RenewNeighbour (const NodeInfo &node) = 0;
 };
 
 
@@ -62,7 +63,7 @@ public:
     
     virtual ~IClientMethods() {}
 
-    virtual NodeInfo GetNodeInfo() const = 0;
+    virtual std::shared_ptr<const NodeInfo> GetNodeInfo() const = 0;
     
     virtual std::vector<NodeInfo> GetNeighbourNodesByDistance() const = 0;
     virtual std::vector<NodeInfo> GetClosestNodesByDistance(const GpsLocation &location,
@@ -112,11 +113,19 @@ class Node : public ILocalServiceMethods, public IClientMethods, public INodeMet
     std::shared_ptr<ISpatialDatabase>          _spatialDb;
     mutable std::shared_ptr<INodeProxyFactory> _proxyFactory;
     
+    // Deadlines to renew relations initiated by us, so renewals are spread over time instead of done at once.
+    // NOTE holds a reference on the id of each node scheduled
+    TimingWheel                                _renewals;
+    std::chrono::steady_clock::time_point      _lastMapFillAttempt;
+    
     
     std::shared_ptr<INodeMethods> SafeConnectTo(const NetworkEndpoint &endpoint) const;
     bool SafeStoreNode( const NodeDbEntry &entry,
         std::shared_ptr<INodeMethods> nodeProxy = std::shared_ptr<INodeMethods>() );
     
+    void ScheduleRenewal(const NodeId &nodeId);
+    void ScheduleRenewal(const NodeId &nodeId, std::chrono::system_clock::time_point renewAt);
+    
     bool InitializeWorld(const std::vector<NetworkEndpoint> &seedNodes);
     bool InitializeNeighbourhood(const std::vector<NetworkEndpoint> &seedNodes);
     
@@ -132,6 +141,7 @@ public:
     static std::shared_ptr<Node> Create( std::shared_ptr<Config> config,
                                          std::shared_ptr<ISpatialDatabase> spatialDb,
                                          std::shared_ptr<INodeProxyFactory> proxyFactory );
+    ~Node();
     
     void EnsureMapFilled();
     
@@ -139,6 +149,8 @@ public:
     
     void ExpireOldNodes();
     void RenewNodeRelations();
+    // Renew only relations having their renewal deadline passed
+    void RenewDueNodeRelations();
     void RenewNeighbours();
     void DiscoverUnknownAreas();
     void MergeSplits();
@@ -146,7 +158,7 @@ public:
     
     // Interface provided to serve higher level services and clients
     //   + GetClosestNodes() + GetNeighbourNodes() which are the same as on other interfaces
-    NodeInfo GetNodeInfo() const override;
+    std::shared_ptr<const NodeInfo> GetNodeInfo() const override;
     std::vector<NodeInfo> ExploreNetworkNodesByDistance(const GpsLocation &location,
         size_t targetNodeCount, size_t maxNodeHops) const override;
     
@@ -167,10 +179,10 @@ public:
     std::vector<NodeInfo> GetClosestNodesByDistance(const GpsLocation &location,
         Distance radiusKm, size_t maxNodeCount, Neighbours filter) const override;    
         
-    std::shared_ptr<NodeInfo> AcceptColleague(const NodeInfo &node) override;
-    std::shared_ptr<NodeInfo> RenewColleague (const NodeInfo &node) override;
-    std::shared_ptr<NodeInfo> AcceptNeighbour(const NodeInfo &node) override;
-    std::shared_ptr<NodeInfo> RenewNeighbour (const NodeInfo &node) override;
+    std::shared_ptr<const NodeInfo> AcceptColleague(const NodeInfo &node) override;
+    std::shared_ptr<const NodeInfo> RenewColleague (const NodeInfo &node) override;
+    std::shared_ptr<const NodeInfo> AcceptNeighbour(const NodeInfo &node) override;
+    std::shared_ptr<const NodeInfo> RenewNeighbour (const NodeInfo &node) override;
 };
 
 
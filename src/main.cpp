@@ -1,8 +1,11 @@
 #include <iostream>
 #include <csignal>
+#include <mutex>
 
+#include "cacheddb.hpp"
 #include "config.hpp"
 #include "server.hpp"
+#include "snapshot.hpp"
 
 #include <easylogging++.h>
 
@@ -13,12 +16,59 @@ using namespace LocNet;
 
 
 
+// Nodes due to renew or expire are checked this often, spreading the work evenly over time
+const chrono::seconds DB_MAINTENANCE_CHECK_PERIOD(5);
+// Requests waiting for a worker of an interface, further ones are refused until workers catch up
+const size_t WORKER_QUEUE_SIZE = 1024;
+
 function<void(int)> mySignalHandlerFunc;
 
 void signalHandler(int signal)
     { mySignalHandlerFunc(signal); }
 
 
+// Periodic snapshots of the maintenance thread and the final one at shutdown must not overlap
+mutex snapshotMutex;
+bool finalSnapshotWritten = false;
+
+void writeSnapshot(const Config &config, const ISpatialDatabase &geodb, bool isFinal = false)
+{
+    if ( config.snapshotPath().empty() )
+        { return; }
+    
+    // NOTE the maintenance thread is detached, a late periodic snapshot must not replace the final one
+    lock_guard<mutex> lock(snapshotMutex);
+    if (finalSnapshotWritten)
+        { return; }
+    finalSnapshotWritten = isFinal;
+    try
+    {
+        NodeMapSnapshot::Write( config.snapshotPath(), geodb.LoadAllEntries(),
+                                chrono::system_clock::to_time_t( chrono::system_clock::now() ) );
+    }
+    catch (exception &ex)
+        { LOG(WARNING) << "Failed to write node map snapshot: " << ex.what(); }
+}
+
+
+// Checks scanning the whole database, run only at the rare db maintenance cadence
+void checkDatabase(ISpatialDatabase &geodb)
+{
+    SpatiaLiteDatabase *spatialiteDb = dynamic_cast<SpatiaLiteDatabase*>(&geodb);
+    if (spatialiteDb == nullptr)
+        { return; }
+    
+    for ( const auto &lockStats : { make_pair( "Writer", spatialiteDb->writerLockStats() ),
+                                    make_pair( "Reader", spatialiteDb->readerLockStats() ) } )
+    {
+        LOG(DEBUG) << lockStats.first << " lock waits so far: " << lockStats.second.waitCount << " of "
+                   << lockStats.second.acquireCount << " acquisitions, total "
+                   << lockStats.second.waitTime.count() << " microseconds";
+    }
+    spatialiteDb->CheckNodeCounts();
+}
+
+
 void reactorLoop(const string &threadName)
 {
     LOG(DEBUG) << "Thread " << threadName << " started";
@@ -66,8 +116,33 @@ int main(int argc, const char *argv[])
         NodeInfo myNodeInfo( config->myNodeInfo() );
         LOG(INFO) << "Initializing server with node info: " << myNodeInfo;
         
-        shared_ptr<ISpatialDatabase> geodb( new SpatiaLiteDatabase(
-            myNodeInfo, config->dbPath(), config->dbExpirationPeriod() ) );
+        shared_ptr<ISpatialDatabase> geodb;
+        if ( config->dbBackend() == DbBackend::InMemory )
+        {
+            LOG(INFO) << "Using in-memory node database persisted to " << config->dbPath();
+            geodb.reset( new CachedSpatialDatabase(
+                myNodeInfo, config->dbPath(), config->dbExpirationPeriod(), config->dbDurability() ) );
+        }
+        else
+        {
+            geodb.reset( new SpatiaLiteDatabase(
+                myNodeInfo, config->dbPath(), config->dbExpirationPeriod(), config->dbDurability() ) );
+        }
+        
+        // A database having only our own node is freshly created, so restore the node map of the last run
+        // to serve queries right away instead of waiting for the network to be explored again
+        if ( ! config->snapshotPath().empty() && geodb->GetNodeCount() <= 1 )
+        {
+            try
+            {
+                NodeMapSnapshot snapshot( config->snapshotPath() );
+                size_t restoredCount = snapshot.RestoreInto( *geodb,
+                    chrono::system_clock::to_time_t( chrono::system_clock::now() ) );
+                LOG(INFO) << "Restored " << restoredCount << " nodes from snapshot " << config->snapshotPath();
+            }
+            catch (exception &ex)
+                { LOG(INFO) << "No node map snapshot restored: " << ex.what(); }
+        }
 
         TcpNodeConnectionFactory *connFactPtr = new TcpNodeConnectionFactory(config);
         shared_ptr<INodeProxyFactory> connectionFactory(connFactPtr);
@@ -77,14 +152,19 @@ int main(int argc, const char *argv[])
         shared_ptr<IBlockingRequestDispatcherFactory> nodeDispatcherFactory(
             new StaticBlockingDispatcherFactory( shared_ptr<IBlockingRequestDispatcher>(
                 new IncomingNodeRequestDispatcher(node) ) ) );
+        shared_ptr<WorkerPool> nodeWorkers( new WorkerPool(
+            "Node", config->nodeWorkerCount(), WORKER_QUEUE_SIZE ) );
         shared_ptr<DispatchingTcpServer> nodeTcpServer = DispatchingTcpServer::Create(
-            myNodeInfo.contact().nodePort(), nodeDispatcherFactory );
+            myNodeInfo.contact().nodePort(), nodeDispatcherFactory, nodeWorkers );
         nodeTcpServer->StartListening();
         
         connFactPtr->detectedIpCallback( [node](const Address &addr)
             { node->DetectedExternalAddress(addr); } );
         
-        thread mainReactorThread( [] { reactorLoop("ReactorMain"); } );
+        // NOTE all threads run the same io_service, handlers of a single session are serialized by its strands
+        vector<thread> reactorThreads;
+        for (size_t idx = 0; idx < config->reactorThreadCount(); ++idx)
+            { reactorThreads.emplace_back( [idx] { reactorLoop( "Reactor" + to_string(idx) ); } ); }
         node->EnsureMapFilled();
 
         LOG(INFO) << "Serving local and client interfaces";
@@ -94,10 +174,16 @@ int main(int argc, const char *argv[])
             new StaticBlockingDispatcherFactory( shared_ptr<IBlockingRequestDispatcher>(
                 new IncomingClientRequestDispatcher(node) ) ) );
         
+        shared_ptr<WorkerPool> localWorkers( new WorkerPool(
+            "Local", config->localWorkerCount(), WORKER_QUEUE_SIZE ) );
+        shared_ptr<WorkerPool> clientWorkers( new WorkerPool(
+            "Client", config->clientWorkerCount(), WORKER_QUEUE_SIZE ) );
+        
         shared_ptr<DispatchingTcpServer> localTcpServer = DispatchingTcpServer::Create(
-            config->localServiceEndpoint().address(), config->localServiceEndpoint().port(), localDispatcherFactory );
+            config->localServiceEndpoint().address(), config->localServiceEndpoint().port(),
+            localDispatcherFactory, localWorkers );
         shared_ptr<DispatchingTcpServer> clientTcpServer = DispatchingTcpServer::Create(
-            myNodeInfo.contact().clientPort(), clientDispatcherFactory );
+            myNodeInfo.contact().clientPort(), clientDispatcherFactory, clientWorkers );
 
         localTcpServer->StartListening();
         clientTcpServer->StartListening();
@@ -108,15 +194,33 @@ int main(int argc, const char *argv[])
         signal(SIGTERM, signalHandler);
         
         // start threads for periodic db maintenance (relation renewal and expiration) and discovery
-        thread dbMaintenanceThread( [config, node]
+        // NOTE renewal and expiration deadlines are kept for each node, so only due nodes are processed in each round
+        thread dbMaintenanceThread( [config, node, geodb]
         {
+            auto lastSnapshot = chrono::steady_clock::now();
+            auto lastDbCheck = chrono::steady_clock::now();
             while ( ! Reactor::Instance().IsShutdown() )
             {
                 try
                 {
-                    this_thread::sleep_for( config->dbMaintenancePeriod() );
-                    node->RenewNodeRelations();
+                    this_thread::sleep_for(DB_MAINTENANCE_CHECK_PERIOD);
+                    if ( Reactor::Instance().IsShutdown() )
+                        { break; }
+                    
+                    node->RenewDueNodeRelations();
                     node->ExpireOldNodes();
+                    
+                    if ( chrono::steady_clock::now() - lastSnapshot >= config->snapshotPeriod() )
+                    {
+                        writeSnapshot(*config, *geodb);
+                        lastSnapshot = chrono::steady_clock::now();
+                    }
+                    
+                    if ( chrono::steady_clock::now() - lastDbCheck >= config->dbMaintenancePeriod() )
+                    {
+                        checkDatabase(*geodb);
+                        lastDbCheck = chrono::steady_clock::now();
+                    }
                 }
                 catch (exception &ex)
                     { LOG(ERROR) << "Maintenance failed: " << ex.what(); }
@@ -140,9 +244,11 @@ int main(int argc, const char *argv[])
         } );
         discoveryThread.detach();
 
-        mainReactorThread.join();
+        for (auto &reactorThread : reactorThreads)
+            { reactorThread.join(); }
         
         LOG(INFO) << "Shutting down location-based network";
+        writeSnapshot(*config, *geodb, true);
         return 0;
     }
     catch (exception &e)
@@ -116,13 +116,12 @@ NodeInfo Converter::FromProtoBuf(const iop::locnet::NodeInfo& value)
     for (int idx = 0; idx < value.services_size(); ++idx)
     {
         const iop::locnet::ServiceInfo &sourceService = value.services(idx);
-        ServiceInfo service = FromProtoBuf(sourceService);
-        services[ service.type() ] = service;
+        services.Set( FromProtoBuf(sourceService) );
     }
     
-    return NodeInfo( value.node_id(), FromProtoBuf( value.location() ), NodeContact(
-        NodeContact::AddressFromBytes( contact.ip_address() ), contact.node_port(), contact.client_port() ),
-        services );
+    return NodeInfo( value.node_id(), FromProtoBuf( value.location() ), NodeContact::FromAddressBytes(
+        contact.ip_address(), contact.node_port(), contact.client_port() ),
+        move(services) );
 }
 
 
@@ -157,10 +156,10 @@ void Converter::FillProtoBuf(
     targetContact->set_client_port( sourceContact.clientPort() );
     targetContact->set_ip_address( sourceContact.AddressBytes() );
     
-    for ( const auto &serviceEntry : source.services() )
+    for ( const auto &service : source.services() )
     {
         iop::locnet::ServiceInfo *targetService = target->add_services();
-        FillProtoBuf(targetService, serviceEntry.second);
+        FillProtoBuf(targetService, service);
     }
 }
 
@@ -173,6 +172,24 @@ iop::locnet::NodeInfo* Converter::ToProtoBuf(const NodeInfo &info)
 
 
 
+iop::locnet::NodeInfo* NodeInfoProtoBufCache::ToProtoBuf(const shared_ptr<const NodeInfo> &info)
+{
+    auto result = new iop::locnet::NodeInfo();
+    
+    // NOTE snapshots are immutable and we keep the cached one alive, so the same pointer means the same content
+    lock_guard<mutex> lock(_mutex);
+    if (info != _source)
+    {
+        _converted.Clear();
+        Converter::FillProtoBuf(&_converted, *info);
+        _source = info;
+    }
+    result->CopyFrom(_converted);
+    return result;
+}
+
+
+
 IncomingLocalServiceRequestDispatcher::IncomingLocalServiceRequestDispatcher(
         shared_ptr<ILocalServiceMethods> iLocalService, shared_ptr<IChangeListenerFactory> listenerFactory) :
     _iLocalService(iLocalService), _listenerFactory(listenerFactory)
@@ -254,11 +271,11 @@ unique_ptr<iop::locnet::Response> IncomingLocalServiceRequestDispatcher::Dispatc
 
         case iop::locnet::LocalServiceRequest::kGetNodeInfo:
         {
-            NodeInfo node = _iLocalService->GetNodeInfo();
-            LOG(DEBUG) << "Served GetNodeInfo(): " << node;
+            shared_ptr<const NodeInfo> node = _iLocalService->GetNodeInfo();
+            LOG(DEBUG) << "Served GetNodeInfo(): " << *node;
             
             auto responseContent = localServiceResponse->mutable_get_node_info();
-            responseContent->set_allocated_node_info( Converter::ToProtoBuf(node) );
+            responseContent->set_allocated_node_info( _selfInfoCache.ToProtoBuf(node) );
             break;
         }
         
@@ -302,11 +319,11 @@ unique_ptr<iop::locnet::Response> IncomingNodeRequestDispatcher::Dispatch(unique
     {
         case iop::locnet::RemoteNodeRequest::kGetNodeInfo:
         {
-            NodeInfo node = _iNode->GetNodeInfo();
-            LOG(DEBUG) << "Served GetNodeInfo(): " << node;
+            shared_ptr<const NodeInfo> node = _iNode->GetNodeInfo();
+            LOG(DEBUG) << "Served GetNodeInfo(): " << *node;
             
             auto responseContent = nodeResponse->mutable_get_node_info();
-            responseContent->set_allocated_node_info( Converter::ToProtoBuf(node) );
+            responseContent->set_allocated_node_info( _selfInfoCache.ToProtoBuf(node) );
             break;
         }
         
@@ -315,14 +332,14 @@ unique_ptr<iop::locnet::Response> IncomingNodeRequestDispatcher::Dispatch(unique
             auto acceptColleagueReq = nodeRequest.accept_colleague();
             auto nodeInfo = Converter::FromProtoBuf( acceptColleagueReq.requestor_node_info() );
             
-            shared_ptr<NodeInfo> result = _iNode->AcceptColleague(nodeInfo);
+            shared_ptr<const NodeInfo> result = _iNode->AcceptColleague(nodeInfo);
             LOG(DEBUG) << "Served AcceptColleague(" << nodeInfo
                        << "), accepted: " << static_cast<bool>(result);
             
             nodeResponse->mutable_accept_colleague()->set_accepted( static_cast<bool>(result) );
             if (result) {
                 nodeResponse->mutable_accept_colleague()->set_allocated_acceptor_node_info(
-                    Converter::ToProtoBuf(*result) );
+                    _selfInfoCache.ToProtoBuf(result) );
             }
             break;
         }
@@ -332,14 +349,14 @@ unique_ptr<iop::locnet::Response> IncomingNodeRequestDispatcher::Dispatch(unique
             auto renewColleagueReq = nodeRequest.renew_colleague();
             auto nodeInfo = Converter::FromProtoBuf( renewColleagueReq.requestor_node_info() );
             
-            shared_ptr<NodeInfo> result = _iNode->RenewColleague(nodeInfo);
+            shared_ptr<const NodeInfo> result = _iNode->RenewColleague(nodeInfo);
             LOG(DEBUG) << "Served RenewColleague(" << nodeInfo
                        << "), accepted: " << static_cast<bool>(result);
                        
             nodeResponse->mutable_renew_colleague()->set_accepted( static_cast<bool>(result) );
             if (result) {
                 nodeResponse->mutable_renew_colleague()->set_allocated_acceptor_node_info(
-                    Converter::ToProtoBuf(*result) );
+                    _selfInfoCache.ToProtoBuf(result) );
             }
             break;
         }
@@ -349,14 +366,14 @@ unique_ptr<iop::locnet::Response> IncomingNodeRequestDispatcher::Dispatch(unique
             auto acceptNeighbourReq = nodeRequest.accept_neighbour();
             auto nodeInfo = Converter::FromProtoBuf( acceptNeighbourReq.requestor_node_info() );
             
-            shared_ptr<NodeInfo> result = _iNode->AcceptNeighbour(nodeInfo);
+            shared_ptr<const NodeInfo> result = _iNode->AcceptNeighbour(nodeInfo);
             LOG(DEBUG) << "Served AcceptNeighbour(" << nodeInfo
                        << "), accepted: " << static_cast<bool>(result);
                        
             nodeResponse->mutable_accept_neighbour()->set_accepted( static_cast<bool>(result) );
             if (result) {
                 nodeResponse->mutable_accept_neighbour()->set_allocated_acceptor_node_info(
-                    Converter::ToProtoBuf(*result) );
+                    _selfInfoCache.ToProtoBuf(result) );
             }
             break;
         }
@@ -366,14 +383,14 @@ unique_ptr<iop::locnet::Response> IncomingNodeRequestDispatcher::Dispatch(unique
             auto renewNeighbourReq = nodeRequest.renew_neighbour();
             auto nodeInfo = Converter::FromProtoBuf( renewNeighbourReq.requestor_node_info() );
             
-            shared_ptr<NodeInfo> result = _iNode->RenewNeighbour(nodeInfo);
+            shared_ptr<const NodeInfo> result = _iNode->RenewNeighbour(nodeInfo);
             LOG(DEBUG) << "Served RenewNeighbour(" << nodeInfo
                        << "), accepted: " << static_cast<bool>(result);
                        
             nodeResponse->mutable_renew_neighbour()->set_accepted( static_cast<bool>(result) );
             if (result) {
                 nodeResponse->mutable_renew_neighbour()->set_allocated_acceptor_node_info(
-                    Converter::ToProtoBuf(*result) );
+                    _selfInfoCache.ToProtoBuf(result) );
             }
             break;
         }
@@ -460,11 +477,11 @@ unique_ptr<iop::locnet::Response> IncomingClientRequestDispatcher::Dispatch(uniq
     {
         case iop::locnet::ClientRequest::kGetNodeInfo:
         {
-            NodeInfo node = _iClient->GetNodeInfo();
-            LOG(DEBUG) << "Served GetNodeInfo(): " << node;
+            shared_ptr<const NodeInfo> node = _iClient->GetNodeInfo();
+            LOG(DEBUG) << "Served GetNodeInfo(): " << *node;
             
             auto responseContent = clientResponse->mutable_get_node_info();
-            responseContent->set_allocated_node_info( Converter::ToProtoBuf(node) );
+            responseContent->set_allocated_node_info( _selfInfoCache.ToProtoBuf(node) );
             break;
         }
         
@@ -608,7 +625,7 @@ NodeMethodsProtoBufClient::NodeMethodsProtoBufClient(
 
 
 // TODO All methods simply translate between different data formats, ideally this should be generated.
-NodeInfo NodeMethodsProtoBufClient::GetNodeInfo() const
+shared_ptr<const NodeInfo> NodeMethodsProtoBufClient::GetNodeInfo() const
 {
     unique_ptr<iop::locnet::Request> request( new iop::locnet::Request() );
     request->mutable_remote_node()->mutable_get_node_info();
@@ -617,8 +634,8 @@ NodeInfo NodeMethodsProtoBufClient::GetNodeInfo() const
     if (! response || ! response->has_remote_node() || ! response->remote_node().has_get_node_info() )
         { throw LocationNetworkError(ErrorCode::ERROR_BAD_RESPONSE, "Failed to get expected response"); }
     
-    auto result = Converter::FromProtoBuf( response->remote_node().get_node_info().node_info() );
-    LOG(DEBUG) << "Request GetNodeInfo() returned " << result;
+    auto result = make_shared<const NodeInfo>( Converter::FromProtoBuf( response->remote_node().get_node_info().node_info() ) );
+    LOG(DEBUG) << "Request GetNodeInfo() returned " << *result;
     return result;
 }
 
@@ -640,7 +657,7 @@ size_t NodeMethodsProtoBufClient::GetNodeCount() const
 
 
 
-shared_ptr<NodeInfo> NodeMethodsProtoBufClient::AcceptColleague(const NodeInfo& node)
+shared_ptr<const NodeInfo> NodeMethodsProtoBufClient::AcceptColleague(const NodeInfo& node)
 {
     unique_ptr<iop::locnet::Request> request( new iop::locnet::Request() );
     request->mutable_remote_node()->mutable_accept_colleague()->set_allocated_requestor_node_info(
@@ -651,9 +668,9 @@ shared_ptr<NodeInfo> NodeMethodsProtoBufClient::AcceptColleague(const NodeInfo&
         { throw LocationNetworkError(ErrorCode::ERROR_BAD_RESPONSE, "Failed to get expected response"); }
     
     auto result = response->remote_node().accept_colleague().accepted() ?
-        shared_ptr<NodeInfo>( new NodeInfo( Converter::FromProtoBuf(
+        shared_ptr<const NodeInfo>( new NodeInfo( Converter::FromProtoBuf(
             response->remote_node().accept_colleague().acceptor_node_info() ) ) ) :
-        shared_ptr<NodeInfo>();
+        shared_ptr<const NodeInfo>();
     LOG(DEBUG) << "Request AcceptColleague() returned " << static_cast<bool>(result);
     
     if (_detectedIpCallback)
@@ -667,7 +684,7 @@ shared_ptr<NodeInfo> NodeMethodsProtoBufClient::AcceptColleague(const NodeInfo&
 
 
 
-shared_ptr<NodeInfo> NodeMethodsProtoBufClient::RenewColleague(const NodeInfo& node)
+shared_ptr<const NodeInfo> NodeMethodsProtoBufClient::RenewColleague(const NodeInfo& node)
 {
     unique_ptr<iop::locnet::Request> request( new iop::locnet::Request() );
     request->mutable_remote_node()->mutable_renew_colleague()->set_allocated_requestor_node_info(
@@ -678,9 +695,9 @@ shared_ptr<NodeInfo> NodeMethodsProtoBufClient::RenewColleague(const NodeInfo& n
         { throw LocationNetworkError(ErrorCode::ERROR_BAD_RESPONSE, "Failed to get expected response"); }
     
     auto result = response->remote_node().renew_colleague().accepted() ?
-        shared_ptr<NodeInfo>( new NodeInfo( Converter::FromProtoBuf(
+        shared_ptr<const NodeInfo>( new NodeInfo( Converter::FromProtoBuf(
             response->remote_node().renew_colleague().acceptor_node_info() ) ) ) :
-        shared_ptr<NodeInfo>();
+        shared_ptr<const NodeInfo>();
     LOG(DEBUG) << "Request RenewColleague() returned " << static_cast<bool>(result);
     
     if (_detectedIpCallback)
@@ -694,7 +711,7 @@ shared_ptr<NodeInfo> NodeMethodsProtoBufClient::RenewColleague(const NodeInfo& n
 
 
 
-shared_ptr<NodeInfo> NodeMethodsProtoBufClient::AcceptNeighbour(const NodeInfo& node)
+shared_ptr<const NodeInfo> NodeMethodsProtoBufClient::AcceptNeighbour(const NodeInfo& node)
 {
     unique_ptr<iop::locnet::Request> request( new iop::locnet::Request() );
     request->mutable_remote_node()->mutable_accept_neighbour()->set_allocated_requestor_node_info(
@@ -705,9 +722,9 @@ shared_ptr<NodeInfo> NodeMethodsProtoBufClient::AcceptNeighbour(const NodeInfo&
         { throw LocationNetworkError(ErrorCode::ERROR_BAD_RESPONSE, "Failed to get expected response"); }
     
     auto result = response->remote_node().accept_neighbour().accepted() ?
-        shared_ptr<NodeInfo>( new NodeInfo( Converter::FromProtoBuf(
+        shared_ptr<const NodeInfo>( new NodeInfo( Converter::FromProtoBuf(
             response->remote_node().accept_neighbour().acceptor_node_info() ) ) ) :
-        shared_ptr<NodeInfo>();
+        shared_ptr<const NodeInfo>();
     LOG(DEBUG) << "Request AcceptNeighbour() returned " << static_cast<bool>(result);
     
     if (_detectedIpCallback)
@@ -721,7 +738,7 @@ shared_ptr<NodeInfo> NodeMethodsProtoBufClient::AcceptNeighbour(const NodeInfo&
 
 
 
-shared_ptr<NodeInfo> NodeMethodsProtoBufClient::RenewNeighbour(const NodeInfo& node)
+shared_ptr<const NodeInfo> NodeMethodsProtoBufClient::RenewNeighbour(const NodeInfo& node)
 {
     unique_ptr<iop::locnet::Request> request( new iop::locnet::Request() );
     request->mutable_remote_node()->mutable_renew_neighbour()->set_allocated_requestor_node_info(
@@ -732,9 +749,9 @@ shared_ptr<NodeInfo> NodeMethodsProtoBufClient::RenewNeighbour(const NodeInfo& n
         { throw LocationNetworkError(ErrorCode::ERROR_BAD_RESPONSE, "Failed to get expected response"); }
     
     auto result = response->remote_node().renew_neighbour().accepted() ?
-        shared_ptr<NodeInfo>( new NodeInfo( Converter::FromProtoBuf(
+        shared_ptr<const NodeInfo>( new NodeInfo( Converter::FromProtoBuf(
             response->remote_node().renew_neighbour().acceptor_node_info() ) ) ) :
-        shared_ptr<NodeInfo>();
+        shared_ptr<const NodeInfo>();
     LOG(DEBUG) << "Request RenewNeighbour() returned " << static_cast<bool>(result);
     
     if (_detectedIpCallback)
@@ -3,6 +3,7 @@
 
 #include <future>
 #include <memory>
+#include <mutex>
 
 #include <google/protobuf/text_format.h>
 
@@ -40,6 +41,22 @@ struct Converter
 
 
 
+// Keeps the protobuf form of the last converted node info snapshot.
+// Our own node info is sent in most responses but changes very rarely,
+// so it is converted only once per change and copied afterwards.
+class NodeInfoProtoBufCache
+{
+    std::mutex                      _mutex;
+    std::shared_ptr<const NodeInfo> _source;
+    iop::locnet::NodeInfo           _converted;
+    
+public:
+    
+    iop::locnet::NodeInfo* ToProtoBuf(const std::shared_ptr<const NodeInfo> &info);
+};
+
+
+
 // Interface to dispatch messages to serve incoming requests directly in a blocking way.
 // Implementation should translate incoming protobuf requests to internal representation,
 // serve the request with our business logic and translate the result into a protobuf response.
@@ -59,6 +76,7 @@ class IncomingLocalServiceRequestDispatcher : public IBlockingRequestDispatcher
 {
     std::shared_ptr<ILocalServiceMethods>   _iLocalService;
     std::shared_ptr<IChangeListenerFactory> _listenerFactory;
+    NodeInfoProtoBufCache                   _selfInfoCache;
     
 public:
     
@@ -74,6 +92,7 @@ public:
 class IncomingNodeRequestDispatcher : public IBlockingRequestDispatcher
 {
     std::shared_ptr<INodeMethods> _iNode;
+    NodeInfoProtoBufCache         _selfInfoCache;
     
 public:
     
@@ -88,6 +107,7 @@ public:
 class IncomingClientRequestDispatcher : public IBlockingRequestDispatcher
 {
     std::shared_ptr<IClientMethods> _iClient;
+    NodeInfoProtoBufCache           _selfInfoCache;
     
 public:
     
@@ -149,7 +169,7 @@ public:
     NodeMethodsProtoBufClient( std::shared_ptr<IBlockingRequestDispatcher> dispatcher,
                                std::function<void(const Address&)> detectedIpCallback );
     
-    NodeInfo GetNodeInfo() const override;
+    std::shared_ptr<const NodeInfo> GetNodeInfo() const override;
     size_t GetNodeCount() const override;
     std::vector<NodeInfo> GetRandomNodes(
         size_t maxNodeCount, Neighbours filter) const override;
@@ -157,10 +177,10 @@ public:
     std::vector<NodeInfo> GetClosestNodesByDistance(const GpsLocation &location,
         Distance radiusKm, size_t maxNodeCount, Neighbours filter) const override;
     
-    std::shared_ptr<NodeInfo> AcceptColleague(const NodeInfo &node) override;
-    std::shared_ptr<NodeInfo> RenewColleague (const NodeInfo &node) override;
-    std::shared_ptr<NodeInfo> AcceptNeighbour(const NodeInfo &node) override;
-    std::shared_ptr<NodeInfo> RenewNeighbour (const NodeInfo &node) override;
+    std::shared_ptr<const NodeInfo> AcceptColleague(const NodeInfo &node) override;
+    std::shared_ptr<const NodeInfo> RenewColleague (const NodeInfo &node) override;
+    std::shared_ptr<const NodeInfo> AcceptNeighbour(const NodeInfo &node) override;
+    std::shared_ptr<const NodeInfo> RenewNeighbour (const NodeInfo &node) override;
 };
 
 
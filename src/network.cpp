@@ -47,7 +47,11 @@ string NodeContact::AddressToBytes(const Address &addr)
     if ( addr.empty() )
         { return result; }
     
-    auto ipAddress( address::from_string(addr) );
+    asio::error_code error;
+    auto ipAddress( address::from_string(addr, error) );
+    if (error)
+        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Invalid IP address: " + addr); }
+    
     if ( ipAddress.is_v4() )
     {
         auto bytes = ipAddress.to_v4().to_bytes();
@@ -64,9 +68,6 @@ string NodeContact::AddressToBytes(const Address &addr)
     return result;
 }
 
-string  NodeContact::AddressBytes() const
-    { return AddressToBytes(_address); }
-
 
 
 Reactor Reactor::_instance;
@@ -81,16 +82,150 @@ asio::io_service& Reactor::AsioService() { return _asioService; }
 
 
 
-shared_ptr<AsyncConnection> AsyncConnection::Create(
-    weak_ptr<asio::ip::tcp::socket> socket, unique_ptr<string> &&buffer, size_t offset )
+WorkerPool::WorkerPool(const string &name, size_t threadCount, size_t maxQueueSize) :
+    _maxQueueSize(maxQueueSize), _mutex(), _condition(), _tasks(), _shutdownRequested(false), _threads()
+{
+    if (threadCount == 0)
+        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Worker pool " + name + " needs at least one thread"); }
+    
+    for (size_t idx = 0; idx < threadCount; ++idx)
+        { _threads.emplace_back( [this] { WorkerLoop(); } ); }
+    LOG(DEBUG) << "Started worker pool " << name << " with " << threadCount << " threads";
+}
+
+
+WorkerPool::~WorkerPool()
+{
+    {
+        lock_guard<mutex> guard(_mutex);
+        _shutdownRequested = true;
+        _tasks.clear();
+    }
+    _condition.notify_all();
+    
+    for (auto &workerThread : _threads)
+        { workerThread.join(); }
+}
+
+
+bool WorkerPool::Post(function<void()> task)
+{
+    {
+        lock_guard<mutex> guard(_mutex);
+        if ( _shutdownRequested || _tasks.size() >= _maxQueueSize )
+            { return false; }
+        _tasks.push_back( move(task) );
+    }
+    _condition.notify_one();
+    return true;
+}
+
+
+void WorkerPool::WorkerLoop()
+{
+    while (true)
+    {
+        function<void()> task;
+        {
+            unique_lock<mutex> guard(_mutex);
+            _condition.wait( guard, [this] { return _shutdownRequested || ! _tasks.empty(); } );
+            if (_shutdownRequested)
+                { return; }
+            
+            task = move( _tasks.front() );
+            _tasks.pop_front();
+        }
+        
+        try { task(); }
+        catch (exception &ex)
+            { LOG(WARNING) << "Worker task failed: " << ex.what(); }
+    }
+}
+
+
+
+BufferPool::BufferPool(size_t minBufferSize, size_t maxBufferSize, size_t maxBuffersPerClass) :
+    _mutex(), _freeBuffers(), _minBufferSize(minBufferSize), _maxBuffersPerClass(maxBuffersPerClass)
+{
+    if (minBufferSize == 0 || maxBufferSize < minBufferSize)
+        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Invalid buffer pool size limits"); }
+    
+    size_t classCount = 1;
+    while ( ClassSize(classCount - 1) < maxBufferSize )
+        { ++classCount; }
+    _freeBuffers.resize(classCount);
+    for (auto &freeBuffers : _freeBuffers)
+        { freeBuffers.reserve(maxBuffersPerClass); }
+}
+
+
+size_t BufferPool::ClassSize(size_t sizeClass) const
+    { return _minBufferSize << sizeClass; }
+
+
+unique_ptr<string> BufferPool::Acquire(size_t size)
+{
+    size_t sizeClass = 0;
+    while ( sizeClass < _freeBuffers.size() && ClassSize(sizeClass) < size )
+        { ++sizeClass; }
+    
+    unique_ptr<string> buffer;
+    if ( sizeClass < _freeBuffers.size() )
+    {
+        lock_guard<mutex> guard(_mutex);
+        auto &freeBuffers = _freeBuffers[sizeClass];
+        if ( ! freeBuffers.empty() )
+        {
+            buffer = move( freeBuffers.back() );
+            freeBuffers.pop_back();
+        }
+    }
+    
+    if (! buffer)
+    {
+        buffer.reset( new string() );
+        if ( sizeClass < _freeBuffers.size() )
+            { buffer->reserve( ClassSize(sizeClass) ); }
+    }
+    // NOTE capacity of the class is already reserved, this does not allocate
+    buffer->resize(size);
+    return buffer;
+}
+
+
+void BufferPool::Release(unique_ptr<string> &&buffer)
 {
-    return shared_ptr<AsyncConnection>( new AsyncConnection( socket, move(buffer), offset ) );
+    // NOTE buffers bigger than the largest class are dropped, keeping them would hold huge memory for long
+    if ( ! buffer || buffer->capacity() < _minBufferSize ||
+         buffer->capacity() > ClassSize( _freeBuffers.size() - 1 ) )
+        { return; }
+    
+    // Put buffer into the largest class that it can serve
+    size_t sizeClass = 0;
+    while ( sizeClass + 1 < _freeBuffers.size() && ClassSize(sizeClass + 1) <= buffer->capacity() )
+        { ++sizeClass; }
+    
+    lock_guard<mutex> guard(_mutex);
+    auto &freeBuffers = _freeBuffers[sizeClass];
+    if ( freeBuffers.size() < _maxBuffersPerClass )
+        { freeBuffers.push_back( move(buffer) ); }
+}
+
+
+
+shared_ptr<AsyncConnection> AsyncConnection::Create( weak_ptr<asio::ip::tcp::socket> socket,
+    shared_ptr<asio::io_service::strand> strand, unique_ptr<string> &&buffer, size_t offset )
+{
+    return shared_ptr<AsyncConnection>( new AsyncConnection( socket, strand, move(buffer), offset ) );
 }
 
-AsyncConnection::AsyncConnection( weak_ptr<tcp::socket> socket,
+AsyncConnection::AsyncConnection( weak_ptr<tcp::socket> socket, shared_ptr<asio::io_service::strand> strand,
                                   unique_ptr<string> &&buffer, size_t offset ) :
-    _socket(socket), _buffer( move(buffer) ), _offset(offset)
+    _socket(socket), _strand(strand), _buffer( move(buffer) ), _offset(offset)
 {
+    if (_strand == nullptr) {
+        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "No strand instantiated");
+    }
     if (_buffer == nullptr) {
         throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "No buffer instantiated");
     }
@@ -103,17 +238,11 @@ AsyncConnection::AsyncConnection( weak_ptr<tcp::socket> socket,
 
 void AsyncConnection::ReadBuffer( function< void ( unique_ptr<string>&& ) > completionCallback )
 {
+    // NOTE this may be called from any thread, the socket is used only from the strand.
+    //      The buffer is never complete here, so the callback starts reading its remaining part.
     shared_ptr<AsyncConnection> self = shared_from_this();
-    shared_ptr<tcp::socket> socket = _socket.lock();
-    if (! socket) {
-        LOG(INFO) << "Socket was closed, stop reading";
-        completionCallback( unique_ptr<string>() );
-        return;
-    }
-    
-    asio::async_read( *socket, asio::buffer( &_buffer->operator[](_offset), _buffer->size() - _offset ),
-        [self, completionCallback] (const asio::error_code& error, std::size_t bytesRead)
-        { self->AsyncReadCallback(error, bytesRead, completionCallback); } );
+    _strand->dispatch( [self, completionCallback]
+        { self->AsyncReadCallback( asio::error_code(), 0, completionCallback ); } );
 }
 
 
@@ -150,8 +279,8 @@ void AsyncConnection::AsyncReadCallback( const asio::error_code &error, size_t b
         }
         
         asio::async_read( *socket, asio::buffer( &_buffer->operator[](_offset), _buffer->size() - _offset ),
-            [self, completionCallback] (const asio::error_code& error, std::size_t bytesRead)
-            { self->AsyncReadCallback(error, bytesRead, completionCallback); } );
+            _strand->wrap( [self, completionCallback] (const asio::error_code& error, std::size_t bytesRead)
+                { self->AsyncReadCallback(error, bytesRead, completionCallback); } ) );
     }
     else { completionCallback( move(_buffer) ); }
 }
@@ -160,18 +289,10 @@ void AsyncConnection::AsyncReadCallback( const asio::error_code &error, size_t b
 
 void AsyncConnection::WriteBuffer( function< void ( unique_ptr<string>&& ) > completionCallback )
 {
+    // NOTE this may be called from any thread, the socket is used only from the strand
     shared_ptr<AsyncConnection> self = shared_from_this();
-    shared_ptr<tcp::socket> socket = _socket.lock();
-    if (! socket) {
-        LOG(INFO) << "Socket was closed, stop writing";
-        completionCallback( unique_ptr<string>() );
-        return;
-    }
-    asio::async_write( *socket, asio::buffer( &_buffer->operator[](_offset), _buffer->size() - _offset ),
-        [self, completionCallback] (const asio::error_code& error, std::size_t bytesWritten)
-    {
-        self->AsyncWriteCallback(error, bytesWritten, completionCallback);
-    } );
+    _strand->dispatch( [self, completionCallback]
+        { self->AsyncWriteCallback( asio::error_code(), 0, completionCallback ); } );
 }
 
 
@@ -208,8 +329,8 @@ void AsyncConnection::AsyncWriteCallback( const asio::error_code &error, size_t
         }
         
         asio::async_write( *socket, asio::buffer( &_buffer->operator[](_offset), _buffer->size() - _offset ),
-            [self, completionCallback] (const asio::error_code& error, std::size_t bytesWritten)
-            { self->AsyncWriteCallback(error, bytesWritten, completionCallback); } );
+            _strand->wrap( [self, completionCallback] (const asio::error_code& error, std::size_t bytesWritten)
+                { self->AsyncWriteCallback(error, bytesWritten, completionCallback); } ) );
     }
     else
     {
@@ -1,10 +1,16 @@
 #ifndef __LOCNET_ASIO_NETWORK_H__
 #define __LOCNET_ASIO_NETWORK_H__
 
+#include <condition_variable>
+#include <deque>
 #include <functional>
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #include "asio.hpp"
+#include "asio/steady_timer.hpp"
 #include "asio/use_future.hpp"
 #include "basic.hpp"
 
@@ -39,14 +45,68 @@ public:
 
 
 
+// Fixed number of threads executing tasks that may block, e.g. on the database or remote nodes,
+// to keep them away from the reactor threads. Queued tasks are limited, further tasks are refused.
+// NOTE tasks still queued on destruction are dropped, running ones are waited for.
+class WorkerPool
+{
+    size_t                              _maxQueueSize;
+    std::mutex                          _mutex;
+    std::condition_variable             _condition;
+    std::deque< std::function<void()> > _tasks;
+    bool                                _shutdownRequested;
+    std::vector<std::thread>            _threads;
+    
+    void WorkerLoop();
+    
+public:
+    
+    WorkerPool(const std::string &name, size_t threadCount, size_t maxQueueSize);
+    WorkerPool(const WorkerPool &other) = delete;
+    WorkerPool& operator=(const WorkerPool &other) = delete;
+    ~WorkerPool();
+    
+    // Returns false without executing the task if the queue is full or the pool is shut down
+    bool Post(std::function<void()> task);
+};
+
+
+
+// Recycles message buffers of a session to avoid allocating new ones for every message.
+// Buffers are kept in power of two size classes by their capacity, up to maxBufferSize,
+// bigger buffers are simply allocated and freed. Only a few buffers are kept per class.
+class BufferPool
+{
+    std::mutex _mutex;
+    std::vector< std::vector< std::unique_ptr<std::string> > > _freeBuffers;
+    size_t _minBufferSize;
+    size_t _maxBuffersPerClass;
+    
+    size_t ClassSize(size_t sizeClass) const;
+    
+public:
+    
+    BufferPool(size_t minBufferSize, size_t maxBufferSize, size_t maxBuffersPerClass);
+    
+    // Buffer of exactly the requested size, contents are unspecified
+    std::unique_ptr<std::string> Acquire(size_t size);
+    void Release(std::unique_ptr<std::string> &&buffer);
+};
+
+
+
+// Reads or writes a whole buffer, completion handlers are executed through the strand of the connection
+// so handlers of the same connection never run concurrently, even with multiple reactor threads.
 class AsyncConnection : public std::enable_shared_from_this<AsyncConnection>
 {
     // TODO consider whether socket member should be weak_ptr or shared_ptr
     std::weak_ptr<asio::ip::tcp::socket>    _socket;
+    std::shared_ptr<asio::io_service::strand> _strand;
     std::unique_ptr<std::string>            _buffer;
     size_t                                  _offset;
 
     AsyncConnection( std::weak_ptr<asio::ip::tcp::socket> socket,
+                     std::shared_ptr<asio::io_service::strand> strand,
                      std::unique_ptr<std::string> &&buffer, size_t offset );
     
     void AsyncReadCallback ( const asio::error_code &error, size_t bytesRead,
@@ -58,6 +118,7 @@ public:
     
     static std::shared_ptr<AsyncConnection> Create(
         std::weak_ptr<asio::ip::tcp::socket> socket,
+        std::shared_ptr<asio::io_service::strand> strand,
         std::unique_ptr<std::string> &&buffer, size_t offset = 0 );
     
     void ReadBuffer( std::function< void ( std::unique_ptr<std::string>&& ) > completionCallback );
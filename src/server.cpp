@@ -18,6 +18,17 @@ static const size_t MaxMessageSize = 1024 * 1024;
 static const size_t MessageHeaderSize = 5;
 static const size_t MessageSizeOffset = 1;
 
+// Incoming data is read in chunks of this size, consecutive messages are usually received in a single read
+static const size_t ReceiveChunkSize = 16 * 1024;
+
+// Buffers of a session are recycled in size classes from the smallest one up to the biggest message
+static const size_t MinPooledBufferSize = 256;
+static const size_t MaxPooledBuffersPerClass = 2;
+
+// Text dumps of messages are expensive, they are built only if they are really logged
+static bool IsMessageTraceEnabled()
+    { return el::Loggers::getLogger(el::base::consts::kDefaultLoggerId)->enabled(el::Level::Trace); }
+
 
 // static chrono::duration<uint32_t> GetNetworkExpirationPeriod()
 //     { return Config::Instance().isTestMode() ? chrono::seconds(1) : chrono::seconds(10); }
@@ -26,31 +37,37 @@ static const size_t MessageSizeOffset = 1;
 
 
 
-shared_ptr<DispatchingTcpServer> DispatchingTcpServer::Create(
-        TcpPort portNumber, shared_ptr<IBlockingRequestDispatcherFactory> dispatcherFactory )
-    { return shared_ptr<DispatchingTcpServer>( new DispatchingTcpServer(portNumber, dispatcherFactory) ); }
+shared_ptr<DispatchingTcpServer> DispatchingTcpServer::Create( TcpPort portNumber,
+        shared_ptr<IBlockingRequestDispatcherFactory> dispatcherFactory, shared_ptr<WorkerPool> workers )
+    { return shared_ptr<DispatchingTcpServer>( new DispatchingTcpServer(portNumber, dispatcherFactory, workers) ); }
 
-shared_ptr<DispatchingTcpServer> DispatchingTcpServer::Create( const string &interfaceName,
-        TcpPort portNumber, shared_ptr<IBlockingRequestDispatcherFactory> dispatcherFactory )
-    { return shared_ptr<DispatchingTcpServer>( new DispatchingTcpServer(interfaceName, portNumber, dispatcherFactory) ); }
+shared_ptr<DispatchingTcpServer> DispatchingTcpServer::Create( const string &interfaceName, TcpPort portNumber,
+        shared_ptr<IBlockingRequestDispatcherFactory> dispatcherFactory, shared_ptr<WorkerPool> workers )
+    { return shared_ptr<DispatchingTcpServer>( new DispatchingTcpServer(interfaceName, portNumber, dispatcherFactory, workers) ); }
 
 
 DispatchingTcpServer::DispatchingTcpServer( TcpPort portNumber,
-        shared_ptr<IBlockingRequestDispatcherFactory> dispatcherFactory ) :
-    TcpServer(portNumber), _dispatcherFactory(dispatcherFactory)
+        shared_ptr<IBlockingRequestDispatcherFactory> dispatcherFactory, shared_ptr<WorkerPool> workers ) :
+    TcpServer(portNumber), _dispatcherFactory(dispatcherFactory), _workers(workers)
 {
     if (_dispatcherFactory == nullptr) {
         throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "No dispatcher factory instantiated");
     }
+    if (_workers == nullptr) {
+        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "No worker pool instantiated");
+    }
 }
 
 DispatchingTcpServer::DispatchingTcpServer( const string &interfaceName, TcpPort portNumber,
-        shared_ptr<IBlockingRequestDispatcherFactory> dispatcherFactory ) :
-    TcpServer(interfaceName, portNumber), _dispatcherFactory(dispatcherFactory)
+        shared_ptr<IBlockingRequestDispatcherFactory> dispatcherFactory, shared_ptr<WorkerPool> workers ) :
+    TcpServer(interfaceName, portNumber), _dispatcherFactory(dispatcherFactory), _workers(workers)
 {
     if (_dispatcherFactory == nullptr) {
         throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "No dispatcher factory instantiated");
     }
+    if (_workers == nullptr) {
+        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "No worker pool instantiated");
+    }
 }
 
 
@@ -99,14 +116,60 @@ void DispatchingTcpServer::AsyncAcceptHandler(
     shared_ptr<IBlockingRequestDispatcher> dispatcher( _dispatcherFactory->Create(session) );
 
     LOG(INFO) << "Starting server message loop for connection " << connection->id();
-    
-    connection->ReceiveMessage( [session, dispatcher] ( unique_ptr<iop::locnet::Message> &&incomingMessage )
-        { AsyncServeMessageHandler( move(incomingMessage), session, dispatcher); } );
+    ReceiveNextMessage(session, dispatcher, _workers);
+}
+
+
+void DispatchingTcpServer::ReceiveNextMessage( shared_ptr<ProtoBufClientSession> session,
+    shared_ptr<IBlockingRequestDispatcher> dispatcher, weak_ptr<WorkerPool> workers )
+{
+    session->messageChannel()->ReceiveMessage( [session, dispatcher, workers]
+        ( unique_ptr<iop::locnet::Message> &&incomingMessage )
+        { AsyncServeMessageHandler( move(incomingMessage), session, dispatcher, workers ); } );
 }
 
 
 void DispatchingTcpServer::AsyncServeMessageHandler( unique_ptr<iop::locnet::Message> &&receivedMessage,
-    shared_ptr<ProtoBufClientSession> session, shared_ptr<IBlockingRequestDispatcher> dispatcher )
+    shared_ptr<ProtoBufClientSession> session, shared_ptr<IBlockingRequestDispatcher> dispatcher,
+    weak_ptr<WorkerPool> workers )
+{
+    // Responses and read failures are handled right away, only serving requests may block.
+    // NOTE the pool is referenced weakly not to be destroyed by its own threads, it's gone only on shutdown
+    if ( ! receivedMessage || ! receivedMessage->has_request() )
+    {
+        ServeMessage( move(receivedMessage), session, dispatcher, workers );
+        return;
+    }
+    shared_ptr<WorkerPool> workerPool = workers.lock();
+    if (! workerPool)
+    {
+        LOG(DEBUG) << "Server is shut down, dropping request of session " << session->id();
+        return;
+    }
+    
+    // NOTE tasks must be copyable, so the message is moved into a shared holder
+    uint32_t messageId = receivedMessage->id();
+    shared_ptr< unique_ptr<iop::locnet::Message> > request(
+        new unique_ptr<iop::locnet::Message>( move(receivedMessage) ) );
+    bool posted = workerPool->Post( [request, session, dispatcher, workers]
+        { ServeMessage( move(*request), session, dispatcher, workers ); } );
+    // The worker sends the response and continues the message loop after serving the request
+    if (posted)
+        { return; }
+    
+    LOG(WARNING) << "All workers are busy, refusing request of session " << session->id();
+    unique_ptr<iop::locnet::Message> responseMsg( new iop::locnet::Message() );
+    responseMsg->mutable_response()->set_status( Converter::ToProtoBuf(ErrorCode::ERROR_BAD_STATE) );
+    responseMsg->mutable_response()->set_details("Server is busy, try again later");
+    responseMsg->set_id(messageId);
+    session->messageChannel()->SendMessage( move(responseMsg), [] {} );
+    ReceiveNextMessage(session, dispatcher, workers);
+}
+
+
+void DispatchingTcpServer::ServeMessage( unique_ptr<iop::locnet::Message> &&receivedMessage,
+    shared_ptr<ProtoBufClientSession> session, shared_ptr<IBlockingRequestDispatcher> dispatcher,
+    weak_ptr<WorkerPool> workers )
 {
     bool handlerSuccessful = false;
     bool sendResponse = true;
@@ -214,9 +277,7 @@ void DispatchingTcpServer::AsyncServeMessageHandler( unique_ptr<iop::locnet::Mes
     if (handlerSuccessful)
     {
         // Schedule next message loop iteration
-        session->messageChannel()->ReceiveMessage( [session, dispatcher]
-            ( unique_ptr<iop::locnet::Message> &&incomingMessage )
-            { AsyncServeMessageHandler( move(incomingMessage), session, dispatcher); } );
+        ReceiveNextMessage(session, dispatcher, workers);
     }
     else { LOG(INFO) << "Server message loop ended for session " << session->id(); }
 }
@@ -224,7 +285,10 @@ void DispatchingTcpServer::AsyncServeMessageHandler( unique_ptr<iop::locnet::Mes
 
 
 AsyncProtoBufTcpChannel::AsyncProtoBufTcpChannel(shared_ptr<tcp::socket> socket) :
-    _socket(socket), _id(), _remoteAddress(), _nextRequestId(1) // , _socketWriteMutex(), _socketReadMutex()
+    _socket(socket), _strand( new asio::io_service::strand( Reactor::Instance().AsioService() ) ),
+    _writeQueue( new WriteQueue() ),
+    _bufferPool( new BufferPool(MinPooledBufferSize, MaxMessageSize, MaxPooledBuffersPerClass) ),
+    _receiveBuffer( new ReceiveBuffer() ), _id(), _remoteAddress(), _nextRequestId(1)
 {
     if (! _socket)
         { throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "No socket instantiated"); }
@@ -236,26 +300,101 @@ AsyncProtoBufTcpChannel::AsyncProtoBufTcpChannel(shared_ptr<tcp::socket> socket)
 }
 
 
-AsyncProtoBufTcpChannel::AsyncProtoBufTcpChannel(const NetworkEndpoint &endpoint) :
-    _socket( new tcp::socket( Reactor::Instance().AsioService() ) ),
+AsyncProtoBufTcpChannel::AsyncProtoBufTcpChannel( shared_ptr<tcp::socket> socket,
+        shared_ptr<asio::io_service::strand> strand, const NetworkEndpoint &endpoint ) :
+    _socket(socket), _strand(strand), _writeQueue( new WriteQueue() ),
+    _bufferPool( new BufferPool(MinPooledBufferSize, MaxMessageSize, MaxPooledBuffersPerClass) ),
+    _receiveBuffer( new ReceiveBuffer() ),
     _id( endpoint.address() + ":" + to_string( endpoint.port() ) ),
-    _remoteAddress( endpoint.address() ), _nextRequestId(1) // , _socketWriteMutex(), _socketReadMutex()
+    _remoteAddress( endpoint.address() ), _nextRequestId(1)
 {
-    tcp::resolver resolver( Reactor::Instance().AsioService() );
-    tcp::resolver::query query( endpoint.address(), to_string( endpoint.port() ) );
-    tcp::resolver::iterator addressIter = resolver.resolve(query);
-    // TODO transform this to async to make every I/O call async also for client connections
-    try { asio::connect(*_socket, addressIter); }
-    catch (exception &ex) { throw LocationNetworkError(ErrorCode::ERROR_CONNECTION, "Failed connecting to " +
-        endpoint.address() + ":" + to_string( endpoint.port() ) + " with error: " + ex.what() ); }
     LOG(DEBUG) << "Connected to " << endpoint;
     // TODO handle session expiration
     //_stream.expires_after( GetNormalStreamExpirationPeriod() );
 }
 
+
+void AsyncProtoBufTcpChannel::Connect( const NetworkEndpoint &endpoint,
+    chrono::duration<uint32_t> timeout, function<ConnectedCallback> callback )
+{
+    asio::io_service &ioService = Reactor::Instance().AsioService();
+    shared_ptr<asio::io_service::strand> strand( new asio::io_service::strand(ioService) );
+    shared_ptr<tcp::socket> socket( new tcp::socket(ioService) );
+    shared_ptr<tcp::resolver> resolver( new tcp::resolver(ioService) );
+    shared_ptr<asio::steady_timer> timer( new asio::steady_timer(ioService) );
+    
+    // NOTE all handlers below run on the strand, so the first one to finish the attempt wins
+    shared_ptr<bool> finished( new bool(false) );
+    auto finish = [endpoint, callback, socket, strand, resolver, timer, finished] (const asio::error_code &error)
+    {
+        if (*finished)
+            { return; }
+        *finished = true;
+        
+        asio::error_code ignored;
+        timer->cancel(ignored);
+        if (error)
+        {
+            resolver->cancel();
+            socket->close(ignored);
+            callback( shared_ptr<IProtoBufChannel>(), error );
+            return;
+        }
+        callback( shared_ptr<IProtoBufChannel>( new AsyncProtoBufTcpChannel(socket, strand, endpoint) ), error );
+    };
+    
+    timer->expires_from_now(timeout);
+    timer->async_wait( strand->wrap( [finish] (const asio::error_code &error)
+    {
+        if (error != asio::error::operation_aborted)
+            { finish(asio::error::timed_out); }
+    } ) );
+    
+    tcp::resolver::query query( endpoint.address(), to_string( endpoint.port() ) );
+    resolver->async_resolve( query, strand->wrap( [socket, strand, finished, finish]
+        (const asio::error_code &error, tcp::resolver::iterator addressIter)
+    {
+        if (error)
+            { finish(error); return; }
+        if (*finished) // Timed out while resolving
+            { return; }
+        
+        asio::async_connect( *socket, addressIter, strand->wrap( [finish]
+            (const asio::error_code &error, tcp::resolver::iterator)
+            { finish(error); } ) );
+    } ) );
+}
+
+
+future< shared_ptr<IProtoBufChannel> > AsyncProtoBufTcpChannel::Connect( const NetworkEndpoint &endpoint,
+    chrono::duration<uint32_t> timeout, asio::use_future_t<> )
+{
+    shared_ptr< promise< shared_ptr<IProtoBufChannel> > > result( new promise< shared_ptr<IProtoBufChannel> >() );
+    Connect( endpoint, timeout, [result, endpoint]
+        (shared_ptr<IProtoBufChannel> &&channel, const asio::error_code &error)
+    {
+        if (error)
+        {
+            result->set_exception( make_exception_ptr( LocationNetworkError( ErrorCode::ERROR_CONNECTION,
+                "Failed connecting to " + endpoint.address() + ":" + to_string( endpoint.port() ) +
+                " with error: " + error.message() ) ) );
+        }
+        else { result->set_value( move(channel) ); }
+    } );
+    return result->get_future();
+}
+
+
 AsyncProtoBufTcpChannel::~AsyncProtoBufTcpChannel()
 {
-    _socket->close();
+    // NOTE the last reference may be dropped by any thread while a read or write is continued on the strand,
+    //      so the socket is closed there too. Pending operations are then aborted and their handlers see the error.
+    shared_ptr<tcp::socket> socket = _socket;
+    _strand->post( [socket]
+    {
+        asio::error_code ignored;
+        socket->close(ignored);
+    } );
     LOG(DEBUG) << "Connection closed to " << id();
 }
 
@@ -277,33 +416,38 @@ uint32_t GetMessageSizeFromHeader(const char *bytes)
 
 void AsyncProtoBufTcpChannel::ReceiveMessage( function<ReceivedMessageCallback> callback )
 {
-    //lock_guard<mutex> readGuard(_socketReadMutex);
     //LOG(TRACE) << "Receive message called for connection " << id();
     
-    if ( ! _socket->is_open() )
-    {
-        LOG(DEBUG) << "Connection to " << id() << " is already closed, cannot read message";
-        callback( unique_ptr<iop::locnet::Message>() );
-    }
-
-    // Allocate a buffer for the message header and read it
-    unique_ptr<string> buffer( new string(MessageHeaderSize, 0) );
-    shared_ptr<AsyncConnection> bufferIO = AsyncConnection::Create( _socket, move(buffer) );
-    
-    string connectionId = id();
+    // NOTE this may be called from any thread, the receive buffer and the socket are used only from the strand.
+    //      Posting also avoids deep recursion when a message loop consumes many pipelined messages from the buffer.
     shared_ptr<tcp::socket> socket = _socket;
-    bufferIO->ReadBuffer( [socket, callback, connectionId] ( unique_ptr<string> &&transferredBuffer )
+    shared_ptr<asio::io_service::strand> strand = _strand;
+    shared_ptr<ReceiveBuffer> receiveBuffer = _receiveBuffer;
+    shared_ptr<BufferPool> bufferPool = _bufferPool;
+    string connectionId = id();
+    _strand->post( [socket, strand, receiveBuffer, bufferPool, callback, connectionId]
     {
-        unique_ptr<string> buffer( move(transferredBuffer) );
-        if ( ! buffer || buffer->size() < MessageHeaderSize )
+        if ( ! socket->is_open() )
         {
-            LOG(DEBUG) << "Failed to read message header";
+            LOG(DEBUG) << "Connection to " << connectionId << " is already closed, cannot read message";
             callback( unique_ptr<iop::locnet::Message>() );
             return;
         }
+        ReadNextMessage(socket, strand, receiveBuffer, bufferPool, callback, connectionId);
+    } );
+}
+
 
-        // Extract message size from the header to know how many bytes to read
-        uint32_t bodySize = GetMessageSizeFromHeader( &buffer->operator[](MessageSizeOffset) );
+void AsyncProtoBufTcpChannel::ReadNextMessage( shared_ptr<tcp::socket> socket,
+    shared_ptr<asio::io_service::strand> strand, shared_ptr<ReceiveBuffer> receiveBuffer,
+    shared_ptr<BufferPool> bufferPool, function<ReceivedMessageCallback> callback, const SessionId &connectionId )
+{
+    ReceiveBuffer &buffer = *receiveBuffer;
+    size_t frameSize = 0;
+    if (buffer.end - buffer.begin >= MessageHeaderSize)
+    {
+        // Extract message size from the header to know whether the whole message is already received
+        uint32_t bodySize = GetMessageSizeFromHeader( &(*buffer.data)[buffer.begin + MessageSizeOffset] );
         if (bodySize > MaxMessageSize)
         {
             LOG(DEBUG) << "Message size is over limit: " << bodySize;
@@ -311,35 +455,82 @@ void AsyncProtoBufTcpChannel::ReceiveMessage( function<ReceivedMessageCallback>
             return;
         }
         
-        // Extend buffer to fit remaining message size and read it
-        buffer->resize(MessageHeaderSize + bodySize, 0);
-        
-        shared_ptr<AsyncConnection> bufferIO = AsyncConnection::Create( socket, move(buffer), MessageHeaderSize );
-        bufferIO->ReadBuffer( [callback, connectionId] ( unique_ptr<string> &&buffer )
+        frameSize = MessageHeaderSize + bodySize;
+        if (buffer.end - buffer.begin >= frameSize)
         {
-            if (! buffer)
+            // Deserialize message right from the receive buffer, avoid leaks for failing cases with RAII-based unique_ptr
+            unique_ptr<iop::locnet::MessageWithHeader> message( new iop::locnet::MessageWithHeader() );
+            bool parsed = message->ParseFromArray( &(*buffer.data)[buffer.begin], frameSize );
+            buffer.begin += frameSize;
+            if (buffer.begin == buffer.end)
             {
-                LOG(DEBUG) << "Received empty buffer due to an error, ignore it";
-                return;
+                buffer.begin = buffer.end = 0;
+                // Don't keep memory of a huge message for the whole session, a chunk is taken again on next read
+                if ( buffer.data->size() > ReceiveChunkSize )
+                    { bufferPool->Release( move(buffer.data) ); }
             }
             
-            // Deserialize message from receive buffer, avoid leaks for failing cases with RAII-based unique_ptr
-            unique_ptr<iop::locnet::MessageWithHeader> message( new iop::locnet::MessageWithHeader() );
-            message->ParseFromString(*buffer);
+            if (! parsed)
+            {
+                LOG(DEBUG) << "Failed to parse message from connection " << connectionId;
+                callback( unique_ptr<iop::locnet::Message>() );
+                return;
+            }
             
-            string msgDebugStr;
-            google::protobuf::TextFormat::PrintToString(*message, &msgDebugStr);
-            LOG(TRACE) << "Connection " << connectionId << " received message " << msgDebugStr;
+            if ( IsMessageTraceEnabled() )
+            {
+                string msgDebugStr;
+                google::protobuf::TextFormat::PrintToString(*message, &msgDebugStr);
+                LOG(TRACE) << "Connection " << connectionId << " received message " << msgDebugStr;
+            }
             
             callback( unique_ptr<iop::locnet::Message>( message->release_body() ) );
-        } );
-    } );
+            return;
+        }
+    }
+    
+    // Move the partial message to the front and make room for all of it, or at least for a whole chunk
+    size_t requiredSize = max(frameSize, ReceiveChunkSize);
+    if ( ! buffer.data || buffer.data->size() < requiredSize )
+    {
+        unique_ptr<string> grownData( bufferPool->Acquire(requiredSize) );
+        if (buffer.data)
+        {
+            copy( buffer.data->begin() + buffer.begin, buffer.data->begin() + buffer.end, grownData->begin() );
+            bufferPool->Release( move(buffer.data) );
+        }
+        buffer.data = move(grownData);
+        buffer.end -= buffer.begin;
+        buffer.begin = 0;
+    }
+    else if (buffer.begin > 0)
+    {
+        copy( buffer.data->begin() + buffer.begin, buffer.data->begin() + buffer.end, buffer.data->begin() );
+        buffer.end -= buffer.begin;
+        buffer.begin = 0;
+    }
+    
+    socket->async_read_some( asio::buffer( &(*buffer.data)[buffer.end], buffer.data->size() - buffer.end ),
+        strand->wrap( [socket, strand, receiveBuffer, bufferPool, callback, connectionId]
+            (const asio::error_code &error, size_t bytesRead)
+    {
+        if (error)
+        {
+            if (error == asio::error::eof)
+                { LOG(DEBUG) << "Connection " << connectionId << " was closed by the remote peer"; }
+            else { LOG(WARNING) << "Failed to read from connection " << connectionId << ": " << error; }
+            callback( unique_ptr<iop::locnet::Message>() );
+            return;
+        }
+        
+        receiveBuffer->end += bytesRead;
+        ReadNextMessage(socket, strand, receiveBuffer, bufferPool, callback, connectionId);
+    } ) );
 }
 
 
 future< unique_ptr<iop::locnet::Message> > AsyncProtoBufTcpChannel::ReceiveMessage(asio::use_future_t<>)
 {
-    //lock_guard<mutex> readGuard(_socketReadMutex);
     //LOG(TRACE) << "Receive message called for connection " << id();
     
     shared_ptr< promise< unique_ptr<iop::locnet::Message> > > result(
@@ -356,17 +547,11 @@ future< unique_ptr<iop::locnet::Message> > AsyncProtoBufTcpChannel::ReceiveMessa
 void AsyncProtoBufTcpChannel::SendMessage( unique_ptr<iop::locnet::Message> &&messagePtr,
                                            function<SentMessageCallback> callback )
 {
-    if ( ! _socket->is_open() )
-        { throw LocationNetworkError(ErrorCode::ERROR_BAD_STATE,
-            "Session " + id() + " socket is already closed, cannot write message"); }
-    
     if (! messagePtr)
         { throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Got empty message argument to send"); }
-    if ( messagePtr->has_request() )
-    {
-        messagePtr->set_id(_nextRequestId);
-        ++_nextRequestId;
-    }
+    // NOTE requests sent through a session already have their ids, don't overwrite them
+    if ( messagePtr->has_request() && messagePtr->id() == 0 )
+        { messagePtr->set_id( _nextRequestId++ ); }
     
     iop::locnet::MessageWithHeader message;
     message.set_allocated_body( messagePtr.release() );
@@ -374,13 +559,57 @@ void AsyncProtoBufTcpChannel::SendMessage( unique_ptr<iop::locnet::Message> &&me
     message.set_header(1);
     message.set_header( message.ByteSize() - MessageHeaderSize );
 
-    string msgDebugStr;
-    google::protobuf::TextFormat::PrintToString(message, &msgDebugStr);
-    LOG(TRACE) << "Connection " << id() << " sending message " << msgDebugStr;
+    if ( IsMessageTraceEnabled() )
+    {
+        string msgDebugStr;
+        google::protobuf::TextFormat::PrintToString(message, &msgDebugStr);
+        LOG(TRACE) << "Connection " << id() << " sending message " << msgDebugStr;
+    }
+
+    // Serialize into a recycled buffer, ByteSize() also refreshes the cached sizes after setting the header
+    unique_ptr<string> buffer( _bufferPool->Acquire( message.ByteSize() ) );
+    message.SerializeWithCachedSizesToArray( reinterpret_cast<uint8_t*>( &buffer->operator[](0) ) );
+    
+    // NOTE handlers must be copyable, so the buffer is moved into the queue only on the strand
+    shared_ptr< unique_ptr<string> > serializedMessage( new unique_ptr<string>( move(buffer) ) );
+    shared_ptr<tcp::socket> socket = _socket;
+    shared_ptr<asio::io_service::strand> strand = _strand;
+    shared_ptr<WriteQueue> writeQueue = _writeQueue;
+    shared_ptr<BufferPool> bufferPool = _bufferPool;
+    string connectionId = id();
+    _strand->dispatch( [socket, strand, writeQueue, bufferPool, serializedMessage, callback, connectionId]
+    {
+        // NOTE the callback is dropped with the message, so waiting on the future fails with a broken promise
+        if ( ! socket->is_open() )
+        {
+            LOG(DEBUG) << "Connection to " << connectionId << " is already closed, cannot write message";
+            bufferPool->Release( move(*serializedMessage) );
+            return;
+        }
+        
+        writeQueue->emplace_back( move(*serializedMessage), callback );
+        // Start writing unless a previous message is still being written, that will continue with this one
+        if ( writeQueue->size() == 1 )
+            { WriteNextMessage(socket, strand, writeQueue, bufferPool); }
+    } );
+}
+
 
-    unique_ptr<string> serializedMessage( new string( message.SerializeAsString() ) );
-    shared_ptr<AsyncConnection> bufferIO = AsyncConnection::Create( _socket, move(serializedMessage) );
-    bufferIO->WriteBuffer( [callback] ( unique_ptr<string> && ) { callback(); } );
+void AsyncProtoBufTcpChannel::WriteNextMessage( shared_ptr<tcp::socket> socket,
+    shared_ptr<asio::io_service::strand> strand, shared_ptr<WriteQueue> writeQueue,
+    shared_ptr<BufferPool> bufferPool )
+{
+    shared_ptr<AsyncConnection> bufferIO = AsyncConnection::Create(
+        socket, strand, move( writeQueue->front().first ) );
+    bufferIO->WriteBuffer( [socket, strand, writeQueue, bufferPool] ( unique_ptr<string> &&writtenBuffer )
+    {
+        bufferPool->Release( move(writtenBuffer) );
+        function<SentMessageCallback> callback = move( writeQueue->front().second );
+        writeQueue->pop_front();
+        if ( ! writeQueue->empty() )
+            { WriteNextMessage(socket, strand, writeQueue, bufferPool); }
+        callback();
+    } );
 }
 
 
@@ -399,7 +628,7 @@ shared_ptr<ProtoBufClientSession> ProtoBufClientSession::Create(
     { return shared_ptr<ProtoBufClientSession>( new ProtoBufClientSession(connection) ); }
 
 ProtoBufClientSession::ProtoBufClientSession(shared_ptr<IProtoBufChannel> connection) :
-    _messageChannel(connection), _nextMessageId(1)
+    _messageChannel(connection), _strand( Reactor::Instance().AsioService() ), _nextMessageId(1)
 {
     if (_messageChannel == nullptr)
         { throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "No connection instantiated"); }
@@ -443,7 +672,14 @@ void ProtoBufClientSession::AsyncMessageLoopHandler(
                 sessionPtr->ResponseArrived( move(incomingMsg) );
             }
             
-            Reactor::Instance().AsioService().post( [sessionWeakRef, sessionId, requestHandler]
+            shared_ptr<ProtoBufClientSession> sessionPtr = sessionWeakRef.lock();
+            if (! sessionPtr)
+            {
+                LOG(DEBUG) << "Session " << sessionId << " was closed, stopping message loop";
+                return;
+            }
+            
+            sessionPtr->_strand.post( [sessionWeakRef, sessionId, requestHandler]
                 { AsyncMessageLoopHandler(sessionWeakRef, sessionId, requestHandler); } );
         }
         catch (exception &ex)
@@ -457,7 +693,7 @@ void ProtoBufClientSession::StartMessageLoop( std::function<IncomingRequestHandl
     shared_ptr<ProtoBufClientSession> session = shared_from_this();
     string sessionId = session->id();
     weak_ptr<ProtoBufClientSession> sessionWeakRef(session);
-    Reactor::Instance().AsioService().post( [sessionWeakRef, sessionId, requestHandler]
+    _strand.post( [sessionWeakRef, sessionId, requestHandler]
         { AsyncMessageLoopHandler(sessionWeakRef, sessionId, requestHandler); } );
 }
 
@@ -572,7 +808,15 @@ void TcpNodeConnectionFactory::detectedIpCallback(function<void(const Address&)>
 shared_ptr<INodeMethods> TcpNodeConnectionFactory::ConnectTo(const NetworkEndpoint& endpoint)
 {
     LOG(DEBUG) << "Connecting to " << endpoint;
-    shared_ptr<IProtoBufChannel> connection( new AsyncProtoBufTcpChannel(endpoint) );
+    // NOTE the connection is made by the reactor, this only waits for it, so it must not run on a reactor thread.
+    //      Servers dispatch requests on worker pools for this reason. The deadline is kept here as well,
+    //      otherwise the wait could never end if the reactor is not running.
+    future< shared_ptr<IProtoBufChannel> > futureConnection = AsyncProtoBufTcpChannel::Connect(
+        endpoint, _config->connectTimeout(), asio::use_future );
+    if ( futureConnection.wait_for( _config->connectTimeout() ) != future_status::ready )
+        { throw LocationNetworkError( ErrorCode::ERROR_CONNECTION, "Timeout connecting to " +
+            endpoint.address() + ":" + to_string( endpoint.port() ) ); }
+    shared_ptr<IProtoBufChannel> connection( futureConnection.get() );
     shared_ptr<ProtoBufClientSession> session( ProtoBufClientSession::Create(connection) );
     shared_ptr<IBlockingRequestDispatcher> dispatcher( new NetworkDispatcher(_config, session) );
     shared_ptr<INodeMethods> result( new NodeMethodsProtoBufClient(dispatcher, _detectedIpCallback) );
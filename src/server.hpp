@@ -1,6 +1,8 @@
 #ifndef __LOCNET_SERVER_H__
 #define __LOCNET_SERVER_H__
 
+#include <atomic>
+#include <deque>
 
 #include "network.hpp"
 #include "messaging.hpp"
@@ -35,23 +37,58 @@ public:
 
 
 // ProtoBuf message channel that sends messages through an async TCP network connection.
+// All socket operations and their completion handlers run through the strand of the channel,
+// so messages of a connection are processed in order without locking while reactor threads serve other connections.
+// Incoming data is read in large chunks, so pipelined messages are decoded from the buffer without further reads.
 class AsyncProtoBufTcpChannel : public IProtoBufChannel
 {
+    // Messages waiting to be written, the first one is being written. Used only from the strand.
+    typedef std::deque< std::pair< std::unique_ptr<std::string>, std::function<SentMessageCallback> > > WriteQueue;
+    
+    // Bytes received but not consumed yet are kept between begin and end. Used only from the strand.
+    // NOTE data is taken from the buffer pool when needed and grows only for messages bigger than a chunk.
+    struct ReceiveBuffer
+    {
+        std::unique_ptr<std::string> data;
+        size_t      begin = 0;
+        size_t      end = 0;
+    };
+    
     std::shared_ptr<asio::ip::tcp::socket>  _socket;
+    std::shared_ptr<asio::io_service::strand> _strand;
+    std::shared_ptr<WriteQueue>             _writeQueue;
+    std::shared_ptr<BufferPool>             _bufferPool;
+    std::shared_ptr<ReceiveBuffer>          _receiveBuffer;
     SessionId                               _id;
     Address                                 _remoteAddress;
-    uint32_t                                _nextRequestId;
+    std::atomic<uint32_t>                   _nextRequestId;
+    
+    static void ReadNextMessage( std::shared_ptr<asio::ip::tcp::socket> socket,
+        std::shared_ptr<asio::io_service::strand> strand, std::shared_ptr<ReceiveBuffer> receiveBuffer,
+        std::shared_ptr<BufferPool> bufferPool, std::function<ReceivedMessageCallback> callback,
+        const SessionId &connectionId );
+    static void WriteNextMessage( std::shared_ptr<asio::ip::tcp::socket> socket,
+        std::shared_ptr<asio::io_service::strand> strand, std::shared_ptr<WriteQueue> writeQueue,
+        std::shared_ptr<BufferPool> bufferPool );
     
-    //std::mutex                              _socketWriteMutex;
-    //std::mutex                              _socketReadMutex;
+    // Client connection to server with a socket already connected by Connect()
+    AsyncProtoBufTcpChannel( std::shared_ptr<asio::ip::tcp::socket> socket,
+        std::shared_ptr<asio::io_service::strand> strand, const NetworkEndpoint &endpoint );
 
 public:
-
+    
+    typedef void ConnectedCallback( std::shared_ptr<IProtoBufChannel> &&channel, const asio::error_code &error );
+    
     // Server connection to client with accepted socket
     AsyncProtoBufTcpChannel(std::shared_ptr<asio::ip::tcp::socket> socket);
-    // Client connection to server, endpoint resolution to be done
-    AsyncProtoBufTcpChannel(const NetworkEndpoint &endpoint);
     ~AsyncProtoBufTcpChannel();
+    
+    // Client connection to server, resolving and connecting asynchronously on the reactor.
+    // Fails with asio::error::timed_out if not connected within the timeout.
+    static void Connect( const NetworkEndpoint &endpoint, std::chrono::duration<uint32_t> timeout,
+                         std::function<ConnectedCallback> callback );
+    static std::future< std::shared_ptr<IProtoBufChannel> > Connect( const NetworkEndpoint &endpoint,
+        std::chrono::duration<uint32_t> timeout, asio::use_future_t<> );
 
     const SessionId& id() const override;
     const Address& remoteAddress() const override;
@@ -73,6 +110,8 @@ public:
 private:
     
     std::shared_ptr<IProtoBufChannel> _messageChannel;
+    // Serializes iterations of the message loop of this session
+    asio::io_service::strand          _strand;
     
     uint32_t _nextMessageId;
     std::unordered_map< uint32_t, std::promise< std::unique_ptr<iop::locnet::Response> > > _pendingRequests;
@@ -116,27 +155,44 @@ public:
 
 
 // Tcp server implementation that serves protobuf requests for accepted clients.
+// Requests are dispatched on a worker pool, so reactor threads never block on the database or remote nodes.
+// NOTE a worker pool is mandatory: serving may connect and talk to remote nodes, waiting for
+//      the reactor to complete it, which would never happen if served on the only reactor thread.
 class DispatchingTcpServer : public TcpServer
 {
 protected:
     
     std::shared_ptr<IBlockingRequestDispatcherFactory> _dispatcherFactory;
+    std::shared_ptr<WorkerPool>                        _workers;
     
     DispatchingTcpServer( TcpPort portNumber,
-        std::shared_ptr<IBlockingRequestDispatcherFactory> dispatcherFactory );
+        std::shared_ptr<IBlockingRequestDispatcherFactory> dispatcherFactory,
+        std::shared_ptr<WorkerPool> workers );
     DispatchingTcpServer( const std::string &interfaceName, TcpPort portNumber,
-        std::shared_ptr<IBlockingRequestDispatcherFactory> dispatcherFactory );
+        std::shared_ptr<IBlockingRequestDispatcherFactory> dispatcherFactory,
+        std::shared_ptr<WorkerPool> workers );
+    
+    static void ServeMessage( std::unique_ptr<iop::locnet::Message> &&receivedMessage,
+                              std::shared_ptr<ProtoBufClientSession> session,
+                              std::shared_ptr<IBlockingRequestDispatcher> dispatcher,
+                              std::weak_ptr<WorkerPool> workers );
+    static void ReceiveNextMessage( std::shared_ptr<ProtoBufClientSession> session,
+                                    std::shared_ptr<IBlockingRequestDispatcher> dispatcher,
+                                    std::weak_ptr<WorkerPool> workers );
 
 public:
     
     static std::shared_ptr<DispatchingTcpServer> Create( TcpPort portNumber,
-        std::shared_ptr<IBlockingRequestDispatcherFactory> dispatcherFactory );
+        std::shared_ptr<IBlockingRequestDispatcherFactory> dispatcherFactory,
+        std::shared_ptr<WorkerPool> workers );
     static std::shared_ptr<DispatchingTcpServer> Create( const std::string &interfaceName, TcpPort portNumber,
-        std::shared_ptr<IBlockingRequestDispatcherFactory> dispatcherFactory );
+        std::shared_ptr<IBlockingRequestDispatcherFactory> dispatcherFactory,
+        std::shared_ptr<WorkerPool> workers );
     
     static void AsyncServeMessageHandler( std::unique_ptr<iop::locnet::Message> &&receivedMessage,
                                           std::shared_ptr<ProtoBufClientSession> session,
-                                          std::shared_ptr<IBlockingRequestDispatcher> dispatcher );
+                                          std::shared_ptr<IBlockingRequestDispatcher> dispatcher,
+                                          std::weak_ptr<WorkerPool> workers );
     void StartListening() override;
     void AsyncAcceptHandler( std::shared_ptr<asio::ip::tcp::socket> socket,
                              const asio::error_code &ec ) override;
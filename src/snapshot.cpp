@@ -0,0 +1,500 @@
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+
+#ifndef _WIN32
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
+#include <easylogging++.h>
+
+#include "snapshot.hpp"
+
+using namespace std;
+
+
+
+namespace LocNet
+{
+
+
+const uint32_t NodeMapSnapshot::VERSION = 1;
+
+static const char SNAPSHOT_MAGIC[8] = { 'L', 'N', 'S', 'N', 'A', 'P', '\0', '\0' };
+
+// Records are grouped into cells of a fixed latitude/longitude grid
+static const double   GRID_CELL_DEGREES = 10.;
+static const uint32_t GRID_ROWS         = 18;
+static const uint32_t GRID_COLUMNS      = 36;
+static const uint32_t GRID_CELL_COUNT   = GRID_ROWS * GRID_COLUMNS;
+
+// Areas of the file start at multiples of this to keep records aligned
+static const size_t AREA_ALIGNMENT = 8;
+
+
+
+struct NodeMapSnapshot::Header
+{
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    headerSize;     // Sizes of all structures are stored to detect layout differences
+    uint32_t    recordSize;
+    uint32_t    serviceSize;
+    int64_t     createdAt;
+    uint32_t    recordCount;
+    uint32_t    serviceCount;
+    uint32_t    cellCount;
+    uint32_t    reserved;
+    uint64_t    recordsOffset;
+    uint64_t    servicesOffset;
+    uint64_t    idIndexOffset;
+    uint64_t    cellsOffset;
+    uint64_t    stringsOffset;
+    uint64_t    stringsSize;
+};
+
+
+struct NodeMapSnapshot::Record
+{
+    double      latitude;
+    double      longitude;
+    int64_t     expiresAt;
+    uint32_t    idOffset;       // Offsets are relative to the string area
+    uint32_t    idSize;
+    uint32_t    firstService;
+    uint32_t    serviceCount;
+    uint8_t     address[16];
+    uint16_t    nodePort;
+    uint16_t    clientPort;
+    uint8_t     addressSize;
+    uint8_t     relationType;
+    uint8_t     roleType;
+    uint8_t     reserved;
+};
+
+
+struct NodeMapSnapshot::Service
+{
+    uint32_t    typeOffset;
+    uint32_t    typeSize;
+    uint32_t    dataOffset;
+    uint32_t    dataSize;
+    uint16_t    port;
+    uint16_t    reserved[3];
+};
+
+
+
+namespace
+{
+    uint32_t GridCell(double latitude, double longitude)
+    {
+        uint32_t row    = min( GRID_ROWS - 1,    static_cast<uint32_t>( max( 0., floor( (latitude + 90.)   / GRID_CELL_DEGREES ) ) ) );
+        uint32_t column = min( GRID_COLUMNS - 1, static_cast<uint32_t>( max( 0., floor( (longitude + 180.) / GRID_CELL_DEGREES ) ) ) );
+        return row * GRID_COLUMNS + column;
+    }
+    
+    size_t AlignedSize(size_t size)
+        { return (size + AREA_ALIGNMENT - 1) / AREA_ALIGNMENT * AREA_ALIGNMENT; }
+    
+    // Append a string to the string area, returning its offset
+    uint32_t AddString(string &strings, const string &value)
+    {
+        if ( strings.size() + value.size() > numeric_limits<uint32_t>::max() )
+            { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Too much data for a snapshot"); }
+        uint32_t offset = strings.size();
+        strings += value;
+        return offset;
+    }
+    
+    // Check that an area of count items of the given size fits into the file
+    bool AreaFits(uint64_t offset, uint64_t count, size_t itemSize, size_t fileSize)
+    {
+        return offset % AREA_ALIGNMENT == 0 && offset <= fileSize &&
+               count <= (fileSize - offset) / itemSize;
+    }
+}
+
+
+
+void NodeMapSnapshot::Write(const string &path, const vector< pair<NodeDbEntry, time_t> > &entries,
+                            time_t createdAt)
+{
+    if ( entries.size() >= numeric_limits<uint32_t>::max() )
+        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Too many nodes for a snapshot"); }
+    
+    // Records are ordered by grid cell, cells are described by the position of their first record
+    vector<uint32_t> cells;
+    cells.reserve( entries.size() );
+    for (const auto &entry : entries)
+        { cells.push_back( GridCell( entry.first.location().latitude(), entry.first.location().longitude() ) ); }
+    
+    vector<uint32_t> order( entries.size() );
+    for (size_t idx = 0; idx < order.size(); ++idx)
+        { order[idx] = idx; }
+    stable_sort( order.begin(), order.end(), [&cells] (uint32_t one, uint32_t other)
+        { return cells[one] < cells[other]; } );
+    
+    vector<uint32_t> cellStarts(GRID_CELL_COUNT + 1, 0);
+    for (uint32_t cell : cells)
+        { ++cellStarts[cell + 1]; }
+    for (size_t cell = 0; cell < GRID_CELL_COUNT; ++cell)
+        { cellStarts[cell + 1] += cellStarts[cell]; }
+    
+    vector<Record>  records;
+    vector<Service> services;
+    string          strings;
+    records.reserve( entries.size() );
+    for (uint32_t entryIdx : order)
+    {
+        const NodeDbEntry &node = entries[entryIdx].first;
+        string addressBytes = node.contact().AddressBytes();
+        
+        Record record;
+        memset( &record, 0, sizeof(record) );
+        record.latitude     = node.location().latitude();
+        record.longitude    = node.location().longitude();
+        record.expiresAt    = entries[entryIdx].second;
+        record.idOffset     = AddString( strings, node.id() );
+        record.idSize       = node.id().size();
+        record.firstService = services.size();
+        record.serviceCount = node.services().size();
+        memcpy( record.address, addressBytes.data(), addressBytes.size() );
+        record.addressSize  = addressBytes.size();
+        record.nodePort     = node.contact().nodePort();
+        record.clientPort   = node.contact().clientPort();
+        record.relationType = static_cast<uint8_t>( node.relationType() );
+        record.roleType     = static_cast<uint8_t>( node.roleType() );
+        records.push_back(record);
+        
+        for (const auto &serviceInfo : node.services())
+        {
+            Service service;
+            memset( &service, 0, sizeof(service) );
+            service.typeOffset  = AddString( strings, serviceInfo.type() );
+            service.typeSize    = serviceInfo.type().size();
+            service.dataOffset  = AddString( strings, serviceInfo.customData() );
+            service.dataSize    = serviceInfo.customData().size();
+            service.port        = serviceInfo.port();
+            services.push_back(service);
+        }
+    }
+    
+    vector<uint32_t> idIndex( records.size() );
+    for (size_t idx = 0; idx < idIndex.size(); ++idx)
+        { idIndex[idx] = idx; }
+    sort( idIndex.begin(), idIndex.end(), [&records, &strings] (uint32_t one, uint32_t other)
+    {
+        return strings.compare( records[one].idOffset, records[one].idSize,
+                                strings, records[other].idOffset, records[other].idSize ) < 0;
+    } );
+    
+    Header header;
+    memset( &header, 0, sizeof(header) );
+    memcpy( header.magic, SNAPSHOT_MAGIC, sizeof(header.magic) );
+    header.version          = VERSION;
+    header.headerSize       = sizeof(Header);
+    header.recordSize       = sizeof(Record);
+    header.serviceSize      = sizeof(Service);
+    header.createdAt        = createdAt;
+    header.recordCount      = records.size();
+    header.serviceCount     = services.size();
+    header.cellCount        = GRID_CELL_COUNT;
+    header.recordsOffset    = AlignedSize( sizeof(Header) );
+    header.servicesOffset   = AlignedSize( header.recordsOffset  + records.size()    * sizeof(Record) );
+    header.idIndexOffset    = AlignedSize( header.servicesOffset + services.size()   * sizeof(Service) );
+    header.cellsOffset      = AlignedSize( header.idIndexOffset  + idIndex.size()    * sizeof(uint32_t) );
+    header.stringsOffset    = AlignedSize( header.cellsOffset    + cellStarts.size() * sizeof(uint32_t) );
+    header.stringsSize      = strings.size();
+    
+    string content( header.stringsOffset + header.stringsSize, '\0' );
+    memcpy( &content[0], &header, sizeof(header) );
+    if ( ! records.empty() )
+        { memcpy( &content[header.recordsOffset], records.data(), records.size() * sizeof(Record) ); }
+    if ( ! services.empty() )
+        { memcpy( &content[header.servicesOffset], services.data(), services.size() * sizeof(Service) ); }
+    if ( ! idIndex.empty() )
+        { memcpy( &content[header.idIndexOffset], idIndex.data(), idIndex.size() * sizeof(uint32_t) ); }
+    memcpy( &content[header.cellsOffset], cellStarts.data(), cellStarts.size() * sizeof(uint32_t) );
+    if ( ! strings.empty() )
+        { memcpy( &content[header.stringsOffset], strings.data(), strings.size() ); }
+    
+    // Write a temporary file first, so a crash while writing leaves the previous snapshot intact.
+    // NOTE the temporary file has a unique name, so concurrent writers of the same snapshot cannot clobber each other
+#ifndef _WIN32
+    string tempPath = path + ".XXXXXX";
+    int fd = mkstemp( &tempPath[0] );
+    if (fd < 0)
+    {
+        LOG(ERROR) << "Failed to create temporary snapshot file " << tempPath << ": " << strerror(errno);
+        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to create snapshot file");
+    }
+    
+    // NOTE mkstemp creates the file readable by the owner only
+    bool written = fchmod(fd, 0644) == 0;
+    for (size_t offset = 0; written && offset < content.size(); )
+    {
+        ssize_t writtenBytes = write( fd, content.data() + offset, content.size() - offset );
+        if (writtenBytes < 0 && errno == EINTR)
+            { continue; }
+        written = writtenBytes > 0;
+        if (written)
+            { offset += writtenBytes; }
+    }
+    written = close(fd) == 0 && written;
+    if (! written)
+    {
+        LOG(ERROR) << "Failed to write snapshot file " << tempPath << ": " << strerror(errno);
+        remove( tempPath.c_str() );
+        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to write snapshot file");
+    }
+#else
+    string tempPath = path + ".tmp";
+    {
+        ofstream file( tempPath, ios::binary | ios::trunc );
+        file.write( content.data(), content.size() );
+        file.close();
+        if ( ! file )
+        {
+            LOG(ERROR) << "Failed to write snapshot file " << tempPath;
+            remove( tempPath.c_str() );
+            throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to write snapshot file");
+        }
+    }
+#endif
+
+#ifdef _WIN32
+    // NOTE rename does not replace existing files on Windows
+    remove( path.c_str() );
+#endif
+    if ( rename( tempPath.c_str(), path.c_str() ) != 0 )
+    {
+        LOG(ERROR) << "Failed to replace snapshot file " << path;
+        remove( tempPath.c_str() );
+        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to replace snapshot file");
+    }
+    LOG(DEBUG) << "Written snapshot of " << records.size() << " nodes, " << content.size() << " bytes";
+}
+
+
+
+NodeMapSnapshot::NodeMapSnapshot(const string &path) :
+    _data(nullptr), _size(0)
+{
+#ifndef _WIN32
+    int fileDescriptor = open( path.c_str(), O_RDONLY );
+    if (fileDescriptor < 0)
+        { throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to open snapshot file " + path); }
+    scope_exit closeFile( [fileDescriptor] { close(fileDescriptor); } );
+    
+    struct stat fileStat;
+    if ( fstat(fileDescriptor, &fileStat) != 0 )
+        { throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to get size of snapshot file " + path); }
+    if ( static_cast<size_t>(fileStat.st_size) < sizeof(Header) )
+        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Snapshot file is too short: " + path); }
+    
+    void *mapped = mmap( nullptr, fileStat.st_size, PROT_READ, MAP_PRIVATE, fileDescriptor, 0 );
+    if (mapped == MAP_FAILED)
+        { throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to map snapshot file " + path); }
+    _data = static_cast<const char*>(mapped);
+    _size = fileStat.st_size;
+    scope_error unmapFile( [this] { munmap( const_cast<char*>(_data), _size ); } );
+#else
+    ifstream file( path, ios::binary );
+    if ( ! file )
+        { throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to open snapshot file " + path); }
+    _buffer.assign( istreambuf_iterator<char>(file), istreambuf_iterator<char>() );
+    if ( _buffer.size() < sizeof(Header) )
+        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Snapshot file is too short: " + path); }
+    _data = _buffer.data();
+    _size = _buffer.size();
+#endif
+
+    Validate();
+}
+
+
+NodeMapSnapshot::~NodeMapSnapshot()
+{
+#ifndef _WIN32
+    munmap( const_cast<char*>(_data), _size );
+#endif
+}
+
+
+
+void NodeMapSnapshot::Validate() const
+{
+    const Header &head = header();
+    if ( memcmp( head.magic, SNAPSHOT_MAGIC, sizeof(head.magic) ) != 0 )
+        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Not a snapshot file"); }
+    if ( head.version != VERSION )
+        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Unsupported snapshot version " + to_string(head.version) ); }
+    if ( head.headerSize != sizeof(Header) || head.recordSize != sizeof(Record) ||
+         head.serviceSize != sizeof(Service) || head.cellCount != GRID_CELL_COUNT )
+        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Incompatible snapshot layout"); }
+    
+    if ( ! AreaFits( head.recordsOffset,  head.recordCount,     sizeof(Record),   _size ) ||
+         ! AreaFits( head.servicesOffset, head.serviceCount,    sizeof(Service),  _size ) ||
+         ! AreaFits( head.idIndexOffset,  head.recordCount,     sizeof(uint32_t), _size ) ||
+         ! AreaFits( head.cellsOffset,    head.cellCount + 1,   sizeof(uint32_t), _size ) ||
+         ! AreaFits( head.stringsOffset,  head.stringsSize,     1,                _size ) )
+        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Snapshot file is truncated"); }
+    
+    for (size_t position = 0; position < head.recordCount; ++position)
+    {
+        const Record &rec = record(position);
+        if ( static_cast<uint64_t>(rec.idOffset) + rec.idSize > head.stringsSize ||
+             static_cast<uint64_t>(rec.firstService) + rec.serviceCount > head.serviceCount ||
+             ( rec.addressSize != 0 && rec.addressSize != 4 && rec.addressSize != 16 ) ||
+             rec.relationType < static_cast<uint8_t>(NodeRelationType::Colleague) ||
+             rec.relationType > static_cast<uint8_t>(NodeRelationType::Self) ||
+             rec.roleType < static_cast<uint8_t>(NodeContactRoleType::Initiator) ||
+             rec.roleType > static_cast<uint8_t>(NodeContactRoleType::Self) ||
+             ! ( -90. <= rec.latitude && rec.latitude <= 90. ) ||
+             ! ( -180. <= rec.longitude && rec.longitude <= 180. ) )
+            { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Invalid snapshot record " + to_string(position) ); }
+        if ( idIndex()[position] >= head.recordCount )
+            { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Invalid snapshot id index"); }
+    }
+    
+    for (size_t position = 0; position < head.serviceCount; ++position)
+    {
+        const Service &serv = service(position);
+        if ( static_cast<uint64_t>(serv.typeOffset) + serv.typeSize > head.stringsSize ||
+             static_cast<uint64_t>(serv.dataOffset) + serv.dataSize > head.stringsSize )
+            { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Invalid snapshot service " + to_string(position) ); }
+    }
+    
+    const uint32_t *cells = cellStarts();
+    if ( cells[0] != 0 || cells[head.cellCount] != head.recordCount ||
+         ! is_sorted( cells, cells + head.cellCount + 1 ) )
+        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Invalid snapshot grid"); }
+}
+
+
+
+const NodeMapSnapshot::Header& NodeMapSnapshot::header() const
+    { return *reinterpret_cast<const Header*>(_data); }
+
+const NodeMapSnapshot::Record& NodeMapSnapshot::record(size_t position) const
+    { return reinterpret_cast<const Record*>( _data + header().recordsOffset )[position]; }
+
+const NodeMapSnapshot::Service& NodeMapSnapshot::service(size_t position) const
+    { return reinterpret_cast<const Service*>( _data + header().servicesOffset )[position]; }
+
+const uint32_t* NodeMapSnapshot::idIndex() const
+    { return reinterpret_cast<const uint32_t*>( _data + header().idIndexOffset ); }
+
+const uint32_t* NodeMapSnapshot::cellStarts() const
+    { return reinterpret_cast<const uint32_t*>( _data + header().cellsOffset ); }
+
+string NodeMapSnapshot::String(uint32_t offset, uint32_t size) const
+    { return string( _data + header().stringsOffset + offset, size ); }
+
+int NodeMapSnapshot::CompareId(size_t position, const NodeId &nodeId) const
+{
+    const Record &rec = record(position);
+    return -nodeId.compare( 0, string::npos, _data + header().stringsOffset + rec.idOffset, rec.idSize );
+}
+
+
+
+time_t NodeMapSnapshot::createdAt() const
+    { return header().createdAt; }
+
+size_t NodeMapSnapshot::size() const
+    { return header().recordCount; }
+
+
+NodeDbEntry NodeMapSnapshot::Entry(size_t position) const
+{
+    if ( position >= size() )
+        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Snapshot position out of range: " + to_string(position) ); }
+    
+    const Record &rec = record(position);
+    NodeInfo::Services services;
+    for (size_t idx = rec.firstService; idx < rec.firstService + rec.serviceCount; ++idx)
+    {
+        const Service &serv = service(idx);
+        services.Set( ServiceInfo( String(serv.typeOffset, serv.typeSize), serv.port,
+                                   String(serv.dataOffset, serv.dataSize) ) );
+    }
+    
+    NodeContact contact = NodeContact::FromAddressBytes(
+        string( reinterpret_cast<const char*>(rec.address), rec.addressSize ), rec.nodePort, rec.clientPort );
+    return NodeDbEntry( NodeInfo( String(rec.idOffset, rec.idSize), GpsLocation(rec.latitude, rec.longitude),
+                                  move(contact), move(services) ),
+                        static_cast<NodeRelationType>(rec.relationType),
+                        static_cast<NodeContactRoleType>(rec.roleType) );
+}
+
+
+time_t NodeMapSnapshot::ExpiresAt(size_t position) const
+{
+    if ( position >= size() )
+        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Snapshot position out of range: " + to_string(position) ); }
+    return record(position).expiresAt;
+}
+
+
+bool NodeMapSnapshot::Find(const NodeId &nodeId, size_t &position) const
+{
+    const uint32_t *begin = idIndex();
+    const uint32_t *end = begin + size();
+    const uint32_t *found = lower_bound( begin, end, nodeId, [this] (uint32_t recordPosition, const NodeId &id)
+        { return CompareId(recordPosition, id) < 0; } );
+    if ( found == end || CompareId(*found, nodeId) != 0 )
+        { return false; }
+    position = *found;
+    return true;
+}
+
+
+void NodeMapSnapshot::VisitCell(const GpsLocation &location, const NodeVisitor &visitor) const
+{
+    uint32_t cell = GridCell( location.latitude(), location.longitude() );
+    for (size_t position = cellStarts()[cell]; position < cellStarts()[cell + 1]; ++position)
+    {
+        if ( ! visitor( Entry(position) ) )
+            { break; }
+    }
+}
+
+
+
+size_t NodeMapSnapshot::RestoreInto(ISpatialDatabase &db, time_t now) const
+{
+    NodeId selfId = db.ThisNode()->id();
+    
+    db.BeginBatch();
+    scope_error rollback( [&db] { db.RollbackBatch(); } );
+    
+    size_t restoredCount = 0;
+    for (size_t position = 0; position < size(); ++position)
+    {
+        const Record &rec = record(position);
+        if ( rec.relationType == static_cast<uint8_t>(NodeRelationType::Self) || rec.expiresAt <= now )
+            { continue; }
+        
+        NodeDbEntry entry = Entry(position);
+        if ( entry.id() == selfId )
+            { continue; }
+        db.StoreExpiringAt(entry, rec.expiresAt);
+        ++restoredCount;
+    }
+    
+    db.CommitBatch();
+    return restoredCount;
+}
+
+
+
+} // namespace LocNet
@@ -0,0 +1,80 @@
+#ifndef __LOCNET_SNAPSHOT_H__
+#define __LOCNET_SNAPSHOT_H__
+
+#include <string>
+#include <vector>
+
+#include "spatialdb.hpp"
+
+
+
+namespace LocNet
+{
+
+
+
+// Read-only view of a binary node map snapshot, the file is memory mapped and used in place.
+// The file consists of a header, fixed size node and service records, a string area for
+// variable length fields, an index of records ordered by node id and a grid of 10x10 degree cells.
+// Records are ordered by the grid cell of their location, so nodes of a cell are stored next to each other.
+// The whole file is validated on opening, malformed or incompatible files throw, so they can be simply skipped.
+// NOTE records are read in host byte order, files are not meant to be moved between different architectures
+class NodeMapSnapshot
+{
+    struct Header;
+    struct Record;
+    struct Service;
+    
+    const char         *_data;
+    size_t              _size;
+    std::vector<char>   _buffer;    // File contents if memory mapping is not available
+    
+    const Header&   header() const;
+    const Record&   record(size_t position) const;
+    const Service&  service(size_t position) const;
+    const uint32_t* idIndex() const;
+    const uint32_t* cellStarts() const;
+    
+    std::string String(uint32_t offset, uint32_t size) const;
+    int CompareId(size_t position, const NodeId &nodeId) const;
+    void Validate() const;
+    
+public:
+    
+    // Format version, snapshots of other versions are refused
+    static const uint32_t VERSION;
+    
+    explicit NodeMapSnapshot(const std::string &path);
+    ~NodeMapSnapshot();
+    
+    NodeMapSnapshot(const NodeMapSnapshot &other) = delete;
+    NodeMapSnapshot& operator=(const NodeMapSnapshot &other) = delete;
+    
+    // Write entries into a new snapshot file, replacing any previous one only after it's completely written.
+    // Expiration times are absolute, numeric_limits<time_t>::max() for non expiring nodes
+    static void Write(const std::string &path, const std::vector< std::pair<NodeDbEntry, time_t> > &entries,
+                      time_t createdAt);
+    
+    time_t createdAt() const;
+    size_t size() const;
+    
+    NodeDbEntry Entry(size_t position) const;
+    time_t ExpiresAt(size_t position) const;
+    
+    // Position of the node with the given id using the id index
+    bool Find(const NodeId &nodeId, size_t &position) const;
+    // Nodes stored in the grid cell containing the location, returning false from the visitor stops
+    void VisitCell(const GpsLocation &location, const NodeVisitor &visitor) const;
+    
+    // Store nodes not expired until now into an empty database in a single batch, returns the number of restored nodes.
+    // The self entry is skipped, as the database already has its own one. Restored nodes keep their recorded
+    // expiration time, so a restart does not extend relations that would not be renewed anyway.
+    size_t RestoreInto(ISpatialDatabase &db, time_t now) const;
+};
+
+
+
+} // namespace LocNet
+
+
+#endif // __LOCNET_SNAPSHOT_H__
@@ -1,11 +1,16 @@
 #include <algorithm>
 #include <chrono>
+#include <cmath>
+#include <iterator>
 #include <limits>
+#include <random>
+#include <unordered_set>
 
 #include <easylogging++.h>
 #include <sqlite3.h>
 #include <spatialite.h>
 
+#include "geodesic.hpp"
 #include "spatialdb.hpp"
 
 using namespace std;
@@ -39,7 +44,8 @@ const vector<string> DatabaseInitCommands = {
     "  relationType INT NOT NULL, "
     "  roleType     INT NOT NULL, "
     "  expiresAt    INT NOT NULL, " // Unix timestamp. NOTE consider implementing non expiring entries to have NULL here.
-    "  location     POINT NOT NULL "
+    "  location     POINT NOT NULL, "
+    "  selfDistanceKm REAL "          // Distance from the self entry, maintained by writes
     ");"
     
     "CREATE TABLE IF NOT EXISTS services ( "
@@ -54,146 +60,1031 @@ const vector<string> DatabaseInitCommands = {
 "END TRANSACTION;" };
 
 
+// NOTE these are run on every startup, also upgrading databases created with an older schema
+const vector<string> DatabaseUpgradeCommands = {
+"BEGIN TRANSACTION;",
+    // Spatial index of node locations, minimum and maximum of both coordinates are the same for a point
+    "CREATE VIRTUAL TABLE IF NOT EXISTS nodes_rtree USING rtree( "
+    "  id, minLat, maxLat, minLon, maxLon "
+    ");"
+    
+    "CREATE TRIGGER IF NOT EXISTS nodes_rtree_insert AFTER INSERT ON nodes BEGIN "
+    "  INSERT INTO nodes_rtree (id, minLat, maxLat, minLon, maxLon) VALUES "
+    "    (NEW.rowid, Y(NEW.location), Y(NEW.location), X(NEW.location), X(NEW.location)); "
+    "END;"
+    
+    "CREATE TRIGGER IF NOT EXISTS nodes_rtree_update AFTER UPDATE OF location ON nodes BEGIN "
+    "  UPDATE nodes_rtree SET minLat = Y(NEW.location), maxLat = Y(NEW.location), "
+    "    minLon = X(NEW.location), maxLon = X(NEW.location) "
+    "  WHERE id = NEW.rowid; "
+    "END;"
+    
+    "CREATE TRIGGER IF NOT EXISTS nodes_rtree_delete AFTER DELETE ON nodes BEGIN "
+    "  DELETE FROM nodes_rtree WHERE id = OLD.rowid; "
+    "END;"
+    
+    // NOTE rowids of the nodes table are not stable (e.g. VACUUM may renumber them), so always rebuild the index
+    "DELETE FROM nodes_rtree;"
+    "INSERT INTO nodes_rtree (id, minLat, maxLat, minLon, maxLon) "
+    "  SELECT rowid, Y(location), Y(location), X(location), X(location) FROM nodes;"
+    
+    "CREATE INDEX IF NOT EXISTS nodes_expiresAt ON nodes (expiresAt);"
+    // NOTE id is the tie-breaker of neighbour ordering, the index without it is replaced on databases created earlier
+    "DROP INDEX IF EXISTS nodes_relationType_selfDistanceKm;"
+    "CREATE INDEX IF NOT EXISTS nodes_relationType_selfDistanceKm_id ON nodes (relationType, selfDistanceKm, id);"
+    
+    "UPDATE metainfo SET value = '4' WHERE key = 'version';"
+"END TRANSACTION;" };
+
+
+
+// Distances of all nodes from the location of the self entry, run when the self location changes
+const string UpdateSelfDistancesCommand =
+    "UPDATE nodes SET selfDistanceKm = GeodesicDistanceKm( X(location), Y(location), "
+    "  (SELECT X(location) FROM nodes WHERE relationType = " + to_string( static_cast<int>(NodeRelationType::Self) ) + "), "
+    "  (SELECT Y(location) FROM nodes WHERE relationType = " + to_string( static_cast<int>(NodeRelationType::Self) ) + ") );";
+
+// Distance of the node written from the self entry, NULL while there is no self entry yet.
+// NOTE uses the location of the node to be written bound to ?8 and ?9.
+const string SelfDistanceExpression =
+    "GeodesicDistanceKm( ?8, ?9, "
+    "  (SELECT X(location) FROM nodes WHERE relationType = " + to_string( static_cast<int>(NodeRelationType::Self) ) + "), "
+    "  (SELECT Y(location) FROM nodes WHERE relationType = " + to_string( static_cast<int>(NodeRelationType::Self) ) + ") )";
+
+
+
+// Nodes closer than this are searched first, then the search area is expanded by SEARCH_RADIUS_GROWTH_RATE
+const Distance INITIAL_SEARCH_RADIUS_KM = 100;
+const Distance SEARCH_RADIUS_GROWTH_RATE = 4;
+
+// Any two points of the Earth surface are closer than this
+const Distance MAX_SURFACE_DISTANCE_KM = 20100;
+
+// Number of nodes whose services are queried by a single statement
+const size_t SERVICE_QUERY_BATCH_SIZE = 32;
+// Number of nodes loaded by id with a single statement
+const size_t NODE_QUERY_BATCH_SIZE = 32;
 
 
 NodeDbEntry NodeDbEntry::FromSelfInfo(const NodeInfo &thisNodeInfo)
     { return NodeDbEntry(thisNodeInfo, NodeRelationType::Self, NodeContactRoleType::Self); }
 
 
-NodeDbEntry::NodeDbEntry(const NodeDbEntry& other) :
-    NodeInfo(other), _relationType(other._relationType), _roleType(other._roleType) {}
+NodeDbEntry::NodeDbEntry(NodeInfo info, NodeRelationType relationType, NodeContactRoleType roleType) :
+    NodeInfo( move(info) ), _relationType(relationType), _roleType(roleType) {}
+
+
+NodeRelationType NodeDbEntry::relationType() const { return _relationType; }
+NodeContactRoleType NodeDbEntry::roleType() const { return _roleType; }
+
+
+bool NodeDbEntry::operator==(const NodeDbEntry &other) const
+{
+    return  NodeInfo::operator==(other) &&
+            _relationType == other._relationType &&
+            _roleType == other._roleType;
+}
+
+bool NodeDbEntry::operator!=(const NodeDbEntry &other) const
+    { return ! operator==(other); }
+
+
+
+namespace
+{
+    void VisitAll(const vector<NodeDbEntry> &entries, const NodeVisitor &visitor)
+    {
+        for (const auto &entry : entries)
+        {
+            if ( ! visitor(entry) )
+                { break; }
+        }
+    }
+}
+
+
+void ISpatialDatabase::VisitNodes(NodeContactRoleType roleType, const NodeVisitor &visitor)
+    { VisitAll( GetNodes(roleType), visitor ); }
+
+void ISpatialDatabase::VisitNeighbourNodesByDistance(const NodeVisitor &visitor) const
+    { VisitAll( GetNeighbourNodesByDistance(), visitor ); }
+
+void ISpatialDatabase::VisitClosestNodesByDistance(const GpsLocation &location,
+        Distance maxRadiusKm, size_t maxNodeCount, Neighbours filter,
+        const NodeVisitor &visitor, ServiceDetails details) const
+    { VisitAll( GetClosestNodesByDistance(location, maxRadiusKm, maxNodeCount, filter, details), visitor ); }
+
+void ISpatialDatabase::VisitRandomNodes(size_t maxNodeCount, Neighbours filter,
+        const NodeVisitor &visitor, ServiceDetails details) const
+    { VisitAll( GetRandomNodes(maxNodeCount, filter, details), visitor ); }
+
+
+
+void ThreadSafeChangeListenerRegistry::AddListener(shared_ptr<IChangeListener> listener)
+{
+    lock_guard<mutex> lock(_mutex);
+    if (listener == nullptr)
+        { throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Attempt to register listener instance null"); }
+    
+    if ( _listeners.find( listener->sessionId() ) != _listeners.end() )
+    {
+        LOG(DEBUG) << "Session already have a registered listener, ignore request to add new one";
+        return;
+    }
+    
+    _listeners[ listener->sessionId() ] = listener;
+    listener->OnRegistered();
+    LOG(DEBUG) << "Registered ChangeListener for session " << listener->sessionId();
+}
+
+
+void ThreadSafeChangeListenerRegistry::RemoveListener(const SessionId& sessionId)
+{
+    lock_guard<mutex> lock(_mutex);
+    _listeners.erase(sessionId);
+    LOG(DEBUG) << "Deregistered ChangeListener for session " << sessionId;
+}
+
+
+vector<shared_ptr<IChangeListener>> ThreadSafeChangeListenerRegistry::listeners() const
+{
+    lock_guard<mutex> lock(_mutex);
+    vector<shared_ptr<IChangeListener>> result;
+    for (const auto &listenerEntry : _listeners)
+        { result.push_back(listenerEntry.second); }
+    //LOG(DEBUG) << "Listener count " << result.size();
+    return result;
+}
+
+
+
+void NodeIdSampler::Clear()
+{
+    lock_guard<mutex> lock(_mutex);
+    for (auto &ids : _ids)
+        { ids.clear(); }
+    _positions.clear();
+}
+
+
+vector<NodeHandle> NodeIdSampler::Ids() const
+{
+    lock_guard<mutex> lock(_mutex);
+    vector<NodeHandle> result;
+    result.reserve( _positions.size() );
+    for (const auto &ids : _ids)
+        { result.insert( result.end(), ids.begin(), ids.end() ); }
+    return result;
+}
+
+
+void NodeIdSampler::Set(NodeHandle handle, NodeRelationType relationType)
+{
+    lock_guard<mutex> lock(_mutex);
+    RemoveUnlocked(handle);
+    
+    vector<NodeHandle> &ids = _ids.at( static_cast<size_t>(relationType) );
+    _positions[handle] = make_pair( relationType, ids.size() );
+    ids.push_back(handle);
+}
+
+
+void NodeIdSampler::Remove(NodeHandle handle)
+{
+    lock_guard<mutex> lock(_mutex);
+    RemoveUnlocked(handle);
+}
+
+
+void NodeIdSampler::RemoveUnlocked(NodeHandle handle)
+{
+    auto positionIt = _positions.find(handle);
+    if ( positionIt == _positions.end() )
+        { return; }
+    
+    // Move the last id into the place of the removed one to keep the array continuous
+    vector<NodeHandle> &ids = _ids.at( static_cast<size_t>(positionIt->second.first) );
+    size_t position = positionIt->second.second;
+    _positions.erase(positionIt);
+    if ( position + 1 != ids.size() )
+    {
+        ids[position] = ids.back();
+        _positions[ ids[position] ].second = position;
+    }
+    ids.pop_back();
+}
+
+
+vector<NodeHandle> NodeIdSampler::Sample(size_t maxCount, const vector<NodeRelationType> &relationTypes) const
+{
+    static thread_local mt19937 generator{ random_device()() };
+    
+    lock_guard<mutex> lock(_mutex);
+    size_t totalCount = 0;
+    for (NodeRelationType relationType : relationTypes)
+        { totalCount += _ids.at( static_cast<size_t>(relationType) ).size(); }
+    size_t resultCount = min(maxCount, totalCount);
+    
+    // Robert Floyd's algorithm selects distinct positions of the concatenated arrays
+    // with a single random number each, without touching unselected entries
+    unordered_set<size_t> selected;
+    vector<size_t> positions;
+    positions.reserve(resultCount);
+    for (size_t last = totalCount - resultCount; last < totalCount; ++last)
+    {
+        uniform_int_distribution<size_t> fromRange(0, last);
+        size_t position = fromRange(generator);
+        if ( ! selected.insert(position).second )
+        {
+            position = last;
+            selected.insert(position);
+        }
+        positions.push_back(position);
+    }
+    // Selection is uniform, but the order of positions is not, so shuffle them as well
+    shuffle( positions.begin(), positions.end(), generator );
+    
+    vector<NodeHandle> result;
+    result.reserve(resultCount);
+    for (size_t position : positions)
+    {
+        for (NodeRelationType relationType : relationTypes)
+        {
+            const vector<NodeHandle> &ids = _ids.at( static_cast<size_t>(relationType) );
+            if ( position < ids.size() )
+            {
+                result.push_back( ids[position] );
+                break;
+            }
+            position -= ids.size();
+        }
+    }
+    return result;
+}
+
+
+
+
+struct NeighbourhoodTreeNode
+{
+    // NOTE ties are broken by the node id string to match ORDER BY selfDistanceKm, id of the database queries.
+    //      Handles are assigned in order of appearance, so they would give a different order on every run.
+    struct Key
+    {
+        Distance        distanceKm;
+        NodeHandle      handle;
+        const NodeId   *id;
+        
+        Key(Distance distanceKm, NodeHandle handle) :
+            distanceKm(distanceKm), handle(handle), id( &NodeIdTable::Instance().Id(handle) ) {}
+        
+        bool operator==(const Key &other) const
+            { return handle == other.handle; }
+        bool operator!=(const Key &other) const
+            { return handle != other.handle; }
+        bool operator<(const Key &other) const
+        {
+            if (distanceKm != other.distanceKm)
+                { return distanceKm < other.distanceKm; }
+            return *id < *other.id;
+        }
+    };
+    
+    Key                                 key;
+    uint32_t                            priority;
+    size_t                              size;
+    unique_ptr<NeighbourhoodTreeNode>   left;
+    unique_ptr<NeighbourhoodTreeNode>   right;
+    
+    NeighbourhoodTreeNode(const Key &key, uint32_t priority) :
+        key(key), priority(priority), size(1) {}
+};
+
+
+namespace
+{
+    typedef unique_ptr<NeighbourhoodTreeNode> TreePtr;
+    
+    size_t SubtreeSize(const TreePtr &tree)
+        { return tree ? tree->size : 0; }
+    
+    void UpdateSize(TreePtr &tree)
+    {
+        if (tree)
+            { tree->size = 1 + SubtreeSize(tree->left) + SubtreeSize(tree->right); }
+    }
+    
+    // Split tree into nodes with keys lower than the given key and all others
+    void Split(TreePtr tree, const NeighbourhoodTreeNode::Key &key, TreePtr &lower, TreePtr &higher)
+    {
+        if (! tree)
+        {
+            lower.reset();
+            higher.reset();
+        }
+        else if (tree->key < key)
+        {
+            Split( move(tree->right), key, tree->right, higher );
+            UpdateSize(tree);
+            lower = move(tree);
+        }
+        else
+        {
+            Split( move(tree->left), key, lower, tree->left );
+            UpdateSize(tree);
+            higher = move(tree);
+        }
+    }
+    
+    // Merge two trees where all keys of the first one are lower than keys of the second one
+    TreePtr Merge(TreePtr lower, TreePtr higher)
+    {
+        if (! lower)  { return higher; }
+        if (! higher) { return lower; }
+        if (lower->priority > higher->priority)
+        {
+            lower->right = Merge( move(lower->right), move(higher) );
+            UpdateSize(lower);
+            return lower;
+        }
+        higher->left = Merge( move(lower), move(higher->left) );
+        UpdateSize(higher);
+        return higher;
+    }
+    
+    bool Erase(TreePtr &tree, const NeighbourhoodTreeNode::Key &key)
+    {
+        if (! tree)
+            { return false; }
+        bool erased;
+        if (key == tree->key)
+        {
+            tree = Merge( move(tree->left), move(tree->right) );
+            erased = true;
+        }
+        else { erased = Erase( key < tree->key ? tree->left : tree->right, key ); }
+        UpdateSize(tree);
+        return erased;
+    }
+    
+    void CollectIds(const TreePtr &tree, vector<NodeHandle> &result)
+    {
+        if (! tree)
+            { return; }
+        CollectIds(tree->left, result);
+        result.push_back(tree->key.handle);
+        CollectIds(tree->right, result);
+    }
+}
+
+
+NeighbourhoodIndex::NeighbourhoodIndex() : _nextPriority(2463534242u) {}
+
+// NOTE defined here where the tree node type is complete
+NeighbourhoodIndex::~NeighbourhoodIndex() {}
+
+
+void NeighbourhoodIndex::Clear()
+{
+    lock_guard<mutex> lock(_mutex);
+    _root.reset();
+    _distances.clear();
+}
+
+
+size_t NeighbourhoodIndex::size() const
+{
+    lock_guard<mutex> lock(_mutex);
+    return _distances.size();
+}
+
+
+void NeighbourhoodIndex::Set(NodeHandle handle, Distance distanceKm)
+{
+    lock_guard<mutex> lock(_mutex);
+    auto distanceIt = _distances.find(handle);
+    if ( distanceIt != _distances.end() )
+    {
+        if (distanceIt->second == distanceKm)
+            { return; }
+        Erase( _root, NeighbourhoodTreeNode::Key(distanceIt->second, handle) );
+    }
+    _distances[handle] = distanceKm;
+    
+    // Priorities just have to be random enough to keep the tree balanced, a xorshift generator is fine
+    _nextPriority ^= _nextPriority << 13;
+    _nextPriority ^= _nextPriority >> 17;
+    _nextPriority ^= _nextPriority << 5;
+    
+    NeighbourhoodTreeNode::Key key(distanceKm, handle);
+    TreePtr lower, higher;
+    Split( move(_root), key, lower, higher );
+    _root = Merge( Merge( move(lower), TreePtr( new NeighbourhoodTreeNode(key, _nextPriority) ) ), move(higher) );
+}
+
+
+void NeighbourhoodIndex::Remove(NodeHandle handle)
+{
+    lock_guard<mutex> lock(_mutex);
+    auto distanceIt = _distances.find(handle);
+    if ( distanceIt == _distances.end() )
+        { return; }
+    Erase( _root, NeighbourhoodTreeNode::Key(distanceIt->second, handle) );
+    _distances.erase(distanceIt);
+}
+
+
+size_t NeighbourhoodIndex::Rank(NodeHandle handle) const
+{
+    lock_guard<mutex> lock(_mutex);
+    auto distanceIt = _distances.find(handle);
+    if ( distanceIt == _distances.end() )
+        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Node handle is not a neighbour: " + to_string(handle)); }
+    
+    NeighbourhoodTreeNode::Key key(distanceIt->second, handle);
+    size_t rank = 0;
+    const NeighbourhoodTreeNode *treeNode = _root.get();
+    while (treeNode != nullptr && treeNode->key != key)
+    {
+        if (key < treeNode->key)
+            { treeNode = treeNode->left.get(); }
+        else
+        {
+            rank += SubtreeSize(treeNode->left) + 1;
+            treeNode = treeNode->right.get();
+        }
+    }
+    if (treeNode == nullptr)
+        { throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Neighbourhood index is inconsistent"); }
+    return rank + SubtreeSize(treeNode->left);
+}
+
+
+Distance NeighbourhoodIndex::DistanceAt(size_t rank) const
+{
+    lock_guard<mutex> lock(_mutex);
+    if ( rank >= SubtreeSize(_root) )
+        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Neighbour rank is out of range: " + to_string(rank)); }
+    
+    const NeighbourhoodTreeNode *treeNode = _root.get();
+    while (true)
+    {
+        size_t leftSize = SubtreeSize(treeNode->left);
+        if (rank == leftSize)
+            { return treeNode->key.distanceKm; }
+        if (rank < leftSize)
+            { treeNode = treeNode->left.get(); }
+        else
+        {
+            rank -= leftSize + 1;
+            treeNode = treeNode->right.get();
+        }
+    }
+}
+
+
+vector<NodeHandle> NeighbourhoodIndex::Ids() const
+{
+    lock_guard<mutex> lock(_mutex);
+    vector<NodeHandle> result;
+    result.reserve( _distances.size() );
+    CollectIds(_root, result);
+    return result;
+}
+
+
+
+const size_t TimingWheel::LEVEL_BITS;
+const size_t TimingWheel::SLOT_COUNT;
+const size_t TimingWheel::LEVEL_COUNT;
+
+
+TimingWheel::TimingWheel(time_t now) :
+    _now(now), _slots(), _overflow(), _due(), _entryCount(0), _deadlines() {}
+
+
+void TimingWheel::Clear()
+{
+    lock_guard<mutex> lock(_mutex);
+    _deadlines.clear();
+    Rebuild();
+}
+
+
+size_t TimingWheel::size() const
+{
+    lock_guard<mutex> lock(_mutex);
+    return _deadlines.size();
+}
+
+
+bool TimingWheel::Set(NodeHandle handle, time_t deadline)
+{
+    lock_guard<mutex> lock(_mutex);
+    auto deadlineIt = _deadlines.find(handle);
+    bool added = deadlineIt == _deadlines.end();
+    if ( ! added && deadlineIt->second == deadline )
+        { return false; }
+    _deadlines[handle] = deadline;
+    Place( Entry{handle, deadline} );
+    
+    // Outdated entries are dropped only when their slot is reached, clean them up if there are too many
+    if ( _entryCount > 2 * _deadlines.size() + SLOT_COUNT )
+        { Rebuild(); }
+    return added;
+}
+
+
+void TimingWheel::Remove(NodeHandle handle)
+{
+    lock_guard<mutex> lock(_mutex);
+    _deadlines.erase(handle);
+}
+
+
+vector<NodeHandle> TimingWheel::Ids() const
+{
+    lock_guard<mutex> lock(_mutex);
+    vector<NodeHandle> result;
+    result.reserve( _deadlines.size() );
+    for (const auto &deadline : _deadlines)
+        { result.push_back(deadline.first); }
+    return result;
+}
+
+
+vector<NodeHandle> TimingWheel::PopDue(time_t now, size_t maxCount)
+{
+    lock_guard<mutex> lock(_mutex);
+    Advance(now);
+    
+    vector<NodeHandle> result;
+    while ( ! _due.empty() && result.size() < maxCount )
+    {
+        Entry entry = _due.back();
+        _due.pop_back();
+        --_entryCount;
+        
+        auto deadlineIt = _deadlines.find(entry.handle);
+        if ( deadlineIt == _deadlines.end() || deadlineIt->second != entry.deadline )
+            { continue; }
+        _deadlines.erase(deadlineIt);
+        result.push_back(entry.handle);
+    }
+    return result;
+}
+
+
+void TimingWheel::Place(const Entry &entry)
+{
+    ++_entryCount;
+    if (entry.deadline <= _now)
+    {
+        _due.push_back(entry);
+        return;
+    }
+    
+    // Use the lowest level where the deadline falls into the current revolution of the level above
+    for (size_t level = 0; level < LEVEL_COUNT; ++level)
+    {
+        size_t shift = LEVEL_BITS * (level + 1);
+        if ( (entry.deadline >> shift) == (_now >> shift) )
+        {
+            size_t slot = (entry.deadline >> (LEVEL_BITS * level)) & (SLOT_COUNT - 1);
+            _slots[level][slot].push_back(entry);
+            return;
+        }
+    }
+    _overflow.push_back(entry);
+}
+
+
+void TimingWheel::Rebuild()
+{
+    for (auto &level : _slots)
+    {
+        for (auto &slot : level)
+            { slot.clear(); }
+    }
+    _overflow.clear();
+    _due.clear();
+    _entryCount = 0;
+    
+    for (const auto &deadline : _deadlines)
+        { Place( Entry{deadline.first, deadline.second} ); }
+}
+
+
+void TimingWheel::Advance(time_t now)
+{
+    if (now <= _now)
+        { return; }
+    
+    // Stepping through a long pause (e.g. a clock adjustment) second by second is slower than starting over
+    if ( now - _now > static_cast<time_t>(SLOT_COUNT * SLOT_COUNT) )
+    {
+        _now = now;
+        Rebuild();
+        return;
+    }
+    
+    auto cascade = [this] (vector<Entry> &entries)
+    {
+        vector<Entry> cascaded;
+        cascaded.swap(entries);
+        _entryCount -= cascaded.size();
+        for (const Entry &entry : cascaded)
+        {
+            auto deadlineIt = _deadlines.find(entry.handle);
+            if ( deadlineIt != _deadlines.end() && deadlineIt->second == entry.deadline )
+                { Place(entry); }
+        }
+    };
+    
+    while (_now < now)
+    {
+        ++_now;
+        
+        // Entries of higher levels are redistributed when the time reaches their slot, topmost level first
+        if ( ( _now & ( (static_cast<time_t>(1) << (LEVEL_BITS * LEVEL_COUNT)) - 1 ) ) == 0 )
+            { cascade(_overflow); }
+        for (size_t level = LEVEL_COUNT - 1; level > 0; --level)
+        {
+            if ( ( _now & ( (static_cast<time_t>(1) << (LEVEL_BITS * level)) - 1 ) ) == 0 )
+                { cascade( _slots[level][ (_now >> (LEVEL_BITS * level)) & (SLOT_COUNT - 1) ] ); }
+        }
+        cascade( _slots[0][ _now & (SLOT_COUNT - 1) ] );
+    }
+}
+
+
+
+// NOTE SQLite works fine without this as sqlite3_open also calls init()
+// struct StaticDatabaseInitializer {
+//     StaticDatabaseInitializer() {
+//         if ( sqlite3_initialize() != SQLITE_OK )
+//             { throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to initialize SQLite environment"); }
+//     }
+// };
+// 
+// StaticDatabaseInitializer SqlLiteInitializer;
+
+
+
+bool FileExist(const string &fileName)
+{
+    ifstream fileStream(fileName);
+    return fileStream.good();
+}
+
+
+
+bool ColumnExists(sqlite3 *dbHandle, const string &table, const string &column)
+{
+    sqlite3_stmt *statement = nullptr;
+    if ( sqlite3_prepare_v2( dbHandle, ( "PRAGMA table_info(" + table + ")" ).c_str(), -1, &statement, nullptr ) != SQLITE_OK )
+    {
+        LOG(ERROR) << "Failed to query columns of table " << table;
+        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to query table columns");
+    }
+    scope_exit finalize( [statement] { sqlite3_finalize(statement); } );
+    
+    // NOTE column 1 of the result is the column name
+    while ( sqlite3_step(statement) == SQLITE_ROW )
+    {
+        if ( column == reinterpret_cast<const char*>( sqlite3_column_text(statement, 1) ) )
+            { return true; }
+    }
+    return false;
+}
+
+
+
+void ExecuteSql(sqlite3 *dbHandle, const string &sql)
+{
+    char *errorMessage = nullptr;
+    int execResult = sqlite3_exec( dbHandle, sql.c_str(), nullptr, nullptr, &errorMessage );
+    scope_exit freeMsg( [&errorMessage] { sqlite3_free(errorMessage); } );
+    if (execResult != SQLITE_OK)
+    {
+        LOG(ERROR) << "Failed to execute command: " << sql;
+        LOG(ERROR) << "Error was: " << errorMessage;
+        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, errorMessage);
+    }
+}
+
+
+// void QuerySql(sqlite3 *dbHandle, const string &queryStr)
+// {
+//     char **results;
+//     int rows;
+//     int columns;
+//     char *errorMessage;
+//     int execResult = sqlite3_get_table( dbHandle, queryStr.c_str(), &results, &rows, &columns, &errorMessage );
+//     scope_error freeMsg( [errorMessage] { sqlite3_free(errorMessage); } );
+//     if (execResult != SQLITE_OK)
+//     {
+//         LOG(ERROR) << "Failed to query neighbours by distance: " << errorMessage;
+//         throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, errorMessage);
+//     }
+//     
+//     scope_exit freeMsg( [results] { sqlite3_free_table(results); } );
+// }
+
+
+
+CachedStatement::CachedStatement(StatementCache *cache, vector<sqlite3_stmt*> *pool, sqlite3_stmt *statement) :
+    _cache(cache), _pool(pool), _statement(statement) {}
+
+CachedStatement::CachedStatement(CachedStatement &&other) :
+    _cache(other._cache), _pool(other._pool), _statement(other._statement)
+    { other._statement = nullptr; }
+
+CachedStatement::~CachedStatement()
+{
+    if (_statement != nullptr)
+        { _cache->Release(_pool, _statement); }
+}
+
+CachedStatement::operator sqlite3_stmt*() const
+    { return _statement; }
+
+
+
+StatementCache::StatementCache(sqlite3 *dbHandle) :
+    _dbHandle(dbHandle), _hitCount(0), _missCount(0) {}
+
+StatementCache::~StatementCache()
+{
+    lock_guard<mutex> lock(_mutex);
+    for (auto &poolEntry : _idleStatements)
+    {
+        for (sqlite3_stmt *statement : poolEntry.second)
+            { sqlite3_finalize(statement); }
+    }
+}
+
+
+CachedStatement StatementCache::Prepare(const string &sql)
+{
+    lock_guard<mutex> lock(_mutex);
+    // NOTE references to map elements stay valid even if the map is rehashed
+    vector<sqlite3_stmt*> &pool = _idleStatements[sql];
+    if ( ! pool.empty() )
+    {
+        ++_hitCount;
+        sqlite3_stmt *statement = pool.back();
+        pool.pop_back();
+        return CachedStatement(this, &pool, statement);
+    }
+    
+    ++_missCount;
+    sqlite3_stmt *statement = nullptr;
+    int prepResult = sqlite3_prepare_v2( _dbHandle, sql.c_str(), -1, &statement, nullptr );
+    if (prepResult != SQLITE_OK)
+    {
+        LOG(ERROR) << "Failed to prepare statement: " << sql;
+        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to prepare statement");
+    }
+    return CachedStatement(this, &pool, statement);
+}
+
+
+void StatementCache::Release(vector<sqlite3_stmt*> *pool, sqlite3_stmt *statement)
+{
+    // NOTE reset() repeats the error code of a failed step(), but the statement can be still reused
+    sqlite3_reset(statement);
+    sqlite3_clear_bindings(statement);
+    
+    lock_guard<mutex> lock(_mutex);
+    pool->push_back(statement);
+}
+
+
+size_t StatementCache::hitCount() const
+{
+    lock_guard<mutex> lock(_mutex);
+    return _hitCount;
+}
+
+size_t StatementCache::missCount() const
+{
+    lock_guard<mutex> lock(_mutex);
+    return _missCount;
+}
+
 
-NodeDbEntry::NodeDbEntry( const NodeInfo& info,
-                          NodeRelationType relationType, NodeContactRoleType roleType) :
-    NodeInfo(info), _relationType(relationType), _roleType(roleType) {}
 
+// SQL function GeodesicDistanceKm(longitude1, latitude1, longitude2, latitude2) using the same native
+// implementation as GetDistanceKm(), so distances in queries match the ones measured in code.
+// Argument order follows MakePoint(), the distance model to be used is passed as user data.
+void GeodesicDistanceSqlFunction(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    if (argc != 4)
+    {
+        sqlite3_result_error(context, "GeodesicDistanceKm() needs 4 arguments", -1);
+        return;
+    }
+    for (int argIdx = 0; argIdx < argc; ++argIdx)
+    {
+        if ( sqlite3_value_type(argv[argIdx]) == SQLITE_NULL )
+        {
+            sqlite3_result_null(context);
+            return;
+        }
+    }
+    
+    const DistanceModel *model = static_cast<const DistanceModel*>( sqlite3_user_data(context) );
+    double distance = GeodesicDistanceKm(
+        sqlite3_value_double(argv[1]), sqlite3_value_double(argv[0]),
+        sqlite3_value_double(argv[3]), sqlite3_value_double(argv[2]), *model );
+    sqlite3_result_double(context, distance);
+}
 
-NodeRelationType NodeDbEntry::relationType() const { return _relationType; }
-NodeContactRoleType NodeDbEntry::roleType() const { return _roleType; }
 
 
-bool NodeDbEntry::operator==(const NodeDbEntry &other) const
+void BindLocation(sqlite3_stmt *statement, int longitudeParamIdx, const GpsLocation &location)
 {
-    return  NodeInfo::operator==(other) &&
-            _relationType == other._relationType &&
-            _roleType == other._roleType;
+    if ( sqlite3_bind_double( statement, longitudeParamIdx,     location.longitude() ) != SQLITE_OK ||
+         sqlite3_bind_double( statement, longitudeParamIdx + 1, location.latitude() )  != SQLITE_OK )
+    {
+        LOG(ERROR) << "Failed to bind location params";
+        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to bind location params");
+    }
 }
 
-bool NodeDbEntry::operator!=(const NodeDbEntry &other) const
-    { return ! operator==(other); }
 
 
+LockWaitCounter::LockWaitCounter() :
+    _acquireCount(0), _waitCount(0), _waitMicroseconds(0) {}
 
-void ThreadSafeChangeListenerRegistry::AddListener(shared_ptr<IChangeListener> listener)
+
+void LockWaitCounter::Record(chrono::steady_clock::duration waitTime)
 {
-    lock_guard<mutex> lock(_mutex);
-    if (listener == nullptr)
-        { throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Attempt to register listener instance null"); }
-    
-    if ( _listeners.find( listener->sessionId() ) != _listeners.end() )
+    ++_acquireCount;
+    if ( waitTime > chrono::steady_clock::duration::zero() )
     {
-        LOG(DEBUG) << "Session already have a registered listener, ignore request to add new one";
-        return;
+        ++_waitCount;
+        _waitMicroseconds += chrono::duration_cast<chrono::microseconds>(waitTime).count();
     }
-    
-    _listeners[ listener->sessionId() ] = listener;
-    listener->OnRegistered();
-    LOG(DEBUG) << "Registered ChangeListener for session " << listener->sessionId();
 }
 
 
-void ThreadSafeChangeListenerRegistry::RemoveListener(const SessionId& sessionId)
+DbLockStats LockWaitCounter::stats() const
+    { return DbLockStats{ _acquireCount, _waitCount, chrono::microseconds(_waitMicroseconds) }; }
+
+
+
+// SpatiaLite initialization/shutdown sequence is documented here:
+// https://groups.google.com/forum/#!msg/spatialite-users/83SOajOJ2JU/sgi5fuYAVVkJ
+SpatiaLiteConnection::SpatiaLiteConnection(const string &dbPath, int openFlags) :
+    _dbHandle(nullptr), _spatialiteConnection(nullptr)
 {
-    lock_guard<mutex> lock(_mutex);
-    _listeners.erase(sessionId);
-    LOG(DEBUG) << "Deregistered ChangeListener for session " << sessionId;
+    // NOTE nullptr: no VFS module to use
+    int openResult = sqlite3_open_v2( dbPath.c_str(), &_dbHandle, openFlags, nullptr );
+    if (openResult != SQLITE_OK)
+    {
+        LOG(ERROR) << "Failed to open/create SpatiaLite database file " << dbPath;
+        sqlite3_close(_dbHandle);
+        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to open SpatiaLite database");
+    }
+    scope_error closeDbOnError( [this] { _statements.reset(); sqlite3_close(_dbHandle); } );
+    _statements.reset( new StatementCache(_dbHandle) );
+    
+#ifndef _WIN32
+    _spatialiteConnection = spatialite_alloc_connection();
+    spatialite_init_ex(_dbHandle, _spatialiteConnection, 0);
+    scope_error cleanupOnError( [this] { spatialite_cleanup_ex(_spatialiteConnection); } );
+#else
+    sqlite3_enable_load_extension(_dbHandle, 1);
+    sqlite3_load_extension(_dbHandle, "mod_spatialite", nullptr, nullptr);
+#endif
+    
+    if ( sqlite3_create_function_v2( _dbHandle, "GeodesicDistanceKm", 4, SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+            const_cast<DistanceModel*>(&NODE_DISTANCE_MODEL), GeodesicDistanceSqlFunction,
+            nullptr, nullptr, nullptr ) != SQLITE_OK )
+    {
+        LOG(ERROR) << "Failed to register distance function: " << sqlite3_errmsg(_dbHandle);
+        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to register distance function");
+    }
 }
 
 
-vector<shared_ptr<IChangeListener>> ThreadSafeChangeListenerRegistry::listeners() const
+SpatiaLiteConnection::~SpatiaLiteConnection()
 {
-    lock_guard<mutex> lock(_mutex);
-    vector<shared_ptr<IChangeListener>> result;
-    for (const auto &listenerEntry : _listeners)
-        { result.push_back(listenerEntry.second); }
-    //LOG(DEBUG) << "Listener count " << result.size();
-    return result;
+    _statements.reset();
+    sqlite3_close(_dbHandle);
+#ifndef _WIN32
+    spatialite_cleanup_ex(_spatialiteConnection);
+#endif
+    // TODO there is no free cache function in current version despite description
+    // spatialite_free_internal_cache();
+    // TODO is this needed?
+    //spatialite_shutdown();
 }
 
 
+sqlite3* SpatiaLiteConnection::handle() const
+    { return _dbHandle; }
 
-
-// NOTE SQLite works fine without this as sqlite3_open also calls init()
-// struct StaticDatabaseInitializer {
-//     StaticDatabaseInitializer() {
-//         if ( sqlite3_initialize() != SQLITE_OK )
-//             { throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to initialize SQLite environment"); }
-//     }
-// };
-// 
-// StaticDatabaseInitializer SqlLiteInitializer;
+StatementCache& SpatiaLiteConnection::statements() const
+    { return *_statements; }
 
 
 
-bool FileExist(const string &fileName)
+// Coordinate ranges in degrees that contain all points within a radius of a given center.
+// Areas crossing the antimeridian are split into two longitude ranges, otherwise both ranges are the same.
+struct SearchArea
 {
-    ifstream fileStream(fileName);
-    return fileStream.good();
-}
-
+    double minLatitude;
+    double maxLatitude;
+    double minLongitude1;
+    double maxLongitude1;
+    double minLongitude2;
+    double maxLongitude2;
+};
 
 
-void ExecuteSql(sqlite3 *dbHandle, const string &sql)
+SearchArea GetSearchArea(const GpsLocation &center, Distance radiusKm)
 {
-    char *errorMessage = nullptr;
-    int execResult = sqlite3_exec( dbHandle, sql.c_str(), nullptr, nullptr, &errorMessage );
-    scope_exit freeMsg( [&errorMessage] { sqlite3_free(errorMessage); } );
-    if (execResult != SQLITE_OK)
+    // Overestimate the angular radius with the polar (i.e. smallest) Earth radius and an additional
+    // tolerance, so the spherical approximation cannot miss points measured on the ellipsoid
+    static const double POLAR_EARTH_RADIUS_KM = 6356.752;
+    static const double TOLERANCE_RATE = 1.01;
+    static const double DEGREES_PER_RADIAN = 180. / M_PI;
+    
+    double angle = radiusKm * TOLERANCE_RATE / POLAR_EARTH_RADIUS_KM;
+    double latitude = center.latitude() / DEGREES_PER_RADIAN;
+    double minLatitude = latitude - angle;
+    double maxLatitude = latitude + angle;
+    
+    SearchArea area;
+    if ( minLatitude <= -M_PI / 2 || M_PI / 2 <= maxLatitude )
     {
-        LOG(ERROR) << "Failed to execute command: " << sql;
-        LOG(ERROR) << "Error was: " << errorMessage;
-        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, errorMessage);
+        // Area contains a pole, so it covers all longitudes
+        area.minLatitude = max(minLatitude, -M_PI / 2) * DEGREES_PER_RADIAN;
+        area.maxLatitude = min(maxLatitude,  M_PI / 2) * DEGREES_PER_RADIAN;
+        area.minLongitude1 = area.minLongitude2 = -180.;
+        area.maxLongitude1 = area.maxLongitude2 =  180.;
+        return area;
+    }
+    
+    // NOTE argument of asin() is below 1 here because the area does not reach the poles
+    double longitudeDelta = asin( sin(angle) / cos(latitude) ) * DEGREES_PER_RADIAN;
+    double minLongitude = center.longitude() - longitudeDelta;
+    double maxLongitude = center.longitude() + longitudeDelta;
+    
+    area.minLatitude = minLatitude * DEGREES_PER_RADIAN;
+    area.maxLatitude = maxLatitude * DEGREES_PER_RADIAN;
+    area.minLongitude1 = area.minLongitude2 = minLongitude;
+    area.maxLongitude1 = area.maxLongitude2 = maxLongitude;
+    if (minLongitude < -180.)
+    {
+        area.minLongitude1 = -180.;
+        area.minLongitude2 = minLongitude + 360.;
+        area.maxLongitude2 = 180.;
+    }
+    else if (180. < maxLongitude)
+    {
+        area.maxLongitude1 = 180.;
+        area.minLongitude2 = -180.;
+        area.maxLongitude2 = maxLongitude - 360.;
     }
+    return area;
 }
 
 
-// void QuerySql(sqlite3 *dbHandle, const string &queryStr)
-// {
-//     char **results;
-//     int rows;
-//     int columns;
-//     char *errorMessage;
-//     int execResult = sqlite3_get_table( dbHandle, queryStr.c_str(), &results, &rows, &columns, &errorMessage );
-//     scope_error freeMsg( [errorMessage] { sqlite3_free(errorMessage); } );
-//     if (execResult != SQLITE_OK)
-//     {
-//         LOG(ERROR) << "Failed to query neighbours by distance: " << errorMessage;
-//         throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, errorMessage);
-//     }
-//     
-//     scope_exit freeMsg( [results] { sqlite3_free_table(results); } );
-// }
 
+vector<NodeDbEntry> SpatiaLiteDatabase::QueryEntries(const GpsLocation &fromLocation,
+    const string &whereCondition, const string orderBy, const string &limit,
+    ParamBinder bindParams, ServiceDetails details) const
+{
+    vector<NodeDbEntry> result;
+    VisitEntries( [&result] (NodeDbEntry &entry)
+        { result.push_back( move(entry) ); return true; },
+        fromLocation, whereCondition, orderBy, limit, bindParams, details );
+    return result;
+}
 
 
-string LocationPointSql(const GpsLocation &location)
+bool SpatiaLiteDatabase::VisitEntries(const EntryConsumer &consumer, const GpsLocation &fromLocation,
+    const string &whereCondition, const string orderBy, const string &limit,
+    ParamBinder bindParams, ServiceDetails details) const
 {
-    // NOTE int-based numbers, no string or user input, so no SQL injection vulnerability
-    return string( "MakePoint(" +
-        to_string( location.longitude() ) + "," + 
-        to_string( location.latitude()  ) + ")" );
+    ReadLease reader = LeaseReader();
+    return VisitEntries( reader.statements(), consumer, fromLocation,
+        whereCondition, orderBy, limit, bindParams, details );
 }
 
 
-
-vector<NodeDbEntry> SpatiaLiteDatabase::QueryEntries(const GpsLocation &fromLocation,
-    const string &whereCondition, const string orderBy, const string &limit) const
+bool SpatiaLiteDatabase::VisitEntries(StatementCache &statements, const EntryConsumer &consumer,
+    const GpsLocation &fromLocation, const string &whereCondition, const string orderBy, const string &limit,
+    ParamBinder bindParams, ServiceDetails details) const
 {
-    sqlite3_stmt *statement;
     string queryStr =
         "SELECT id, ipAddress, nodePort, clientPort, X(location), Y(location), "
             "relationType, roleType, expiresAt, "
-            "Distance(location, " + LocationPointSql(fromLocation) + ", 1) / 1000 AS dist_km "
+            "GeodesicDistanceKm(X(location), Y(location), ?1, ?2) AS dist_km "
         "FROM nodes " +
         whereCondition + " " +
         orderBy + " " +
@@ -201,16 +1092,16 @@ vector<NodeDbEntry> SpatiaLiteDatabase::QueryEntries(const GpsLocation &fromLoca
     
     //LOG(DEBUG) << "Running query: " << queryStr;
     
-    int prepResult = sqlite3_prepare_v2( _dbHandle, queryStr.c_str(), -1, &statement, nullptr );
-    if (prepResult != SQLITE_OK)
-    {
-        LOG(ERROR) << "Failed to prepare statement: " << queryStr;
-        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to prepare statement to get neighbourhood");
-    }
-
-    scope_exit finalizeStmt( [&statement] { sqlite3_finalize(statement); } );
+    CachedStatement statement = statements.Prepare(queryStr);
+    BindLocation(statement, 1, fromLocation);
+    if (bindParams)
+        { bindParams(statement); }
     
-    vector<NodeDbEntry> result;
+    // NOTE without services rows can be passed on immediately, otherwise they are collected
+    //      to load services of several nodes with a single query
+    size_t chunkSize = details == ServiceDetails::Included ? NODE_QUERY_BATCH_SIZE : 1;
+    vector<NodeDbEntry> chunk;
+    chunk.reserve(chunkSize);
     while ( sqlite3_step(statement) == SQLITE_ROW )
     {
         const uint8_t *idPtr        = sqlite3_column_text  (statement, 0);
@@ -225,169 +1116,291 @@ vector<NodeDbEntry> SpatiaLiteDatabase::QueryEntries(const GpsLocation &fromLoca
         
         NodeContact contact( reinterpret_cast<const char*>(ipAddrPtr),
                              static_cast<TcpPort>(nodePort), static_cast<TcpPort>(clientPort) );
-        string nodeId( reinterpret_cast<const char*>(idPtr) );
-        NodeInfo::Services services = LoadServices(nodeId);
-        NodeInfo info( nodeId, GpsLocation(latitude, longitude), contact, services );
-        result.emplace_back( info,
+        NodeInfo info( reinterpret_cast<const char*>(idPtr), GpsLocation(latitude, longitude), move(contact), NodeInfo::Services() );
+        chunk.emplace_back( move(info),
             // TODO use some kind of checked conversion function from int to enums
             static_cast<NodeRelationType>(relationType),
             static_cast<NodeContactRoleType>(roleType) );
+        
+        if ( chunk.size() >= chunkSize )
+        {
+            if ( ! VisitChunk( consumer, statements, chunk, details ) )
+                { return false; }
+            chunk.clear();
+        }
     }
     
-    return result;
+    return VisitChunk( consumer, statements, chunk, details );
 }
 
 
-// SpatiaLite initialization/shutdown sequence is documented here:
-// https://groups.google.com/forum/#!msg/spatialite-users/83SOajOJ2JU/sgi5fuYAVVkJ
-SpatiaLiteDatabase::SpatiaLiteDatabase( const NodeInfo& myNodeInfo, const string &dbPath,
-                                        chrono::duration<uint32_t> entryExpirationPeriod ) :
-    _myNodeInfo(myNodeInfo), _dbHandle(nullptr), _entryExpirationPeriod(entryExpirationPeriod)
+bool SpatiaLiteDatabase::VisitChunk(const EntryConsumer &consumer, StatementCache &statements,
+    vector<NodeDbEntry> &chunk, ServiceDetails details) const
 {
-    _spatialiteConnection = spatialite_alloc_connection();
-    
-    bool creatingDb = ! FileExist(dbPath);
-    
-    // TODO SQLITE_OPEN_FULLMUTEX performs operations sequentially using a mutex.
-    //      We might have to change to a more performant but more complicated model here.
-    int openResult = sqlite3_open_v2 ( dbPath.c_str(), &_dbHandle,
-         SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX | SQLITE_OPEN_URI, nullptr); // nullptr: no vFS module to use
-    if (openResult != SQLITE_OK)
+    if ( details == ServiceDetails::Included && ! chunk.empty() )
     {
-        LOG(ERROR) << "Failed to open/create SpatiaLite database file " << dbPath;
-        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to open SpatiaLite database");
+        vector<NodeId> nodeIds;
+        nodeIds.reserve( chunk.size() );
+        for (const auto &entry : chunk)
+            { nodeIds.push_back( entry.id() ); }
+        
+        unordered_map<NodeId, NodeInfo::Services> services = LoadServices(statements, nodeIds);
+        for (auto &entry : chunk)
+        {
+            auto servicesIt = services.find( entry.id() );
+            if ( servicesIt != services.end() )
+                { entry.services() = move(servicesIt->second); }
+        }
     }
-    scope_error closeDbOnError( [this] { sqlite3_close(_dbHandle); } );
     
-#ifndef _WIN32
-    spatialite_init_ex(_dbHandle, _spatialiteConnection, 0);
-    scope_error cleanupOnError( [this] { spatialite_cleanup_ex(_spatialiteConnection); } );
-#else
-    sqlite3_enable_load_extension(_dbHandle, 1);
-    sqlite3_load_extension(_dbHandle, "mod_spatialite", nullptr, nullptr);
-#endif
+    for (auto &entry : chunk)
+    {
+        if ( ! consumer(entry) )
+            { return false; }
+    }
+    return true;
+}
+
 
+SpatiaLiteDatabase::SpatiaLiteDatabase( const NodeInfo& myNodeInfo, const string &dbPath,
+                                        chrono::duration<uint32_t> entryExpirationPeriod,
+                                        DbDurability durability ) :
+    _myNode( make_shared<const NodeDbEntry>( NodeDbEntry::FromSelfInfo(myNodeInfo) ) ), _dbPath(dbPath), _entryExpirationPeriod(entryExpirationPeriod),
+    _expirations( chrono::system_clock::to_time_t( chrono::system_clock::now() ) ),
+    _writerThread( thread::id() ), _writerLockDepth(0), _lastExpirationDuration(0)
+{
+    bool creatingDb = ! FileExist(dbPath);
+    
+    // NOTE connections are used by a single thread at a time, serialized by our own locks,
+    //      so SQLite does not need to lock them again
+    _writer.reset( new SpatiaLiteConnection( dbPath,
+        SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX | SQLITE_OPEN_URI ) );
+    
+    // Each connection to a memory or temporary database sees a separate database, so all reads must use the writer
+    bool sharedDb = dbPath != IN_MEMORY_DB && dbPath != TEMPORARY_DB &&
+        dbPath.find("mode=memory") == string::npos;
+    _maxReaders = sharedDb ? max( 1u, thread::hardware_concurrency() ) : 0;
+    
     LOG(TRACE) << "SQLite version: " << sqlite3_libversion();
     LOG(TRACE) << "SpatiaLite version: " << spatialite_version();
     
+    // Write ahead log needs only a single sync per transaction and does not block readers while writing
+    ExecuteSql(_writer->handle(), "PRAGMA journal_mode=WAL;");
+    ExecuteSql(_writer->handle(), "PRAGMA synchronous=" + to_string( static_cast<int>(durability) ) + ";");
+    
     if (creatingDb)
     {
         LOG(INFO) << "No SpatiaLite database found, generating: " << dbPath;
         for (const string &command : DatabaseInitCommands)
-            { ExecuteSql(_dbHandle, command); }
+            { ExecuteSql(_writer->handle(), command); }
         LOG(INFO) << "Database initialized";
     }
     
+    // NOTE columns cannot be added conditionally in SQL, so check and add them here
+    bool addingSelfDistance = ! ColumnExists( _writer->handle(), "nodes", "selfDistanceKm" );
+    if (addingSelfDistance)
+    {
+        LOG(INFO) << "Adding distance from self to stored nodes";
+        ExecuteSql( _writer->handle(), "ALTER TABLE nodes ADD COLUMN selfDistanceKm REAL;" );
+        ExecuteSql( _writer->handle(), UpdateSelfDistancesCommand );
+    }
+    
+    for (const string &command : DatabaseUpgradeCommands)
+        { ExecuteSql(_writer->handle(), command); }
+    
+    ReloadNodeCounts();
+    ReloadNodeIds();
+    ReloadNeighbourhood();
+    
     LOG(DEBUG) << "Updating node information in database";
-    vector<NodeDbEntry> selfEntries = QueryEntries( _myNodeInfo.location(),
-        "WHERE relationType = " + to_string( static_cast<uint32_t>(NodeRelationType::Self) ) );
+    vector<NodeDbEntry> selfEntries = QueryEntries( myNodeInfo.location(),
+        "WHERE relationType = " + to_string( static_cast<uint32_t>(NodeRelationType::Self) ),
+        "", "", ParamBinder(), ServiceDetails::Excluded );
     if ( selfEntries.size() > 1 )
         { throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Multiple self instances found, database may have been tampered with."); }
-    if ( ! selfEntries.empty() && selfEntries.front().id() != _myNodeInfo.id() )
+    if ( ! selfEntries.empty() && selfEntries.front().id() != myNodeInfo.id() )
         { throw LocationNetworkError(ErrorCode::ERROR_BAD_STATE, "Node id changed, database is invalidated. Delete database file " +
             dbPath + " to force signing up to the network with the new node id."); }
     
-    if ( selfEntries.empty() )  { Store ( NodeDbEntry::FromSelfInfo(_myNodeInfo), false ); }
-    else                        { Update( NodeDbEntry::FromSelfInfo(_myNodeInfo), false ); }
+    if ( selfEntries.empty() )  { Store ( NodeDbEntry::FromSelfInfo(myNodeInfo), false ); }
+    else                        { Update( NodeDbEntry::FromSelfInfo(myNodeInfo), false ); }
     LOG(DEBUG) << "Database ready with node count: " << GetNodeCount();
 }
 
 
 SpatiaLiteDatabase::~SpatiaLiteDatabase()
 {
-    sqlite3_close (_dbHandle);
-#ifndef _WIN32
-    spatialite_cleanup_ex(_spatialiteConnection);
-#endif
-    // TODO there is no free cache function in current version despite description
-    // spatialite_free_internal_cache();
-    // TODO is this needed?
-    //spatialite_shutdown();
+    // NOTE readers must be closed first, the last connection closed checkpoints and removes the write ahead log
+    _idleReaders.clear();
+    _readers.clear();
+    _writer.reset();
+    
+    for ( NodeHandle handle : _nodeIds.Ids() )
+        { NodeIdTable::Instance().Release(handle); }
 }
 
 
 IChangeListenerRegistry& SpatiaLiteDatabase::changeListenerRegistry()
     { return _listenerRegistry; }
 
+const StatementCache& SpatiaLiteDatabase::statementCache() const
+    { return _writer->statements(); }
 
+DbLockStats SpatiaLiteDatabase::writerLockStats() const
+    { return _writerLockWaits.stats(); }
 
+DbLockStats SpatiaLiteDatabase::readerLockStats() const
+    { return _readerLockWaits.stats(); }
 
-Distance SpatiaLiteDatabase::GetDistanceKm(const GpsLocation &one, const GpsLocation &other) const
-{
-    sqlite3_stmt *statement;
-    string queryStr(
-        "SELECT Distance(" +
-            LocationPointSql(one) + "," +
-            LocationPointSql(other) + "," +
-            "1" // Needed for GPS distance, without this SpatiaLite calculates only Euclidean distance
-        ") / 1000 AS dist_km;" );
-            
-    int prepResult = sqlite3_prepare_v2( _dbHandle, queryStr.c_str(), -1, &statement, nullptr );
-    if (prepResult != SQLITE_OK)
-    {
-        LOG(ERROR) << "Failed to prepare statement: " << queryStr;
-        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to prepare statement for distance measurement");
-    }
 
-    scope_exit finalizeStmt( [&statement] { sqlite3_finalize(statement); } );
-    
-    if ( sqlite3_step(statement) != SQLITE_ROW )
+
+void SpatiaLiteDatabase::LockWriter() const
+{
+    if ( _writeMutex.try_lock() )
+        { _writerLockWaits.Record( chrono::steady_clock::duration::zero() ); }
+    else
     {
-        LOG(ERROR) << "Failed to run distance query";
-        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to run distance query");
+        auto waitStart = chrono::steady_clock::now();
+        _writeMutex.lock();
+        _writerLockWaits.Record( chrono::steady_clock::now() - waitStart );
     }
     
-    double result = sqlite3_column_double(statement, 0);
-    return result;
+    if (_writerLockDepth++ == 0)
+        { _writerThread = this_thread::get_id(); }
+}
+
+
+void SpatiaLiteDatabase::UnlockWriter() const
+{
+    if (--_writerLockDepth == 0)
+        { _writerThread = thread::id(); }
+    _writeMutex.unlock();
 }
 
 
 
-// TODO now that we have services in a different table, probably all methods should change
-// to use transactions where node and related service entries are updated together
-NodeInfo::Services SpatiaLiteDatabase::LoadServices(const NodeId& nodeId) const
+SpatiaLiteDatabase::ReadLease::ReadLease(const SpatiaLiteDatabase *db, SpatiaLiteConnection *connection, bool pooled) :
+    _db(db), _connection(connection), _pooled(pooled) {}
+
+SpatiaLiteDatabase::ReadLease::ReadLease(ReadLease &&other) :
+    _db(other._db), _connection(other._connection), _pooled(other._pooled)
+    { other._connection = nullptr; }
+
+SpatiaLiteDatabase::ReadLease::~ReadLease()
 {
-    sqlite3_stmt *statement;
-    string queryStr =
-        "SELECT serviceType, port, data "
-        "FROM services WHERE nodeId=?";
+    if (_connection != nullptr)
+        { _db->ReleaseReader(_connection, _pooled); }
+}
+
+StatementCache& SpatiaLiteDatabase::ReadLease::statements() const
+    { return _connection->statements(); }
+
+
+SpatiaLiteDatabase::ReadLease SpatiaLiteDatabase::LeaseReader() const
+{
+    // NOTE only the thread holding the writer lock can find its own id here
+    if ( _maxReaders == 0 || _writerThread == this_thread::get_id() )
+    {
+        LockWriter();
+        return ReadLease(this, _writer.get(), false);
+    }
     
-    int prepResult = sqlite3_prepare_v2( _dbHandle, queryStr.c_str(), -1, &statement, nullptr );
-    if (prepResult != SQLITE_OK)
+    unique_lock<mutex> lock(_readerMutex);
+    if ( _idleReaders.empty() && _readers.size() < _maxReaders )
     {
-        LOG(ERROR) << "Failed to prepare statement: " << queryStr;
-        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to prepare statement to load services");
+        _readers.emplace_back( new SpatiaLiteConnection( _dbPath,
+            SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX | SQLITE_OPEN_URI ) );
+        _idleReaders.push_back( _readers.back().get() );
     }
     
-    scope_exit finalizeStmt( [&statement] { sqlite3_finalize(statement); } );
+    if ( _idleReaders.empty() )
+    {
+        auto waitStart = chrono::steady_clock::now();
+        _readerReleased.wait( lock, [this] { return ! _idleReaders.empty(); } );
+        _readerLockWaits.Record( chrono::steady_clock::now() - waitStart );
+    }
+    else { _readerLockWaits.Record( chrono::steady_clock::duration::zero() ); }
     
-    if ( sqlite3_bind_text( statement, 1, nodeId.c_str(), -1, SQLITE_STATIC ) != SQLITE_OK )
+    SpatiaLiteConnection *connection = _idleReaders.back();
+    _idleReaders.pop_back();
+    return ReadLease(this, connection, true);
+}
+
+
+void SpatiaLiteDatabase::ReleaseReader(SpatiaLiteConnection *connection, bool pooled) const
+{
+    if (! pooled)
     {
-        LOG(ERROR) << "Failed to bind LoadServices query node id param";
-        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to bind LoadServices query node id param");
+        UnlockWriter();
+        return;
     }
     
-    NodeInfo::Services services;
-    while ( sqlite3_step(statement) == SQLITE_ROW )
     {
-        const uint8_t *serviceTypePtr = sqlite3_column_text(statement, 0);
-        std::string serviceType( reinterpret_cast<const char*>(serviceTypePtr) );
-        int port = sqlite3_column_int(statement, 1);
+        lock_guard<mutex> lock(_readerMutex);
+        _idleReaders.push_back(connection);
+    }
+    _readerReleased.notify_one();
+}
+
+
+
+
+Distance SpatiaLiteDatabase::GetDistanceKm(const GpsLocation &one, const GpsLocation &other) const
+    { return GeodesicDistanceKm(one, other, NODE_DISTANCE_MODEL); }
 
-        string data;
-        if ( sqlite3_column_type(statement, 2) == SQLITE_BLOB )
+
+
+// TODO now that we have services in a different table, probably all methods should change
+// to use transactions where node and related service entries are updated together
+unordered_map<NodeId, NodeInfo::Services> SpatiaLiteDatabase::LoadServices(
+    StatementCache &statements, const vector<NodeId> &nodeIds) const
+{
+    // Services of several nodes are loaded at once, unused parameters of the last batch are left NULL
+    static const string queryStr = [] {
+        string placeholders;
+        for (size_t idx = 0; idx < SERVICE_QUERY_BATCH_SIZE; ++idx)
+            { placeholders += idx == 0 ? "?" : ", ?"; }
+        return "SELECT nodeId, serviceType, port, data "
+               "FROM services WHERE nodeId IN (" + placeholders + ")";
+    }();
+    
+    unordered_map<NodeId, NodeInfo::Services> result;
+    for (size_t batchStart = 0; batchStart < nodeIds.size(); batchStart += SERVICE_QUERY_BATCH_SIZE)
+    {
+        CachedStatement statement = statements.Prepare(queryStr);
+        
+        size_t batchEnd = min( nodeIds.size(), batchStart + SERVICE_QUERY_BATCH_SIZE );
+        for (size_t idx = batchStart; idx < batchEnd; ++idx)
         {
-            int dataBytesCnt = sqlite3_column_bytes(statement, 2);
-            const void *dataBytes  = sqlite3_column_blob(statement, 2);
-            if ( dataBytes != nullptr && dataBytesCnt > 0 )
-                { data = string( reinterpret_cast<const char*>(dataBytes), dataBytesCnt ); }
+            if ( sqlite3_bind_text( statement, idx - batchStart + 1, nodeIds[idx].c_str(), -1, SQLITE_STATIC ) != SQLITE_OK )
+            {
+                LOG(ERROR) << "Failed to bind LoadServices query node id param";
+                throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to bind LoadServices query node id param");
+            }
         }
         
-        ServiceInfo service( serviceType, port, data );
-        services[ service.type() ] = service;
+        while ( sqlite3_step(statement) == SQLITE_ROW )
+        {
+            const uint8_t *nodeIdPtr = sqlite3_column_text(statement, 0);
+            const uint8_t *serviceTypePtr = sqlite3_column_text(statement, 1);
+            std::string serviceType( reinterpret_cast<const char*>(serviceTypePtr) );
+            int port = sqlite3_column_int(statement, 2);
+
+            string data;
+            if ( sqlite3_column_type(statement, 3) == SQLITE_BLOB )
+            {
+                int dataBytesCnt = sqlite3_column_bytes(statement, 3);
+                const void *dataBytes  = sqlite3_column_blob(statement, 3);
+                if ( dataBytes != nullptr && dataBytesCnt > 0 )
+                    { data = string( reinterpret_cast<const char*>(dataBytes), dataBytesCnt ); }
+            }
+            
+            NodeInfo::Services &services = result[ reinterpret_cast<const char*>(nodeIdPtr) ];
+            services.Set( ServiceInfo( serviceType, port, move(data) ) );
+        }
     }
     
-    return services;
+    return result;
 }
 
 
@@ -396,24 +1409,14 @@ void SpatiaLiteDatabase::StoreServices(const NodeId& nodeId, const NodeInfo::Ser
 {
     RemoveServices(nodeId);
     
-    sqlite3_stmt *statement;
-    string insertStr(
+    CachedStatement statement = _writer->statements().Prepare(
         "INSERT INTO services "
         "(nodeId, serviceType, port, data) "
         "VALUES (?, ?, ?, ?)" );
-    int prepResult = sqlite3_prepare_v2( _dbHandle, insertStr.c_str(), -1, &statement, nullptr );
-    if (prepResult != SQLITE_OK)
-    {
-        LOG(ERROR) << "Failed to prepare statement: " << insertStr;
-        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to prepare statement for storing node services");
-    }
-
-    scope_exit finalizeStmt( [&statement] { sqlite3_finalize(statement); } );
     
-    for (const auto &servicePair : services)
+    for (const auto &service : services)
     {
         // TODO abstract bind checks away, probably with functions, or maybe macros
-        const ServiceInfo &service = servicePair.second;
         const char *blobData = service.customData().empty() ? nullptr : service.customData().data();
         int blobSize = service.customData().size();
         if ( sqlite3_bind_text( statement, 1, nodeId.c_str(), -1, SQLITE_STATIC )  != SQLITE_OK ||
@@ -445,17 +1448,8 @@ void SpatiaLiteDatabase::StoreServices(const NodeId& nodeId, const NodeInfo::Ser
 
 void SpatiaLiteDatabase::RemoveServices(const NodeId& nodeId)
 {
-    sqlite3_stmt *statement;
-    string queryStr = "DELETE FROM services WHERE nodeId=?";
-    
-    int prepResult = sqlite3_prepare_v2( _dbHandle, queryStr.c_str(), -1, &statement, nullptr );
-    if (prepResult != SQLITE_OK)
-    {
-        LOG(ERROR) << "Failed to prepare statement: " << queryStr;
-        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to prepare statement to remove services");
-    }
-    
-    scope_exit finalizeStmt( [&statement] { sqlite3_finalize(statement); } );
+    CachedStatement statement = _writer->statements().Prepare(
+        "DELETE FROM services WHERE nodeId=?" );
     
     if ( sqlite3_bind_text( statement, 1, nodeId.c_str(), -1, SQLITE_STATIC ) != SQLITE_OK )
     {
@@ -463,12 +1457,32 @@ void SpatiaLiteDatabase::RemoveServices(const NodeId& nodeId)
         throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to bind remove service query node id param");
     }
     
-    int execResult = sqlite3_step(statement);
-    if (execResult != SQLITE_DONE)
+    int execResult = sqlite3_step(statement);
+    if (execResult != SQLITE_DONE)
+    {
+        LOG(ERROR) << "Failed to run node RemoveServices statement, error code: " << execResult;
+        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to run remove services statement");
+    }
+}
+
+
+
+NodeRelationType SpatiaLiteDatabase::LoadRelationType(const NodeId& nodeId) const
+{
+    ReadLease reader = LeaseReader();
+    CachedStatement statement = reader.statements().Prepare(
+        "SELECT relationType FROM nodes WHERE id=?" );
+    
+    if ( sqlite3_bind_text( statement, 1, nodeId.c_str(), -1, SQLITE_STATIC ) != SQLITE_OK )
     {
-        LOG(ERROR) << "Failed to run node RemoveServices statement, error code: " << execResult;
-        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to run remove services statement");
+        LOG(ERROR) << "Failed to bind relation type query node id param";
+        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to bind relation type query node id param");
     }
+    
+    if ( sqlite3_step(statement) != SQLITE_ROW )
+        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Node to be updated is not present: " + nodeId); }
+    
+    return static_cast<NodeRelationType>( sqlite3_column_int(statement, 0) );
 }
 
 
@@ -477,23 +1491,12 @@ void SpatiaLiteDatabase::RemoveServices(const NodeId& nodeId)
 //      to avoid SQL injection attacks. We could deduplicate at least some parts like result processing.
 shared_ptr<NodeDbEntry> SpatiaLiteDatabase::Load(const NodeId& nodeId) const
 {
-    sqlite3_stmt *statement;
-    string queryStr =
+    ReadLease reader = LeaseReader();
+    CachedStatement statement = reader.statements().Prepare(
         "SELECT id, ipAddress, nodePort, clientPort, X(location), Y(location), "
                "relationType, roleType "
         "FROM nodes "
-        "WHERE id=?";
-    
-    //LOG(DEBUG) << "Running query: " << queryStr;
-    
-    int prepResult = sqlite3_prepare_v2( _dbHandle, queryStr.c_str(), -1, &statement, nullptr );
-    if (prepResult != SQLITE_OK)
-    {
-        LOG(ERROR) << "Failed to prepare statement: " << queryStr;
-        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to prepare statement to load node");
-    }
-
-    scope_exit finalizeStmt( [&statement] { sqlite3_finalize(statement); } );
+        "WHERE id=?" );
     
     if ( sqlite3_bind_text( statement, 1, nodeId.c_str(), -1, SQLITE_STATIC ) != SQLITE_OK )
     {
@@ -517,9 +1520,9 @@ shared_ptr<NodeDbEntry> SpatiaLiteDatabase::Load(const NodeId& nodeId) const
         NodeContact contact( reinterpret_cast<const char*>(ipAddrPtr),
                              static_cast<TcpPort>(nodePort), static_cast<TcpPort>(clientPort) );
         
-        NodeInfo::Services services = LoadServices(nodeId);
+        NodeInfo::Services services = move( LoadServices( reader.statements(), {nodeId} )[nodeId] );
         result.reset( new NodeDbEntry(
-            NodeInfo( reinterpret_cast<const char*>(idPtr), GpsLocation(latitude, longitude), contact, services ),
+            NodeInfo( reinterpret_cast<const char*>(idPtr), GpsLocation(latitude, longitude), move(contact), move(services) ),
             static_cast<NodeRelationType>(relationType), static_cast<NodeContactRoleType>(roleType) ) );
     }
     
@@ -531,36 +1534,37 @@ shared_ptr<NodeDbEntry> SpatiaLiteDatabase::Load(const NodeId& nodeId) const
 // TODO reduce SpatiaLite boilerplate in general as much as possible. Currently it's very repetitive.
 void SpatiaLiteDatabase::Store(const NodeDbEntry &node, bool expires)
 {
-    sqlite3_stmt *statement;
-    string insertStr(
-        "INSERT INTO nodes "
-        "(id, ipAddress, nodePort, clientPort, relationType, roleType, expiresAt, location) VALUES "
-        "(?, ?, ?, ?, ?, ?, ?, " + LocationPointSql( node.location() ) + ")" );
-    int prepResult = sqlite3_prepare_v2( _dbHandle, insertStr.c_str(), -1, &statement, nullptr );
-    if (prepResult != SQLITE_OK)
-    {
-        LOG(ERROR) << "Failed to prepare statement: " << insertStr;
-        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to prepare statement for storing node entry");
-    }
+    StoreExpiringAt( node, expires ?
+        chrono::system_clock::to_time_t( chrono::system_clock::now() + _entryExpirationPeriod ) :
+        numeric_limits<time_t>::max() );
+}
+
 
-    scope_exit finalizeStmt( [&statement] { sqlite3_finalize(statement); } );
+void SpatiaLiteDatabase::StoreExpiringAt(const NodeDbEntry &node, time_t expiresAt)
+{
+    BeginBatch();
+    scope_error rollback( [this] { RollbackBatch(); } );
+    
+    CachedStatement statement = _writer->statements().Prepare(
+        "INSERT INTO nodes "
+        "(id, ipAddress, nodePort, clientPort, relationType, roleType, expiresAt, location, selfDistanceKm) VALUES "
+        "(?1, ?2, ?3, ?4, ?5, ?6, ?7, MakePoint(?8, ?9), " + SelfDistanceExpression + ")" );
     
-    time_t expiresAt = expires ?
-        chrono::system_clock::to_time_t( chrono::system_clock::now() + _entryExpirationPeriod ) :
-        numeric_limits<time_t>::max();
     const NodeContact &contact = node.contact();
+    Address address = contact.address();
     // TODO abstract long bind checks away, probably with functions, or maybe macros
     if ( sqlite3_bind_text( statement, 1, node.id().c_str(), -1, SQLITE_STATIC )        != SQLITE_OK ||
-         sqlite3_bind_text( statement, 2, contact.address().c_str(), -1, SQLITE_STATIC )!= SQLITE_OK ||
+         sqlite3_bind_text( statement, 2, address.c_str(), -1, SQLITE_STATIC )        != SQLITE_OK ||
          sqlite3_bind_int(  statement, 3, contact.nodePort() )                          != SQLITE_OK ||
          sqlite3_bind_int(  statement, 4, contact.clientPort() )                        != SQLITE_OK ||
          sqlite3_bind_int(  statement, 5, static_cast<int>( node.relationType() ) )     != SQLITE_OK ||
          sqlite3_bind_int(  statement, 6, static_cast<int>( node.roleType() ) )         != SQLITE_OK ||
-         sqlite3_bind_int(  statement, 7, expiresAt )                                   != SQLITE_OK )
+         sqlite3_bind_int64(statement, 7, expiresAt )                                   != SQLITE_OK )
     {
         LOG(ERROR) << "Failed to bind node store statement params";
         throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to bind node store statement params");
     }
+    BindLocation( statement, 8, node.location() );
     
     int execResult = sqlite3_step(statement);
     if (execResult != SQLITE_DONE)
@@ -568,50 +1572,69 @@ void SpatiaLiteDatabase::Store(const NodeDbEntry &node, bool expires)
         LOG(ERROR) << "Failed to run node store statement, error code: " << execResult;
         throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to run node store statement");
     }
+    ++_nodeCounts.at( static_cast<size_t>( node.relationType() ) );
+    // NOTE this reference is released when the node is removed or by reloading node ids on rollback
+    NodeHandle handle = NodeIdTable::Instance().Intern( node.id() );
+    _nodeIds.Set( handle, node.relationType() );
+    if ( expiresAt != numeric_limits<time_t>::max() )   { _expirations.Set(handle, expiresAt); }
+    else                                                { _expirations.Remove(handle); }
+    
+    // Nodes stored before the self entry have no distance from it yet
+    if ( node.relationType() == NodeRelationType::Self )
+    {
+        ExecuteCached(UpdateSelfDistancesCommand);
+        ReloadNeighbourhood();
+    }
+    else { IndexNeighbour( node.id(), node.relationType() ); }
     
     StoreServices( node.id(), node.services() );
     
-    for ( auto listenerEntry : _listenerRegistry.listeners() )
+    _afterCommitActions.push_back( [this, node]
     {
-        // if ( auto listener = listenerEntry.lock() )
-            { listenerEntry->AddedNode(node); }
-    }
+        for ( auto listenerEntry : _listenerRegistry.listeners() )
+        {
+            // if ( auto listener = listenerEntry.lock() )
+                { listenerEntry->AddedNode(node); }
+        }
+    } );
+    CommitBatch();
 }
 
 
 
 void SpatiaLiteDatabase::Update(const NodeDbEntry& node, bool expires)
 {
-    sqlite3_stmt *statement;
-    string insertStr(
+    BeginBatch();
+    scope_error rollback( [this] { RollbackBatch(); } );
+    
+    NodeRelationType oldRelationType = LoadRelationType( node.id() );
+    shared_ptr<NodeDbEntry> oldSelf;
+    if ( node.relationType() == NodeRelationType::Self )
+        { oldSelf = Load( node.id() ); }
+    
+    CachedStatement statement = _writer->statements().Prepare(
         "UPDATE nodes SET "
-        "  ipAddress=?, nodePort=?, clientPort=?, relationType=?, roleType=?, expiresAt=?, "
-        "  location=" + LocationPointSql( node.location() ) + " "
-        "WHERE id=?");
-    int prepResult = sqlite3_prepare_v2( _dbHandle, insertStr.c_str(), -1, &statement, nullptr );
-    if (prepResult != SQLITE_OK)
-    {
-        LOG(ERROR) << "Failed to prepare statement: " << insertStr;
-        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to prepare statement for updating node entry");
-    }
-
-    scope_exit finalizeStmt( [&statement] { sqlite3_finalize(statement); } );
+        "  ipAddress=?1, nodePort=?2, clientPort=?3, relationType=?4, roleType=?5, expiresAt=?6, "
+        "  location=MakePoint(?8, ?9), selfDistanceKm=" + SelfDistanceExpression + " "
+        "WHERE id=?7" );
     
     time_t expiresAt = expires ?
         chrono::system_clock::to_time_t( chrono::system_clock::now() + _entryExpirationPeriod ) :
         numeric_limits<time_t>::max();
     const NodeContact &contact = node.contact();
-    if ( sqlite3_bind_text( statement, 1, contact.address().c_str(), -1, SQLITE_STATIC )!= SQLITE_OK ||
+    Address address = contact.address();
+    if ( sqlite3_bind_text( statement, 1, address.c_str(), -1, SQLITE_STATIC )        != SQLITE_OK ||
          sqlite3_bind_int(  statement, 2, contact.nodePort() )                          != SQLITE_OK ||
          sqlite3_bind_int(  statement, 3, contact.clientPort() )                        != SQLITE_OK ||
          sqlite3_bind_int(  statement, 4, static_cast<int>( node.relationType() ) )     != SQLITE_OK ||
          sqlite3_bind_int(  statement, 5, static_cast<int>( node.roleType() ) )         != SQLITE_OK ||
-         sqlite3_bind_int(  statement, 6, expiresAt )                                   != SQLITE_OK ||
+         sqlite3_bind_int64(statement, 6, expiresAt )                                   != SQLITE_OK ||
          sqlite3_bind_text( statement, 7, node.id().c_str(), -1, SQLITE_STATIC )        != SQLITE_OK )
     {
         LOG(ERROR) << "Failed to bind node store statement params";
         throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to bind node store statement params");
     }
+    BindLocation( statement, 8, node.location() );
     
     int execResult = sqlite3_step(statement);
     if (execResult != SQLITE_DONE)
@@ -620,30 +1643,51 @@ void SpatiaLiteDatabase::Update(const NodeDbEntry& node, bool expires)
         throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to run node update statement");
     }
     
-    int affectedRows = sqlite3_changes(_dbHandle);
+    int affectedRows = sqlite3_changes( _writer->handle() );
     if (affectedRows != 1)
     {
         LOG(ERROR) << "Affected row count for update should be 1, got : " << affectedRows;
         throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Wrong affected row count for update");
     }
+    --_nodeCounts.at( static_cast<size_t>(oldRelationType) );
+    ++_nodeCounts.at( static_cast<size_t>( node.relationType() ) );
+    NodeHandle handle = StoredHandle( node.id() );
+    _nodeIds.Set( handle, node.relationType() );
+    if (expires)    { _expirations.Set(handle, expiresAt); }
+    else            { _expirations.Remove(handle); }
     
-    StoreServices( node.id(), node.services() );
+    // Our location changes very rarely, distances of all nodes are recalculated only then
+    if ( oldSelf != nullptr && ( oldRelationType != NodeRelationType::Self || oldSelf->location() != node.location() ) )
+    {
+        ExecuteCached(UpdateSelfDistancesCommand);
+        ReloadNeighbourhood();
+    }
+    else { IndexNeighbour( node.id(), node.relationType() ); }
     
-    // update cached self node info
-    if ( node.relationType() == NodeRelationType::Self )
-        { _myNodeInfo = node; }
+    StoreServices( node.id(), node.services() );
     
-    for ( auto listenerEntry : _listenerRegistry.listeners() )
+    _afterCommitActions.push_back( [this, node]
     {
-        // if ( auto listener = listenerEntry.lock() )
-            { listenerEntry->UpdatedNode(node); }
-    }
+        // publish new snapshot of self node info, readers still holding the old one are not affected
+        if ( node.relationType() == NodeRelationType::Self )
+            { atomic_store( &_myNode, make_shared<const NodeDbEntry>( NodeDbEntry::FromSelfInfo(node) ) ); }
+        
+        for ( auto listenerEntry : _listenerRegistry.listeners() )
+        {
+            // if ( auto listener = listenerEntry.lock() )
+                { listenerEntry->UpdatedNode(node); }
+        }
+    } );
+    CommitBatch();
 }
 
 
 
 void SpatiaLiteDatabase::Remove(const NodeId &nodeId)
 {
+    BeginBatch();
+    scope_error rollback( [this] { RollbackBatch(); } );
+    
     shared_ptr<NodeDbEntry> storedNode = Load(nodeId);
     if (storedNode == nullptr)
         { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Node to be removed is not present: " + nodeId); }
@@ -652,18 +1696,9 @@ void SpatiaLiteDatabase::Remove(const NodeId &nodeId)
     
     RemoveServices(nodeId);
     
-    sqlite3_stmt *statement;
-    string insertStr(
+    CachedStatement statement = _writer->statements().Prepare(
         "DELETE FROM nodes "
-        "WHERE id=?");
-    int prepResult = sqlite3_prepare_v2( _dbHandle, insertStr.c_str(), -1, &statement, nullptr );
-    if (prepResult != SQLITE_OK)
-    {
-        LOG(ERROR) << "Failed to prepare statement: " << insertStr;
-        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to prepare statement for deleting node entry");
-    }
-
-    scope_exit finalizeStmt( [&statement] { sqlite3_finalize(statement); } );
+        "WHERE id=?" );
     
     if ( sqlite3_bind_text( statement, 1, nodeId.c_str(), -1, SQLITE_STATIC ) != SQLITE_OK )
     {
@@ -678,45 +1713,213 @@ void SpatiaLiteDatabase::Remove(const NodeId &nodeId)
         throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to run node delete statement");
     }
     
-    int affectedRows = sqlite3_changes(_dbHandle);
+    int affectedRows = sqlite3_changes( _writer->handle() );
     if (affectedRows != 1)
     {
         LOG(ERROR) << "Affected row count for delete should be 1, got : " << affectedRows;
         throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Wrong affected row count for delete");
     }
+    --_nodeCounts.at( static_cast<size_t>( storedNode->relationType() ) );
+    UnindexNode( StoredHandle(nodeId) );
     
-    for ( auto listenerEntry : _listenerRegistry.listeners() )
+    _afterCommitActions.push_back( [this, storedNode]
     {
-        // if ( auto listener = listenerEntry.lock() )
-            { listenerEntry->RemovedNode(*storedNode); }
-    }
+        for ( auto listenerEntry : _listenerRegistry.listeners() )
+        {
+            // if ( auto listener = listenerEntry.lock() )
+                { listenerEntry->RemovedNode(*storedNode); }
+        }
+    } );
+    CommitBatch();
 }
 
 
 
 void SpatiaLiteDatabase::ExpireOldNodes()
 {
-    // NOTE int-based number, no string or user input, so no SQL injection vulnerability
+    auto sweepStart = chrono::steady_clock::now();
+    
+    // Only nodes found due by the expiration wheel are checked instead of scanning the whole table
     time_t now = chrono::system_clock::to_time_t( chrono::system_clock::now() );
-    string expiredCondition(
-        "WHERE expiresAt <= " + to_string(now) + " AND " +
-            "relationType != " + to_string( static_cast<uint32_t>(NodeRelationType::Self) ) );
+    vector<NodeHandle> dueHandles = _expirations.PopDue(now);
+    const NodeIdTable &idTable = NodeIdTable::Instance();
+    
+    // Nodes are expired in batches with a fixed condition, unused parameters of the last batch are left NULL.
+    // NOTE the condition refers to ?3 and later as used with QueryEntries(), unused ?1 and ?2 are also left NULL.
+    static const string expiredCondition = [] {
+        string placeholders;
+        for (size_t idx = 0; idx < NODE_QUERY_BATCH_SIZE; ++idx)
+            { placeholders += ( idx == 0 ? "?" : ", ?" ) + to_string(idx + 4); }
+        return "WHERE expiresAt <= ?3 AND "
+            "relationType != " + to_string( static_cast<uint32_t>(NodeRelationType::Self) ) + " AND "
+            "id IN (" + placeholders + ")";
+    }();
     
-    vector<NodeDbEntry> expiredEntries = QueryEntries( _myNodeInfo.location(), expiredCondition );
+    BeginBatch();
+    scope_error rollback( [this] { RollbackBatch(); } );
     
-    for (const auto &entry : expiredEntries)
+    auto expiredEntries = make_shared<vector<NodeDbEntry>>();
+    for (size_t batchStart = 0; batchStart < dueHandles.size(); batchStart += NODE_QUERY_BATCH_SIZE)
     {
-        Remove( entry.id() );
-        for ( auto listenerEntry : _listenerRegistry.listeners() )
-            { listenerEntry->RemovedNode(entry); }
+        size_t batchEnd = min( dueHandles.size(), batchStart + NODE_QUERY_BATCH_SIZE );
+        auto bindParams = [&dueHandles, &idTable, now, batchStart, batchEnd] (sqlite3_stmt *statement)
+        {
+            if ( sqlite3_bind_int64(statement, 3, now) != SQLITE_OK )
+                { throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to bind expiration query params"); }
+            for (size_t idx = batchStart; idx < batchEnd; ++idx)
+            {
+                const NodeId &nodeId = idTable.Id( dueHandles[idx] );
+                if ( sqlite3_bind_text( statement, idx - batchStart + 4, nodeId.c_str(), -1, SQLITE_STATIC ) != SQLITE_OK )
+                    { throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to bind expiration query params"); }
+            }
+        };
+        
+        // NOTE listeners need only ids of removed nodes, so services of expired nodes are not loaded
+        vector<NodeDbEntry> batchEntries = QueryEntries( ThisNode()->location(),
+            expiredCondition, "", "", bindParams, ServiceDetails::Excluded );
+        if ( batchEntries.empty() )
+            { continue; }
+        
+        CachedStatement removeServices = _writer->statements().Prepare(
+            "DELETE FROM services WHERE nodeId IN (SELECT id FROM nodes " + expiredCondition + ")" );
+        CachedStatement removeNodes = _writer->statements().Prepare(
+            "DELETE FROM nodes " + expiredCondition );
+        for ( sqlite3_stmt *statement : { static_cast<sqlite3_stmt*>(removeServices), static_cast<sqlite3_stmt*>(removeNodes) } )
+        {
+            bindParams(statement);
+            int execResult = sqlite3_step(statement);
+            if (execResult != SQLITE_DONE)
+            {
+                LOG(ERROR) << "Failed to run node expiration statement, error code: " << execResult;
+                throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to run node expiration statement");
+            }
+        }
+        
+        int affectedRows = sqlite3_changes( _writer->handle() );
+        if ( static_cast<size_t>(affectedRows) != batchEntries.size() )
+        {
+            LOG(ERROR) << "Affected row count for expiration should be " << batchEntries.size() << ", got : " << affectedRows;
+            throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Wrong affected row count for expiration");
+        }
+        
+        for (auto &entry : batchEntries)
+        {
+            --_nodeCounts.at( static_cast<size_t>( entry.relationType() ) );
+            UnindexNode( StoredHandle( entry.id() ) );
+            expiredEntries->push_back( move(entry) );
+        }
+    }
+    
+    if ( ! expiredEntries->empty() )
+    {
+        _afterCommitActions.push_back( [this, expiredEntries]
+        {
+            for (const auto &entry : *expiredEntries)
+            {
+                for ( auto listenerEntry : _listenerRegistry.listeners() )
+                    { listenerEntry->RemovedNode(entry); }
+            }
+        } );
+    }
+    
+    CommitBatch();
+    
+    _lastExpirationDuration = chrono::duration_cast<chrono::microseconds>(
+        chrono::steady_clock::now() - sweepStart ).count();
+    if ( ! expiredEntries->empty() )
+    {
+        LOG(DEBUG) << "Expired " << expiredEntries->size() << " nodes in "
+                   << _lastExpirationDuration << " microseconds";
+    }
+}
+
+
+chrono::microseconds SpatiaLiteDatabase::lastExpirationDuration() const
+    { return chrono::microseconds(_lastExpirationDuration); }
+
+
+
+void SpatiaLiteDatabase::ExecuteCached(const string &sql)
+    { ExecuteCached( _writer->statements(), sql ); }
+
+void SpatiaLiteDatabase::ExecuteCached(StatementCache &statements, const string &sql)
+{
+    CachedStatement statement = statements.Prepare(sql);
+    int execResult = sqlite3_step(statement);
+    if (execResult != SQLITE_DONE)
+    {
+        LOG(ERROR) << "Failed to execute command " << sql << ", error code: " << execResult;
+        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to execute command " + sql);
+    }
+}
+
+
+// NOTE savepoints work as transactions when not nested, so we don't need separate BEGIN and COMMIT commands
+void SpatiaLiteDatabase::BeginBatch()
+{
+    LockWriter();
+    scope_error unlock( [this] { UnlockWriter(); } );
+    
+    ExecuteCached("SAVEPOINT batch");
+    _batchStarts.push_back( _afterCommitActions.size() );
+}
+
+
+void SpatiaLiteDatabase::CommitBatch()
+{
+    if ( _batchStarts.empty() )
+        { throw LocationNetworkError(ErrorCode::ERROR_BAD_STATE, "No batch was started to be committed"); }
+    
+    ExecuteCached("RELEASE SAVEPOINT batch");
+    _batchStarts.pop_back();
+    
+    vector<function<void()>> actions;
+    if ( _batchStarts.empty() )
+        { actions.swap(_afterCommitActions); }
+    UnlockWriter();
+    
+    for (const auto &action : actions)
+        { action(); }
+}
+
+
+// NOTE this is typically called from scope guards thus must not throw
+void SpatiaLiteDatabase::RollbackBatch()
+{
+    if ( _batchStarts.empty() )
+    {
+        LOG(ERROR) << "No batch was started to be rolled back";
+        return;
+    }
+    
+    try
+    {
+        ExecuteCached("ROLLBACK TO SAVEPOINT batch");
+        ExecuteCached("RELEASE SAVEPOINT batch");
+        ReloadNodeCounts();
+        ReloadNodeIds();
+        ReloadNeighbourhood();
     }
+    catch (exception &e)
+        { LOG(ERROR) << "Failed to roll back batch: " << e.what(); }
+    
+    _afterCommitActions.resize( _batchStarts.back() );
+    _batchStarts.pop_back();
+    UnlockWriter();
 }
 
 
 
 vector<NodeDbEntry> SpatiaLiteDatabase::GetNodes(NodeContactRoleType roleType)
 {
-    return QueryEntries( _myNodeInfo.location(),
+    return QueryEntries( ThisNode()->location(),
+        "WHERE roleType = " + to_string( static_cast<int>(roleType) ) );
+}
+
+
+void SpatiaLiteDatabase::VisitNodes(NodeContactRoleType roleType, const NodeVisitor &visitor)
+{
+    VisitEntries( [&visitor] (NodeDbEntry &entry) { return visitor(entry); }, ThisNode()->location(),
         "WHERE roleType = " + to_string( static_cast<int>(roleType) ) );
 }
 
@@ -724,62 +1927,400 @@ vector<NodeDbEntry> SpatiaLiteDatabase::GetNodes(NodeContactRoleType roleType)
 
 size_t SpatiaLiteDatabase::GetNodeCount() const
 {
-    // NOTE this would be better done by SELECT COUNT(*) but that would need a lot more boilerplate code again
-    vector<NodeDbEntry> nodes( QueryEntries( _myNodeInfo.location() ) );
-    return nodes.size();
+    size_t result = 0;
+    for (const auto &nodeCount : _nodeCounts)
+        { result += nodeCount; }
+    return result;
 }
 
 
 size_t SpatiaLiteDatabase::GetNodeCount(NodeRelationType filter) const
+    { return _nodeCounts.at( static_cast<size_t>(filter) ); }
+
+
+size_t SpatiaLiteDatabase::CountNodes(NodeRelationType filter) const
+{
+    ReadLease reader = LeaseReader();
+    CachedStatement statement = reader.statements().Prepare(
+        "SELECT COUNT(*) FROM nodes WHERE relationType=?" );
+    
+    if ( sqlite3_bind_int( statement, 1, static_cast<int>(filter) ) != SQLITE_OK )
+    {
+        LOG(ERROR) << "Failed to bind node count query params";
+        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to bind node count query params");
+    }
+    
+    if ( sqlite3_step(statement) != SQLITE_ROW )
+    {
+        LOG(ERROR) << "Failed to run node count query";
+        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to run node count query");
+    }
+    
+    return sqlite3_column_int64(statement, 0);
+}
+
+
+void SpatiaLiteDatabase::ReloadNodeCounts()
+{
+    for (size_t relationType = 0; relationType < _nodeCounts.size(); ++relationType)
+        { _nodeCounts[relationType] = CountNodes( static_cast<NodeRelationType>(relationType) ); }
+}
+
+
+void SpatiaLiteDatabase::ReloadNodeIds()
+{
+    ReadLease reader = LeaseReader();
+    CachedStatement statement = reader.statements().Prepare("SELECT id, relationType, expiresAt FROM nodes");
+    
+    // NOTE references of the previous ids are released only after taking the new ones,
+    //      so handles of nodes still present are kept
+    vector<NodeHandle> previousHandles = _nodeIds.Ids();
+    _nodeIds.Clear();
+    _expirations.Clear();
+    while ( sqlite3_step(statement) == SQLITE_ROW )
+    {
+        const uint8_t *idPtr = sqlite3_column_text(statement, 0);
+        time_t expiresAt = sqlite3_column_int64(statement, 2);
+        NodeHandle handle = NodeIdTable::Instance().Intern( reinterpret_cast<const char*>(idPtr) );
+        _nodeIds.Set( handle, static_cast<NodeRelationType>( sqlite3_column_int(statement, 1) ) );
+        if ( expiresAt != numeric_limits<time_t>::max() )
+            { _expirations.Set(handle, expiresAt); }
+    }
+    
+    for (NodeHandle handle : previousHandles)
+        { NodeIdTable::Instance().Release(handle); }
+}
+
+
+void SpatiaLiteDatabase::ReloadNeighbourhood()
+{
+    ReadLease reader = LeaseReader();
+    CachedStatement statement = reader.statements().Prepare(
+        "SELECT id, selfDistanceKm FROM nodes WHERE relationType = " +
+            to_string( static_cast<int>(NodeRelationType::Neighbour) ) );
+    
+    _neighbourhood.Clear();
+    while ( sqlite3_step(statement) == SQLITE_ROW )
+    {
+        const uint8_t *idPtr = sqlite3_column_text(statement, 0);
+        _neighbourhood.Set( StoredHandle( reinterpret_cast<const char*>(idPtr) ),
+                            sqlite3_column_double(statement, 1) );
+    }
+}
+
+
+// NOTE expects the node to be already written, so its distance is read back as calculated by SQLite
+void SpatiaLiteDatabase::IndexNeighbour(const NodeId &nodeId, NodeRelationType relationType)
+{
+    NodeHandle handle = StoredHandle(nodeId);
+    if (relationType != NodeRelationType::Neighbour)
+    {
+        _neighbourhood.Remove(handle);
+        return;
+    }
+    
+    CachedStatement statement = _writer->statements().Prepare(
+        "SELECT selfDistanceKm FROM nodes WHERE id=?" );
+    if ( sqlite3_bind_text( statement, 1, nodeId.c_str(), -1, SQLITE_STATIC ) != SQLITE_OK )
+    {
+        LOG(ERROR) << "Failed to bind self distance query node id param";
+        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to bind self distance query node id param");
+    }
+    if ( sqlite3_step(statement) != SQLITE_ROW )
+        { throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Written node is not found: " + nodeId); }
+    
+    _neighbourhood.Set( handle, sqlite3_column_double(statement, 0) );
+}
+
+
+NodeHandle SpatiaLiteDatabase::StoredHandle(const NodeId &nodeId) const
+{
+    NodeHandle handle;
+    if ( ! NodeIdTable::Instance().Find(nodeId, handle) )
+        { throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Stored node has no handle: " + nodeId); }
+    return handle;
+}
+
+
+// NOTE the reference is released last, as removing from the neighbourhood still needs the id
+void SpatiaLiteDatabase::UnindexNode(NodeHandle handle)
+{
+    _neighbourhood.Remove(handle);
+    _expirations.Remove(handle);
+    _nodeIds.Remove(handle);
+    NodeIdTable::Instance().Release(handle);
+}
+
+
+bool SpatiaLiteDatabase::CheckNodeCounts()
+{
+    // NOTE counters are changed also by uncommitted batches, so no write may run between counting rows
+    //      and fixing counters. Holding the writer lock also makes the counts run on the writer connection.
+    LockWriter();
+    scope_exit unlock( [this] { UnlockWriter(); } );
+    
+    bool consistent = true;
+    for ( NodeRelationType relationType : { NodeRelationType::Colleague,
+            NodeRelationType::Neighbour, NodeRelationType::Self } )
+    {
+        size_t storedCount = CountNodes(relationType);
+        size_t countedNodes = _nodeCounts.at( static_cast<size_t>(relationType) ).exchange(storedCount);
+        if (countedNodes != storedCount)
+        {
+            LOG(WARNING) << "Node counter of relation type " << static_cast<int>(relationType)
+                         << " was " << countedNodes << ", fixed to stored row count " << storedCount;
+            consistent = false;
+        }
+    }
+    return consistent;
+}
+
+
+
+vector< pair<NodeDbEntry, time_t> > SpatiaLiteDatabase::LoadAllEntries() const
 {
-    // NOTE this would be better done by SELECT COUNT(*) but that would need a lot more boilerplate code again
-    vector<NodeDbEntry> nodes( QueryEntries( _myNodeInfo.location(),
-        "WHERE relationType = " + to_string( static_cast<int>(filter) ) ) );
-    return nodes.size();
+    // Both queries run on the locked writer connection to see the same state
+    LockWriter();
+    scope_exit unlock( [this] { UnlockWriter(); } );
+    
+    ReadLease reader = LeaseReader();
+    CachedStatement statement = reader.statements().Prepare("SELECT id, expiresAt FROM nodes");
+    unordered_map<NodeId, time_t> expirations;
+    while ( sqlite3_step(statement) == SQLITE_ROW )
+    {
+        const uint8_t *idPtr = sqlite3_column_text(statement, 0);
+        expirations[ reinterpret_cast<const char*>(idPtr) ] = sqlite3_column_int64(statement, 1);
+    }
+    
+    vector< pair<NodeDbEntry, time_t> > result;
+    for ( auto &entry : QueryEntries( ThisNode()->location() ) )
+    {
+        auto expirationIt = expirations.find( entry.id() );
+        if ( expirationIt == expirations.end() )
+            { throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Node changed while loading: " + entry.id()); }
+        result.emplace_back( move(entry), expirationIt->second );
+    }
+    return result;
 }
 
 
 
 vector<NodeDbEntry> SpatiaLiteDatabase::GetNeighbourNodesByDistance() const
 {
-    return QueryEntries( _myNodeInfo.location(),
+    // NOTE ordered by the stored distance and id, so rows are simply read in the order of index nodes_relationType_selfDistanceKm_id
+    return QueryEntries( ThisNode()->location(),
+        "WHERE relationType = " + to_string( static_cast<int>(NodeRelationType::Neighbour) ),
+        "ORDER BY selfDistanceKm, id" );
+}
+
+
+void SpatiaLiteDatabase::VisitNeighbourNodesByDistance(const NodeVisitor &visitor) const
+{
+    VisitEntries( [&visitor] (NodeDbEntry &entry) { return visitor(entry); }, ThisNode()->location(),
         "WHERE relationType = " + to_string( static_cast<int>(NodeRelationType::Neighbour) ),
-        "ORDER BY dist_km" );
+        "ORDER BY selfDistanceKm, id" );
+}
+
+
+
+size_t SpatiaLiteDatabase::GetNeighbourRank(const NodeId &nodeId) const
+{
+    NodeHandle handle;
+    if ( ! NodeIdTable::Instance().Find(nodeId, handle) )
+        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Node is not a neighbour: " + nodeId); }
+    return _neighbourhood.Rank(handle);
+}
+
+Distance SpatiaLiteDatabase::GetNeighbourDistanceKm(size_t rank) const
+    { return _neighbourhood.DistanceAt(rank); }
+
+
+
+vector<NodeDbEntry> SpatiaLiteDatabase::GetRandomNodes(
+    size_t maxNodeCount, Neighbours filter, ServiceDetails details) const
+{
+    vector<NodeDbEntry> result;
+    VisitRandomEntries( maxNodeCount, filter, [&result] (NodeDbEntry &entry)
+        { result.push_back( move(entry) ); return true; }, details );
+    return result;
 }
 
 
+void SpatiaLiteDatabase::VisitRandomNodes(size_t maxNodeCount, Neighbours filter,
+    const NodeVisitor &visitor, ServiceDetails details) const
+{
+    VisitRandomEntries( maxNodeCount, filter,
+        [&visitor] (NodeDbEntry &entry) { return visitor(entry); }, details );
+}
+
 
-vector<NodeDbEntry> SpatiaLiteDatabase::GetRandomNodes(size_t maxNodeCount, Neighbours filter) const
+void SpatiaLiteDatabase::VisitRandomEntries(size_t maxNodeCount, Neighbours filter,
+    const EntryConsumer &consumer, ServiceDetails details) const
 {
-    string whereCondition = filter == Neighbours::Included ? "" :
-        "WHERE relationType = " + to_string( static_cast<int>(NodeRelationType::Colleague) );
-    return QueryEntries( _myNodeInfo.location(), whereCondition,
-        "ORDER BY RANDOM()", "LIMIT " + to_string(maxNodeCount) );
+    // Nodes are sampled from the maintained id arrays and loaded by id, so only selected rows are touched.
+    // NOTE ids of uncommitted nodes may be selected while another thread has a batch open,
+    //      they are not found by other connections thus the result may be a bit shorter in this case
+    vector<NodeRelationType> relationTypes = filter == Neighbours::Included ?
+        vector<NodeRelationType>{ NodeRelationType::Colleague, NodeRelationType::Neighbour, NodeRelationType::Self } :
+        vector<NodeRelationType>{ NodeRelationType::Colleague };
+    vector<NodeHandle> handles = _nodeIds.Sample(maxNodeCount, relationTypes);
+    if ( handles.empty() )
+        { return; }
+    
+    // Nodes are loaded in batches with a fixed statement, unused parameters of the last batch are left NULL
+    static const string idCondition = [] {
+        string placeholders;
+        for (size_t idx = 0; idx < NODE_QUERY_BATCH_SIZE; ++idx)
+            { placeholders += ( idx == 0 ? "?" : ", ?" ) + to_string(idx + 3); }
+        return "WHERE id IN (" + placeholders + ")";
+    }();
+    
+    // Ids are materialized from handles only here, as they are needed for the query.
+    // NOTE ids are copied, as nodes removed meanwhile by a writer release their handles
+    const NodeIdTable &idTable = NodeIdTable::Instance();
+    vector<NodeId> nodeIds;
+    nodeIds.reserve( handles.size() );
+    for (NodeHandle handle : handles)
+    {
+        NodeId nodeId;
+        if ( idTable.FindId(handle, nodeId) )
+            { nodeIds.push_back( move(nodeId) ); }
+    }
+    
+    // Batches are consecutive parts of the sample, so they are visited one by one
+    // and only entries of a single batch have to be reordered into the random order of the sample
+    unordered_map<NodeId, size_t> samplePositions;
+    for (size_t idx = 0; idx < nodeIds.size(); ++idx)
+        { samplePositions[ nodeIds[idx] ] = idx; }
+    
+    for (size_t batchStart = 0; batchStart < nodeIds.size(); batchStart += NODE_QUERY_BATCH_SIZE)
+    {
+        size_t batchEnd = min( nodeIds.size(), batchStart + NODE_QUERY_BATCH_SIZE );
+        vector<NodeDbEntry> batchEntries = QueryEntries( ThisNode()->location(), idCondition, "", "",
+            [&nodeIds, batchStart, batchEnd] (sqlite3_stmt *statement)
+        {
+            for (size_t idx = batchStart; idx < batchEnd; ++idx)
+            {
+                if ( sqlite3_bind_text( statement, idx - batchStart + 3, nodeIds[idx].c_str(), -1, SQLITE_STATIC ) != SQLITE_OK )
+                    { throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to bind random node query params"); }
+            }
+        }, details );
+        
+        sort( batchEntries.begin(), batchEntries.end(), [&samplePositions] (const NodeDbEntry &one, const NodeDbEntry &other)
+            { return samplePositions.at( one.id() ) < samplePositions.at( other.id() ); } );
+        for (auto &entry : batchEntries)
+        {
+            if ( ! consumer(entry) )
+                { return; }
+        }
+    }
 }
 
 
 
 vector<NodeDbEntry> SpatiaLiteDatabase::GetClosestNodesByDistance(
-    const GpsLocation& location, Distance radiusKm, size_t maxNodeCount, Neighbours filter) const
+    const GpsLocation& location, Distance radiusKm, size_t maxNodeCount, Neighbours filter,
+    ServiceDetails details) const
+{
+    vector<NodeDbEntry> result;
+    VisitClosestEntries( location, radiusKm, maxNodeCount, filter, [&result] (NodeDbEntry &entry)
+        { result.push_back( move(entry) ); return true; }, details );
+    return result;
+}
+
+
+void SpatiaLiteDatabase::VisitClosestNodesByDistance(
+    const GpsLocation& location, Distance radiusKm, size_t maxNodeCount, Neighbours filter,
+    const NodeVisitor &visitor, ServiceDetails details) const
 {
-    string whereCondition = "WHERE (dist_km IS NULL OR dist_km <= " + to_string(radiusKm) + ")";
+    VisitClosestEntries( location, radiusKm, maxNodeCount, filter,
+        [&visitor] (NodeDbEntry &entry) { return visitor(entry); }, details );
+}
+
+
+void SpatiaLiteDatabase::VisitClosestEntries(
+    const GpsLocation& location, Distance radiusKm, size_t maxNodeCount, Neighbours filter,
+    const EntryConsumer &consumer, ServiceDetails details) const
+{
+    // Candidates are preselected with the spatial index, exact distances are calculated only for them
+    string whereCondition =
+        "WHERE rowid IN ( SELECT id FROM nodes_rtree WHERE "
+            "minLat <= ?6 AND maxLat >= ?5 AND "
+            "( (minLon <= ?8 AND maxLon >= ?7) OR (minLon <= ?10 AND maxLon >= ?9) ) ) "
+        "AND (dist_km IS NULL OR dist_km <= ?3)";
     if (filter == Neighbours::Excluded)
     {
         whereCondition += " AND relationType = " +
             to_string( static_cast<int>(NodeRelationType::Colleague) );
     }
     
-    return QueryEntries(location,
-        whereCondition,
-        "ORDER BY dist_km",
-        "LIMIT " + to_string(maxNodeCount) );
+    // All rounds and services of the nodes found are read from the same snapshot of a single connection
+    // NOTE savepoints also nest into an open batch if the writer connection is leased
+    ReadLease reader = LeaseReader();
+    StatementCache &statements = reader.statements();
+    ExecuteCached(statements, "SAVEPOINT closest_nodes");
+    scope_exit endRead( [&statements]
+    {
+        try { ExecuteCached(statements, "RELEASE SAVEPOINT closest_nodes"); }
+        catch (exception &e)
+            { LOG(ERROR) << "Failed to end closest node query transaction: " << e.what(); }
+    } );
+    
+    // Search an expanding area until enough nodes are found or the requested radius is covered.
+    // Nodes outside of the area are farther than its radius, thus all nodes found are the closest ones.
+    Distance searchRadiusKm = INITIAL_SEARCH_RADIUS_KM;
+    while (true)
+    {
+        bool lastRound = radiusKm <= searchRadiusKm || MAX_SURFACE_DISTANCE_KM <= searchRadiusKm;
+        Distance roundRadiusKm = min(searchRadiusKm, radiusKm);
+        SearchArea area = GetSearchArea(location, roundRadiusKm);
+        
+        ParamBinder bindParams = [roundRadiusKm, maxNodeCount, &area] (sqlite3_stmt *statement)
+        {
+            if ( sqlite3_bind_double(statement, 3,  roundRadiusKm)      != SQLITE_OK ||
+                 sqlite3_bind_int64 (statement, 4,  maxNodeCount)       != SQLITE_OK ||
+                 sqlite3_bind_double(statement, 5,  area.minLatitude)   != SQLITE_OK ||
+                 sqlite3_bind_double(statement, 6,  area.maxLatitude)   != SQLITE_OK ||
+                 sqlite3_bind_double(statement, 7,  area.minLongitude1) != SQLITE_OK ||
+                 sqlite3_bind_double(statement, 8,  area.maxLongitude1) != SQLITE_OK ||
+                 sqlite3_bind_double(statement, 9,  area.minLongitude2) != SQLITE_OK ||
+                 sqlite3_bind_double(statement, 10, area.maxLongitude2) != SQLITE_OK )
+                { throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to bind closest node query params"); }
+        };
+        
+        // The last round is final whatever it finds, so rows are streamed right from the cursor
+        if (lastRound)
+        {
+            VisitEntries( statements, consumer, location, whereCondition, "ORDER BY dist_km", "LIMIT ?4", bindParams, details );
+            return;
+        }
+        
+        // Otherwise the round is final only if enough nodes are found, so they are collected first,
+        // but services are loaded only for nodes actually visited
+        vector<NodeDbEntry> result;
+        VisitEntries( statements, [&result] (NodeDbEntry &entry)
+            { result.push_back( move(entry) ); return true; },
+            location, whereCondition, "ORDER BY dist_km", "LIMIT ?4", bindParams, ServiceDetails::Excluded );
+        if ( result.size() >= maxNodeCount )
+        {
+            for (size_t chunkStart = 0; chunkStart < result.size(); chunkStart += NODE_QUERY_BATCH_SIZE)
+            {
+                vector<NodeDbEntry> chunk( make_move_iterator( result.begin() + chunkStart ),
+                    make_move_iterator( result.begin() + min( result.size(), chunkStart + NODE_QUERY_BATCH_SIZE ) ) );
+                if ( ! VisitChunk( consumer, statements, chunk, details ) )
+                    { return; }
+            }
+            return;
+        }
+        searchRadiusKm *= SEARCH_RADIUS_GROWTH_RATE;
+    }
 }
 
 
 
-NodeDbEntry SpatiaLiteDatabase::ThisNode() const
+shared_ptr<const NodeDbEntry> SpatiaLiteDatabase::ThisNode() const
 {
-    return NodeDbEntry::FromSelfInfo(_myNodeInfo);
+    return atomic_load(&_myNode);
 //     string whereCondition = "WHERE relationType = " + to_string( static_cast<int>(NodeRelationType::Colleague) );
 //     vector<NodeDbEntry> result = QueryEntries( _myNodeInfo.location(), whereCondition );
 //     if ( result.empty() )
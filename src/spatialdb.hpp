@@ -1,13 +1,20 @@
 #ifndef __LOCNET_SPATIAL_DATABASE_H__
 #define __LOCNET_SPATIAL_DATABASE_H__
 
+#include <array>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <limits>
 #include <memory>
 #include <mutex>
 #include <sqlite3.h>
+#include <thread>
 #include <vector>
 
 #include "basic.hpp"
+#include "config.hpp"
 
 
 
@@ -40,6 +47,15 @@ enum class Neighbours : uint8_t
 };
 
 
+// Flag for node queries whether services of the nodes are needed. When excluded,
+// implementations may skip loading them and return nodes with an empty service list.
+enum class ServiceDetails : uint8_t
+{
+    Included = 1,
+    Excluded = 2,
+};
+
+
 
 // Data holder class for full node information stored in the database.
 class NodeDbEntry : public NodeInfo
@@ -51,9 +67,7 @@ public:
     
     static NodeDbEntry FromSelfInfo(const NodeInfo &thisNodeInfo);
     
-    NodeDbEntry(const NodeDbEntry& other);
-    NodeDbEntry( const NodeInfo& info,
-                 NodeRelationType relationType, NodeContactRoleType roleType );
+    NodeDbEntry( NodeInfo info, NodeRelationType relationType, NodeContactRoleType roleType );
     
     NodeRelationType relationType() const;
     NodeContactRoleType roleType() const;
@@ -64,6 +78,12 @@ public:
 
 
 
+// Called with the nodes of a query result one by one in the order of the result, returning false stops the query.
+// NOTE visitors are called while the query is still running, so they must not use the database themselves
+typedef std::function<bool(const NodeDbEntry &node)> NodeVisitor;
+
+
+
 // Interface to listen for any changes in the node map.
 class IChangeListener
 {
@@ -106,23 +126,58 @@ public:
     virtual std::shared_ptr<NodeDbEntry> Load(const NodeId &nodeId) const = 0;
     virtual void Store (const NodeDbEntry &node, bool expires = true) = 0;
     virtual void Update(const NodeDbEntry &node, bool expires = true) = 0;
+    // Store a node keeping an expiration time recorded earlier instead of starting a new period,
+    // numeric_limits<time_t>::max() for non expiring nodes
+    virtual void StoreExpiringAt(const NodeDbEntry &node, time_t expiresAt) = 0;
     virtual void Remove(const NodeId &nodeId) = 0;
     virtual void ExpireOldNodes() = 0;
     
+    // Group several writes into a single transaction, batches may be nested.
+    // Calls must be balanced and made from the same thread, other writers wait until the batch is finished.
+    virtual void BeginBatch() = 0;
+    virtual void CommitBatch() = 0;
+    virtual void RollbackBatch() = 0;
+    
     virtual IChangeListenerRegistry& changeListenerRegistry() = 0;
 
-    virtual NodeDbEntry ThisNode() const = 0;
+    // Immutable snapshot of our own node info, replaced as a whole by Update() so it's cheap to share
+    virtual std::shared_ptr<const NodeDbEntry> ThisNode() const = 0;
     virtual std::vector<NodeDbEntry> GetNodes(NodeContactRoleType roleType) = 0;
+    
+    // All stored nodes with their expiration time, numeric_limits<time_t>::max() for non expiring nodes
+    virtual std::vector< std::pair<NodeDbEntry, time_t> > LoadAllEntries() const = 0;
 
     virtual size_t GetNodeCount() const = 0;
     virtual size_t GetNodeCount(NodeRelationType filter) const = 0;
     virtual std::vector<NodeDbEntry> GetNeighbourNodesByDistance() const = 0;
     
+    // Position of a neighbour in the list returned by GetNeighbourNodesByDistance(), throws if not a neighbour
+    virtual size_t GetNeighbourRank(const NodeId &nodeId) const = 0;
+    // Distance from self of the neighbour at the given position of the same list, throws if out of range
+    virtual Distance GetNeighbourDistanceKm(size_t rank) const = 0;
+    
     virtual std::vector<NodeDbEntry> GetClosestNodesByDistance(
-        const GpsLocation &location, Distance maxRadiusKm, size_t maxNodeCount, Neighbours filter) const = 0;
+        const GpsLocation &location, Distance maxRadiusKm, size_t maxNodeCount, Neighbours filter,
+        ServiceDetails details = ServiceDetails::Included) const = 0;
 
     virtual std::vector<NodeDbEntry> GetRandomNodes(
-        size_t maxNodeCount, Neighbours filter) const = 0;
+        size_t maxNodeCount, Neighbours filter,
+        ServiceDetails details = ServiceDetails::Included) const = 0;
+    
+    // Streaming versions of the queries above, passing nodes to the visitor instead of collecting them.
+    // Default implementations simply iterate the collected results, implementations override them
+    // to avoid building the whole result when only a part of it is used.
+    // NOTE ServiceDetails::Excluded only allows leaving out services, visitors may still get them
+    virtual void VisitNodes(NodeContactRoleType roleType, const NodeVisitor &visitor);
+    virtual void VisitNeighbourNodesByDistance(const NodeVisitor &visitor) const;
+    
+    virtual void VisitClosestNodesByDistance(
+        const GpsLocation &location, Distance maxRadiusKm, size_t maxNodeCount, Neighbours filter,
+        const NodeVisitor &visitor, ServiceDetails details = ServiceDetails::Included) const;
+    
+    virtual void VisitRandomNodes(
+        size_t maxNodeCount, Neighbours filter,
+        const NodeVisitor &visitor, ServiceDetails details = ServiceDetails::Included) const;
 };
 
 
@@ -144,25 +199,336 @@ public:
 
 
 
+// Handles of nodes grouped by relation type for selecting random nodes without scanning all of them.
+// Handles are kept in arrays, so a uniform random sample of k nodes is selected in O(k). Protected by a lock to be threadsafe.
+class NodeIdSampler
+{
+    mutable std::mutex _mutex;
+    
+    std::array< std::vector<NodeHandle>, 4 > _ids;
+    std::unordered_map< NodeHandle, std::pair<NodeRelationType, size_t> > _positions;
+    
+    void RemoveUnlocked(NodeHandle handle);
+    
+public:
+    
+    void Clear();
+    
+    // Add a node or change its relation type
+    void Set(NodeHandle handle, NodeRelationType relationType);
+    void Remove(NodeHandle handle);
+    
+    // Distinct handles of at most maxCount random nodes having any of the given relation types, in random order
+    std::vector<NodeHandle> Sample(size_t maxCount, const std::vector<NodeRelationType> &relationTypes) const;
+    // Handles of all nodes in no specific order
+    std::vector<NodeHandle> Ids() const;
+};
+
+
+
+// Nodes ordered by their distance, stored in a treap (randomized balanced binary search tree)
+// where each tree node also counts the size of its subtree. Finding the rank of a node or the node
+// at a given rank thus takes O(log n) steps. Protected by a lock to be threadsafe.
+struct NeighbourhoodTreeNode;
+
+class NeighbourhoodIndex
+{
+    mutable std::mutex _mutex;
+    
+    std::unique_ptr<NeighbourhoodTreeNode> _root;
+    std::unordered_map<NodeHandle, Distance> _distances;
+    uint32_t                            _nextPriority;
+    
+public:
+    
+    NeighbourhoodIndex();
+    ~NeighbourhoodIndex();
+    
+    void Clear();
+    size_t size() const;
+    
+    // Add a node or change its distance
+    void Set(NodeHandle handle, Distance distanceKm);
+    void Remove(NodeHandle handle);
+    
+    // Number of nodes closer than the given one, throws if the node is not present
+    size_t Rank(NodeHandle handle) const;
+    // Distance of the node having the given rank, throws if out of range
+    Distance DistanceAt(size_t rank) const;
+    // Handles of all nodes ordered by distance
+    std::vector<NodeHandle> Ids() const;
+};
+
+
+
+// Hierarchical timing wheel of node deadlines (e.g. expiration or renewal times) in seconds.
+// Each level has 64 slots, a slot of level L covering 64^L seconds. Entries are moved to lower levels
+// as time advances, so finding due nodes takes time proportional to their number instead of all nodes.
+// Deadlines too far for the top level wait in an overflow list. Protected by a lock to be threadsafe.
+class TimingWheel
+{
+    struct Entry
+    {
+        NodeHandle  handle;
+        time_t      deadline;
+    };
+    
+    static const size_t LEVEL_BITS  = 6;
+    static const size_t SLOT_COUNT  = 1 << LEVEL_BITS;
+    static const size_t LEVEL_COUNT = 4;
+    
+    mutable std::mutex _mutex;
+    
+    time_t _now;    // Entries with deadlines up to this time are already moved into _due
+    std::array< std::array<std::vector<Entry>, SLOT_COUNT>, LEVEL_COUNT > _slots;
+    std::vector<Entry>  _overflow;
+    std::vector<Entry>  _due;
+    size_t              _entryCount;
+    
+    // Current deadline of each node, entries not matching these are outdated and dropped when reached
+    std::unordered_map<NodeHandle, time_t> _deadlines;
+    
+    // NOTE these expect _mutex to be locked
+    void Place(const Entry &entry);
+    void Rebuild();
+    void Advance(time_t now);
+    
+public:
+    
+    explicit TimingWheel(time_t now);
+    
+    void Clear();
+    size_t size() const;
+    
+    // Add a node or change its deadline, returns true if the node was added
+    bool Set(NodeHandle handle, time_t deadline);
+    void Remove(NodeHandle handle);
+    // Handles of all nodes in no specific order
+    std::vector<NodeHandle> Ids() const;
+    
+    // Remove and return at most maxCount nodes having their deadline passed by now, in no specific order
+    std::vector<NodeHandle> PopDue( time_t now, size_t maxCount = std::numeric_limits<size_t>::max() );
+};
+
+
+
+class StatementCache;
+
+// Prepared statement leased from a StatementCache, automatically reset and given back to the cache
+// when going out of scope. Converts to a raw statement pointer to be used with the SQLite API.
+class CachedStatement
+{
+    StatementCache              *_cache;
+    std::vector<sqlite3_stmt*>  *_pool;
+    sqlite3_stmt                *_statement;
+    
+public:
+    
+    CachedStatement(StatementCache *cache, std::vector<sqlite3_stmt*> *pool, sqlite3_stmt *statement);
+    CachedStatement(CachedStatement &&other);
+    ~CachedStatement();
+    
+    CachedStatement(const CachedStatement &other) = delete;
+    CachedStatement& operator=(const CachedStatement &other) = delete;
+    
+    operator sqlite3_stmt*() const;
+};
+
+
+// Pool of reusable prepared statements keyed by their SQL text to avoid compiling fixed queries again.
+// A statement is leased exclusively, so nested or concurrent use of the same query prepares another instance.
+class StatementCache
+{
+    friend class CachedStatement;
+    
+    sqlite3            *_dbHandle;
+    mutable std::mutex  _mutex;
+    size_t              _hitCount;
+    size_t              _missCount;
+    
+    std::unordered_map< std::string, std::vector<sqlite3_stmt*> > _idleStatements;
+    
+    void Release(std::vector<sqlite3_stmt*> *pool, sqlite3_stmt *statement);
+    
+public:
+    
+    StatementCache(sqlite3 *dbHandle);
+    ~StatementCache();
+    
+    CachedStatement Prepare(const std::string &sql);
+    
+    size_t hitCount() const;
+    size_t missCount() const;
+};
+
+
+
+// Statistics of waiting for a lock, waits are counted only if the lock was not immediately available.
+struct DbLockStats
+{
+    size_t                      acquireCount;
+    size_t                      waitCount;
+    std::chrono::microseconds   waitTime;
+};
+
+
+// Threadsafe collector of lock acquisitions and their wait times.
+class LockWaitCounter
+{
+    std::atomic<size_t>     _acquireCount;
+    std::atomic<size_t>     _waitCount;
+    std::atomic<int64_t>    _waitMicroseconds;
+    
+public:
+    
+    LockWaitCounter();
+    
+    // Zero wait time means that the lock was acquired without waiting
+    void Record(std::chrono::steady_clock::duration waitTime);
+    DbLockStats stats() const;
+};
+
+
+
+// An open SQLite database connection with SpatiaLite and custom SQL functions loaded.
+// Connections are not threadsafe, they must be used by a single thread at a time.
+class SpatiaLiteConnection
+{
+    sqlite3                         *_dbHandle;
+    void                            *_spatialiteConnection;
+    std::unique_ptr<StatementCache>  _statements;
+    
+public:
+    
+    SpatiaLiteConnection(const std::string &dbPath, int openFlags);
+    ~SpatiaLiteConnection();
+    
+    SpatiaLiteConnection(const SpatiaLiteConnection &other) = delete;
+    SpatiaLiteConnection& operator=(const SpatiaLiteConnection &other) = delete;
+    
+    sqlite3* handle() const;
+    StatementCache& statements() const;
+};
+
+
+
 // A spatial database implementation that uses the SpatiaLite embedded SQL engine.
+// Writes are serialized on a single writer connection, while reads use a pool of read-only connections,
+// so they run concurrently on different threads and see only committed changes.
+// Reads of a thread having a batch open use the writer connection to see the changes of the batch.
 class SpatiaLiteDatabase : public ISpatialDatabase
 {
-    NodeInfo     _myNodeInfo;
-    sqlite3     *_dbHandle;
-    void        *_spatialiteConnection;
+public:
+    
+    typedef std::function<void(sqlite3_stmt *statement)> ParamBinder;
+    // Same as NodeVisitor, but entries may be moved away, used to collect results without copies
+    typedef std::function<bool(NodeDbEntry &entry)> EntryConsumer;
+    
+private:
+    
+    // Connection leased for a read operation, given back on destruction
+    class ReadLease
+    {
+        const SpatiaLiteDatabase    *_db;
+        SpatiaLiteConnection        *_connection;
+        bool                         _pooled;
+        
+    public:
+        
+        ReadLease(const SpatiaLiteDatabase *db, SpatiaLiteConnection *connection, bool pooled);
+        ReadLease(ReadLease &&other);
+        ~ReadLease();
+        
+        ReadLease(const ReadLease &other) = delete;
+        ReadLease& operator=(const ReadLease &other) = delete;
+        
+        StatementCache& statements() const;
+    };
+    
+    // NOTE accessed only through atomic_load() and atomic_store() to be swapped under concurrent readers
+    std::shared_ptr<const NodeDbEntry> _myNode;
+    std::string  _dbPath;
+    
+    std::unique_ptr<SpatiaLiteConnection> _writer;
     
     std::chrono::duration<uint32_t> _entryExpirationPeriod;
     
     ThreadSafeChangeListenerRegistry _listenerRegistry;
     
+    // Node counts and ids maintained by write operations, indexed by relation type
+    std::array<std::atomic<size_t>, 4> _nodeCounts;
+    NodeIdSampler                      _nodeIds;
+    NeighbourhoodIndex                 _neighbourhood;
+    TimingWheel                        _expirations;
+    
+    // Held by write operations and open batches, changes are published to listeners only after commit.
+    // NOTE reads may also lock the writer connection, so it can be locked from const methods.
+    mutable std::recursive_mutex        _writeMutex;
+    mutable std::atomic<std::thread::id> _writerThread;
+    mutable size_t                      _writerLockDepth;
+    std::vector<size_t>                 _batchStarts;
+    std::vector<std::function<void()>>  _afterCommitActions;
+    
+    // Read-only connections opened lazily up to the limit, empty for databases not shared between connections
+    size_t                                                      _maxReaders;
+    mutable std::mutex                                          _readerMutex;
+    mutable std::condition_variable                             _readerReleased;
+    mutable std::vector< std::unique_ptr<SpatiaLiteConnection> > _readers;
+    mutable std::vector<SpatiaLiteConnection*>                  _idleReaders;
+    
+    mutable LockWaitCounter _writerLockWaits;
+    mutable LockWaitCounter _readerLockWaits;
+    
+    std::atomic<int64_t> _lastExpirationDuration;   // microseconds
+    
+    void LockWriter() const;
+    void UnlockWriter() const;
+    
+    ReadLease LeaseReader() const;
+    void ReleaseReader(SpatiaLiteConnection *connection, bool pooled) const;
+    
+    // NOTE parameters ?1 and ?2 are reserved for the location, custom SQL parts may bind from ?3
     std::vector<NodeDbEntry> QueryEntries(const GpsLocation &fromLocation,
         const std::string &whereCondition = "", const std::string orderBy = "",
-        const std::string &limit = "") const;
+        const std::string &limit = "", ParamBinder bindParams = ParamBinder(),
+        ServiceDetails details = ServiceDetails::Included ) const;
+    // Same as above, but rows are passed to the consumer while stepping the cursor, returns false if stopped.
+    // Services are loaded for chunks of rows, so they are not queried for rows never reached.
+    bool VisitEntries(const EntryConsumer &consumer, const GpsLocation &fromLocation,
+        const std::string &whereCondition = "", const std::string orderBy = "",
+        const std::string &limit = "", ParamBinder bindParams = ParamBinder(),
+        ServiceDetails details = ServiceDetails::Included ) const;
+    // Same as above on an already leased connection, e.g. to run several queries in the same read transaction
+    bool VisitEntries(StatementCache &statements, const EntryConsumer &consumer, const GpsLocation &fromLocation,
+        const std::string &whereCondition, const std::string orderBy, const std::string &limit,
+        ParamBinder bindParams, ServiceDetails details) const;
+    // Load services of the entries if requested and pass them to the consumer, returns false if stopped
+    bool VisitChunk(const EntryConsumer &consumer, StatementCache &statements,
+        std::vector<NodeDbEntry> &chunk, ServiceDetails details) const;
+    
+    void VisitClosestEntries(const GpsLocation &location, Distance radiusKm, size_t maxNodeCount,
+        Neighbours filter, const EntryConsumer &consumer, ServiceDetails details) const;
+    void VisitRandomEntries(size_t maxNodeCount, Neighbours filter,
+        const EntryConsumer &consumer, ServiceDetails details) const;
     
-    NodeInfo::Services LoadServices(const NodeId &nodeId) const;
+    std::unordered_map<NodeId, NodeInfo::Services> LoadServices(
+        StatementCache &statements, const std::vector<NodeId> &nodeIds) const;
     void StoreServices(const NodeId &nodeId, const NodeInfo::Services &services);
     void RemoveServices(const NodeId &nodeId);
     
+    NodeRelationType LoadRelationType(const NodeId &nodeId) const;
+    size_t CountNodes(NodeRelationType filter) const;
+    void ReloadNodeCounts();
+    void ReloadNodeIds();   // Also reloads expiration times
+    void ReloadNeighbourhood();
+    void IndexNeighbour(const NodeId &nodeId, NodeRelationType relationType);
+    // Handle of a stored node, the database holds a reference on it while the node is in _nodeIds
+    NodeHandle StoredHandle(const NodeId &nodeId) const;
+    void UnindexNode(NodeHandle handle);
+    
+    void ExecuteCached(const std::string &sql);
+    static void ExecuteCached(StatementCache &statements, const std::string &sql);
+    
 public:
     
     static const std::string IN_MEMORY_DB;
@@ -170,7 +536,8 @@ public:
     
     
     SpatiaLiteDatabase(const NodeInfo &myNodeInfo, const std::string &dbPath,
-                       std::chrono::duration<uint32_t> expirationPeriod);
+                       std::chrono::duration<uint32_t> expirationPeriod,
+                       DbDurability durability = DbDurability::Normal);
     virtual ~SpatiaLiteDatabase();
     
     Distance GetDistanceKm(const GpsLocation &one, const GpsLocation &other) const override;
@@ -178,22 +545,49 @@ public:
     std::shared_ptr<NodeDbEntry> Load(const NodeId &nodeId) const override;
     void Store (const NodeDbEntry &node, bool expires = true) override;
     void Update(const NodeDbEntry &node, bool expires = true) override;
+    void StoreExpiringAt(const NodeDbEntry &node, time_t expiresAt) override;
     void Remove(const NodeId &nodeId) override;
     void ExpireOldNodes() override;
     
+    void BeginBatch() override;
+    void CommitBatch() override;
+    void RollbackBatch() override;
+    
     IChangeListenerRegistry& changeListenerRegistry() override;
+    const StatementCache& statementCache() const;
+    
+    DbLockStats writerLockStats() const;
+    DbLockStats readerLockStats() const;
+    
+    std::chrono::microseconds lastExpirationDuration() const;
+    
+    // Compare maintained node counters to the stored rows, fix counters and return false on mismatch
+    bool CheckNodeCounts();
 
-    NodeDbEntry ThisNode() const override;
+    std::shared_ptr<const NodeDbEntry> ThisNode() const override;
     std::vector<NodeDbEntry> GetNodes(NodeContactRoleType roleType) override;
+    std::vector< std::pair<NodeDbEntry, time_t> > LoadAllEntries() const override;
     
     size_t GetNodeCount() const override;
     size_t GetNodeCount(NodeRelationType filter) const override;
     std::vector<NodeDbEntry> GetNeighbourNodesByDistance() const override;
+    size_t GetNeighbourRank(const NodeId &nodeId) const override;
+    Distance GetNeighbourDistanceKm(size_t rank) const override;
     std::vector<NodeDbEntry> GetRandomNodes(
-        size_t maxNodeCount, Neighbours filter) const override;
+        size_t maxNodeCount, Neighbours filter,
+        ServiceDetails details = ServiceDetails::Included) const override;
     
     std::vector<NodeDbEntry> GetClosestNodesByDistance(const GpsLocation &location,
-        Distance radiusKm, size_t maxNodeCount, Neighbours filter) const override;
+        Distance radiusKm, size_t maxNodeCount, Neighbours filter,
+        ServiceDetails details = ServiceDetails::Included) const override;
+    
+    void VisitNodes(NodeContactRoleType roleType, const NodeVisitor &visitor) override;
+    void VisitNeighbourNodesByDistance(const NodeVisitor &visitor) const override;
+    void VisitClosestNodesByDistance(const GpsLocation &location,
+        Distance radiusKm, size_t maxNodeCount, Neighbours filter,
+        const NodeVisitor &visitor, ServiceDetails details = ServiceDetails::Included) const override;
+    void VisitRandomNodes(size_t maxNodeCount, Neighbours filter,
+        const NodeVisitor &visitor, ServiceDetails details = ServiceDetails::Included) const override;
 };
 
 
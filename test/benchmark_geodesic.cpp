@@ -0,0 +1,81 @@
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+
+#include <easylogging++.h>
+
+#include "geodesic.hpp"
+
+INITIALIZE_EASYLOGGINGPP
+
+using namespace std;
+using namespace LocNet;
+
+
+
+// Compares ranking locations by distance from a single point with a scalar haversine loop
+// to the batch kernel of LocationIndex on different number of locations.
+int main()
+{
+    const size_t QUERY_COUNT = 20;
+    const size_t RESULT_COUNT = 10;
+    
+    mt19937 generator(42);
+    uniform_real_distribution<GpsCoordinate> latitudes(-90, 90);
+    uniform_real_distribution<GpsCoordinate> longitudes(-180, 180);
+    
+    cout << "Batch kernel: " << LocationIndex::KernelName() << endl;
+    cout << setw(10) << "locations" << setw(15) << "scalar (ms)" << setw(15) << "batch (ms)" << setw(10) << "speedup" << endl;
+    
+    for ( size_t locationCount : { 10000, 100000, 1000000 } )
+    {
+        vector<GpsLocation> locations;
+        LocationIndex index;
+        for (size_t idx = 0; idx < locationCount; ++idx)
+        {
+            locations.emplace_back( latitudes(generator), longitudes(generator) );
+            index.Set( idx, locations.back() );
+        }
+        
+        vector<GpsLocation> queries;
+        for (size_t idx = 0; idx < QUERY_COUNT; ++idx)
+            { queries.emplace_back( latitudes(generator), longitudes(generator) ); }
+        
+        // Keep results alive to prevent optimizing away calculations
+        double checksum = 0;
+        
+        auto scalarStart = chrono::steady_clock::now();
+        for (const auto &query : queries)
+        {
+            vector< pair<Distance, size_t> > distances;
+            distances.reserve(locationCount);
+            for (size_t idx = 0; idx < locationCount; ++idx)
+            {
+                distances.emplace_back( HaversineDistanceKm( query.latitude(), query.longitude(),
+                    locations[idx].latitude(), locations[idx].longitude() ), idx );
+            }
+            partial_sort( distances.begin(), distances.begin() + RESULT_COUNT, distances.end() );
+            checksum += distances.front().first;
+        }
+        chrono::duration<double, milli> scalarTime = chrono::steady_clock::now() - scalarStart;
+        
+        auto batchStart = chrono::steady_clock::now();
+        for (const auto &query : queries)
+        {
+            vector<LocationIndex::Result> closest = index.GetClosest(
+                query, numeric_limits<Distance>::max(), RESULT_COUNT );
+            checksum -= closest.front().second;
+        }
+        chrono::duration<double, milli> batchTime = chrono::steady_clock::now() - batchStart;
+        
+        cout << setw(10) << locationCount
+             << setw(15) << fixed << setprecision(3) << scalarTime.count() / QUERY_COUNT
+             << setw(15) << batchTime.count() / QUERY_COUNT
+             << setw(9) << setprecision(1) << scalarTime.count() / batchTime.count() << "x"
+             << "   (checksum " << setprecision(3) << checksum << ")" << endl;
+    }
+    
+    return 0;
+}
@@ -41,8 +41,20 @@ int main(int argc, const char* argv[])
         el::Loggers::reconfigureAllLoggers(el::ConfigurationType::Format, "%datetime %level %msg (%fbase:%line)");
         
         const NetworkEndpoint nodeContact(host, port);
+        
+        thread reactorThread( []
+        {
+            while (! ShutdownRequested)
+            {
+                Reactor::Instance().AsioService().run_one();
+                if ( Reactor::Instance().AsioService().stopped() )
+                    { Reactor::Instance().AsioService().reset(); }
+            }
+        } );
+        
         LOG(INFO) << "Connecting to server " << nodeContact;
-        shared_ptr<IProtoBufChannel> channel( new AsyncProtoBufTcpChannel(nodeContact) );
+        shared_ptr<IProtoBufChannel> channel( AsyncProtoBufTcpChannel::Connect(
+            nodeContact, config->connectTimeout(), asio::use_future ).get() );
         shared_ptr<ProtoBufClientSession> session( ProtoBufClientSession::Create(channel) );
         
         uint32_t notificationsReceived = 0;
@@ -83,17 +95,7 @@ int main(int argc, const char* argv[])
                 signalHandler(SIGINT);
             }
         } );
-         
-        thread reactorThread( []
-        {
-            while (! ShutdownRequested)
-            {
-                Reactor::Instance().AsioService().run_one();
-                if ( Reactor::Instance().AsioService().stopped() )
-                    { Reactor::Instance().AsioService().reset(); }
-            }
-        } );
- 
+        
         try
         {
             shared_ptr<IBlockingRequestDispatcher> dispatcher( new NetworkDispatcher(config, session) );
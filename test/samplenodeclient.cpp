@@ -41,12 +41,7 @@ int main(int argc, const char* argv[])
         el::Loggers::reconfigureAllLoggers(el::ConfigurationType::Format, "%datetime %level %msg (%fbase:%line)");
         
         const NetworkEndpoint nodeContact(host, port);
-        LOG(INFO) << "Connecting to server " << nodeContact;
-        shared_ptr<IProtoBufChannel> channel( new AsyncProtoBufTcpChannel(nodeContact) );
-        shared_ptr<ProtoBufClientSession> session( ProtoBufClientSession::Create(channel) );
-        session->StartMessageLoop();
-        shared_ptr<IBlockingRequestDispatcher> dispatcher( new NetworkDispatcher(config, session) );
-
+        
         thread reactorThread( []
         {
             while (! ShutdownRequested)
@@ -57,6 +52,13 @@ int main(int argc, const char* argv[])
             }
         } );
         
+        LOG(INFO) << "Connecting to server " << nodeContact;
+        shared_ptr<IProtoBufChannel> channel( AsyncProtoBufTcpChannel::Connect(
+            nodeContact, config->connectTimeout(), asio::use_future ).get() );
+        shared_ptr<ProtoBufClientSession> session( ProtoBufClientSession::Create(channel) );
+        session->StartMessageLoop();
+        shared_ptr<IBlockingRequestDispatcher> dispatcher( new NetworkDispatcher(config, session) );
+        
         LOG(INFO) << "Sending getnodecount request";
         NodeMethodsProtoBufClient client(dispatcher, nullptr);
         size_t colleagueCount = client.GetNodeCount();
@@ -90,10 +90,11 @@ int main(int argc, const char *argv[])
             new StaticBlockingDispatcherFactory( shared_ptr<IBlockingRequestDispatcher>(
                 new IncomingClientRequestDispatcher(node) ) ) );
         
+        shared_ptr<WorkerPool> workers( new WorkerPool( "Sample", config->nodeWorkerCount(), 1024 ) );
         shared_ptr<DispatchingTcpServer> nodeTcpServer = DispatchingTcpServer::Create(
-            BudapestNodeContact.nodePort(), nodeDispatcherFactory );
+            BudapestNodeContact.nodePort(), nodeDispatcherFactory, workers );
         shared_ptr<DispatchingTcpServer> clientTcpServer = DispatchingTcpServer::Create(
-            BudapestNodeContact.clientPort(), clientDispatcherFactory );
+            BudapestNodeContact.clientPort(), clientDispatcherFactory, workers );
         
         nodeTcpServer->StartListening();
         clientTcpServer->StartListening();
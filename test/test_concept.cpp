@@ -105,6 +105,14 @@ ostream& operator<<(ostream &out, const TestCase testCase)
     { return out << "test case (maxNodes: " << testCase._maxNodeCount << ", seeds: " << testCase._seedCount << ", neighbours: " << testCase._maxNeighbourCount << ")"; }
 
 
+// Simulated nodes are told apart by their address, so generate a distinct IP for each of them
+Address createNodeAddress(size_t nodeIndex)
+{
+    return "10." + to_string( (nodeIndex >> 16) & 0xff ) + "." +
+        to_string( (nodeIndex >> 8) & 0xff ) + "." + to_string( nodeIndex & 0xff );
+}
+
+
 vector< shared_ptr<TestConfig> > createOneConfigByCity(
     const vector<Settlement> &settlements, const TestCase &testCase)
 {
@@ -114,7 +122,7 @@ vector< shared_ptr<TestConfig> > createOneConfigByCity(
         //cout << settlement.name << "\t" << settlement.location << "\t" << settlement.population << endl;
         
         NodeInfo nodeInfo( settlement.name, settlement.location,
-            NodeContact(settlement.name, 8888, 9999), NodeInfo::Services() );
+            NodeContact( createNodeAddress( nodeConfigs.size() ), 8888, 9999 ), NodeInfo::Services() );
         shared_ptr<TestConfig> config( new TestConfig(nodeInfo) );
         nodeConfigs.push_back(config);
         
@@ -140,7 +148,7 @@ vector< shared_ptr<TestConfig> > createConfigsByPopulation(
             
             ++nodeUniqueIndex;
             NodeInfo nodeInfo( city.name + "-" + to_string(nodeUniqueIndex), city.location,
-                NodeContact(city.name + "-" + to_string(nodeUniqueIndex), 8888, 9999), NodeInfo::Services() );
+                NodeContact( createNodeAddress( nodeConfigs.size() ), 8888, 9999 ), NodeInfo::Services() );
             shared_ptr<TestConfig> config( new TestConfig(nodeInfo) );
             nodeConfigs.push_back(config);
             
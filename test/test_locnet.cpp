@@ -1,6 +1,15 @@
+#include <fstream>
+#include <limits>
+#include <future>
+#include <thread>
+#include <unordered_set>
+
 #include <catch.hpp>
 #include <easylogging++.h>
 
+#include "cacheddb.hpp"
+#include "geodesic.hpp"
+#include "snapshot.hpp"
 #include "testdata.hpp"
 #include "testimpls.hpp"
 
@@ -60,7 +69,7 @@ SCENARIO("Construction and behaviour of data holder types", "[basic][logic]")
     
     GIVEN("A node info object") {
         NodeInfo::Services services{
-            { "ServiceType::Profile", ServiceInfo("ServiceType::Profile", 1111) } };
+            ServiceInfo("ServiceType::Profile", 1111) };
         NodeInfo node( "NodeId", loc, NodeContact("127.0.0.1", 6666, 7777), services );
         THEN("its fields are properly filled in") {
             REQUIRE( node.id() == "NodeId" );
@@ -84,6 +93,119 @@ SCENARIO("Construction and behaviour of data holder types", "[basic][logic]")
             REQUIRE( contact.address() == "1.2.3.4" );
             REQUIRE( ! contact.nodeEndpoint().isLoopback() );
         }
+        
+        THEN("it is moved without copying its data") {
+            REQUIRE( is_nothrow_move_constructible<NodeInfo>::value );
+            REQUIRE( is_nothrow_move_constructible<NodeDbEntry>::value );
+            
+            const NodeId *idData = &node.id();
+            const string *servicesData = &node.services().at("ServiceType::Profile").type();
+            NodeDbEntry entry( move(node), NodeRelationType::Colleague, NodeContactRoleType::Acceptor );
+            REQUIRE( entry.id() == "NodeId" );
+            REQUIRE( &entry.id() == idData );
+            REQUIRE( entry.services() == services );
+            REQUIRE( &entry.services().at("ServiceType::Profile").type() == servicesData );
+            
+            NodeInfo sliced( move(entry) );
+            REQUIRE( sliced.services() == services );
+            REQUIRE( &sliced.services().at("ServiceType::Profile").type() == servicesData );
+        }
+
+        THEN("its copies share a single interned id") {
+            NodeInfo copy(node);
+            REQUIRE( &copy.id() == &node.id() );
+            REQUIRE( copy.handle() == node.handle() );
+            REQUIRE( NodeIdTable::Instance().Id( node.handle() ) == "NodeId" );
+            REQUIRE( NodeInfo( "OtherNodeId", loc, node.contact(), services ) != node );
+        }
+        
+        THEN("its services are kept ordered by type without duplicates") {
+            NodeInfo::Services &nodeServices = node.services();
+            nodeServices.Set( ServiceInfo("ServiceType::Token", 2222) );
+            nodeServices.Set( ServiceInfo("ServiceType::Minting", 3333) );
+            nodeServices.Set( ServiceInfo("ServiceType::Profile", 4444, "Data") );
+            REQUIRE( nodeServices.size() == 3 );
+            REQUIRE( nodeServices.begin()->type() == "ServiceType::Minting" );
+            REQUIRE( nodeServices.at("ServiceType::Profile") == ServiceInfo("ServiceType::Profile", 4444, "Data") );
+            REQUIRE( ( nodeServices.end() - 1 )->type() == "ServiceType::Token" );
+            REQUIRE( nodeServices != services );
+            
+            nodeServices.Remove("ServiceType::Minting");
+            nodeServices.Remove("ServiceType::Token");
+            nodeServices.Remove("ServiceType::Unknown");
+            REQUIRE( nodeServices.size() == 1 );
+            REQUIRE( nodeServices.find("ServiceType::Token") == nodeServices.end() );
+            REQUIRE_THROWS( nodeServices.at("ServiceType::Token") );
+        }
+        
+        THEN("its contact address is kept in binary form") {
+            const NodeContact &contact = node.contact();
+            REQUIRE( contact.AddressBytes() == string("\x7f\x00\x00\x01", 4) );
+            REQUIRE( NodeContact::FromAddressBytes( contact.AddressBytes(), 6666, 7777 ) == contact );
+            REQUIRE( NodeContact("::1", 6666, 7777).AddressBytes().size() == 16 );
+            REQUIRE( NodeContact("::1", 6666, 7777) != contact );
+            REQUIRE( NodeContact(Address(), 6666, 7777).address().empty() );
+            REQUIRE_THROWS( NodeContact("not.an.ip.address", 6666, 7777) );
+            REQUIRE_THROWS( NodeContact::FromAddressBytes("abc", 6666, 7777) );
+        }
+    }
+    
+    GIVEN("The node id table") {
+        NodeIdTable &idTable = NodeIdTable::Instance();
+        THEN("it assigns a single handle to each id") {
+            NodeHandle handle;
+            REQUIRE( ! idTable.Find("InternedNodeId1", handle) );
+            
+            size_t sizeBefore = idTable.size();
+            NodeHandle handle1 = idTable.Intern("InternedNodeId1");
+            NodeHandle handle2 = idTable.Intern("InternedNodeId2");
+            REQUIRE( handle1 != handle2 );
+            REQUIRE( idTable.Intern("InternedNodeId1") == handle1 );
+            REQUIRE( idTable.size() == sizeBefore + 2 );
+            
+            REQUIRE( idTable.Find("InternedNodeId2", handle) );
+            REQUIRE( handle == handle2 );
+            REQUIRE( idTable.Id(handle1) == "InternedNodeId1" );
+            REQUIRE_THROWS( idTable.Id( numeric_limits<NodeHandle>::max() ) );
+            
+            // Interned twice above, so the first id needs two releases
+            idTable.Release(handle1);
+            REQUIRE( idTable.Id(handle1) == "InternedNodeId1" );
+            idTable.Release(handle1);
+            idTable.Release(handle2);
+            REQUIRE( idTable.size() == sizeBefore );
+            REQUIRE( ! idTable.Find("InternedNodeId1", handle) );
+            REQUIRE_THROWS( idTable.Id(handle1) );
+            REQUIRE_THROWS( idTable.Release(handle1) );
+        }
+        
+        THEN("handles of released ids are reused") {
+            NodeHandle released = idTable.Intern("ReleasedNodeId");
+            idTable.Release(released);
+            NodeHandle reused = idTable.Intern("ReusingNodeId");
+            REQUIRE( reused == released );
+            REQUIRE( idTable.Id(reused) == "ReusingNodeId" );
+            idTable.Release(reused);
+        }
+        
+        THEN("references keep the id until the last one is destroyed") {
+            size_t sizeBefore = idTable.size();
+            NodeHandle handle;
+            {
+                NodeIdRef ref("ReferencedNodeId");
+                {
+                    NodeIdRef copy(ref);
+                    NodeIdRef other("OtherReferencedNodeId");
+                    other = copy;
+                    REQUIRE( other.handle() == ref.handle() );
+                    REQUIRE( idTable.size() == sizeBefore + 1 );
+                }
+                REQUIRE( idTable.Find("ReferencedNodeId", handle) );
+                REQUIRE( handle == ref.handle() );
+            }
+            REQUIRE( ! idTable.Find("ReferencedNodeId", handle) );
+            REQUIRE( idTable.size() == sizeBefore );
+        }
     }
 }
 
@@ -118,13 +240,27 @@ SCENARIO("Spatial database", "[spatialdb][logic]")
             REQUIRE( Budapest_NewYork == Approx(7023.15).epsilon(0.005) );
             REQUIRE( Budapest_CapeTown == Approx(9053.66).epsilon(0.005) );
         }
-        
+
+        THEN("distance models give consistent results") {
+            for ( const GpsLocation &location : { TestData::Kecskemet, TestData::Wien,
+                    TestData::London, TestData::NewYork, TestData::CapeTown } )
+            {
+                Distance haversine = GeodesicDistanceKm(TestData::Budapest, location, DistanceModel::Haversine);
+                Distance vincenty  = GeodesicDistanceKm(TestData::Budapest, location, DistanceModel::Vincenty);
+                REQUIRE( vincenty == Approx(haversine).epsilon(0.005) );
+                REQUIRE( geodb.GetDistanceKm(TestData::Budapest, location) == vincenty );
+            }
+            REQUIRE( GeodesicDistanceKm(TestData::London, TestData::London, DistanceModel::Vincenty) == 0 );
+            // Nearly antipodal points, iteration does not converge
+            REQUIRE( VincentyDistanceKm(0, 0, 0.5, 179.7) == Approx(19936.).epsilon(0.005) );
+        }
+
         WHEN("adding nodes") {
             NodeInfo::Services services1{
-                { "ServiceType::Profile", ServiceInfo("ServiceType::Profile", 1111, "ProfileServerId") },
-                { "ServiceType::Token", ServiceInfo("ServiceType::Token", 2222) } };
+                ServiceInfo("ServiceType::Profile", 1111, "ProfileServerId"),
+                ServiceInfo("ServiceType::Token", 2222) };
             NodeInfo::Services services2{
-                { "ServiceType::Relay", ServiceInfo("ServiceType::Relay", 3333) } };
+                ServiceInfo("ServiceType::Relay", 3333) };
             NodeDbEntry entry1( NodeInfo( "ColleagueNodeId1", GpsLocation(1.0, 1.0),
                 NodeContact("127.0.0.1", 6666, 7777), services1 ),
                     NodeRelationType::Colleague, NodeContactRoleType::Initiator );
@@ -234,6 +370,42 @@ SCENARIO("Spatial database", "[spatialdb][logic]")
                 REQUIRE( neighboursByDistance.size() == 2 );
                 REQUIRE( neighboursByDistance[0] == TestData::EntryKecskemet );
                 REQUIRE( neighboursByDistance[1] == TestData::EntryWien );
+                
+                REQUIRE( geodb.GetNeighbourRank( TestData::NodeKecskemet.id() ) == 0 );
+                REQUIRE( geodb.GetNeighbourRank( TestData::NodeWien.id() ) == 1 );
+                REQUIRE_THROWS( geodb.GetNeighbourRank( TestData::NodeLondon.id() ) );
+                REQUIRE( geodb.GetNeighbourDistanceKm(1) == Approx( geodb.GetDistanceKm(TestData::Budapest, TestData::Wien) ) );
+                REQUIRE_THROWS( geodb.GetNeighbourDistanceKm(2) );
+            }
+            
+            THEN("neighbours at the same distance are ordered by their id") {
+                // NOTE this id is interned later but sorts before WienId
+                NodeDbEntry twinEntry( NodeInfo( "WienAnotherId", TestData::Wien,
+                    TestData::NodeWien.contact(), TestData::NodeWien.services() ),
+                    NodeRelationType::Neighbour, NodeContactRoleType::Acceptor );
+                geodb.Store(twinEntry);
+                
+                vector<NodeDbEntry> neighboursByDistance( geodb.GetNeighbourNodesByDistance() );
+                REQUIRE( neighboursByDistance.size() == 3 );
+                REQUIRE( neighboursByDistance[0] == TestData::EntryKecskemet );
+                REQUIRE( neighboursByDistance[1] == twinEntry );
+                REQUIRE( neighboursByDistance[2] == TestData::EntryWien );
+                REQUIRE( geodb.GetNeighbourRank( twinEntry.id() ) == 1 );
+                REQUIRE( geodb.GetNeighbourRank( TestData::NodeWien.id() ) == 2 );
+            }
+            
+            THEN("neighbours are reordered when our location changes") {
+                NodeDbEntry movedSelf( NodeInfo( TestData::NodeBudapest.id(), TestData::London,
+                    TestData::NodeBudapest.contact(), TestData::NodeBudapest.services() ),
+                    NodeRelationType::Self, NodeContactRoleType::Self );
+                geodb.Update(movedSelf, false);
+                
+                vector<NodeDbEntry> neighboursByDistance( geodb.GetNeighbourNodesByDistance() );
+                REQUIRE( neighboursByDistance.size() == 2 );
+                REQUIRE( neighboursByDistance[0] == TestData::EntryWien );
+                REQUIRE( neighboursByDistance[1] == TestData::EntryKecskemet );
+                REQUIRE( geodb.GetNeighbourRank( TestData::NodeWien.id() ) == 0 );
+                REQUIRE( geodb.GetNeighbourRank( TestData::NodeKecskemet.id() ) == 1 );
             }
             THEN("Data is properly updated and deleted") {
                 REQUIRE( geodb.GetNodeCount() == 6 );
@@ -248,10 +420,14 @@ SCENARIO("Spatial database", "[spatialdb][logic]")
                 
                 vector<NodeDbEntry> neighboursByDistance( geodb.GetNeighbourNodesByDistance() );
                 REQUIRE( geodb.GetNodeCount() == 6 );
+                REQUIRE( geodb.GetNodeCount(NodeRelationType::Neighbour) == 3 );
+                REQUIRE( geodb.GetNodeCount(NodeRelationType::Colleague) == 2 );
+                REQUIRE( geodb.CheckNodeCounts() );
                 REQUIRE( neighboursByDistance.size() == 3 );
                 REQUIRE( neighboursByDistance[0] == TestData::EntryKecskemet );
                 REQUIRE( neighboursByDistance[1] == TestData::EntryWien );
                 REQUIRE( neighboursByDistance[2] == updatedLondonEntry );
+                REQUIRE( geodb.GetNeighbourRank( TestData::NodeLondon.id() ) == 2 );
 
                 REQUIRE( listener->addedCount == 5 );
                 REQUIRE( listener->updatedCount == 1 );
@@ -268,8 +444,850 @@ SCENARIO("Spatial database", "[spatialdb][logic]")
                 REQUIRE( listener->removedCount == 5 );
                 
                 REQUIRE( geodb.GetNodeCount() == 1 );
+                REQUIRE( geodb.GetNodeCount(NodeRelationType::Self) == 1 );
+                REQUIRE( geodb.CheckNodeCounts() );
+                REQUIRE( geodb.GetNeighbourNodesByDistance().empty() );
+            }
+        }
+
+        WHEN("having nodes around the antimeridian and the poles") {
+            auto makeEntry = [] (const NodeId &id, GpsCoordinate latitude, GpsCoordinate longitude)
+            {
+                return NodeDbEntry( NodeInfo( id, GpsLocation(latitude, longitude),
+                    NodeContact("127.0.0.1", 6666, 7777), {} ),
+                        NodeRelationType::Colleague, NodeContactRoleType::Acceptor );
+            };
+            NodeDbEntry fijiEast( makeEntry("FijiEastId", -17.0, 179.9) );
+            NodeDbEntry fijiWest( makeEntry("FijiWestId", -17.0, -179.7) );
+            NodeDbEntry northPole1( makeEntry("NorthPole1Id", 89.9, 0.0) );
+            NodeDbEntry northPole2( makeEntry("NorthPole2Id", 89.8, 180.0) );
+            NodeDbEntry southPole( makeEntry("SouthPoleId", -89.9, -90.0) );
+            geodb.Store(fijiEast);
+            geodb.Store(fijiWest);
+            geodb.Store(northPole1);
+            geodb.Store(northPole2);
+            geodb.Store(southPole);
+
+            THEN("closest nodes are found across the antimeridian") {
+                vector<NodeDbEntry> closestNodes = geodb.GetClosestNodesByDistance(
+                    GpsLocation(-17.0, -179.95), 50.0, 10, Neighbours::Included );
+                REQUIRE( closestNodes.size() == 2 );
+                REQUIRE( closestNodes[0] == fijiEast );
+                REQUIRE( closestNodes[1] == fijiWest );
+            }
+
+            THEN("closest nodes are found across the poles") {
+                vector<NodeDbEntry> closestNodes = geodb.GetClosestNodesByDistance(
+                    GpsLocation(89.95, 90.0), 100.0, 10, Neighbours::Included );
+                REQUIRE( closestNodes.size() == 2 );
+                REQUIRE( closestNodes[0] == northPole1 );
+                REQUIRE( closestNodes[1] == northPole2 );
+
+                closestNodes = geodb.GetClosestNodesByDistance(
+                    GpsLocation(-89.95, 90.0), 100.0, 10, Neighbours::Included );
+                REQUIRE( closestNodes.size() == 1 );
+                REQUIRE( closestNodes[0] == southPole );
+            }
+
+            THEN("the search area is expanded until enough nodes are found") {
+                vector<NodeDbEntry> closestNodes = geodb.GetClosestNodesByDistance(
+                    GpsLocation(-17.0, -179.95), numeric_limits<Distance>::max(), 3, Neighbours::Included );
+                REQUIRE( closestNodes.size() == 3 );
+                REQUIRE( closestNodes[0] == fijiEast );
+                REQUIRE( closestNodes[1] == fijiWest );
+                REQUIRE( closestNodes[2] == southPole );
+            }
+        }
+
+        WHEN("writing nodes in batches") {
+            shared_ptr<ChangeCounter> listener( new ChangeCounter("TestListenerId") );
+            geodb.changeListenerRegistry().AddListener(listener);
+            
+            THEN("changes are published only after commit") {
+                geodb.BeginBatch();
+                geodb.Store(TestData::EntryKecskemet);
+                geodb.BeginBatch();
+                geodb.Store(TestData::EntryLondon);
+                geodb.CommitBatch();
+                REQUIRE( geodb.GetNodeCount() == 3 );
+                REQUIRE( listener->addedCount == 0 );
+                // NOTE reads inside the batch use and must leave the open transaction of the writer connection
+                REQUIRE( geodb.GetClosestNodesByDistance( TestData::London, 1000.0, 1, Neighbours::Excluded ).size() == 1 );
+                geodb.CommitBatch();
+                
+                REQUIRE( listener->addedCount == 2 );
+                REQUIRE( geodb.Load( TestData::NodeLondon.id() ) );
+                REQUIRE( geodb.CheckNodeCounts() );
+            }
+            
+            THEN("rolled back changes are dropped") {
+                geodb.Store(TestData::EntryKecskemet);
+                geodb.BeginBatch();
+                geodb.Store(TestData::EntryLondon);
+                geodb.Remove( TestData::NodeKecskemet.id() );
+                geodb.BeginBatch();
+                geodb.Store(TestData::EntryWien);
+                geodb.RollbackBatch();
+                geodb.Store(TestData::EntryNewYork);
+                geodb.RollbackBatch();
+                
+                REQUIRE( listener->addedCount == 1 );
+                REQUIRE( listener->removedCount == 0 );
+                REQUIRE( geodb.GetNodeCount() == 2 );
+                REQUIRE( geodb.Load( TestData::NodeKecskemet.id() ) );
+                REQUIRE( ! geodb.Load( TestData::NodeLondon.id() ) );
+                REQUIRE( ! geodb.Load( TestData::NodeWien.id() ) );
+                REQUIRE( geodb.CheckNodeCounts() );
+            }
+            
+            THEN("failed writes are rolled back") {
+                geodb.Store(TestData::EntryKecskemet);
+                REQUIRE_THROWS( geodb.Store(TestData::EntryKecskemet) );
+                REQUIRE_THROWS( geodb.Update(TestData::EntryLondon) );
+                REQUIRE( listener->addedCount == 1 );
+                REQUIRE( listener->updatedCount == 0 );
+                REQUIRE( geodb.GetNodeCount() == 2 );
+                REQUIRE( geodb.CheckNodeCounts() );
+            }
+        }
+        
+        WHEN("having more nodes with services than queried in a single batch") {
+            const size_t nodeCount = 70;
+            for (size_t idx = 0; idx < nodeCount; ++idx)
+            {
+                string idxStr = to_string(idx);
+                NodeInfo::Services services{
+                    ServiceInfo("ServiceType::Profile", 1000 + idx, "Data" + idxStr) };
+                geodb.Store( NodeDbEntry( NodeInfo( "BatchNodeId" + idxStr, GpsLocation(1.0, 0.01 * idx),
+                    NodeContact("127.0.0.1", 6666, 7777), services ),
+                        NodeRelationType::Colleague, NodeContactRoleType::Initiator ) );
+            }
+
+            THEN("random samples are distinct and cover all nodes") {
+                unordered_set<NodeId> sampledIds;
+                for (size_t round = 0; round < 100; ++round)
+                {
+                    vector<NodeDbEntry> randomNodes = geodb.GetRandomNodes(10, Neighbours::Excluded);
+                    REQUIRE( randomNodes.size() == 10 );
+                    unordered_set<NodeId> roundIds;
+                    for (const auto &node : randomNodes)
+                    {
+                        REQUIRE( node.relationType() == NodeRelationType::Colleague );
+                        roundIds.insert( node.id() );
+                    }
+                    REQUIRE( roundIds.size() == 10 );
+                    sampledIds.insert( roundIds.begin(), roundIds.end() );
+                }
+                REQUIRE( sampledIds.size() == nodeCount );
+                
+                geodb.Remove("BatchNodeId0");
+                REQUIRE( geodb.GetRandomNodes(nodeCount, Neighbours::Excluded).size() == nodeCount - 1 );
+            }
+            
+            THEN("services of all nodes are loaded") {
+                vector<NodeDbEntry> randomNodes = geodb.GetRandomNodes(nodeCount + 1, Neighbours::Included);
+                REQUIRE( randomNodes.size() == nodeCount + 1 );
+                for (const auto &node : randomNodes)
+                {
+                    if ( node.id() == TestData::NodeBudapest.id() )
+                        { continue; }
+                    string idxStr = node.id().substr( string("BatchNodeId").size() );
+                    REQUIRE( node.services().size() == 1 );
+                    const ServiceInfo &service = node.services().at("ServiceType::Profile");
+                    REQUIRE( service.port() == 1000 + stoul(idxStr) );
+                    REQUIRE( service.customData() == "Data" + idxStr );
+                }
+            }
+
+            THEN("services can be skipped if not needed") {
+                vector<NodeDbEntry> closestNodes = geodb.GetClosestNodesByDistance(
+                    GpsLocation(1.0, 0.0), 1000.0, 2, Neighbours::Excluded, ServiceDetails::Excluded );
+                REQUIRE( closestNodes.size() == 2 );
+                REQUIRE( closestNodes[0].id() == "BatchNodeId0" );
+                REQUIRE( closestNodes[0].services().empty() );
+                REQUIRE( closestNodes[1].services().empty() );
+            }
+            
+            THEN("queries can be streamed and stopped early") {
+                vector<NodeDbEntry> closestNodes = geodb.GetClosestNodesByDistance(
+                    GpsLocation(1.0, 0.0), 1000.0, nodeCount, Neighbours::Excluded );
+                vector<NodeDbEntry> visitedNodes;
+                geodb.VisitClosestNodesByDistance( GpsLocation(1.0, 0.0), 1000.0, nodeCount, Neighbours::Excluded,
+                    [&visitedNodes] (const NodeDbEntry &node)
+                {
+                    visitedNodes.push_back(node);
+                    return visitedNodes.size() < 40;
+                } );
+                REQUIRE( visitedNodes.size() == 40 );
+                REQUIRE( equal( visitedNodes.begin(), visitedNodes.end(), closestNodes.begin() ) );
+                REQUIRE( visitedNodes.back().services().size() == 1 );
+                
+                size_t visitedCount = 0;
+                geodb.VisitRandomNodes( nodeCount, Neighbours::Excluded, [&visitedCount] (const NodeDbEntry &)
+                    { return ++visitedCount < 5; } );
+                REQUIRE( visitedCount == 5 );
+                
+                visitedCount = 0;
+                geodb.VisitNodes( NodeContactRoleType::Initiator, [&visitedCount] (const NodeDbEntry &)
+                    { ++visitedCount; return true; } );
+                REQUIRE( visitedCount == nodeCount );
+            }
+        }
+
+        WHEN("storing and expiring fresh nodes repeatedly") {
+            NodeIdTable &idTable = NodeIdTable::Instance();
+            size_t idCountBefore = idTable.size();
+            time_t expired = chrono::system_clock::to_time_t( chrono::system_clock::now() ) - 1;
+            
+            THEN("ids of nodes gone are released from the id table") {
+                for (size_t cycle = 0; cycle < 5; ++cycle)
+                {
+                    for (size_t idx = 0; idx < 100; ++idx)
+                    {
+                        NodeId nodeId = "CycleNodeId" + to_string(cycle) + "_" + to_string(idx);
+                        geodb.StoreExpiringAt( NodeDbEntry( NodeInfo( nodeId, TestData::London,
+                            TestData::NodeLondon.contact(), NodeInfo::Services() ),
+                            NodeRelationType::Neighbour, NodeContactRoleType::Acceptor ), expired );
+                    }
+                    REQUIRE( idTable.size() == idCountBefore + 100 );
+                    geodb.Remove("CycleNodeId" + to_string(cycle) + "_0");
+                    
+                    geodb.BeginBatch();
+                    geodb.Store( NodeDbEntry( NodeInfo( "RolledBackNodeId", TestData::London,
+                        TestData::NodeLondon.contact(), NodeInfo::Services() ),
+                        NodeRelationType::Colleague, NodeContactRoleType::Acceptor ) );
+                    geodb.RollbackBatch();
+                    
+                    geodb.ExpireOldNodes();
+                    REQUIRE( geodb.GetNodeCount() == 1 );
+                    REQUIRE( idTable.size() == idCountBefore );
+                }
+            }
+        }
+        
+        WHEN("running the same queries repeatedly") {
+            auto runQueries = [&geodb] (const NodeDbEntry &entry)
+            {
+                geodb.Store(entry);
+                geodb.Update(entry);
+                geodb.Load( entry.id() );
+                geodb.GetDistanceKm( TestData::Budapest, entry.location() );
+                geodb.GetNodeCount();
+                geodb.GetNeighbourNodesByDistance();
+                geodb.GetClosestNodesByDistance( entry.location(), 5000.0, 3, Neighbours::Excluded );
+                geodb.GetRandomNodes(2, Neighbours::Included);
+                geodb.ExpireOldNodes();
+                geodb.Remove( entry.id() );
+            };
+
+            runQueries(TestData::EntryKecskemet);
+            size_t missesBefore = geodb.statementCache().missCount();
+            size_t hitsBefore   = geodb.statementCache().hitCount();
+
+            runQueries(TestData::EntryLondon);
+            runQueries(TestData::EntryCapeTown);
+
+            THEN("prepared statements are reused from the cache") {
+                REQUIRE( geodb.statementCache().missCount() == missesBefore );
+                REQUIRE( geodb.statementCache().hitCount() > hitsBefore );
+            }
+        }
+    }
+    
+    GIVEN("A spatial database file shared by concurrent readers") {
+        const string dbPath = "locnet_readers_test.sqlite";
+        TemporaryFiles dbFiles( dbPath, { "", "-wal", "-shm" } );
+        
+        SpatiaLiteDatabase geodb(TestData::NodeBudapest, dbPath, chrono::hours(1) );
+        geodb.Store(TestData::EntryKecskemet);
+        geodb.Store(TestData::EntryWien);
+        geodb.Store(TestData::EntryLondon);
+        
+        WHEN("a batch is open") {
+            geodb.BeginBatch();
+            geodb.Store(TestData::EntryNewYork);
+            
+            THEN("only the writing thread sees its uncommitted changes") {
+                REQUIRE( geodb.Load( TestData::NodeNewYork.id() ) );
+                bool foundByOthers = async( launch::async, [&geodb]
+                    { return geodb.Load( TestData::NodeNewYork.id() ) != nullptr; } ).get();
+                REQUIRE( ! foundByOthers );
+                geodb.RollbackBatch();
+            }
+        }
+        
+        WHEN("reading from several threads while writing") {
+            const size_t READER_COUNT = 4;
+            const size_t READ_COUNT = 200;
+            atomic<bool> consistent(true);
+            
+            vector<thread> readers;
+            for (size_t readerIdx = 0; readerIdx < READER_COUNT; ++readerIdx)
+            {
+                readers.emplace_back( [&geodb, &consistent, READ_COUNT]
+                {
+                    for (size_t readIdx = 0; readIdx < READ_COUNT; ++readIdx)
+                    {
+                        vector<NodeDbEntry> closest = geodb.GetClosestNodesByDistance(
+                            TestData::Budapest, 20000, 10, Neighbours::Included );
+                        if ( closest.size() < 4 || closest.size() > 5 || ! geodb.Load( TestData::NodeLondon.id() ) )
+                            { consistent = false; }
+                    }
+                } );
+            }
+            
+            for (size_t writeIdx = 0; writeIdx < 50; ++writeIdx)
+            {
+                geodb.Store(TestData::EntryNewYork);
+                geodb.Remove( TestData::NodeNewYork.id() );
+            }
+            for (auto &reader : readers)
+                { reader.join(); }
+            
+            THEN("readers always see a committed state") {
+                REQUIRE( consistent );
+                REQUIRE( geodb.GetNodeCount() == 4 );
+                REQUIRE( geodb.readerLockStats().acquireCount >= READER_COUNT * READ_COUNT * 2 );
+                REQUIRE( geodb.writerLockStats().acquireCount >= 100 );
+            }
+        }
+    }
+    
+    GIVEN("A spatial database with immediately expiring entries") {
+        SpatiaLiteDatabase geodb(TestData::NodeBudapest,
+            SpatiaLiteDatabase::IN_MEMORY_DB, chrono::seconds(0) );
+        shared_ptr<ChangeCounter> listener( new ChangeCounter("TestListenerId") );
+        geodb.changeListenerRegistry().AddListener(listener);
+        
+        geodb.Store(TestData::EntryKecskemet);
+        geodb.Store(TestData::EntryLondon);
+        geodb.Store(TestData::EntryWien);
+        geodb.Store(TestData::EntryNewYork, false);
+        
+        WHEN("expiring old nodes") {
+            geodb.ExpireOldNodes();
+            
+            THEN("all expired nodes are removed at once") {
+                REQUIRE( listener->removedCount == 3 );
+                REQUIRE( geodb.GetNodeCount() == 2 );
+                REQUIRE( geodb.CheckNodeCounts() );
+                REQUIRE( ! geodb.Load( TestData::NodeKecskemet.id() ) );
+                REQUIRE( ! geodb.Load( TestData::NodeWien.id() ) );
+                REQUIRE( geodb.Load( TestData::NodeNewYork.id() ) );
                 REQUIRE( geodb.GetNeighbourNodesByDistance().empty() );
+                REQUIRE( geodb.GetClosestNodesByDistance( TestData::London, 1000, 10, Neighbours::Included ).empty() );
+                
+                geodb.ExpireOldNodes();
+                REQUIRE( listener->removedCount == 3 );
+                REQUIRE( geodb.GetNodeCount() == 2 );
+            }
+        }
+    }
+}
+
+
+
+SCENARIO("In-memory database with write-behind persistence", "[spatialdb][logic]")
+{
+    const string dbPath = "locnet_cacheddb_test.sqlite";
+    TemporaryFiles dbFiles( dbPath, { "", "-wal", "-shm" } );
+    
+    GIVEN("An in-memory database with some nodes") {
+        unique_ptr<CachedSpatialDatabase> geodb( new CachedSpatialDatabase(
+            TestData::NodeBudapest, dbPath, chrono::hours(1) ) );
+        shared_ptr<ChangeCounter> listener( new ChangeCounter("TestListenerId") );
+        geodb->changeListenerRegistry().AddListener(listener);
+        
+        geodb->Store(TestData::EntryKecskemet);
+        geodb->Store(TestData::EntryWien);
+        geodb->Store(TestData::EntryLondon);
+        geodb->Store(TestData::EntryNewYork, false);
+        geodb->Store(TestData::EntryCapeTown);
+        
+        THEN("it serves queries like the SpatiaLite implementation") {
+            REQUIRE( listener->addedCount == 5 );
+            REQUIRE( geodb->GetNodeCount() == 6 );
+            REQUIRE( geodb->GetNodeCount(NodeRelationType::Neighbour) == 2 );
+            REQUIRE( *geodb->ThisNode() == TestData::EntryBudapest );
+            REQUIRE_THROWS( geodb->Store(TestData::EntryLondon) );
+            REQUIRE_THROWS( geodb->Remove( TestData::NodeBudapest.id() ) );
+            
+            vector<NodeDbEntry> neighbours = geodb->GetNeighbourNodesByDistance();
+            REQUIRE( neighbours.size() == 2 );
+            REQUIRE( neighbours[0] == TestData::EntryKecskemet );
+            REQUIRE( neighbours[1] == TestData::EntryWien );
+            
+            SpatiaLiteDatabase spatialiteDb(TestData::NodeBudapest, SpatiaLiteDatabase::IN_MEMORY_DB, chrono::hours(1) );
+            REQUIRE( geodb->GetDistanceKm(TestData::Budapest, TestData::CapeTown) ==
+                     spatialiteDb.GetDistanceKm(TestData::Budapest, TestData::CapeTown) );
+            REQUIRE( geodb->GetNeighbourDistanceKm(1) ==
+                     Approx( spatialiteDb.GetDistanceKm(TestData::Budapest, TestData::Wien) ) );
+            
+            geodb->Update( NodeDbEntry( NodeInfo( TestData::NodeBudapest.id(), TestData::London,
+                TestData::NodeBudapest.contact(), TestData::NodeBudapest.services() ),
+                NodeRelationType::Self, NodeContactRoleType::Self ), false );
+            neighbours = geodb->GetNeighbourNodesByDistance();
+            REQUIRE( neighbours.size() == 2 );
+            REQUIRE( neighbours[0] == TestData::EntryWien );
+            REQUIRE( neighbours[1] == TestData::EntryKecskemet );
+            REQUIRE( geodb->GetNeighbourRank( TestData::NodeKecskemet.id() ) == 1 );
+            REQUIRE( geodb->GetNeighbourDistanceKm(0) == Approx( geodb->GetDistanceKm(TestData::London, TestData::Wien) ) );
+            
+            vector<NodeDbEntry> closest = geodb->GetClosestNodesByDistance(
+                TestData::London, 10000, 2, Neighbours::Excluded );
+            REQUIRE( closest.size() == 2 );
+            REQUIRE( closest[0] == TestData::EntryLondon );
+            REQUIRE( closest[1] == TestData::EntryNewYork );
+            
+            REQUIRE( geodb->GetRandomNodes(10, Neighbours::Excluded).size() == 3 );
+            REQUIRE( geodb->GetRandomNodes(2, Neighbours::Included).size() == 2 );
+            
+            vector<NodeId> visitedIds;
+            geodb->VisitClosestNodesByDistance( TestData::London, 10000, 2, Neighbours::Excluded,
+                [&visitedIds] (const NodeDbEntry &node) { visitedIds.push_back( node.id() ); return false; } );
+            REQUIRE( visitedIds == vector<NodeId>{ TestData::NodeLondon.id() } );
+        }
+        
+        WHEN("storing and expiring fresh nodes repeatedly") {
+            geodb->Flush();
+            NodeIdTable &idTable = NodeIdTable::Instance();
+            size_t idCountBefore = idTable.size();
+            time_t expired = chrono::system_clock::to_time_t( chrono::system_clock::now() ) - 1;
+            
+            THEN("ids are released once nodes are gone also from the persistent database") {
+                for (size_t cycle = 0; cycle < 5; ++cycle)
+                {
+                    for (size_t idx = 0; idx < 100; ++idx)
+                    {
+                        NodeId nodeId = "CachedCycleNodeId" + to_string(cycle) + "_" + to_string(idx);
+                        geodb->StoreExpiringAt( NodeDbEntry( NodeInfo( nodeId, TestData::London,
+                            TestData::NodeLondon.contact(), NodeInfo::Services() ),
+                            NodeRelationType::Colleague, NodeContactRoleType::Acceptor ), expired );
+                    }
+                    geodb->Flush();
+                    REQUIRE( idTable.size() == idCountBefore + 100 );
+                    
+                    geodb->Remove("CachedCycleNodeId" + to_string(cycle) + "_0");
+                    geodb->BeginBatch();
+                    geodb->Store( NodeDbEntry( NodeInfo( "CachedRolledBackNodeId", TestData::London,
+                        TestData::NodeLondon.contact(), NodeInfo::Services() ),
+                        NodeRelationType::Colleague, NodeContactRoleType::Acceptor ) );
+                    geodb->RollbackBatch();
+                    
+                    geodb->ExpireOldNodes();
+                    geodb->Flush();
+                    REQUIRE( geodb->GetNodeCount() == 6 );
+                    REQUIRE( idTable.size() == idCountBefore );
+                }
+            }
+        }
+        
+        WHEN("a batch is rolled back") {
+            geodb->BeginBatch();
+            geodb->Remove( TestData::NodeLondon.id() );
+            geodb->Update( NodeDbEntry( TestData::NodeWien,
+                NodeRelationType::Colleague, NodeContactRoleType::Acceptor ) );
+            geodb->RollbackBatch();
+            
+            THEN("all changes are undone without notifications") {
+                REQUIRE( listener->removedCount == 0 );
+                REQUIRE( listener->updatedCount == 0 );
+                REQUIRE( geodb->GetNodeCount(NodeRelationType::Neighbour) == 2 );
+                REQUIRE( *geodb->Load( TestData::NodeLondon.id() ) == TestData::EntryLondon );
+                REQUIRE( *geodb->Load( TestData::NodeWien.id() ) == TestData::EntryWien );
+            }
+        }
+        
+        WHEN("changes are persisted") {
+            geodb->Remove( TestData::NodeCapeTown.id() );
+            geodb->Flush();
+            
+            THEN("they are found in the SpatiaLite database") {
+                geodb.reset();
+                SpatiaLiteDatabase persistentDb(TestData::NodeBudapest, dbPath, chrono::hours(1) );
+                REQUIRE( persistentDb.GetNodeCount() == 5 );
+                REQUIRE( ! persistentDb.Load( TestData::NodeCapeTown.id() ) );
+                REQUIRE( *persistentDb.Load( TestData::NodeWien.id() ) == TestData::EntryWien );
+            }
+            
+            THEN("the node map is restored after restart") {
+                geodb.reset( new CachedSpatialDatabase(
+                    TestData::NodeBudapest, dbPath, chrono::hours(1) ) );
+                REQUIRE( geodb->GetNodeCount() == 5 );
+                REQUIRE( geodb->GetNeighbourNodesByDistance().size() == 2 );
+                REQUIRE( *geodb->Load( TestData::NodeLondon.id() ) == TestData::EntryLondon );
+            }
+        }
+        
+        WHEN("a node is removed, stored again and updated in separate persists") {
+            geodb->Remove( TestData::NodeLondon.id() );
+            geodb->Flush();
+            geodb->Store(TestData::EntryLondon);
+            geodb->Flush();
+            NodeDbEntry updatedLondon( TestData::NodeLondon, NodeRelationType::Colleague, NodeContactRoleType::Acceptor );
+            geodb->Update(updatedLondon);
+            geodb->Flush();
+            
+            THEN("the SpatiaLite database has its latest state") {
+                geodb.reset();
+                SpatiaLiteDatabase persistentDb(TestData::NodeBudapest, dbPath, chrono::hours(1) );
+                REQUIRE( persistentDb.GetNodeCount() == 6 );
+                REQUIRE( *persistentDb.Load( TestData::NodeLondon.id() ) == updatedLondon );
+            }
+        }
+    }
+    
+    GIVEN("An in-memory database with immediately expiring entries") {
+        {
+            CachedSpatialDatabase geodb(TestData::NodeBudapest, dbPath, chrono::seconds(0) );
+            geodb.Store(TestData::EntryKecskemet);
+            geodb.Store(TestData::EntryLondon);
+            geodb.Store(TestData::EntryNewYork, false);
+            geodb.ExpireOldNodes();
+            REQUIRE( geodb.GetNodeCount() == 2 );
+        }
+        
+        THEN("expired nodes are removed from disk too") {
+            SpatiaLiteDatabase persistentDb(TestData::NodeBudapest, dbPath, chrono::hours(1) );
+            REQUIRE( persistentDb.GetNodeCount() == 2 );
+            REQUIRE( persistentDb.Load( TestData::NodeNewYork.id() ) );
+        }
+    }
+}
+
+
+
+SCENARIO("Node map snapshot", "[spatialdb][logic]")
+{
+    const string snapshotPath = "locnet_snapshot_test.bin";
+    TemporaryFiles snapshotFiles( snapshotPath, { "" } );
+    
+    GIVEN("A snapshot written from a database with some nodes") {
+        SpatiaLiteDatabase geodb(TestData::NodeBudapest, SpatiaLiteDatabase::IN_MEMORY_DB, chrono::hours(1) );
+        geodb.Store(TestData::EntryKecskemet);
+        geodb.Store(TestData::EntryWien);
+        geodb.Store(TestData::EntryLondon);
+        geodb.Store(TestData::EntryNewYork, false);
+        geodb.Store(TestData::EntryCapeTown);
+        
+        time_t now = chrono::system_clock::to_time_t( chrono::system_clock::now() );
+        NodeMapSnapshot::Write( snapshotPath, geodb.LoadAllEntries(), now );
+        NodeMapSnapshot snapshot(snapshotPath);
+        
+        THEN("nodes can be read back") {
+            REQUIRE( snapshot.createdAt() == now );
+            REQUIRE( snapshot.size() == 6 );
+            
+            size_t position;
+            REQUIRE( ! snapshot.Find("NonExistingNodeId", position) );
+            for ( const NodeDbEntry &entry : { TestData::EntryBudapest, TestData::EntryKecskemet, TestData::EntryWien,
+                    TestData::EntryLondon, TestData::EntryNewYork, TestData::EntryCapeTown } )
+            {
+                REQUIRE( snapshot.Find( entry.id(), position ) );
+                REQUIRE( snapshot.Entry(position) == entry );
+            }
+            
+            REQUIRE( snapshot.Find( TestData::NodeNewYork.id(), position ) );
+            REQUIRE( snapshot.ExpiresAt(position) == numeric_limits<time_t>::max() );
+            REQUIRE( snapshot.Find( TestData::NodeLondon.id(), position ) );
+            REQUIRE( snapshot.ExpiresAt(position) > now );
+            REQUIRE_THROWS( snapshot.Entry(6) );
+        }
+        
+        THEN("nodes are grouped by grid cells") {
+            unordered_set<NodeId> cellIds;
+            snapshot.VisitCell( TestData::Budapest, [&cellIds] (const NodeDbEntry &node)
+                { cellIds.insert( node.id() ); return true; } );
+            REQUIRE( cellIds == unordered_set<NodeId>{ TestData::NodeBudapest.id(),
+                TestData::NodeKecskemet.id(), TestData::NodeWien.id() } );
+        }
+        
+        THEN("nodes are restored into an empty database") {
+            // NOTE a longer expiration period than the original one must not extend restored nodes
+            SpatiaLiteDatabase restoredDb(TestData::NodeBudapest, SpatiaLiteDatabase::IN_MEMORY_DB, chrono::hours(10) );
+            REQUIRE( snapshot.RestoreInto(restoredDb, now) == 5 );
+            REQUIRE( restoredDb.GetNodeCount() == 6 );
+            REQUIRE( restoredDb.GetNeighbourNodesByDistance().size() == 2 );
+            REQUIRE( *restoredDb.Load( TestData::NodeCapeTown.id() ) == TestData::EntryCapeTown );
+            for ( const auto &restored : restoredDb.LoadAllEntries() )
+            {
+                size_t position;
+                REQUIRE( snapshot.Find( restored.first.id(), position ) );
+                if ( restored.first.relationType() != NodeRelationType::Self )
+                    { REQUIRE( restored.second == snapshot.ExpiresAt(position) ); }
+            }
+            
+            SpatiaLiteDatabase laterDb(TestData::NodeBudapest, SpatiaLiteDatabase::IN_MEMORY_DB, chrono::hours(1) );
+            REQUIRE( snapshot.RestoreInto( laterDb, now + 2 * 3600 ) == 1 );
+            REQUIRE( laterDb.Load( TestData::NodeNewYork.id() ) );
+        }
+        
+        THEN("concurrent writers do not clobber each other") {
+            vector< future<void> > writers;
+            for (size_t writerIdx = 0; writerIdx < 8; ++writerIdx)
+            {
+                writers.push_back( async( launch::async, [&snapshotPath, &geodb, now]
+                {
+                    for (size_t round = 0; round < 50; ++round)
+                        { NodeMapSnapshot::Write( snapshotPath, geodb.LoadAllEntries(), now ); }
+                } ) );
+            }
+            for (auto &writer : writers)
+                { REQUIRE_NOTHROW( writer.get() ); }
+            
+            NodeMapSnapshot rewritten(snapshotPath);
+            REQUIRE( rewritten.size() == 6 );
+        }
+        
+        THEN("damaged files are refused") {
+            {
+                ofstream file( snapshotPath, ios::binary | ios::in | ios::out );
+                file.seekp(8);
+                file.put(99);
+            }
+            REQUIRE_THROWS( NodeMapSnapshot{snapshotPath} );
+            
+            {
+                ofstream file( snapshotPath, ios::binary | ios::trunc );
+                file << "Not a snapshot";
+            }
+            REQUIRE_THROWS( NodeMapSnapshot{snapshotPath} );
+            REQUIRE_THROWS( NodeMapSnapshot{"NonExistingSnapshotFile"} );
+        }
+    }
+}
+
+
+
+SCENARIO("Location index", "[geodesic][logic]")
+{
+    GIVEN("A location index with random locations") {
+        mt19937 generator(42);
+        uniform_real_distribution<GpsCoordinate> latitudes(-90, 90);
+        uniform_real_distribution<GpsCoordinate> longitudes(-180, 180);
+        
+        const size_t locationCount = 1001;
+        LocationIndex index;
+        unordered_map<NodeHandle, pair<GpsLocation, uint8_t>> locations;
+        for (size_t idx = 0; idx < locationCount; ++idx)
+        {
+            NodeHandle id = idx;
+            GpsLocation location( latitudes(generator), longitudes(generator) );
+            uint8_t tag = idx % 3;
+            index.Set(id, location, tag);
+            locations.emplace( id, make_pair(location, tag) );
+        }
+        
+        auto bruteForceClosest = [&locations] (const GpsLocation &from, Distance maxRadiusKm,
+            size_t maxCount, uint32_t tagMask)
+        {
+            vector< pair<Distance, NodeHandle> > candidates;
+            for (const auto &entry : locations)
+            {
+                Distance distance = GeodesicDistanceKm(from, entry.second.first, DistanceModel::Haversine);
+                if ( distance <= maxRadiusKm && ( tagMask & (1u << entry.second.second) ) )
+                    { candidates.emplace_back(distance, entry.first); }
+            }
+            sort( candidates.begin(), candidates.end() );
+            if ( candidates.size() > maxCount )
+                { candidates.resize(maxCount); }
+            return candidates;
+        };
+        
+        auto requireSameResults = [&] (const GpsLocation &from, Distance maxRadiusKm,
+            size_t maxCount, uint32_t tagMask)
+        {
+            vector<LocationIndex::Result> closest = index.GetClosest(from, maxRadiusKm, maxCount, tagMask);
+            vector< pair<Distance, NodeHandle> > expected = bruteForceClosest(from, maxRadiusKm, maxCount, tagMask);
+            REQUIRE( closest.size() == expected.size() );
+            for (size_t idx = 0; idx < closest.size(); ++idx)
+                { REQUIRE( closest[idx].second == Approx(expected[idx].first).epsilon(0.0001) ); }
+        };
+        
+        THEN("it returns the same closest locations as a full scan") {
+            REQUIRE( index.size() == locationCount );
+            requireSameResults( TestData::Budapest, 5000, 10, ~0u );
+            requireSameResults( TestData::NewYork, numeric_limits<Distance>::max(), 50, ~0u );
+            requireSameResults( TestData::CapeTown, 3000, 1000, 1u << 1 );
+            requireSameResults( TestData::London, numeric_limits<Distance>::max(), locationCount, (1u << 0) | (1u << 2) );
+        }
+        
+        THEN("locations can be updated and removed") {
+            index.Set( 0, TestData::Budapest, 2 );
+            vector<LocationIndex::Result> closest = index.GetClosest(TestData::Budapest, 1, 5);
+            REQUIRE( closest.size() == 1 );
+            REQUIRE( closest[0].first == 0 );
+            REQUIRE( closest[0].second == Approx(0).margin(0.001) );
+            REQUIRE( index.GetClosest(TestData::Budapest, 1, 5, 1u << 0).empty() );
+            
+            for (size_t idx = 0; idx < locationCount; idx += 2)
+            {
+                NodeHandle id = idx;
+                index.Remove(id);
+                locations.erase(id);
             }
+            REQUIRE( index.size() == locations.size() );
+            REQUIRE( index.GetClosest(TestData::Budapest, 1, 5).empty() );
+            requireSameResults( TestData::Wien, numeric_limits<Distance>::max(), locationCount, ~0u );
+        }
+    }
+}
+
+
+
+SCENARIO("Neighbourhood index", "[spatialdb][logic]")
+{
+    GIVEN("A neighbourhood index with random distances") {
+        mt19937 generator(42);
+        uniform_real_distribution<Distance> distances(0, 20000);
+        
+        const size_t neighbourCount = 1001;
+        NeighbourhoodIndex index;
+        vector<NodeHandle> handles;
+        unordered_map<NodeHandle, Distance> neighbours;
+        for (size_t idx = 0; idx < neighbourCount; ++idx)
+        {
+            // NOTE ids are interned in reverse order so handle order differs from id order
+            NodeHandle id = NodeIdTable::Instance().Intern( "IndexNode" + to_string(neighbourCount - idx) );
+            // Every tenth node has the same distance as the previous one, ordered by id
+            Distance distance = idx % 10 == 9 ? neighbours[handles.back()] : distances(generator);
+            handles.push_back(id);
+            index.Set(id, distance);
+            neighbours[id] = distance;
+        }
+        NodeHandle unknownHandle = NodeIdTable::Instance().Intern("IndexNodeUnknown");
+        
+        auto requireSameOrder = [&index, &neighbours]
+        {
+            vector< pair<Distance, NodeHandle> > expected;
+            for (const auto &entry : neighbours)
+                { expected.emplace_back(entry.second, entry.first); }
+            sort( expected.begin(), expected.end(), [] (const pair<Distance, NodeHandle> &one, const pair<Distance, NodeHandle> &other)
+            {
+                if (one.first != other.first)
+                    { return one.first < other.first; }
+                return NodeIdTable::Instance().Id(one.second) < NodeIdTable::Instance().Id(other.second);
+            } );
+            
+            vector<NodeHandle> ids = index.Ids();
+            REQUIRE( index.size() == expected.size() );
+            REQUIRE( ids.size() == expected.size() );
+            for (size_t rank = 0; rank < expected.size(); ++rank)
+            {
+                REQUIRE( ids[rank] == expected[rank].second );
+                REQUIRE( index.Rank(expected[rank].second) == rank );
+                REQUIRE( index.DistanceAt(rank) == expected[rank].first );
+            }
+        };
+        
+        THEN("ranks and distances match a sorted full list") {
+            requireSameOrder();
+            REQUIRE_THROWS( index.Rank(unknownHandle) );
+            REQUIRE_THROWS( index.DistanceAt(neighbourCount) );
+        }
+        
+        THEN("neighbours can be moved and removed") {
+            for (size_t idx = 0; idx < neighbourCount; idx += 3)
+            {
+                NodeHandle id = handles[idx];
+                Distance distance = distances(generator);
+                index.Set(id, distance);
+                neighbours[id] = distance;
+            }
+            for (size_t idx = 1; idx < neighbourCount; idx += 3)
+            {
+                NodeHandle id = handles[idx];
+                index.Remove(id);
+                neighbours.erase(id);
+            }
+            index.Remove(unknownHandle);
+            requireSameOrder();
+            
+            index.Clear();
+            REQUIRE( index.size() == 0 );
+            REQUIRE( index.Ids().empty() );
+        }
+    }
+}
+
+
+
+SCENARIO("Timing wheel", "[spatialdb][logic]")
+{
+    GIVEN("A timing wheel with random deadlines") {
+        mt19937 generator(42);
+        const time_t start = 1500000000;
+        const time_t horizon = 2 * 24 * 3600;
+        uniform_int_distribution<time_t> delays(0, horizon);
+        
+        const size_t nodeCount = 1001;
+        TimingWheel wheel(start);
+        unordered_map<NodeHandle, time_t> deadlines;
+        for (NodeHandle handle = 0; handle < nodeCount; ++handle)
+        {
+            time_t deadline = start + delays(generator);
+            wheel.Set(handle, deadline);
+            deadlines[handle] = deadline;
+        }
+        
+        auto requireDueExactly = [&wheel, &deadlines] (time_t now)
+        {
+            unordered_set<NodeHandle> expected;
+            for (auto it = deadlines.begin(); it != deadlines.end(); )
+            {
+                if (it->second <= now)
+                {
+                    expected.insert(it->first);
+                    it = deadlines.erase(it);
+                }
+                else { ++it; }
+            }
+            
+            vector<NodeHandle> due = wheel.PopDue(now);
+            REQUIRE( due.size() == expected.size() );
+            REQUIRE( unordered_set<NodeHandle>( due.begin(), due.end() ) == expected );
+            REQUIRE( wheel.size() == deadlines.size() );
+        };
+        
+        THEN("nodes become due exactly when their deadline passes") {
+            REQUIRE( wheel.size() == nodeCount );
+            REQUIRE( wheel.PopDue(start - 1).empty() );
+            for (time_t now = start; now <= start + horizon; now += 997)
+                { requireDueExactly(now); }
+            requireDueExactly(start + horizon);
+            REQUIRE( wheel.size() == 0 );
+        }
+        
+        THEN("deadlines can be changed and removed") {
+            for (NodeHandle handle = 0; handle < nodeCount; handle += 3)
+            {
+                time_t deadline = start + delays(generator);
+                wheel.Set(handle, deadline);
+                deadlines[handle] = deadline;
+            }
+            for (NodeHandle handle = 1; handle < nodeCount; handle += 3)
+            {
+                wheel.Remove(handle);
+                deadlines.erase(handle);
+            }
+            wheel.Set(nodeCount, start - 10);
+            deadlines[nodeCount] = start - 10;
+            
+            requireDueExactly(start);
+            requireDueExactly(start + 3600);
+            
+            // Jumping far ahead is also handled
+            requireDueExactly(start + 100 * horizon);
+            REQUIRE( wheel.size() == 0 );
+        }
+        
+        THEN("due nodes can be taken in small batches") {
+            vector<NodeHandle> due = wheel.PopDue(start + horizon, 100);
+            REQUIRE( due.size() == 100 );
+            REQUIRE( wheel.size() == nodeCount - 100 );
+            for (NodeHandle handle : due)
+                { deadlines.erase(handle); }
+            requireDueExactly(start + horizon);
         }
     }
 }
@@ -290,7 +1308,7 @@ SCENARIO("Server registration", "[localservice][logic]")
         
         WHEN("it's newly created") {
             THEN("it has no registered servers") {
-                auto services = geonet->GetNodeInfo().services();
+                auto services = geonet->GetNodeInfo()->services();
                 REQUIRE( services.empty() );
                 REQUIRE( services.find("ServiceType::Token") == services.end() );
                 REQUIRE( services.find("ServiceType::Minting") == services.end() );
@@ -305,7 +1323,7 @@ SCENARIO("Server registration", "[localservice][logic]")
             geonet->RegisterService(minterService);
             geonet->RegisterService(profileService);
             THEN("added servers appear on queries") {
-                NodeInfo nodeInfo = geonet->GetNodeInfo();
+                NodeInfo nodeInfo = *geonet->GetNodeInfo();
                 const auto &services = nodeInfo.services();
                 REQUIRE( services.size() == 3 );
                 REQUIRE( services.find("ServiceType::Relay") == services.end() );
@@ -323,7 +1341,7 @@ SCENARIO("Server registration", "[localservice][logic]")
             geonet->RegisterService(minterService);
             geonet->DeregisterService("ServiceType::Minting");
             THEN("they disappear from the list") {
-                NodeInfo nodeInfo = geonet->GetNodeInfo();
+                NodeInfo nodeInfo = *geonet->GetNodeInfo();
                 const auto &services = nodeInfo.services();
                 REQUIRE( services.find("ServiceType::Relay") == services.end() );
                 REQUIRE( services.find("ServiceType::Minting") == services.end() );
@@ -59,6 +59,32 @@ SCENARIO("ProtoBuf messaging", "[messaging]")
             NodeInfo secondNeighbour( Converter::FromProtoBuf( getNeighboursResp.nodes(1) ) );
             REQUIRE( secondNeighbour == TestData::NodeWien );
         }
+        
+        THEN("Client GetNodeInfo requests follow changes of our node info") {
+            auto getNodeInfo = [&dispatcher]
+            {
+                unique_ptr<iop::locnet::Request> request( new iop::locnet::Request() );
+                request->set_version({1,0,0});
+                request->mutable_client()->mutable_get_node_info();
+                
+                unique_ptr<iop::locnet::Response> response = dispatcher.Dispatch( move(request) );
+                REQUIRE( response->has_client() );
+                REQUIRE( response->client().has_get_node_info() );
+                return Converter::FromProtoBuf( response->client().get_node_info().node_info() );
+            };
+            
+            shared_ptr<const NodeDbEntry> oldSnapshot = geodb->ThisNode();
+            REQUIRE( getNodeInfo() == TestData::NodeBudapest );
+            REQUIRE( getNodeInfo() == TestData::NodeBudapest );
+            
+            NodeDbEntry updatedEntry(*oldSnapshot);
+            updatedEntry.services().Set( ServiceInfo("ServiceType::Token", 1111) );
+            geodb->Update(updatedEntry, false);
+            
+            REQUIRE( *oldSnapshot == TestData::EntryBudapest );
+            REQUIRE( *geodb->ThisNode() == updatedEntry );
+            REQUIRE( getNodeInfo() == updatedEntry );
+        }
     }
     
 }
@@ -1,3 +1,6 @@
+#include <atomic>
+#include <cstdlib>
+#include <new>
 #include <thread>
 
 #include <asio.hpp>
@@ -15,6 +18,25 @@ using namespace asio::ip;
 
 
 
+// Heap allocations big enough to be message buffers made by any thread, used to verify that buffers are recycled
+static const size_t BufferAllocationSize = 2048;
+static atomic<size_t> BufferAllocationCount(0);
+
+void* operator new(size_t size)
+{
+    if (size >= BufferAllocationSize)
+        { ++BufferAllocationCount; }
+    void *result = malloc(size == 0 ? 1 : size);
+    if (result == nullptr)
+        { throw bad_alloc(); }
+    return result;
+}
+
+void operator delete(void *pointer) noexcept
+    { free(pointer); }
+
+
+
 void reactorLoop(const string &threadName)
 {
     LOG(DEBUG) << "Thread " << threadName << " started";
@@ -35,6 +57,135 @@ void reactorLoop(const string &threadName)
 
 
 
+SCENARIO("Buffer pool", "[network]")
+{
+    GIVEN("A buffer pool with some buffers already used")
+    {
+        BufferPool pool(256, 1024 * 1024, 2);
+        pool.Release( pool.Acquire(5) );
+        pool.Release( pool.Acquire(2000) );
+        pool.Release( pool.Acquire(3000) );
+        
+        THEN("buffers of the requested size are returned")
+        {
+            REQUIRE( pool.Acquire(5)->size() == 5 );
+            REQUIRE( pool.Acquire(3000)->size() == 3000 );
+            REQUIRE( pool.Acquire(2 * 1024 * 1024)->size() == 2 * 1024 * 1024 );
+        }
+        
+        THEN("buffers bigger than the largest class are not kept")
+        {
+            pool.Release( pool.Acquire(4 * 1024 * 1024) );
+            size_t allocationsBefore = BufferAllocationCount;
+            pool.Acquire(1024 * 1024);
+            REQUIRE( BufferAllocationCount == allocationsBefore + 1 );
+        }
+    }
+}
+
+
+
+// Serves all requests with the same response, without touching the database
+class CannedResponseDispatcher : public IBlockingRequestDispatcher
+{
+    iop::locnet::Response _response;
+    
+public:
+    
+    CannedResponseDispatcher(const iop::locnet::Response &response) : _response(response) {}
+    
+    unique_ptr<iop::locnet::Response> Dispatch(unique_ptr<iop::locnet::Request> &&) override
+        { return unique_ptr<iop::locnet::Response>( new iop::locnet::Response(_response) ); }
+};
+
+
+
+SCENARIO("Message buffers of request and response round trips", "[network]")
+{
+    GIVEN("A server responding with a few kilobytes of neighbour nodes")
+    {
+        shared_ptr<TestConfig> config( new TestConfig(TestData::NodeBudapest) );
+        const NodeContact &nodeContact( config->myNodeInfo().contact() );
+        
+        // NOTE the response consists of many small items, so parsing it does not allocate buffer-sized memory
+        iop::locnet::Response response;
+        auto neighbours = response.mutable_local_service()->mutable_get_neighbour_nodes();
+        for (size_t idx = 0; idx < 96; ++idx)
+            { neighbours->mutable_nodes()->AddAllocated( Converter::ToProtoBuf(TestData::NodeKecskemet) ); }
+        REQUIRE( response.ByteSize() > BufferAllocationSize );
+        
+        shared_ptr<IBlockingRequestDispatcherFactory> dispatcherFactory(
+            new StaticBlockingDispatcherFactory( shared_ptr<IBlockingRequestDispatcher>(
+                new CannedResponseDispatcher(response) ) ) );
+        shared_ptr<WorkerPool> workers( new WorkerPool( "Test", config->nodeWorkerCount(), 16 ) );
+        shared_ptr<DispatchingTcpServer> tcpServer = DispatchingTcpServer::Create(
+            nodeContact.nodePort(), dispatcherFactory, workers );
+        tcpServer->StartListening();
+        
+        thread reactorMainThread( [] { reactorLoop("ReactorMain"); } );
+        reactorMainThread.detach();
+        
+        THEN("round trips of similar messages do not allocate new buffers on either side")
+        {
+            shared_ptr<IProtoBufChannel> clientChannel( AsyncProtoBufTcpChannel::Connect(
+                nodeContact.nodeEndpoint(), config->connectTimeout(), asio::use_future ).get() );
+            auto requestNeighbours = [clientChannel]
+            {
+                unique_ptr<iop::locnet::Message> requestMsg( new iop::locnet::Message() );
+                requestMsg->mutable_request()->mutable_local_service()->mutable_get_neighbour_nodes();
+                requestMsg->mutable_request()->set_version({1,0,0});
+                clientChannel->SendMessage( move(requestMsg), asio::use_future ).get();
+                unique_ptr<iop::locnet::Message> responseMsg( clientChannel->ReceiveMessage(asio::use_future).get() );
+                return responseMsg->response().local_service().get_neighbour_nodes().nodes_size();
+            };
+            
+            // NOTE formatting log messages would also allocate, turn logging off while measuring
+            el::Loggers::reconfigureAllLoggers(el::ConfigurationType::Enabled, "false");
+            for (size_t round = 0; round < 10; ++round)
+                { requestNeighbours(); }
+            
+            size_t allocationsBefore = BufferAllocationCount;
+            int nodesReceived = 0;
+            for (size_t round = 0; round < 100; ++round)
+                { nodesReceived += requestNeighbours(); }
+            size_t allocationsAfter = BufferAllocationCount;
+            el::Loggers::reconfigureAllLoggers(el::ConfigurationType::Enabled, "true");
+            
+            REQUIRE( nodesReceived == 9600 );
+            REQUIRE( allocationsAfter == allocationsBefore );
+        }
+        
+        Reactor::Instance().Shutdown();
+    }
+}
+
+
+
+SCENARIO("Worker pool", "[network]")
+{
+    GIVEN("A worker pool with a single thread and a short queue")
+    {
+        WorkerPool workers("Test", 1, 1);
+        promise<void> blockerStarted;
+        promise<void> blockerReleased;
+        shared_future<void> released( blockerReleased.get_future() );
+        REQUIRE( workers.Post( [&blockerStarted, released] { blockerStarted.set_value(); released.wait(); } ) );
+        blockerStarted.get_future().wait();
+        
+        THEN("tasks are queued only up to the limit")
+        {
+            promise<void> queuedDone;
+            REQUIRE( workers.Post( [&queuedDone] { queuedDone.set_value(); } ) );
+            REQUIRE( ! workers.Post( [] {} ) );
+            
+            blockerReleased.set_value();
+            REQUIRE( queuedDone.get_future().wait_for( chrono::seconds(5) ) == future_status::ready );
+        }
+    }
+}
+
+
+
 SCENARIO("Client-Server requests and responses with TCP networking", "[network]")
 {
     GIVEN("A configured Node and Tcp networking")
@@ -55,8 +206,9 @@ SCENARIO("Client-Server requests and responses with TCP networking", "[network]"
         
         shared_ptr<IBlockingRequestDispatcherFactory> dispatcherFactory(
             new CombinedBlockingRequestDispatcherFactory(node) );
+        shared_ptr<WorkerPool> workers( new WorkerPool( "Test", config->nodeWorkerCount(), 16 ) );
         shared_ptr<DispatchingTcpServer> tcpServer = DispatchingTcpServer::Create(
-            nodeContact.nodePort(), dispatcherFactory );
+            nodeContact.nodePort(), dispatcherFactory, workers );
         tcpServer->StartListening();
         
         thread reactorMainThread( [] { reactorLoop("ReactorMain"); } );
@@ -64,8 +216,8 @@ SCENARIO("Client-Server requests and responses with TCP networking", "[network]"
 
         THEN("It serves clients via sync TCP")
         {
-            shared_ptr<IProtoBufChannel> clientChannel( new AsyncProtoBufTcpChannel(
-                        nodeContact.nodeEndpoint() ) );
+            shared_ptr<IProtoBufChannel> clientChannel( AsyncProtoBufTcpChannel::Connect(
+                nodeContact.nodeEndpoint(), config->connectTimeout(), asio::use_future ).get() );
             {
                 unique_ptr<iop::locnet::Message> requestMsg( new iop::locnet::Message() );
                 requestMsg->mutable_request()->mutable_local_service()->mutable_get_neighbour_nodes();
@@ -96,8 +248,8 @@ SCENARIO("Client-Server requests and responses with TCP networking", "[network]"
 
         THEN("It serves transparent clients using ProtoBuf/TCP protocol")
         {
-            shared_ptr<IProtoBufChannel> clientChannel( new AsyncProtoBufTcpChannel(
-                        nodeContact.nodeEndpoint() ) );
+            shared_ptr<IProtoBufChannel> clientChannel( AsyncProtoBufTcpChannel::Connect(
+                nodeContact.nodeEndpoint(), config->connectTimeout(), asio::use_future ).get() );
             shared_ptr<ProtoBufClientSession> clientSession( ProtoBufClientSession::Create(clientChannel) );
             clientSession->StartMessageLoop();
 
@@ -107,7 +259,155 @@ SCENARIO("Client-Server requests and responses with TCP networking", "[network]"
             size_t nodeCount = client.GetNodeCount();
             REQUIRE( nodeCount == 6 );
         }
+        
+        THEN("It serves pipelined requests split at arbitrary points")
+        {
+            auto requestFrame = [] (uint32_t messageId)
+            {
+                iop::locnet::MessageWithHeader message;
+                message.mutable_body()->set_id(messageId);
+                message.mutable_body()->mutable_request()->set_version({1,0,0});
+                message.mutable_body()->mutable_request()->mutable_remote_node()->mutable_get_node_count();
+                message.set_header(1);
+                message.set_header( message.ByteSize() - 5 );
+                return message.SerializeAsString();
+            };
+            string firstRequests = requestFrame(1) + requestFrame(2);
+            string lastRequest = requestFrame(3);
+            
+            asio::io_service clientService;
+            tcp::socket socket(clientService);
+            socket.connect( tcp::endpoint( address::from_string( nodeContact.address() ), nodeContact.nodePort() ) );
+            asio::write( socket, asio::buffer( firstRequests + lastRequest.substr(0, 3) ) );
+            this_thread::sleep_for( chrono::milliseconds(100) );
+            asio::write( socket, asio::buffer( lastRequest.substr(3) ) );
+            
+            for (uint32_t messageId = 1; messageId <= 3; ++messageId)
+            {
+                string frame(5, 0);
+                asio::read( socket, asio::buffer(&frame[0], frame.size()) );
+                const uint8_t *sizeBytes = reinterpret_cast<const uint8_t*>( &frame[1] );
+                uint32_t bodySize = sizeBytes[0] + (sizeBytes[1] << 8) + (sizeBytes[2] << 16) + (sizeBytes[3] << 24);
+                frame.resize(5 + bodySize);
+                asio::read( socket, asio::buffer(&frame[5], bodySize) );
+                
+                iop::locnet::MessageWithHeader response;
+                REQUIRE( response.ParseFromString(frame) );
+                REQUIRE( response.body().id() == messageId );
+                REQUIRE( response.body().response().remote_node().get_node_count().node_count() == 6 );
+            }
+        }
+        
+        THEN("Connecting to a port with no server fails instead of blocking")
+        {
+            NetworkEndpoint closedEndpoint( "localhost", nodeContact.clientPort() );
+            auto futureChannel = AsyncProtoBufTcpChannel::Connect(
+                closedEndpoint, config->connectTimeout(), asio::use_future );
+            REQUIRE( futureChannel.wait_for( config->connectTimeout() + chrono::seconds(1) ) == future_status::ready );
+            REQUIRE_THROWS_AS( futureChannel.get(), LocationNetworkError );
+        }
+        
+        THEN("It serves requests sent concurrently through the same session")
+        {
+            shared_ptr<IProtoBufChannel> clientChannel( AsyncProtoBufTcpChannel::Connect(
+                nodeContact.nodeEndpoint(), config->connectTimeout(), asio::use_future ).get() );
+            shared_ptr<ProtoBufClientSession> clientSession( ProtoBufClientSession::Create(clientChannel) );
+            clientSession->StartMessageLoop();
+            
+            shared_ptr<IBlockingRequestDispatcher> netDispatcher( new NetworkDispatcher(config, clientSession) );
+            NodeMethodsProtoBufClient client(netDispatcher, {});
+            
+            vector< future<size_t> > nodeCounts;
+            for (size_t idx = 0; idx < 8; ++idx)
+                { nodeCounts.push_back( async( launch::async, [&client] { return client.GetNodeCount(); } ) ); }
+            for (auto &nodeCount : nodeCounts)
+                { REQUIRE( nodeCount.get() == 6 ); }
+        }
+
+        Reactor::Instance().Shutdown();
+    }
+}
+
 
+
+// Serves requests by asking the node count of another node over the network
+class ForwardingNodeCountDispatcher : public IBlockingRequestDispatcher
+{
+    shared_ptr<INodeProxyFactory>   _connectionFactory;
+    NetworkEndpoint                 _targetEndpoint;
+    
+public:
+    
+    ForwardingNodeCountDispatcher( shared_ptr<INodeProxyFactory> connectionFactory,
+                                   const NetworkEndpoint &targetEndpoint ) :
+        _connectionFactory(connectionFactory), _targetEndpoint(targetEndpoint) {}
+    
+    unique_ptr<iop::locnet::Response> Dispatch(unique_ptr<iop::locnet::Request> &&) override
+    {
+        shared_ptr<INodeMethods> target( _connectionFactory->ConnectTo(_targetEndpoint) );
+        unique_ptr<iop::locnet::Response> response( new iop::locnet::Response() );
+        response->mutable_remote_node()->mutable_get_node_count()->set_node_count( target->GetNodeCount() );
+        return response;
+    }
+};
+
+
+
+SCENARIO("Connecting to remote nodes while serving a request", "[network]")
+{
+    GIVEN("A node and a server connecting to it from its request handler, sharing a single reactor thread")
+    {
+        shared_ptr<TestConfig> config( new TestConfig(TestData::NodeBudapest) );
+        
+        shared_ptr<ISpatialDatabase> geodb( new SpatiaLiteDatabase( config->myNodeInfo(),
+            SpatiaLiteDatabase::IN_MEMORY_DB, chrono::hours(1) ) );
+        geodb->Store(TestData::EntryKecskemet);
+        geodb->Store(TestData::EntryWien);
+        
+        shared_ptr<INodeProxyFactory> dummyConnectionFactory( new DummyNodeConnectionFactory() );
+        shared_ptr<Node> node = Node::Create(config, geodb, dummyConnectionFactory);
+        
+        shared_ptr<WorkerPool> workers( new WorkerPool( "Test", config->nodeWorkerCount(), 16 ) );
+        shared_ptr<IBlockingRequestDispatcherFactory> nodeDispatcherFactory(
+            new CombinedBlockingRequestDispatcherFactory(node) );
+        shared_ptr<DispatchingTcpServer> nodeTcpServer = DispatchingTcpServer::Create(
+            TestData::NodeBudapest.contact().nodePort(), nodeDispatcherFactory, workers );
+        nodeTcpServer->StartListening();
+        
+        shared_ptr<INodeProxyFactory> tcpConnectionFactory( new TcpNodeConnectionFactory(config) );
+        shared_ptr<IBlockingRequestDispatcherFactory> forwardingDispatcherFactory(
+            new StaticBlockingDispatcherFactory( shared_ptr<IBlockingRequestDispatcher>(
+                new ForwardingNodeCountDispatcher( tcpConnectionFactory,
+                    TestData::NodeBudapest.contact().nodeEndpoint() ) ) ) );
+        shared_ptr<DispatchingTcpServer> forwardingTcpServer = DispatchingTcpServer::Create(
+            TestData::NodeKecskemet.contact().nodePort(), forwardingDispatcherFactory, workers );
+        forwardingTcpServer->StartListening();
+        
+        REQUIRE( config->reactorThreadCount() == 1 );
+        thread reactorMainThread( [] { reactorLoop("ReactorMain"); } );
+        reactorMainThread.detach();
+        
+        THEN("the request handler connects without waiting for the connection timeout")
+        {
+            shared_ptr<IProtoBufChannel> clientChannel( AsyncProtoBufTcpChannel::Connect(
+                TestData::NodeKecskemet.contact().nodeEndpoint(), config->connectTimeout(), asio::use_future ).get() );
+            shared_ptr<ProtoBufClientSession> clientSession( ProtoBufClientSession::Create(clientChannel) );
+            clientSession->StartMessageLoop();
+            
+            shared_ptr<IBlockingRequestDispatcher> netDispatcher( new NetworkDispatcher(config, clientSession) );
+            NodeMethodsProtoBufClient client(netDispatcher, {});
+            
+            auto started = chrono::steady_clock::now();
+            REQUIRE( client.GetNodeCount() == 3 );
+            REQUIRE( chrono::steady_clock::now() - started < config->connectTimeout() );
+        }
+        
+        THEN("servers refuse to serve requests without a worker pool")
+        {
+            REQUIRE_THROWS( DispatchingTcpServer::Create(
+                TestData::NodeWien.contact().nodePort(), nodeDispatcherFactory, shared_ptr<WorkerPool>() ) );
+        }
+        
         Reactor::Instance().Shutdown();
     }
 }
@@ -129,8 +429,9 @@ SCENARIO("Neighbourhood notifications for local services", "[network]")
         const NodeContact &BudapestNodeContact( config->myNodeInfo().contact() );
         shared_ptr<IBlockingRequestDispatcherFactory> dispatcherFactory(
             new CombinedBlockingRequestDispatcherFactory(node) );
+        shared_ptr<WorkerPool> workers( new WorkerPool( "Test", config->localWorkerCount(), 16 ) );
         shared_ptr<DispatchingTcpServer> tcpServer = DispatchingTcpServer::Create(
-            BudapestNodeContact.nodePort(), dispatcherFactory );
+            BudapestNodeContact.nodePort(), dispatcherFactory, workers );
         tcpServer->StartListening();
 
         thread reactorMainThread( [] { reactorLoop("ReactorMain"); } );
@@ -138,8 +439,8 @@ SCENARIO("Neighbourhood notifications for local services", "[network]")
         
         THEN("It properly notifies local services on changes")
         {
-            shared_ptr<IProtoBufChannel> channel( new AsyncProtoBufTcpChannel(
-                BudapestNodeContact.nodeEndpoint() ) );
+            shared_ptr<IProtoBufChannel> channel( AsyncProtoBufTcpChannel::Connect(
+                BudapestNodeContact.nodeEndpoint(), config->connectTimeout(), asio::use_future ).get() );
             shared_ptr<ProtoBufClientSession> session( ProtoBufClientSession::Create(channel) );
 
             uint32_t notificationsReceived = 0;
@@ -1,4 +1,5 @@
-#include <list>
+#include <cstdio>
+#include <limits>
 #include <easylogging++.h>
 
 #include "testimpls.hpp"
@@ -38,7 +39,7 @@ void NodeRegistry::Register(shared_ptr<Node> node)
 {
     if (! node)
         { throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Received empty node"); }
-    _nodes.emplace( node->GetNodeInfo().contact().nodeEndpoint().address(), node );
+    _nodes.emplace( node->GetNodeInfo()->contact().nodeEndpoint().address(), node );
 }
 
 const NodeRegistry::NodeContainer& NodeRegistry::nodes() const
@@ -49,6 +50,24 @@ std::shared_ptr<INodeMethods> NodeRegistry::ConnectTo(const NetworkEndpoint &end
 
 
 
+TemporaryFiles::TemporaryFiles(const string &path, initializer_list<const char*> suffixes)
+{
+    for (const char *suffix : suffixes)
+        { _paths.push_back(path + suffix); }
+    Remove();
+}
+
+TemporaryFiles::~TemporaryFiles()
+    { Remove(); }
+
+void TemporaryFiles::Remove()
+{
+    for (const string &path : _paths)
+        { remove( path.c_str() ); }
+}
+
+
+
 TestClock::TestClock() : _now( chrono::system_clock::now() ) {}
 chrono::system_clock::time_point TestClock::now() const { return _now; }
 void TestClock::elapse(chrono::duration<int64_t> period) { _now += period; }
@@ -57,9 +76,6 @@ void TestClock::elapse(chrono::duration<int64_t> period) { _now += period; }
 InMemDbEntry::InMemDbEntry(const NodeDbEntry &other, chrono::system_clock::time_point expiresAt) :
     NodeDbEntry(other), _expiresAt(expiresAt) {}
 
-InMemDbEntry::InMemDbEntry(const InMemDbEntry &other) :
-    NodeDbEntry(other), _expiresAt(other._expiresAt) {}
-
 
 
 random_device InMemorySpatialDatabase::_randomDevice;
@@ -67,28 +83,43 @@ random_device InMemorySpatialDatabase::_randomDevice;
 
 InMemorySpatialDatabase::InMemorySpatialDatabase(const NodeInfo& myNodeInfo,
         shared_ptr<TestClock> testClock, chrono::duration<int64_t> entryExpirationPeriod) :
-    _myNodeInfo(myNodeInfo), _testClock(testClock), _entryExpirationPeriod(entryExpirationPeriod)
+    _myNodeInfo(myNodeInfo), _myNode( make_shared<const NodeDbEntry>( NodeDbEntry::FromSelfInfo(myNodeInfo) ) ),
+    _testClock(testClock), _entryExpirationPeriod(entryExpirationPeriod)
 {
     Store( NodeDbEntry(myNodeInfo, NodeRelationType::Self, NodeContactRoleType::Acceptor), false );
 }
 
 
 
-NodeDbEntry InMemorySpatialDatabase::ThisNode() const
-    { return NodeDbEntry::FromSelfInfo(_myNodeInfo); }
+shared_ptr<const NodeDbEntry> InMemorySpatialDatabase::ThisNode() const
+    { return _myNode; }
 
 
 
 void InMemorySpatialDatabase::Store(const NodeDbEntry &node, bool expires)
+{
+    StoreEntry( node, expires ?
+        _testClock->now() + _entryExpirationPeriod : chrono::system_clock::time_point::max() );
+}
+
+
+void InMemorySpatialDatabase::StoreExpiringAt(const NodeDbEntry &node, time_t expiresAt)
+{
+    StoreEntry( node, expiresAt == numeric_limits<time_t>::max() ?
+        chrono::system_clock::time_point::max() : chrono::system_clock::from_time_t(expiresAt) );
+}
+
+
+void InMemorySpatialDatabase::StoreEntry(const NodeDbEntry &node, chrono::system_clock::time_point expiresAt)
 {
     auto it = _nodes.find( node.id() );
     if ( it != _nodes.end() ) {
         throw runtime_error("Node is already present");
     }
     
-    chrono::system_clock::time_point expiresAt = expires ?
-         _testClock->now() + _entryExpirationPeriod : chrono::system_clock::time_point::max();
-    _nodes.emplace( node.id(), InMemDbEntry(node, expiresAt) );
+    it = _nodes.emplace( node.id(), InMemDbEntry(node, expiresAt) ).first;
+    _locationIndex.Set( it->second.handle(), node.location(),
+                        static_cast<uint8_t>( node.relationType() ) );
 }
 
 
@@ -114,6 +145,8 @@ void InMemorySpatialDatabase::Update(const NodeDbEntry &node, bool expires)
     chrono::system_clock::time_point expiresAt = expires ?
         _testClock->now() + _entryExpirationPeriod : chrono::system_clock::time_point::max();
     it->second = InMemDbEntry(node, expiresAt);
+    _locationIndex.Set( it->second.handle(), node.location(),
+                        static_cast<uint8_t>( node.relationType() ) );
 }
 
 
@@ -123,7 +156,8 @@ void InMemorySpatialDatabase::Remove(const string &nodeId)
     if ( it == _nodes.end() ) {
         throw runtime_error("Node is not found");
     }
-    _nodes.erase(nodeId);
+    _locationIndex.Remove( it->second.handle() );
+    _nodes.erase(it);
 }
 
 
@@ -137,57 +171,43 @@ void InMemorySpatialDatabase::ExpireOldNodes()
 //         auto now = _testClock->now();
         
         if ( it->second._expiresAt <= _testClock->now() )
-            { it = _nodes.erase(it); }
+        {
+            _locationIndex.Remove( it->second.handle() );
+            it = _nodes.erase(it);
+        }
         else { ++it; }
     }
 //     cout << ", after " << GetNodeCount() << endl;
 }
 
 
+// NOTE changes are applied immediately without transactions, rollback is not supported
+void InMemorySpatialDatabase::BeginBatch() {}
+void InMemorySpatialDatabase::CommitBatch() {}
+void InMemorySpatialDatabase::RollbackBatch() {}
+
+
 IChangeListenerRegistry& InMemorySpatialDatabase::changeListenerRegistry()
     { return _listenerRegistry; }
 
 
 
 vector<NodeDbEntry> InMemorySpatialDatabase::GetClosestNodesByDistance(
-    const GpsLocation &location, Distance maxRadiusKm, size_t maxNodeCount, Neighbours filter) const
+    const GpsLocation &location, Distance maxRadiusKm, size_t maxNodeCount, Neighbours filter, ServiceDetails) const
 {
-    //vector<NodeDbEntry> candidateNodes;
-    list< pair<Distance,NodeDbEntry> > candidateNodes;
-    for (auto const &entry : _nodes)
-    {
-        const NodeDbEntry &node = entry.second;
-        Distance nodeDistance = GetDistanceKm( location, node.location() );
-        if (maxRadiusKm >= nodeDistance)
-        {
-            if ( (filter == Neighbours::Included) ||
-                 (filter == Neighbours::Excluded && node.relationType() != NodeRelationType::Neighbour) )
-            {
-                candidateNodes.emplace_back(nodeDistance, node);
-            }
-        }
-    }
-        
+    uint32_t tagMask = ~0u;
+    if (filter == Neighbours::Excluded)
+        { tagMask &= ~( 1u << static_cast<uint8_t>(NodeRelationType::Neighbour) ); }
+    
     vector<NodeDbEntry> result;
-    while ( result.size() < maxNodeCount )
-    {
-        // Select closest element
-        auto minElement = min_element( candidateNodes.begin(), candidateNodes.end(),
-            [] (const pair<Distance,NodeDbEntry> &one, const pair<Distance,NodeDbEntry> &other)
-                { return one.first < other.first; } );
-        if (minElement == candidateNodes.end() )
-            { break; }
-
-        // Save element to result and remove it from candidates
-        result.emplace_back(minElement->second);
-        candidateNodes.erase(minElement);
-    }
+    for ( const auto &closest : _locationIndex.GetClosest(location, maxRadiusKm, maxNodeCount, tagMask) )
+        { result.emplace_back( _nodes.at( NodeIdTable::Instance().Id(closest.first) ) ); }
     return result;
 }
 
 
 std::vector<NodeDbEntry>
-InMemorySpatialDatabase::GetRandomNodes(size_t maxNodeCount, Neighbours filter) const
+InMemorySpatialDatabase::GetRandomNodes(size_t maxNodeCount, Neighbours filter, ServiceDetails) const
 {
     // Start with all nodes
     vector<NodeDbEntry> remainingNodes;
@@ -254,56 +274,50 @@ vector<NodeDbEntry> InMemorySpatialDatabase::GetNodes(NodeContactRoleType roleTy
 }
 
 
+vector< pair<NodeDbEntry, time_t> > InMemorySpatialDatabase::LoadAllEntries() const
+{
+    vector< pair<NodeDbEntry, time_t> > result;
+    for (auto const &entry : _nodes)
+    {
+        time_t expiresAt = entry.second._expiresAt == chrono::system_clock::time_point::max() ?
+            numeric_limits<time_t>::max() : chrono::system_clock::to_time_t(entry.second._expiresAt);
+        result.emplace_back( NodeDbEntry(entry.second), expiresAt );
+    }
+    return result;
+}
+
+
 
 vector<NodeDbEntry> InMemorySpatialDatabase::GetNeighbourNodesByDistance() const
 {
-    vector<NodeDbEntry> neighbours( GetNodes(NodeRelationType::Neighbour) );
-    sort( neighbours.begin(), neighbours.end(),
-        [this] (const NodeDbEntry &one, const NodeDbEntry &other)
-            { return GetDistanceKm( one.location(), _myNodeInfo.location() ) <
-                     GetDistanceKm( other.location(), _myNodeInfo.location() ); } );
+    uint32_t tagMask = 1u << static_cast<uint8_t>(NodeRelationType::Neighbour);
+    vector<NodeDbEntry> neighbours;
+    for ( const auto &closest : _locationIndex.GetClosest( _myNodeInfo.location(),
+            numeric_limits<Distance>::max(), _nodes.size(), tagMask ) )
+        { neighbours.emplace_back( _nodes.at( NodeIdTable::Instance().Id(closest.first) ) ); }
     return neighbours;
 }
-    
-    
 
-GpsCoordinate degreesToRadian(GpsCoordinate degrees)
+
+
+size_t InMemorySpatialDatabase::GetNeighbourRank(const NodeId &nodeId) const
 {
-    //static const GpsCoordinate PI = acos(-1);
-    return degrees * M_PI / 180.0;
+    vector<NodeDbEntry> neighbours = GetNeighbourNodesByDistance();
+    auto neighbourIt = find_if( neighbours.begin(), neighbours.end(),
+        [&nodeId] (const NodeDbEntry &neighbour) { return neighbour.id() == nodeId; } );
+    if ( neighbourIt == neighbours.end() )
+        { throw runtime_error("Node is not a neighbour"); }
+    return distance( neighbours.begin(), neighbourIt );
 }
 
 
-// Implementation based on Haversine formula, see e.g. http://www.movable-type.co.uk/scripts/latlong.html
-// An original example code in Javascript:
-// var R = 6371e3; // metres
-// var φ1 = lat1.toRadians();
-// var φ2 = lat2.toRadians();
-// var Δφ = (lat2-lat1).toRadians();
-// var Δλ = (lon2-lon1).toRadians();
-// 
-// var a = Math.sin(Δφ/2) * Math.sin(Δφ/2) +
-//         Math.cos(φ1) * Math.cos(φ2) *
-//         Math.sin(Δλ/2) * Math.sin(Δλ/2);
-// var c = 2 * Math.atan2(Math.sqrt(a), Math.sqrt(1-a));
-// 
-// var d = R * c;
+Distance InMemorySpatialDatabase::GetNeighbourDistanceKm(size_t rank) const
+    { return GetDistanceKm( _myNodeInfo.location(), GetNeighbourNodesByDistance().at(rank).location() ); }
 
-Distance InMemorySpatialDatabase::GetDistanceKm(const GpsLocation &one, const GpsLocation &other) const
-{
-    static const double EARTH_RADIUS = 6371.;
-    
-    GpsCoordinate fi1 = degreesToRadian( one.latitude() );
-    GpsCoordinate fi2 = degreesToRadian( other.latitude() );
-    GpsCoordinate delta_fi = fi2 - fi1;
-    GpsCoordinate delta_lambda = degreesToRadian( other.longitude() - one.longitude() );
-    
-    Distance a = sin(delta_fi / 2) * sin(delta_fi / 2) +
-        cos(fi1) * cos(fi2) * sin(delta_lambda / 2) * sin(delta_lambda / 2);
 
-    Distance c = 2 * atan2( sqrt(a), sqrt(1-a) );
-    return EARTH_RADIUS * c;
-}
+
+Distance InMemorySpatialDatabase::GetDistanceKm(const GpsLocation &one, const GpsLocation &other) const
+    { return GeodesicDistanceKm(one, other, NODE_DISTANCE_MODEL); }
 
 
 
@@ -313,20 +327,29 @@ chrono::duration<uint32_t> TestConfig::DbExpirationPeriod( chrono::hours(24) );
 
 TestConfig::TestConfig(const NodeInfo &aNodeInfo) : _nodeInfo(aNodeInfo) {}
 TestConfig::TestConfig() :
-    _nodeInfo("TestNodeId", GpsLocation(0,0), NodeContact("Im.a.client", 0, 0), {} ) {}
+    _nodeInfo("TestNodeId", GpsLocation(0,0), NodeContact(Address(), 0, 0), {} ) {}
 
 bool TestConfig::isTestMode() const             { return true; }
 const NodeInfo& TestConfig::myNodeInfo() const  { return _nodeInfo; }
 const NetworkEndpoint& TestConfig::localServiceEndpoint() const { return _localEndpoint; }
 const std::string& TestConfig::logPath() const  { return _logPath; }
 const std::string& TestConfig::dbPath() const   { return _dbPath; }
+DbDurability TestConfig::dbDurability() const   { return DbDurability::Off; }
+DbBackend TestConfig::dbBackend() const         { return DbBackend::SpatiaLite; }
+const std::string& TestConfig::snapshotPath() const { return _snapshotPath; }
+size_t TestConfig::reactorThreadCount() const       { return _reactorThreadCount; }
+size_t TestConfig::nodeWorkerCount() const          { return 2; }
+size_t TestConfig::clientWorkerCount() const        { return 2; }
+size_t TestConfig::localWorkerCount() const         { return 2; }
 
 size_t TestConfig::neighbourhoodTargetSize() const  { return _neighbourhoodTargetSize; }
 const std::vector<NetworkEndpoint>& TestConfig::seedNodes() const           { return _seedNodes; }
 std::chrono::duration<uint32_t> TestConfig::requestExpirationPeriod() const { return chrono::seconds(60); }
+std::chrono::duration<uint32_t> TestConfig::connectTimeout() const          { return chrono::seconds(5); }
 std::chrono::duration<uint32_t> TestConfig::dbMaintenancePeriod() const     { return chrono::hours(7); }
 std::chrono::duration<uint32_t> TestConfig::dbExpirationPeriod() const      { return DbExpirationPeriod; }
 std::chrono::duration<uint32_t> TestConfig::discoveryPeriod() const         { return chrono::minutes(5); }
+std::chrono::duration<uint32_t> TestConfig::snapshotPeriod() const          { return chrono::minutes(10); }
 
 
 
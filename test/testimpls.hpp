@@ -1,6 +1,7 @@
 #ifndef __LOCNET_TEST_IMPLEMENTATIONS_H__
 #define __LOCNET_TEST_IMPLEMENTATIONS_H__
 
+#include "geodesic.hpp"
 #include "locnet.hpp"
 
 
@@ -66,6 +67,21 @@ public:
 
 
 
+// Files of a test database or snapshot, removed both before and after the test
+class TemporaryFiles
+{
+    std::vector<std::string> _paths;
+    
+public:
+    
+    TemporaryFiles(const std::string &path, std::initializer_list<const char*> suffixes);
+    ~TemporaryFiles();
+    
+    void Remove();
+};
+
+
+
 class TestClock
 {
     std::chrono::system_clock::time_point _now;
@@ -81,7 +97,6 @@ public:
 
 struct InMemDbEntry : public NodeDbEntry
 {
-    InMemDbEntry(const InMemDbEntry& other);
     InMemDbEntry(const NodeDbEntry& other, std::chrono::system_clock::time_point expiresAt);
     
     std::chrono::system_clock::time_point _expiresAt = std::chrono::system_clock::now();
@@ -94,11 +109,14 @@ class InMemorySpatialDatabase : public ISpatialDatabase
     static std::random_device _randomDevice;
     
     NodeInfo _myNodeInfo;
+    std::shared_ptr<const NodeDbEntry> _myNode;
     std::unordered_map<NodeId,InMemDbEntry> _nodes;
+    LocationIndex _locationIndex;
     std::shared_ptr<TestClock> _testClock;
     std::chrono::duration<int64_t> _entryExpirationPeriod;
     
     std::vector<NodeDbEntry> GetNodes(NodeRelationType relationType) const;
+    void StoreEntry(const NodeDbEntry &node, std::chrono::system_clock::time_point expiresAt);
     
     ThreadSafeChangeListenerRegistry _listenerRegistry;
     
@@ -112,22 +130,32 @@ public:
     std::shared_ptr<NodeDbEntry> Load(const NodeId &nodeId) const override;
     void Store (const NodeDbEntry &node, bool expires = true) override;
     void Update(const NodeDbEntry &node, bool expires = true) override;
+    void StoreExpiringAt(const NodeDbEntry &node, time_t expiresAt) override;
     void Remove(const NodeId &nodeId) override;
     void ExpireOldNodes() override;
     
+    void BeginBatch() override;
+    void CommitBatch() override;
+    void RollbackBatch() override;
+    
     IChangeListenerRegistry& changeListenerRegistry() override;
 
-    NodeDbEntry ThisNode() const override;
+    std::shared_ptr<const NodeDbEntry> ThisNode() const override;
     std::vector<NodeDbEntry> GetNodes(NodeContactRoleType roleType) override;
+    std::vector< std::pair<NodeDbEntry, time_t> > LoadAllEntries() const override;
     
     size_t GetNodeCount() const override;
     size_t GetNodeCount(NodeRelationType filter) const override;
     std::vector<NodeDbEntry> GetNeighbourNodesByDistance() const override;
+    size_t GetNeighbourRank(const NodeId &nodeId) const override;
+    Distance GetNeighbourDistanceKm(size_t rank) const override;
     std::vector<NodeDbEntry> GetRandomNodes(
-        size_t maxNodeCount, Neighbours filter) const override;
+        size_t maxNodeCount, Neighbours filter,
+        ServiceDetails details = ServiceDetails::Included) const override;
     
     std::vector<NodeDbEntry> GetClosestNodesByDistance(const GpsLocation &position,
-        Distance radiusKm, size_t maxNodeCount, Neighbours filter) const override;
+        Distance radiusKm, size_t maxNodeCount, Neighbours filter,
+        ServiceDetails details = ServiceDetails::Included) const override;
 };
 
 
@@ -143,6 +171,8 @@ struct TestConfig : public Config
     NetworkEndpoint _localEndpoint = NetworkEndpoint("",0);
     std::string     _logPath;
     std::string     _dbPath;
+    std::string     _snapshotPath;
+    size_t          _reactorThreadCount = 1;
     size_t          _neighbourhoodTargetSize = 5;
     std::vector<NetworkEndpoint> _seedNodes;
         
@@ -155,15 +185,24 @@ struct TestConfig : public Config
     
     const std::string& logPath() const override;
     const std::string& dbPath() const override;
+    DbDurability dbDurability() const override;
+    DbBackend dbBackend() const override;
+    const std::string& snapshotPath() const override;
+    size_t reactorThreadCount() const override;
+    size_t nodeWorkerCount() const override;
+    size_t clientWorkerCount() const override;
+    size_t localWorkerCount() const override;
     
     bool isTestMode() const override;
     const std::vector<NetworkEndpoint>& seedNodes() const override;
     size_t neighbourhoodTargetSize() const override;
     
     std::chrono::duration<uint32_t> requestExpirationPeriod() const override;
+    std::chrono::duration<uint32_t> connectTimeout() const override;
     std::chrono::duration<uint32_t> dbMaintenancePeriod() const override;
     std::chrono::duration<uint32_t> dbExpirationPeriod() const override;
     std::chrono::duration<uint32_t> discoveryPeriod() const override;
+    std::chrono::duration<uint32_t> snapshotPeriod() const override;
 };
 
 